@@ -1,48 +1,515 @@
-#include "parameters.h"
+// The problem size comes in as arguments, so one binary serves every N and box,
+// unless the host builds the program for its run with the build options
+//   -D PARTICLES=<N> -D BOX=<box_size>f -D CUTOFF2=<rc^2>f
+// which turn the loop bounds and the box into literals; the arguments are then
+// still passed but unused. -D UNROLL=<k> sets the unrolling of the pair loops.
+#ifndef PARTICLES
+    #define PARTICLES n
+#endif
+#ifndef BOX
+    #define BOX box_size
+#endif
+#ifndef CUTOFF2
+    #define CUTOFF2 cutoff2
+#endif
+#ifndef UNROLL
+    #define UNROLL 4
+#endif
 
-__attribute__((reqd_work_group_size(N, 1, 1)))
-__kernel void md(__global const float3 *restrict particles,
-                 __global float *restrict out_energy,
-                 __global float3 *restrict out_force) {
+// Every force kernel comes in two variants with the same arguments: md_forces() and the
+// like only write out_force, for the steps whose energy nobody looks at, while md() and
+// the like also sum the pair energies of each work-group into out_energy[group], for
+// energy_sum() to add up. Both are built from one body, with tabulated and energy_step
+// constants the compiler folds, so the force variants carry no energy math at all.
+
+// Tree sum of value over the work-group, for any local size; every work-item gets the sum.
+float group_sum(float value, __local float *restrict partial) {
+    int local_index = get_local_id(0);
+    int items = get_local_size(0);
+    partial[local_index] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    for (int stride = 1; stride < items; stride *= 2) {
+        if (local_index % (2 * stride) == 0 && local_index + stride < items)
+            partial[local_index] += partial[local_index + stride];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    float sum = partial[0];
+    // the next sum writes partial only once every work-item has read this one
+    barrier(CLK_LOCAL_MEM_FENCE);
+    return sum;
+}
+
+// All pairs in tiles: each work-group stages tile_size particles at a time in
+// local memory, one per work-item, and every work-item runs through the tile.
+// The launch starts at the global offset first and covers first .. last - 1
+// rounded up to the work-group size; the work-items past last only help to load
+// the tiles. With tabulated the pair is interpolated from a cubic table on r^2
+// instead of the reciprocals; table[k] holds e0..e3 and m0..m3 of interval k as
+// laid out in pair_table.h, and pairs closer than sqrt(s_min) get the values at s_min.
+void all_pairs(__global const float3 *restrict particles,
+               __global float *restrict out_energy,
+               __local float *restrict partial,
+               __global float3 *restrict out_force,
+               const int n,
+               const float box_size,
+               const float cutoff2,
+               const int last,
+               __local float3 *restrict tile,
+               __global const float8 *restrict table,
+               const float s_min,
+               const float inv_h,
+               const int intervals,
+               const bool tabulated,
+               const bool energy_step) {
 
     int index = get_global_id(0);
+    int local_index = get_local_id(0);
+    int tile_size = get_local_size(0);
+    float3 own = particles[min(index, PARTICLES - 1)];
+    float half_box = BOX / 2;
     float energy = 0;
     float3 force = (float3)(0, 0, 0);
-    #pragma unroll 4
-    for (int i = 0; i < N; i++) {
-        float x = particles[i].x - particles[index].x;
-        float y = particles[i].y - particles[index].y;
-        float z = particles[i].z - particles[index].z;
-        if (x > half_box)
-            x -= box_size;
-        else{
-            if (x < -half_box)
-                x += box_size;
-        }
-        if (y > half_box)
-            y -= box_size;
-        else{
-            if (y < -half_box)
-                y += box_size;
+    for (int start = 0; start < PARTICLES; start += tile_size) {
+        if (start + local_index < PARTICLES)
+            tile[local_index] = particles[start + local_index];
+        barrier(CLK_LOCAL_MEM_FENCE);
+        int count = min(tile_size, PARTICLES - start);
+        #pragma unroll UNROLL
+        for (int j = 0; j < count; j++) {
+            float x = tile[j].x - own.x;
+            float y = tile[j].y - own.y;
+            float z = tile[j].z - own.z;
+            if (x > half_box)
+                x -= BOX;
+            else{
+                if (x < -half_box)
+                    x += BOX;
+            }
+            if (y > half_box)
+                y -= BOX;
+            else{
+                if (y < -half_box)
+                    y += BOX;
+            }
+            if (z > half_box)
+                z -= BOX;
+            else{
+                if (z < -half_box)
+                    z += BOX;
+            }
+            float3 r = (float3)(x, y, z);
+            float sq_dist = x * x + y * y + z * z;
+            if ((sq_dist < CUTOFF2) && (start + j != index)) {
+                if (tabulated) {
+                    float u = max(sq_dist - s_min, 0.0f) * inv_h;
+                    int k = min((int)u, intervals - 1);
+                    float t = u - k;
+                    float8 c = table[k];
+                    force += r * (c.s4 + t * (c.s5 + t * (c.s6 + t * c.s7)));
+                    if (energy_step)
+                        energy += c.s0 + t * (c.s1 + t * (c.s2 + t * c.s3));
+                } else {
+                    float r6 = sq_dist * sq_dist * sq_dist;
+                    float r12 = r6 * r6;
+                    float r8 = r6 * sq_dist;
+                    float r14 = r12 * sq_dist;
+                    // -dU/dr_i of 4 (1 / r12 - 1 / r6), r points from the particle to its partner
+                    force += r * (24 * (1 / r8 - 2 / r14));
+                    if (energy_step)
+                        energy += 4 * (1 / r12 - 1 / r6);
+                }
+            }
         }
-        if (z > half_box)
-            z -= box_size;
-        else{
-            if (z < -half_box)
-                z += box_size;
+        // the tile is overwritten only once every work-item is through it
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (index < PARTICLES)
+        out_force[index] = force;
+    if (energy_step) {
+        float sum = group_sum(index < last ? energy : 0, partial);
+        if (local_index == 0)
+            out_energy[get_group_id(0)] = sum;
+    }
+}
+
+__kernel void md(__global const float3 *restrict particles,
+                 __global float *restrict out_energy,
+                 __local float *restrict partial,
+                 __global float3 *restrict out_force,
+                 const int n,
+                 const float box_size,
+                 const float cutoff2,
+                 const int first,
+                 const int last,
+                 __local float3 *restrict tile) {
+    all_pairs(particles, out_energy, partial, out_force, n, box_size, cutoff2, last, tile, 0, 0, 0, 0, false, true);
+}
+
+__kernel void md_forces(__global const float3 *restrict particles,
+                        __global float *restrict out_energy,
+                        __local float *restrict partial,
+                        __global float3 *restrict out_force,
+                        const int n,
+                        const float box_size,
+                        const float cutoff2,
+                        const int first,
+                        const int last,
+                        __local float3 *restrict tile) {
+    all_pairs(particles, out_energy, partial, out_force, n, box_size, cutoff2, last, tile, 0, 0, 0, 0, false, false);
+}
+
+// md() with the pair from the table.
+__kernel void md_table(__global const float3 *restrict particles,
+                       __global float *restrict out_energy,
+                       __local float *restrict partial,
+                       __global float3 *restrict out_force,
+                       const int n,
+                       const float box_size,
+                       const float cutoff2,
+                       const int first,
+                       const int last,
+                       __local float3 *restrict tile,
+                       __global const float8 *restrict table,
+                       const float s_min,
+                       const float inv_h,
+                       const int intervals) {
+    all_pairs(particles, out_energy, partial, out_force, n, box_size, cutoff2, last, tile,
+              table, s_min, inv_h, intervals, true, true);
+}
+
+__kernel void md_table_forces(__global const float3 *restrict particles,
+                              __global float *restrict out_energy,
+                              __local float *restrict partial,
+                              __global float3 *restrict out_force,
+                              const int n,
+                              const float box_size,
+                              const float cutoff2,
+                              const int first,
+                              const int last,
+                              __local float3 *restrict tile,
+                              __global const float8 *restrict table,
+                              const float s_min,
+                              const float inv_h,
+                              const int intervals) {
+    all_pairs(particles, out_energy, partial, out_force, n, box_size, cutoff2, last, tile,
+              table, s_min, inv_h, intervals, true, false);
+}
+
+// Cell-list pipeline for rc much smaller than the box. The box is split into
+// cells_per_side^3 cells of side >= rc, and every step
+//   cell_index     counts the particles of each cell, cell_count must be zero before it
+//   cell_offsets   turns the counts into the first sorted slot of each cell
+//   sort_by_cell   lays the positions out cell after cell
+//   md_cells       walks the up to 27 cells around each particle
+// cell_neighbors holds 27 cells per cell, each listed once and padded with -1.
+// The order inside a cell follows the atomics, so sums may differ in the last bits
+// from run to run.
+
+// the cell of a wrapped position; rounding can put a particle on the upper face one cell too far
+int cell_of(float3 p, float box_size, int cells_per_side) {
+    float cell_size = box_size / cells_per_side;
+    int cx = clamp((int)((p.x + box_size / 2) / cell_size), 0, cells_per_side - 1);
+    int cy = clamp((int)((p.y + box_size / 2) / cell_size), 0, cells_per_side - 1);
+    int cz = clamp((int)((p.z + box_size / 2) / cell_size), 0, cells_per_side - 1);
+    return (cz * cells_per_side + cy) * cells_per_side + cx;
+}
+
+__kernel void cell_index(__global const float3 *restrict particles,
+                         __global int *restrict particle_cell,
+                         __global int *restrict particle_slot,
+                         __global int *restrict cell_count,
+                         const int n,
+                         const float box_size,
+                         const int cells_per_side) {
+
+    int index = get_global_id(0);
+    if (index >= PARTICLES)
+        return;
+    int cell = cell_of(particles[index], BOX, cells_per_side);
+    particle_cell[index] = cell;
+    particle_slot[index] = atomic_inc(&cell_count[cell]);
+}
+
+// An exclusive scan by a single work-group: every work-item sums a run of cells,
+// the first one scans those sums, and every work-item then fills in its run.
+__kernel void cell_offsets(__global const int *restrict cell_count,
+                           __global int *restrict cell_start,
+                           const int cells,
+                           __local int *restrict partial) {
+
+    int local_index = get_local_id(0);
+    int items = get_local_size(0);
+    int chunk = (cells + items - 1) / items;
+    int first = min(local_index * chunk, cells);
+    int last = min(first + chunk, cells);
+    int sum = 0;
+    for (int c = first; c < last; c++)
+        sum += cell_count[c];
+    partial[local_index] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (local_index == 0) {
+        int running = 0;
+        for (int i = 0; i < items; i++) {
+            int run = partial[i];
+            partial[i] = running;
+            running += run;
         }
-        float3 r = (float3)(x, y, z);
-        float sq_dist = x * x + y * y + z * z;
-        if ((sq_dist < (rc * rc)) && (i != index)) {
-            float r6 = sq_dist * sq_dist * sq_dist;
-            float r12 = r6 * r6;
-            float r8 = r6 * sq_dist;
-            float r14 = r12 * sq_dist;
-            force += r * (12 * (1 / r14 - 1 / r8));
-            energy += 4 * (1 / r12 - 1 / r6);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    int running = partial[local_index];
+    for (int c = first; c < last; c++) {
+        cell_start[c] = running;
+        running += cell_count[c];
+    }
+}
+
+__kernel void sort_by_cell(__global const float3 *restrict particles,
+                           __global const int *restrict particle_cell,
+                           __global const int *restrict particle_slot,
+                           __global const int *restrict cell_start,
+                           __global float3 *restrict sorted,
+                           __global int *restrict sorted_index,
+                           const int n) {
+
+    int index = get_global_id(0);
+    if (index >= PARTICLES)
+        return;
+    int slot = cell_start[particle_cell[index]] + particle_slot[index];
+    sorted[slot] = particles[index];
+    sorted_index[slot] = index;
+}
+
+// md() over the sorted positions and the neighbor cells only; work-item s computes
+// sorted particle s and writes its results at the particle's own index, if that lies
+// in first .. last - 1, the particles of this device. The work-items of other devices'
+// particles still run to the end, as the group sum waits for all of them.
+void cell_pairs(__global const float3 *restrict sorted,
+                __global const int *restrict sorted_index,
+                __global const int *restrict cell_start,
+                __global const int *restrict cell_count,
+                __global const int *restrict cell_neighbors,
+                __global float *restrict out_energy,
+                __local float *restrict partial,
+                __global float3 *restrict out_force,
+                const int n,
+                const float box_size,
+                const float cutoff2,
+                const int cells_per_side,
+                const int first,
+                const int last,
+                __global const float8 *restrict table,
+                const float s_min,
+                const float inv_h,
+                const int intervals,
+                const bool tabulated,
+                const bool energy_step) {
+
+    int index = get_global_id(0);
+    bool own_particle = index < PARTICLES && sorted_index[index] >= first && sorted_index[index] < last;
+    float energy = 0;
+    float3 force = (float3)(0, 0, 0);
+    if (own_particle) {
+        float3 own = sorted[index];
+        int cell = cell_of(own, BOX, cells_per_side);
+        float half_box = BOX / 2;
+        for (int around = 0; around < 27; around++) {
+            int neighbor = cell_neighbors[cell * 27 + around];
+            if (neighbor < 0)
+                break;
+            int end = cell_start[neighbor] + cell_count[neighbor];
+            for (int i = cell_start[neighbor]; i < end; i++) {
+                float x = sorted[i].x - own.x;
+                float y = sorted[i].y - own.y;
+                float z = sorted[i].z - own.z;
+                if (x > half_box)
+                    x -= BOX;
+                else{
+                    if (x < -half_box)
+                        x += BOX;
+                }
+                if (y > half_box)
+                    y -= BOX;
+                else{
+                    if (y < -half_box)
+                        y += BOX;
+                }
+                if (z > half_box)
+                    z -= BOX;
+                else{
+                    if (z < -half_box)
+                        z += BOX;
+                }
+                float3 r = (float3)(x, y, z);
+                float sq_dist = x * x + y * y + z * z;
+                if ((sq_dist < CUTOFF2) && (i != index)) {
+                    if (tabulated) {
+                        float u = max(sq_dist - s_min, 0.0f) * inv_h;
+                        int k = min((int)u, intervals - 1);
+                        float t = u - k;
+                        float8 c = table[k];
+                        force += r * (c.s4 + t * (c.s5 + t * (c.s6 + t * c.s7)));
+                        if (energy_step)
+                            energy += c.s0 + t * (c.s1 + t * (c.s2 + t * c.s3));
+                    } else {
+                        float r6 = sq_dist * sq_dist * sq_dist;
+                        float r12 = r6 * r6;
+                        float r8 = r6 * sq_dist;
+                        float r14 = r12 * sq_dist;
+                        force += r * (24 * (1 / r8 - 2 / r14));
+                        if (energy_step)
+                            energy += 4 * (1 / r12 - 1 / r6);
+                    }
+                }
+            }
         }
+        out_force[sorted_index[index]] = force;
+    }
+    if (energy_step) {
+        float sum = group_sum(energy, partial);
+        if (get_local_id(0) == 0)
+            out_energy[get_group_id(0)] = sum;
     }
-    out_force[index] = force;
-    out_energy[index] = energy;
 }
 
+__kernel void md_cells(__global const float3 *restrict sorted,
+                       __global const int *restrict sorted_index,
+                       __global const int *restrict cell_start,
+                       __global const int *restrict cell_count,
+                       __global const int *restrict cell_neighbors,
+                       __global float *restrict out_energy,
+                       __local float *restrict partial,
+                       __global float3 *restrict out_force,
+                       const int n,
+                       const float box_size,
+                       const float cutoff2,
+                       const int cells_per_side,
+                       const int first,
+                       const int last) {
+    cell_pairs(sorted, sorted_index, cell_start, cell_count, cell_neighbors, out_energy, partial, out_force,
+               n, box_size, cutoff2, cells_per_side, first, last, 0, 0, 0, 0, false, true);
+}
+
+__kernel void md_cells_forces(__global const float3 *restrict sorted,
+                              __global const int *restrict sorted_index,
+                              __global const int *restrict cell_start,
+                              __global const int *restrict cell_count,
+                              __global const int *restrict cell_neighbors,
+                              __global float *restrict out_energy,
+                              __local float *restrict partial,
+                              __global float3 *restrict out_force,
+                              const int n,
+                              const float box_size,
+                              const float cutoff2,
+                              const int cells_per_side,
+                              const int first,
+                              const int last) {
+    cell_pairs(sorted, sorted_index, cell_start, cell_count, cell_neighbors, out_energy, partial, out_force,
+               n, box_size, cutoff2, cells_per_side, first, last, 0, 0, 0, 0, false, false);
+}
+
+// md_cells() with the pair from the table of md_table().
+__kernel void md_cells_table(__global const float3 *restrict sorted,
+                             __global const int *restrict sorted_index,
+                             __global const int *restrict cell_start,
+                             __global const int *restrict cell_count,
+                             __global const int *restrict cell_neighbors,
+                             __global float *restrict out_energy,
+                             __local float *restrict partial,
+                             __global float3 *restrict out_force,
+                             const int n,
+                             const float box_size,
+                             const float cutoff2,
+                             const int cells_per_side,
+                             const int first,
+                             const int last,
+                             __global const float8 *restrict table,
+                             const float s_min,
+                             const float inv_h,
+                             const int intervals) {
+    cell_pairs(sorted, sorted_index, cell_start, cell_count, cell_neighbors, out_energy, partial, out_force,
+               n, box_size, cutoff2, cells_per_side, first, last, table, s_min, inv_h, intervals, true, true);
+}
+
+__kernel void md_cells_table_forces(__global const float3 *restrict sorted,
+                                    __global const int *restrict sorted_index,
+                                    __global const int *restrict cell_start,
+                                    __global const int *restrict cell_count,
+                                    __global const int *restrict cell_neighbors,
+                                    __global float *restrict out_energy,
+                                    __local float *restrict partial,
+                                    __global float3 *restrict out_force,
+                                    const int n,
+                                    const float box_size,
+                                    const float cutoff2,
+                                    const int cells_per_side,
+                                    const int first,
+                                    const int last,
+                                    __global const float8 *restrict table,
+                                    const float s_min,
+                                    const float inv_h,
+                                    const int intervals) {
+    cell_pairs(sorted, sorted_index, cell_start, cell_count, cell_neighbors, out_energy, partial, out_force,
+               n, box_size, cutoff2, cells_per_side, first, last, table, s_min, inv_h, intervals, true, false);
+}
+
+// The nearest image in the box of every position; the positions themselves stay unwrapped.
+__kernel void wrap(__global const float3 *restrict positions,
+                   __global float3 *restrict nearest,
+                   const float box_size) {
+
+    int index = get_global_id(0);
+    float3 p = positions[index];
+    nearest[index] = p - BOX * floor(p / BOX + 0.5f);
+}
+
+// The velocity takes a kick from the force, then the position drifts with it:
+// kick = dt for symplectic Euler, dt / 2 for the first half of velocity Verlet.
+__kernel void kick_drift(__global float3 *restrict positions,
+                         __global float3 *restrict velocities,
+                         __global const float3 *restrict forces,
+                         const float kick,
+                         const float drift) {
+
+    int index = get_global_id(0);
+    float3 v = velocities[index] + forces[index] * kick;
+    velocities[index] = v;
+    positions[index] += v * drift;
+}
+
+// The second half kick of velocity Verlet, with the forces at the new positions.
+__kernel void kick(__global float3 *restrict velocities,
+                   __global const float3 *restrict forces,
+                   const float kick) {
+
+    int index = get_global_id(0);
+    velocities[index] += forces[index] * kick;
+}
+
+// The energy of the particles first .. last - 1 by a single work-group: the potential
+// from the groups sums of the force kernel, halved as every pair is in it twice, into
+// sums[0] and the kinetic from the velocities into sums[1].
+__kernel void energy_sum(__global const float *restrict group_energy,
+                         const int groups,
+                         __global const float3 *restrict velocities,
+                         const int first,
+                         const int last,
+                         __global float *restrict sums,
+                         __local float *restrict partial) {
+
+    int local_index = get_local_id(0);
+    int items = get_local_size(0);
+    float potential = 0;
+    for (int g = local_index; g < groups; g += items)
+        potential += group_energy[g];
+    float kinetic = 0;
+    for (int i = first + local_index; i < last; i += items) {
+        float3 v = velocities[i];
+        kinetic += v.x * v.x + v.y * v.y + v.z * v.z;
+    }
+    potential = group_sum(potential, partial);
+    kinetic = group_sum(kinetic, partial);
+    if (local_index == 0) {
+        sums[0] = potential / 2;
+        sums[1] = kinetic / 2;
+    }
+}
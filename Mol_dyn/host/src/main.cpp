@@ -3,7 +3,15 @@
 #include <math.h>
 #include "CL/opencl.h"
 #include <time.h>
+#include <omp.h>
 #include "parameters.h"
+#include "config.h"
+#include "snapshot.h"
+#include "pair_table.h"
+#include "program_cache.h"
+#include "lj_kernels.h"
+#define PROFILE_STORAGE
+#include "profile.h"
 #ifdef ALTERA
     #include "AOCL_Utils.h"
     using namespace aocl_utils;
@@ -14,36 +22,186 @@
 
 // OpenCL runtime configuration
 cl_platform_id platform = NULL;
-cl_device_id device;
-cl_context context = NULL;
-cl_command_queue queue;
-cl_program program = NULL;
-cl_kernel kernel;
-cl_mem nearest_buf;
-cl_mem output_energy_buf;
-cl_mem output_force_buf;
-
-// Problem data.
-cl_float3 input_a[N] = {};
-cl_float3 nearest[N] = {};
-cl_float3 velocity[N] = {};
-
-float output_energy[N] = {};
-cl_float3 output_force[N] = {};
+// One OpenCL device of the run, with a context and a queue of its own. Every device holds
+// all the positions, but integrates and computes the forces of its own particles
+// first .. last - 1 only; with several devices the wrapped positions go through the host
+// once per step.
+struct md_device {
+    cl_device_id id;
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel energy_kernel;    // the forces and the pair energy of every work-group
+    cl_kernel force_kernel;     // the same forces only, for the steps nobody reads the energy of
+    cl_kernel energy_sum_kernel;
+    cl_kernel wrap_kernel;
+    cl_kernel kick_drift_kernel;
+    cl_kernel kick_kernel;
+    // positions and velocities live on the device between the reporting steps
+    cl_mem position_buf;
+    cl_mem velocity_buf;
+    cl_mem nearest_buf;
+    cl_mem output_energy_buf;   // one sum per work-group of the force kernel
+    cl_mem output_force_buf;
+    cl_mem energy_sums_buf;     // potential and kinetic energy of its particles, by energy_sum
+    cl_mem table_buf;           // float8 coefficients per interval for md_table
+    // the cell-list pipeline of pair_search = cells, laid out in md.cl
+    cl_kernel cell_index_kernel;
+    cl_kernel cell_offsets_kernel;
+    cl_kernel sort_kernel;
+    cl_mem particle_cell_buf;
+    cl_mem particle_slot_buf;
+    cl_mem cell_count_buf;
+    cl_mem cell_start_buf;
+    cl_mem cell_neighbors_buf;
+    cl_mem sorted_buf;
+    cl_mem sorted_index_buf;
+    size_t scan_local_size;
+    size_t sum_local_size;
+    // the force kernel runs the particles rounded up to whole work-groups, one tile of positions in local memory each
+    size_t force_local_size;
+    cl_uint range_arg;          // the first of the arguments first and last of the force kernels
+    int first;
+    int last;
+    double weight;              // share of the particles: compute units, then the measured throughput
+    double force_time;          // ns of its force kernels since the last split
+    double force_items;         // the particles they computed, counting the padding of the last work-group
+    cl_event last_force;        // with co_execution its last force kernel, for balance_host()
+    double last_items;          // and the particles that one computed, counted as in force_items
+};
+md_device device[MAX_DEVICES];
+int device_count = 0;
+cl_device_id parent_device = NULL;      // the device that sub_devices partitions
+bool programs_cached = true;
+pair_table table;
+int cells_per_side;
+int cells_total;
+
+// co_execution = on: the host's OpenMP threads compute the forces of the particles cpu_first .. N - 1
+// with the pair kernels of the CPU engine and integrate them, next to the devices, which share
+// 0 .. cpu_first - 1. Positions and velocities of the host's particles always live in input_a
+// and velocity, and the wrapped positions go through the host every step.
+int cpu_first;
+lj_setup cpu_lj;            // the unshifted pair of md.cl, in double
+coords cpu_positions;       // the wrapped positions of this step
+cl_float3 *cpu_force;       // forces on the host's particles, indexed by particle
+int *cpu_all;               // 0 .. N - 1, the partners of the all-pairs search
+int *cpu_partners[MAX_THREADS];
+coords cpu_reactions[MAX_THREADS];  // the kernels also subtract every pair from the partner; unused here
+int *host_cell_neighbors;   // the table of init_cells(), and the cells of the wrapped positions
+int *host_cell_head;
+int *host_cell_next;
+double cpu_time = 0;        // s of the host's last force evaluation
+double cpu_potential = 0;   // pair and kinetic energy of the host's particles at the last energy step
+double cpu_kinetic = 0;
+double cpu_share_sum = 0;   // of the host's share over the steps, for its average
+long cpu_share_steps = 0;
+long heap_allocations = 0;  // of the CPU engine's buffers, see scratch_arena.h
+
+// Problem data, N elements each, allocated once the parameters are loaded.
+// The device state is in them only right after read_state().
+cl_float3 *input_a;
+cl_float3 *velocity;
+// the wrapped positions on their way between the devices, two sets used in turn
+cl_float3 *exchange[2];
+long exchanges = 0;
+
 double kernel_total_time = 0.;
+bool host_state_current = true;
+double pairs_per_step;      // partners the force kernel visits each step
+
+// Commands enqueued and not yet collected, oldest first. Once MAX_PENDING are in flight the
+// host waits for the older half, so it runs at most that far ahead of the devices.
+#define MAX_PENDING 1024
+struct pending_event {
+    cl_event event;
+    int phase;
+    int device;
+};
+pending_event pending[MAX_PENDING];
+int pending_count = 0;
+double device_busy_time = 0.;   // ns of every collected command
+double host_wait_time = 0.;     // s the host spent blocked on the device
+double bytes_copied = 0.;       // between host and device memory, all of it after init_opencl()
+
+// The energy sums of a report step, read into one of two staging sets. With pipeline = on
+// a report is printed one report later, while the device runs the steps between.
+struct report_stage {
+    int step;
+    bool waiting;
+    cl_event done[MAX_DEVICES];     // its read on every device
+    cl_float sums[MAX_DEVICES][2];
+    double host_sums[2];            // those of the host's particles with co_execution
+};
+report_stage stage[2];
+int reports = 0;
+
+// Everything a resumed run needs besides the positions and velocities; the forces
+// are recomputed from the positions. The MD uses no random numbers.
+struct md_checkpoint {
+    int N;
+    int integrator;
+    double dt;
+    double box_size;
+    long step;              // steps completed
+    double initial_energy;
+    double max_deviation;
+    double kernel_total_time;
+};
+
+// a restart runs on positions and velocities inside the mapped checkpoint
+snapshot restart_snapshot;
+md_checkpoint resumed;
 
 bool init_opencl();
+int find_devices(cl_device_id *ids);
+void init_device(md_device *on);
 void init_problem();
-void run();
+void init_kernels(md_device *on);
+void init_cells();
+void init_host_share();
+void split_particles();
+void set_range(md_device *on);
+void balance_devices();
+void balance_host();
+void move_boundary(int target);
 void cleanup();
 void md();
-void motion();
-void nearest_image();
-void calculate_energy_force_lj();
+size_t choose_work_group_size(cl_device_id on, cl_kernel tiled);
+void build_options(char *options, size_t size);
+cl_event enqueue_kernel(md_device *on, cl_kernel launched, size_t offset, size_t global, size_t local, int phase);
+void keep_event(cl_event event, int phase, int on);
+void enqueue_cells(md_device *on);
+void enqueue_forces(bool energy);
+void enqueue_energy_sum();
+void exchange_positions();
+void enqueue_step(bool energy);
+void host_wrap(cl_float3 *wrapped);
+void host_forces(bool energy);
+int host_cell_of(cl_float3 p);
+int host_partners(int i, int *list);
+void host_kick_drift();
+void host_kick();
+void upload_state();
+void read_state();
+void collect_pending(int count);
+void wait_for(cl_uint count, const cl_event *events);
+void wait_pending(int count);
+int enqueue_report(int step);
+void finish_report(report_stage *report, double initial_energy, double *max_deviation);
+void finish_reports(double initial_energy, double *max_deviation);
+double read_energy();
+void init_pair_table();
+void restore_checkpoint();
+bool write_checkpoint(long step, double initial_energy, double max_deviation);
+#ifdef PROFILE
+void device_span(int phase, cl_event event, double offset);
+#endif
 
 // Entry point.
-int main() {
+int main(int argc, char **argv) {
     time_t start_total_time = time(NULL);
+    load_parameters(argc, argv);
     // Initialize OpenCL.
     if(!init_opencl()) {
       return -1;
@@ -53,6 +211,7 @@ int main() {
     md();
     // Free the resources allocated
     cleanup();
+    PROFILE_REPORT(profile_trace);
     time_t end_total_time = time(NULL);
     printf("\nTotal execution time in seconds =  %f\n", difftime(end_total_time, start_total_time));
     printf("\nKernel execution time in milliseconds = %0.3f ms\n", (kernel_total_time / 1000000.0) );
@@ -64,106 +223,400 @@ int main() {
 // Initializes the OpenCL objects.
 bool init_opencl() {
     cl_int status;
+    struct timespec startup_start, startup_end;
+    clock_gettime(CLOCK_MONOTONIC, &startup_start);
 
     printf("Initializing OpenCL\n");
+    cl_device_id ids[MAX_DEVICES];
+    int found = find_devices(ids);
+    if (found == 0) {
+      printf("ERROR: Unable to find OpenCL platform.\n");
+      return false;
+    }
+    if (sub_devices > 0) {
+        // equal shares of the compute units, e.g. to try several devices on one CPU
+        cl_uint units;
+        status = clGetDeviceInfo(ids[0], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL);
+        checkError(status, "Failed to query the compute units");
+        if (units < (cl_uint)sub_devices) {
+            printf("ERROR: %d sub-devices of a device with %u compute units\n", sub_devices, units);
+            return false;
+        }
+        cl_device_partition_property counts[MAX_DEVICES + 3];
+        counts[0] = CL_DEVICE_PARTITION_BY_COUNTS;
+        for (int d = 0; d < sub_devices; d++) {
+            counts[d + 1] = units / sub_devices + (d < (int)(units % sub_devices));
+        }
+        counts[sub_devices + 1] = CL_DEVICE_PARTITION_BY_COUNTS_LIST_END;
+        counts[sub_devices + 2] = 0;
+        parent_device = ids[0];
+        cl_uint made;
+        status = clCreateSubDevices(parent_device, counts, MAX_DEVICES, ids, &made);
+        checkError(status, "Failed to create sub-devices");
+        found = made;
+    }
+    // the sub-devices are all used
+    device_count = sub_devices > 0 || devices == 0 || devices > found ? found : devices;
+    if (sub_devices == 0 && devices > found) {
+        printf("only %d OpenCL devices, running on all of them\n", found);
+    }
+    if (N < device_count + co_execution) {
+        printf("ERROR: N = %d particles cannot be split over %d devices%s\n", N, device_count, co_execution ? " and the host" : "");
+        return false;
+    }
+    const char *cache_state = "off";
+    for (int d = 0; d < device_count; d++) {
+        device[d].id = ids[d];
+        init_device(&device[d]);
+    }
+    #ifdef NVIDIA
+        if (program_cache[0] != '\0') {
+            cache_state = programs_cached ? "hot" : "cold";
+        }
+    #endif
+
+    if (potential == POTENTIAL_TABLE) {
+        init_pair_table();
+    }
+    pairs_per_step = (double)N * (N - 1);
+    if (pair_search == PAIR_SEARCH_CELLS) {
+        init_cells();
+    }
+    for (int d = 0; d < device_count; d++) {
+        init_kernels(&device[d]);
+    }
+    if (co_execution) {
+        init_host_share();
+    }
+    split_particles();
+
+    clock_gettime(CLOCK_MONOTONIC, &startup_end);
+    // run twice to see the startup with the cache cold and hot
+    printf("OpenCL ready in %.3f ms, program cache %s\n",
+        1e3 * (startup_end.tv_sec - startup_start.tv_sec) + 1e-6 * (startup_end.tv_nsec - startup_start.tv_nsec),
+        cache_state);
+
+    return true;
+}
+
+// The devices of the platform, or with devices != 1 of every platform opencl_vendor
+// matches, at most MAX_DEVICES; returns how many.
+int find_devices(cl_device_id *ids) {
+    int count = 0;
     #ifdef ALTERA
         if(!setCwdToExeDir()) {
-          return false;
+          return 0;
         }
         platform = findPlatform("Altera");
+        if(platform == NULL) {
+          return 0;
+        }
+        scoped_array<cl_device_id> altera_devices;
+        cl_uint num_devices;
+        altera_devices.reset(getDevices(platform, CL_DEVICE_TYPE_ALL, &num_devices));
+        for (cl_uint d = 0; d < num_devices && count < MAX_DEVICES; d++) {
+            ids[count++] = altera_devices[d];
+        }
     #endif
     #ifdef NVIDIA
         cl_uint num_platforms;
         cl_platform_id pls[MAX_PLATFORMS_COUNT];
         clGetPlatformIDs(MAX_PLATFORMS_COUNT, pls, &num_platforms);
         char vendor[128];
-        for (int i = 0; i < MAX_PLATFORMS_COUNT; i++){
+        // opencl_vendor picks another runtime, e.g. "pocl" to run on the CPU
+        for (cl_uint i = 0; i < num_platforms && i < MAX_PLATFORMS_COUNT; i++){
             clGetPlatformInfo (pls[i], CL_PLATFORM_VENDOR, sizeof(vendor), vendor, NULL);
-            if (!strcmp("NVIDIA Corporation", vendor))
+            if (strstr(vendor, opencl_vendor) != NULL)
             {
-                platform = pls[i];
-                break;
+                if (platform == NULL) {
+                    platform = pls[i];
+                }
+                cl_uint num_devices = 0;
+                clGetDeviceIDs(pls[i], CL_DEVICE_TYPE_ALL, MAX_DEVICES - count, ids + count, &num_devices);
+                count += num_devices < (cl_uint)(MAX_DEVICES - count) ? num_devices : MAX_DEVICES - count;
+                if (devices == 1 || count == MAX_DEVICES) {
+                    break;
+                }
             }
         }
     #endif
-    if(platform == NULL) {
-      printf("ERROR: Unable to find OpenCL platform.\n");
-      return false;
-    }
+    return count;
+}
 
-    #ifdef ALTERA
-        scoped_array<cl_device_id> devices;
-        cl_uint num_devices;
-        devices.reset(getDevices(platform, CL_DEVICE_TYPE_ALL, &num_devices));
-        // We'll just use the first device.
-        device = devices[0];
-    #endif
-    #ifdef NVIDIA
-        cl_uint num_devices;
-        clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU , 1, &device, &num_devices);
-    #endif
+// The context, queue, program, kernels and state buffers of one device; its weight
+// starts as its compute units.
+void init_device(md_device *on) {
+    cl_int status;
+    char name[256] = "";
+    cl_uint units = 1;
+    clGetDeviceInfo(on->id, CL_DEVICE_NAME, sizeof(name), name, NULL);
+    clGetDeviceInfo(on->id, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(units), &units, NULL);
+    on->weight = units;
 
     // Create the context.
-    context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
+    on->context = clCreateContext(NULL, 1, &on->id, NULL, NULL, &status);
     checkError(status, "Failed to create context");
 
-    queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+    on->queue = clCreateCommandQueue(on->context, on->id, CL_QUEUE_PROFILING_ENABLE, &status);
     checkError(status, "Failed to create command queue");
 
     #ifdef ALTERA
-        std::string binary_file = getBoardBinaryFile("md", device);
+        std::string binary_file = getBoardBinaryFile("md", on->id);
         printf("Using AOCX: %s\n", binary_file.c_str());
-        program = createProgramFromBinary(context, binary_file.c_str(), &device, 1);
+        on->program = createProgramFromBinary(on->context, binary_file.c_str(), &on->id, 1);
+        // Build the program that was just created.
+        status = clBuildProgram(on->program, 0, NULL, "", NULL, NULL);
+        checkError(status, "Failed to build program");
     #endif
     #ifdef NVIDIA
-        int MAX_SOURCE_SIZE  = 65536;
-        FILE *fp;
-        const char fileName[] = "./device/md.cl";
-        size_t source_size;
-        char *source_str;
-        try {
-            fp = fopen(fileName, "r");
-            if (!fp) {
-                fprintf(stderr, "Failed to load kernel.\n");
-                exit(1);
-            }
-            source_str = (char *)malloc(MAX_SOURCE_SIZE);
-            source_size = fread(source_str, 1, MAX_SOURCE_SIZE, fp);
-            fclose(fp);
-        }
-        catch (int a) {
-            printf("%f", a);
-        }
-        program = clCreateProgramWithSource(context, 1, (const char **)&source_str, (const size_t *)&source_size, &status);
+        // the program for this run, from the cache when an earlier run built the same one
+        char options[256];
+        bool cached;
+        build_options(options, sizeof(options));
+        struct timespec build_start, build_end;
+        clock_gettime(CLOCK_MONOTONIC, &build_start);
+        on->program = program_cache_build(on->context, on->id, "./device/md.cl", options, program_cache, &cached, &status);
+        checkError(status, "Failed to build program");
+        clock_gettime(CLOCK_MONOTONIC, &build_end);
+        printf("program: %s in %.3f ms, options \"%s\"\n", cached ? "cached binary" : "built from source",
+            1e3 * (build_end.tv_sec - build_start.tv_sec) + 1e-6 * (build_end.tv_nsec - build_start.tv_nsec), options);
+        programs_cached = programs_cached && cached;
     #endif
+    printf("device %d: %s, %u compute units\n", (int)(on - device), name, units);
 
-    // Build the program that was just created.
-    status = clBuildProgram(program, 0, NULL, "", NULL, NULL);
-    checkError(status, "Failed to build program");
-
-    const char *kernel_name = "md";
-    kernel = clCreateKernel(program, kernel_name, &status);
+    const char *kernel_name = potential == POTENTIAL_TABLE ? "md_table" : "md";
+    if (pair_search == PAIR_SEARCH_CELLS) {
+        kernel_name = potential == POTENTIAL_TABLE ? "md_cells_table" : "md_cells";
+    }
+    char force_name[64];
+    snprintf(force_name, sizeof(force_name), "%s_forces", kernel_name);
+    on->energy_kernel = clCreateKernel(on->program, kernel_name, &status);
     checkError(status, "Failed to create kernel");
+    on->force_kernel = clCreateKernel(on->program, force_name, &status);
+    checkError(status, "Failed to create the force-only kernel");
+    on->energy_sum_kernel = clCreateKernel(on->program, "energy_sum", &status);
+    checkError(status, "Failed to create kernel energy_sum");
+    on->wrap_kernel = clCreateKernel(on->program, "wrap", &status);
+    checkError(status, "Failed to create kernel wrap");
+    on->kick_drift_kernel = clCreateKernel(on->program, "kick_drift", &status);
+    checkError(status, "Failed to create kernel kick_drift");
+    on->kick_kernel = clCreateKernel(on->program, "kick", &status);
+    checkError(status, "Failed to create kernel kick");
+
+    // State buffers.
+    on->position_buf = clCreateBuffer(on->context, CL_MEM_READ_WRITE,
+        N * sizeof(cl_float3), NULL, &status);
+    checkError(status, "Failed to create buffer for the positions");
+
+    on->velocity_buf = clCreateBuffer(on->context, CL_MEM_READ_WRITE,
+        N * sizeof(cl_float3), NULL, &status);
+    checkError(status, "Failed to create buffer for the velocities");
 
-    // Input buffer.
-    nearest_buf = clCreateBuffer(context, CL_MEM_READ_ONLY,
+    // Input buffer, written by the wrap kernel.
+    on->nearest_buf = clCreateBuffer(on->context, CL_MEM_READ_WRITE,
         N * sizeof(cl_float3), NULL, &status);
     checkError(status, "Failed to create buffer for input A");
 
-    // Output buffer.
-    output_energy_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+    // Output buffers; there are fewer work-groups than particles.
+    on->output_energy_buf = clCreateBuffer(on->context, CL_MEM_READ_WRITE,
         N * sizeof(float), NULL, &status);
     checkError(status, "Failed to create buffer for output_en");
 
-     output_force_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+    on->energy_sums_buf = clCreateBuffer(on->context, CL_MEM_READ_WRITE,
+        2 * sizeof(cl_float), NULL, &status);
+    checkError(status, "Failed to create buffer for the energy sums");
+
+    on->output_force_buf = clCreateBuffer(on->context, CL_MEM_READ_WRITE,
         N * sizeof(cl_float3), NULL, &status);
     checkError(status, "Failed to create buffer for output_force");
+}
 
-    return true;
+// Gives every device a run of the particles in proportion to its weight, one at least;
+// with co_execution of those before cpu_first.
+void split_particles() {
+    int shared = co_execution ? cpu_first : N;
+    double total = 0;
+    for (int d = 0; d < device_count; d++) {
+        total += device[d].weight;
+    }
+    double share = 0;
+    int first = 0;
+    for (int d = 0; d < device_count; d++) {
+        share += device[d].weight;
+        int last = d == device_count - 1 ? shared : (int)(shared * share / total + 0.5);
+        if (last > shared - (device_count - 1 - d)) {
+            last = shared - (device_count - 1 - d);
+        }
+        if (last < first + 1) {
+            last = first + 1;
+        }
+        device[d].first = first;
+        device[d].last = last;
+        first = last;
+        set_range(&device[d]);
+        if (device_count > 1 || co_execution) {
+            printf("device %d: particles %d to %d\n", d, device[d].first, device[d].last - 1);
+        }
+    }
+    if (co_execution) {
+        printf("host: particles %d to %d\n", cpu_first, N - 1);
+    }
+}
+
+// The run first .. last - 1 of a device into the arguments of its kernels.
+void set_range(md_device *on) {
+    cl_int range[2] = { on->first, on->last };
+    // the all-pairs kernels run from the offset first, the cell kernels over all the sorted particles
+    int count = pair_search == PAIR_SEARCH_CELLS ? N : on->last - on->first;
+    cl_int groups = (count + on->force_local_size - 1) / on->force_local_size;
+    cl_int status = clSetKernelArg(on->energy_kernel, on->range_arg, sizeof(cl_int), &range[0]);
+    status |= clSetKernelArg(on->energy_kernel, on->range_arg + 1, sizeof(cl_int), &range[1]);
+    status |= clSetKernelArg(on->force_kernel, on->range_arg, sizeof(cl_int), &range[0]);
+    status |= clSetKernelArg(on->force_kernel, on->range_arg + 1, sizeof(cl_int), &range[1]);
+    status |= clSetKernelArg(on->energy_sum_kernel, 1, sizeof(cl_int), &groups);
+    status |= clSetKernelArg(on->energy_sum_kernel, 3, sizeof(cl_int), &range[0]);
+    status |= clSetKernelArg(on->energy_sum_kernel, 4, sizeof(cl_int), &range[1]);
+    checkError(status, "Failed to set the particle range");
+}
+
+// At a report step: the particles move to the devices whose force kernels ran faster
+// since the last split, once a share would change by 1% or more. The new owners get
+// the whole state and recompute the forces of their particles; the energy sums of the
+// last report hold for any split.
+void balance_devices() {
+    wait_pending(pending_count);
+    collect_pending(pending_count);
+    double throughput[MAX_DEVICES];
+    double total = 0, old_total = 0;
+    for (int d = 0; d < device_count; d++) {
+        if (device[d].force_time <= 0) {
+            return;
+        }
+        throughput[d] = device[d].force_items / device[d].force_time;
+        total += throughput[d];
+        old_total += device[d].weight;
+    }
+    bool changed = false;
+    for (int d = 0; d < device_count; d++) {
+        changed = changed || fabs(throughput[d] / total - device[d].weight / old_total) >= 0.01;
+        device[d].force_time = 0;
+        device[d].force_items = 0;
+    }
+    if (!changed) {
+        return;
+    }
+    read_state();
+    for (int d = 0; d < device_count; d++) {
+        device[d].weight = throughput[d];
+    }
+    split_particles();
+    upload_state();
+    enqueue_forces(false);
+}
+
+// co_execution, before every step: moves the boundary between the last device's particles and
+// the host's to where both would have finished the last force evaluation together. The devices
+// count as one, as they run side by side, and their particles include the padding of the last
+// work-group as in balance_devices(). The boundary goes halfway to the target each step, which
+// damps the noise of single measurements.
+void balance_host() {
+    double device_time = 0, device_items = 0;
+    bool measured = true;
+    for (int d = 0; d < device_count; d++) {
+        md_device *on = &device[d];
+        if (on->last_force == NULL) {
+            measured = false;
+            continue;
+        }
+        wait_for(1, &on->last_force);
+        cl_ulong time_start, time_end;
+        clGetEventProfilingInfo(on->last_force, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
+        clGetEventProfilingInfo(on->last_force, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
+        clReleaseEvent(on->last_force);
+        on->last_force = NULL;
+        if (time_end - time_start > device_time) {
+            device_time = time_end - time_start;
+        }
+        device_items += on->last_items;
+    }
+    if (!measured || device_time <= 0 || cpu_time <= 0) {
+        return;
+    }
+    // particles per second on either side
+    double device_rate = device_items / (device_time * 1e-9);
+    double cpu_rate = (N - cpu_first) / cpu_time;
+    int target = N - (int)(N * cpu_rate / (device_rate + cpu_rate) + 0.5);
+    target = cpu_first + (target - cpu_first) / 2;
+    if (target < device[device_count - 1].first + 1) {
+        target = device[device_count - 1].first + 1;
+    }
+    if (target > N - 1) {
+        target = N - 1;
+    }
+    if (target != cpu_first) {
+        move_boundary(target);
+    }
+}
+
+// Hands the particles between cpu_first and target from the last device to the host or back,
+// with their positions, velocities and the forces of the last step.
+void move_boundary(int target) {
+    cl_int status;
+    md_device *on = &device[device_count - 1];
+    bool to_host = target < cpu_first;
+    int first = to_host ? target : cpu_first;
+    int count = to_host ? cpu_first - target : target - cpu_first;
+    cl_mem buffers[3] = { on->position_buf, on->velocity_buf, on->output_force_buf };
+    cl_float3 *arrays[3] = { input_a, velocity, cpu_force };
+    cl_event event;
+    for (int b = 0; b < 3; b++) {
+        if (to_host) {
+            status = clEnqueueReadBuffer(on->queue, buffers[b], CL_FALSE, first * sizeof(cl_float3),
+                count * sizeof(cl_float3), arrays[b] + first, 0, NULL, &event);
+            checkError(status, "Failed to hand particles to the host");
+            keep_event(event, PROFILE_READ, device_count - 1);
+        } else {
+            status = clEnqueueWriteBuffer(on->queue, buffers[b], CL_FALSE, first * sizeof(cl_float3),
+                count * sizeof(cl_float3), arrays[b] + first, 0, NULL, &event);
+            checkError(status, "Failed to hand particles to the device");
+            keep_event(event, PROFILE_WRITE, device_count - 1);
+        }
+    }
+    if (to_host) {
+        // the queue runs in order, so the last read finishes after the others
+        wait_for(1, &event);
+        PROFILE_COUNT(PROFILE_BYTES_FROM_DEVICE, 3L * count * sizeof(cl_float3));
+    } else {
+        PROFILE_COUNT(PROFILE_BYTES_TO_DEVICE, 3L * count * sizeof(cl_float3));
+    }
+    bytes_copied += 3.0 * count * sizeof(cl_float3);
+    cpu_first = target;
+    on->last = target;
+    set_range(on);
 }
 
 // Initialize the data for the problem. Requires num_devices to be known.
 void init_problem() {
+    for (int b = 0; b < 2 && (device_count > 1 || co_execution); b++) {
+        exchange[b] = (cl_float3*)calloc(N, sizeof(cl_float3));
+        if (!exchange[b]) {
+            printf("Failed to allocate the problem data for N = %d\n", N);
+            exit(1);
+        }
+    }
+    if (restart_path[0] != '\0') {
+        restore_checkpoint();
+    } else {
+        input_a = (cl_float3*)calloc(N, sizeof(cl_float3));
+        velocity = (cl_float3*)calloc(N, sizeof(cl_float3));
+    }
+    if (!input_a || !velocity) {
+        printf("Failed to allocate the problem data for N = %d\n", N);
+        exit(1);
+    }
+    if (restart_path[0] != '\0') {
+        return;
+    }
     int count = 0;
     for (double i = -(box_size - initial_dist_to_edge)/2; i < (box_size - initial_dist_to_edge)/2; i += initial_dist_by_one_axis) {
         for (double j = -(box_size - initial_dist_to_edge)/2; j < (box_size - initial_dist_to_edge)/2; j += initial_dist_by_one_axis) {
@@ -178,154 +631,1009 @@ void init_problem() {
         }
     }
     if( count < N ){
-        printf("error decrease initial_dist parameter, count is %ld  N is %ld \n", count, N);
+        printf("error decrease initial_dist parameter, count is %d  N is %d \n", count, N);
         exit(1);
     }
 }
 
-void calculate_energy_force_lj() {
-    nearest_image();
-    for (int i = 0; i < N; i++){
-        output_force[i] = (cl_float3){0, 0, 0};
-        output_energy[i] = 0;
+// Tabulates the unshifted pair the md kernel computes and uploads it as floats to every device.
+void init_pair_table() {
+    cl_int status;
+    if (!build_pair_table(&table, lennard_jones_pair, NULL, table_rmin, rc, table_tolerance, NULL, 0)) {
+        printf("pair table: %d intervals reach only a relative error of %.1e\n", table.intervals, table.max_error);
+    } else {
+        printf("pair table: %d intervals, relative error %.1e\n", table.intervals, table.max_error);
+    }
+    cl_float *coefficients = (cl_float*)malloc(sizeof(cl_float) * PAIR_TABLE_STRIDE * table.intervals);
+    for (long c = 0; c < (long)PAIR_TABLE_STRIDE * table.intervals; c++) {
+        coefficients[c] = (cl_float)table.coefficients[c];
+    }
+    for (int d = 0; d < device_count; d++) {
+        device[d].table_buf = clCreateBuffer(device[d].context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            sizeof(cl_float) * PAIR_TABLE_STRIDE * table.intervals, coefficients, &status);
+        checkError(status, "Failed to create buffer for the pair table");
     }
-    run();
+    free(coefficients);
+}
+
+// The pair kernel and buffers of co_execution, and the first split: the host gets a share of the
+// particles as if each of its threads were one more compute unit, until balance_host() measures.
+void init_host_share() {
+    cpu_lj = make_lj_setup(rc, box_size);
+    // md.cl leaves the pair unshifted, and so must the host, for the energies to add up
+    cpu_lj.shift = 0;
+    select_lj_kernel(&cpu_lj, best_lj_isa(), false);
+    if (potential == POTENTIAL_TABLE) {
+        tabulate_lj_setup(&cpu_lj, table_rmin, table_tolerance);
+    }
+    printf("host pair kernel: %s, %d threads\n", cpu_lj.kernel_name, threads);
+    cpu_positions = alloc_coords(N);
+    cpu_force = (cl_float3*)calloc(N, sizeof(cl_float3));
+    cpu_all = (int*)malloc(sizeof(int) * N);
+    for (int i = 0; i < N; i++) {
+        cpu_all[i] = i;
+    }
+    for (int t = 0; t < threads; t++) {
+        cpu_partners[t] = (int*)malloc(sizeof(int) * N);
+        cpu_reactions[t] = alloc_coords(N);
+    }
+    if (pair_search == PAIR_SEARCH_CELLS) {
+        host_cell_head = (int*)malloc(sizeof(int) * cells_total);
+        host_cell_next = (int*)malloc(sizeof(int) * N);
+    }
+    double units = 0;
+    for (int d = 0; d < device_count; d++) {
+        units += device[d].weight;
+    }
+    cpu_first = N - (int)(N * threads / (units + threads) + 0.5);
+    if (cpu_first < device_count) {
+        cpu_first = device_count;
+    }
+    if (cpu_first > N - 1) {
+        cpu_first = N - 1;
+    }
+}
+
+void restore_checkpoint() {
+    if (!snapshot_map(restart_path, &restart_snapshot)) {
+        printf("Failed to map checkpoint %s\n", restart_path);
+        exit(1);
+    }
+    const md_checkpoint *state = (const md_checkpoint*)snapshot_find(&restart_snapshot, "state", sizeof(md_checkpoint));
+    if (state == NULL) {
+        printf("Checkpoint %s is damaged or belongs to another problem\n", restart_path);
+        exit(1);
+    }
+    resumed = *state;
+    if (resumed.N != N || resumed.box_size != box_size) {
+        printf("Checkpoint %s holds N %d in box %g, this run has N %d in box %g\n",
+            restart_path, resumed.N, resumed.box_size, N, box_size);
+        exit(1);
+    }
+    // the private mapping copies a page only once the run writes to it
+    input_a = (cl_float3*)snapshot_find(&restart_snapshot, "positions", N * sizeof(cl_float3));
+    velocity = (cl_float3*)snapshot_find(&restart_snapshot, "velocities", N * sizeof(cl_float3));
+    if (!input_a || !velocity) {
+        printf("Checkpoint %s is damaged or belongs to another problem\n", restart_path);
+        exit(1);
+    }
+    kernel_total_time = resumed.kernel_total_time;
+    printf("resumed from %s at step %ld\n", restart_path, resumed.step);
+}
+
+bool write_checkpoint(long step, double initial_energy, double max_deviation) {
+    md_checkpoint state = { N, integrator, dt, box_size, step, initial_energy, max_deviation, kernel_total_time };
+    snapshot_section sections[] = {
+        { "state", &state, sizeof(state) },
+        { "positions", input_a, N * sizeof(cl_float3) },
+        { "velocities", velocity, N * sizeof(cl_float3) },
+    };
+    return snapshot_write(checkpoint_path, sections, sizeof(sections) / sizeof(sections[0]));
+}
+
+// Sets the arguments of every kernel of a device once: the buffers stay the same for the whole run.
+void init_kernels(md_device *on) {
+    cl_int status;
+    cl_int particle_count = N;
+    cl_float box = box_size;
+    cl_float cutoff2 = rc * rc;
+    on->force_local_size = choose_work_group_size(on->id, on->energy_kernel);
+    printf("force kernel on device %d: groups of %zu work-items\n", (int)(on - device), on->force_local_size);
+    // both variants of the force kernel take the same arguments
+    cl_kernel variants[2] = { on->energy_kernel, on->force_kernel };
+    for (int v = 0; v < 2; v++) {
+        cl_kernel force = variants[v];
+        unsigned argi = 0;
+        if (pair_search == PAIR_SEARCH_CELLS) {
+            status = clSetKernelArg(force, argi++, sizeof(cl_mem), &on->sorted_buf);
+            checkError(status, "Failed to set argument sorted");
+            status = clSetKernelArg(force, argi++, sizeof(cl_mem), &on->sorted_index_buf);
+            checkError(status, "Failed to set argument sorted_index");
+            status = clSetKernelArg(force, argi++, sizeof(cl_mem), &on->cell_start_buf);
+            checkError(status, "Failed to set argument cell_start");
+            status = clSetKernelArg(force, argi++, sizeof(cl_mem), &on->cell_count_buf);
+            checkError(status, "Failed to set argument cell_count");
+            status = clSetKernelArg(force, argi++, sizeof(cl_mem), &on->cell_neighbors_buf);
+            checkError(status, "Failed to set argument cell_neighbors");
+        } else {
+            status = clSetKernelArg(force, argi++, sizeof(cl_mem), &on->nearest_buf);
+            checkError(status, "Failed to set argument input_a");
+        }
+
+        status = clSetKernelArg(force, argi++, sizeof(cl_mem), &on->output_energy_buf);
+        checkError(status, "Failed to set argument output_en");
+
+        status = clSetKernelArg(force, argi++, on->force_local_size * sizeof(cl_float), NULL);
+        checkError(status, "Failed to set argument partial");
+
+        status = clSetKernelArg(force, argi++, sizeof(cl_mem), &on->output_force_buf);
+        checkError(status, "Failed to set argument output_force");
+
+        status = clSetKernelArg(force, argi++, sizeof(cl_int), &particle_count);
+        checkError(status, "Failed to set argument n");
+
+        status = clSetKernelArg(force, argi++, sizeof(cl_float), &box);
+        checkError(status, "Failed to set argument box_size");
+
+        status = clSetKernelArg(force, argi++, sizeof(cl_float), &cutoff2);
+        checkError(status, "Failed to set argument cutoff2");
+
+        if (pair_search == PAIR_SEARCH_CELLS) {
+            cl_int cells = cells_per_side;
+            status = clSetKernelArg(force, argi++, sizeof(cl_int), &cells);
+            checkError(status, "Failed to set argument cells_per_side");
+        }
+        // first and last, set by split_particles()
+        on->range_arg = argi;
+        argi += 2;
+        if (pair_search != PAIR_SEARCH_CELLS) {
+            status = clSetKernelArg(force, argi++, on->force_local_size * sizeof(cl_float3), NULL);
+            checkError(status, "Failed to set argument tile");
+        }
+
+        if (potential == POTENTIAL_TABLE) {
+            cl_float s_min = table.s_min;
+            cl_float inv_h = table.inv_h;
+            cl_int intervals = table.intervals;
+            status = clSetKernelArg(force, argi++, sizeof(cl_mem), &on->table_buf);
+            checkError(status, "Failed to set argument table");
+            status = clSetKernelArg(force, argi++, sizeof(cl_float), &s_min);
+            checkError(status, "Failed to set argument s_min");
+            status = clSetKernelArg(force, argi++, sizeof(cl_float), &inv_h);
+            checkError(status, "Failed to set argument inv_h");
+            status = clSetKernelArg(force, argi++, sizeof(cl_int), &intervals);
+            checkError(status, "Failed to set argument intervals");
+        }
+    }
+
+    // groups, first and last are set by split_particles()
+    on->sum_local_size = choose_work_group_size(on->id, on->energy_sum_kernel);
+    status = clSetKernelArg(on->energy_sum_kernel, 0, sizeof(cl_mem), &on->output_energy_buf);
+    status |= clSetKernelArg(on->energy_sum_kernel, 2, sizeof(cl_mem), &on->velocity_buf);
+    status |= clSetKernelArg(on->energy_sum_kernel, 5, sizeof(cl_mem), &on->energy_sums_buf);
+    status |= clSetKernelArg(on->energy_sum_kernel, 6, on->sum_local_size * sizeof(cl_float), NULL);
+    checkError(status, "Failed to set the arguments of energy_sum");
+
+    status = clSetKernelArg(on->wrap_kernel, 0, sizeof(cl_mem), &on->position_buf);
+    checkError(status, "Failed to set argument positions of wrap");
+    status = clSetKernelArg(on->wrap_kernel, 1, sizeof(cl_mem), &on->nearest_buf);
+    checkError(status, "Failed to set argument nearest of wrap");
+    status = clSetKernelArg(on->wrap_kernel, 2, sizeof(cl_float), &box);
+    checkError(status, "Failed to set argument box_size of wrap");
+
+    // symplectic Euler kicks by a whole step before the drift, velocity Verlet by half of one
+    cl_float kick = integrator == EULER ? dt : dt / 2;
+    cl_float drift = dt;
+    status = clSetKernelArg(on->kick_drift_kernel, 0, sizeof(cl_mem), &on->position_buf);
+    checkError(status, "Failed to set argument positions of kick_drift");
+    status = clSetKernelArg(on->kick_drift_kernel, 1, sizeof(cl_mem), &on->velocity_buf);
+    checkError(status, "Failed to set argument velocities of kick_drift");
+    status = clSetKernelArg(on->kick_drift_kernel, 2, sizeof(cl_mem), &on->output_force_buf);
+    checkError(status, "Failed to set argument forces of kick_drift");
+    status = clSetKernelArg(on->kick_drift_kernel, 3, sizeof(cl_float), &kick);
+    checkError(status, "Failed to set argument kick of kick_drift");
+    status = clSetKernelArg(on->kick_drift_kernel, 4, sizeof(cl_float), &drift);
+    checkError(status, "Failed to set argument drift of kick_drift");
+
+    status = clSetKernelArg(on->kick_kernel, 0, sizeof(cl_mem), &on->velocity_buf);
+    checkError(status, "Failed to set argument velocities of kick");
+    status = clSetKernelArg(on->kick_kernel, 1, sizeof(cl_mem), &on->output_force_buf);
+    checkError(status, "Failed to set argument forces of kick");
+    status = clSetKernelArg(on->kick_kernel, 2, sizeof(cl_float), &kick);
+    checkError(status, "Failed to set argument kick of kick");
 }
 
 void md() {
-    for (int n = 0; n < total_it; n ++){
-        calculate_energy_force_lj();
-        motion();
+    upload_state();
+    // velocity Verlet needs the forces at the starting positions
+    enqueue_forces(true);
+    enqueue_energy_sum();
+    double initial_energy = read_energy();
+    double total_energy = initial_energy;
+    double max_deviation = 0;
+    int first_step = 0;
+    if (restart_path[0] != '\0') {
+        // keep measuring the drift against the energy the run started with
+        initial_energy = resumed.initial_energy;
+        max_deviation = resumed.max_deviation;
+        first_step = (int)resumed.step;
+    }
+    double checkpoint_time = 0;
+    int checkpoints = 0;
+    struct timespec loop_start, loop_end;
+    clock_gettime(CLOCK_MONOTONIC, &loop_start);
+    for (int n = first_step; n < total_it; n ++){
+        // the state only comes back to the host here, so the drift is sampled every 500 steps
         if (!(n % 500)){
-            float total_energy = 0;
-            for (int i = 0; i < N; i++)
-                total_energy+=output_energy[i];
-            total_energy/=(2 * N);
-                printf("energy is %f \n",total_energy);
+            if (device_count > 1 && n > first_step) {
+                balance_devices();
+            }
+            int current = enqueue_report(n);
+            if (!pipeline) {
+                finish_report(&stage[current], initial_energy, &max_deviation);
+            } else if (stage[1 - current].waiting) {
+                // its reads were queued 500 steps ago and are long done
+                finish_report(&stage[1 - current], initial_energy, &max_deviation);
+            }
+        }
+        if (co_execution && n > first_step) {
+            balance_host();
         }
+        // only the steps before a report and the last one compute and sum the energy
+        enqueue_step((n + 1) % 500 == 0 || n + 1 == total_it);
+        if (checkpoint_path[0] != '\0' && ((n + 1) % checkpoint_every == 0 || n + 1 == total_it)) {
+            struct timespec checkpoint_start, checkpoint_end;
+            clock_gettime(CLOCK_MONOTONIC, &checkpoint_start);
+            PROFILE_BEGIN(PROFILE_CHECKPOINT);
+            finish_reports(initial_energy, &max_deviation);
+            read_state();
+            if (!write_checkpoint(n + 1, initial_energy, max_deviation)) {
+                printf("Failed to write checkpoint %s at step %d\n", checkpoint_path, n + 1);
+            }
+            PROFILE_END(PROFILE_CHECKPOINT);
+            clock_gettime(CLOCK_MONOTONIC, &checkpoint_end);
+            checkpoint_time += (checkpoint_end.tv_sec - checkpoint_start.tv_sec) + 1e-9 * (checkpoint_end.tv_nsec - checkpoint_start.tv_nsec);
+            checkpoints++;
+        }
+    }
+    finish_reports(initial_energy, &max_deviation);
+    if (!host_state_current) {
+        read_state();
     }
+    clock_gettime(CLOCK_MONOTONIC, &loop_end);
+    total_energy = read_energy();
+    if (fabs(total_energy - initial_energy) > max_deviation)
+        max_deviation = fabs(total_energy - initial_energy);
+    double loop_time = (loop_end.tv_sec - loop_start.tv_sec) + 1e-9 * (loop_end.tv_nsec - loop_start.tv_nsec);
+    if (checkpoints > 0) {
+        printf("checkpoint %s: %d written, %.3f ms each\n", checkpoint_path, checkpoints, 1000 * checkpoint_time / checkpoints);
+    }
+    int steps = total_it - first_step;
+    printf("\nsimulated time %g in %.3f s of step loop\n", steps * dt, loop_time);
+    printf("throughput: %.4e pairs/s, %.4e steps/s, %.4f ns/day\n",
+        pairs_per_step * steps / loop_time, steps / loop_time, steps * dt * ARGON_TAU_PS * 1e-3 / loop_time * 86400);
+    // the device time the host did not wait for ran behind the host's own work
+    double hidden = device_busy_time * 1e-6 - host_wait_time * 1e3;
+    printf("pipeline %s: device busy %.3f ms, host blocked %.3f ms, %.3f ms of device time hidden\n",
+        pipeline ? "on" : "off", device_busy_time * 1e-6, host_wait_time * 1e3, hidden > 0 ? hidden : 0);
+    // the state stays on the devices, so a step copies only the positions several devices exchange
+    printf("transfers: %.0f bytes copied per step, %.0f in all\n", steps > 0 ? bytes_copied / steps : 0, bytes_copied);
+    if (co_execution) {
+        printf("co-execution: the host computed %.1f%% of the particles on average, %d at the end, in %.3f ms of its last step\n",
+            100 * cpu_share_sum / cpu_share_steps, N - cpu_first, 1e3 * cpu_time);
+    }
+    // a stable dt keeps the total energy flat; pick the largest one whose drift is acceptable
+    printf("\nintegrator %s, dt %g: total energy per particle %f -> %f\n",
+        integrator == EULER ? "euler" : "velocity-verlet", dt, initial_energy / N, total_energy / N);
+    printf("energy drift %e per particle per unit time, max deviation %e per particle\n",
+        (total_energy - initial_energy) / (N * total_it * dt), max_deviation / N);
 }
 
-void run() {
+// Cells of side >= rc, so every partner lies in the cell of a particle or in one of the
+// 26 around it; the neighbor table is built here once, the cells on the device every step.
+// Every device sorts all the particles, and computes those of its own run.
+void init_cells() {
     cl_int status;
+    cells_per_side = (int)(box_size / rc);
+    cells_total = cells_per_side * cells_per_side * cells_per_side;
+    cl_int *neighbors = (cl_int*)malloc(sizeof(cl_int) * cells_total * 27);
+    int stencil = 0;
+    for (int cz = 0; cz < cells_per_side; cz++) {
+        for (int cy = 0; cy < cells_per_side; cy++) {
+            for (int cx = 0; cx < cells_per_side; cx++) {
+                int cell = (cz * cells_per_side + cy) * cells_per_side + cx;
+                cl_int *list = neighbors + cell * 27;
+                int count = 0;
+                for (int dz = -1; dz <= 1; dz++) {
+                    for (int dy = -1; dy <= 1; dy++) {
+                        for (int dx = -1; dx <= 1; dx++) {
+                            int nx = (cx + dx + cells_per_side) % cells_per_side;
+                            int ny = (cy + dy + cells_per_side) % cells_per_side;
+                            int nz = (cz + dz + cells_per_side) % cells_per_side;
+                            int neighbor = (nz * cells_per_side + ny) * cells_per_side + nx;
+                            // with fewer than 3 cells per side the periodic stencil
+                            // wraps onto itself, so every cell must be listed only once
+                            bool seen = false;
+                            for (int k = 0; k < count; k++) {
+                                if (list[k] == neighbor) {
+                                    seen = true;
+                                    break;
+                                }
+                            }
+                            if (!seen) {
+                                list[count] = neighbor;
+                                count++;
+                            }
+                        }
+                    }
+                }
+                for (int k = count; k < 27; k++) {
+                    list[k] = -1;
+                }
+                stencil = count;
+            }
+        }
+    }
+    // at uniform density
+    pairs_per_step = (double)N * ((double)N * stencil / cells_total - 1);
+    printf("cell list: %d cells per side, %d neighbor cells each\n", cells_per_side, stencil);
+    // with co_execution the host walks the same cells
+    host_cell_neighbors = neighbors;
 
-    // Launch the problem for each device.
-    cl_event kernel_event;
-    cl_event finish_event;
-    cl_ulong time_start, time_end;
-    double total_time;
-    // Each of the host buffers supplied to
-    // clEnqueueWriteBuffer here is already aligned to ensure that DMA is used
-    // for the host-to-device transfer.
-    cl_event write_event;
-    status = clEnqueueWriteBuffer(queue, nearest_buf, CL_FALSE,
-        0, N * sizeof(cl_float3), nearest, 0, NULL, &write_event);
-    checkError(status, "Failed to transfer input A");
-
-    // Set kernel arguments.
-    unsigned argi = 0;
-
-    size_t global_work_size[1] = {N};
-    size_t local_work_size[1] = {N};
-    status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &nearest_buf);
-    checkError(status, "Failed to set argument input_a");
-
-    status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &output_energy_buf);
-    checkError(status, "Failed to set argument output_en");
-
-    status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &output_force_buf);
-    checkError(status, "Failed to set argument output_force");
-
-    status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL,
-        global_work_size, local_work_size, 1, &write_event, &kernel_event);
-    checkError(status, "Failed to launch kernel");
+    cl_int particle_count = N;
+    cl_float box = box_size;
+    cl_int cells = cells_per_side;
+    cl_int all_cells = cells_total;
+    for (int d = 0; d < device_count; d++) {
+        md_device *on = &device[d];
+        on->cell_neighbors_buf = clCreateBuffer(on->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            sizeof(cl_int) * cells_total * 27, neighbors, &status);
+        checkError(status, "Failed to create buffer for the neighbor cells");
+        on->particle_cell_buf = clCreateBuffer(on->context, CL_MEM_READ_WRITE, N * sizeof(cl_int), NULL, &status);
+        checkError(status, "Failed to create buffer for the particle cells");
+        on->particle_slot_buf = clCreateBuffer(on->context, CL_MEM_READ_WRITE, N * sizeof(cl_int), NULL, &status);
+        checkError(status, "Failed to create buffer for the particle slots");
+        on->cell_count_buf = clCreateBuffer(on->context, CL_MEM_READ_WRITE, cells_total * sizeof(cl_int), NULL, &status);
+        checkError(status, "Failed to create buffer for the cell counts");
+        on->cell_start_buf = clCreateBuffer(on->context, CL_MEM_READ_WRITE, cells_total * sizeof(cl_int), NULL, &status);
+        checkError(status, "Failed to create buffer for the cell starts");
+        on->sorted_buf = clCreateBuffer(on->context, CL_MEM_READ_WRITE, N * sizeof(cl_float3), NULL, &status);
+        checkError(status, "Failed to create buffer for the sorted positions");
+        on->sorted_index_buf = clCreateBuffer(on->context, CL_MEM_READ_WRITE, N * sizeof(cl_int), NULL, &status);
+        checkError(status, "Failed to create buffer for the sorted indices");
 
-    // Read the result. This the final operation.
-    status = clEnqueueReadBuffer(queue, output_energy_buf, CL_FALSE,
-        0, N * sizeof(float), output_energy, 1, &kernel_event, &finish_event);
+        on->cell_index_kernel = clCreateKernel(on->program, "cell_index", &status);
+        checkError(status, "Failed to create kernel cell_index");
+        on->cell_offsets_kernel = clCreateKernel(on->program, "cell_offsets", &status);
+        checkError(status, "Failed to create kernel cell_offsets");
+        on->sort_kernel = clCreateKernel(on->program, "sort_by_cell", &status);
+        checkError(status, "Failed to create kernel sort_by_cell");
 
-    status = clEnqueueReadBuffer(queue, output_force_buf, CL_FALSE,
-        0, N * sizeof(cl_float3), output_force, 1, &kernel_event, &finish_event);
+        status = clSetKernelArg(on->cell_index_kernel, 0, sizeof(cl_mem), &on->nearest_buf);
+        status |= clSetKernelArg(on->cell_index_kernel, 1, sizeof(cl_mem), &on->particle_cell_buf);
+        status |= clSetKernelArg(on->cell_index_kernel, 2, sizeof(cl_mem), &on->particle_slot_buf);
+        status |= clSetKernelArg(on->cell_index_kernel, 3, sizeof(cl_mem), &on->cell_count_buf);
+        status |= clSetKernelArg(on->cell_index_kernel, 4, sizeof(cl_int), &particle_count);
+        status |= clSetKernelArg(on->cell_index_kernel, 5, sizeof(cl_float), &box);
+        status |= clSetKernelArg(on->cell_index_kernel, 6, sizeof(cl_int), &cells);
+        checkError(status, "Failed to set the arguments of cell_index");
 
-    // Release local events.
-    clReleaseEvent(write_event);
+        on->scan_local_size = choose_work_group_size(on->id, on->cell_offsets_kernel);
+        status = clSetKernelArg(on->cell_offsets_kernel, 0, sizeof(cl_mem), &on->cell_count_buf);
+        status |= clSetKernelArg(on->cell_offsets_kernel, 1, sizeof(cl_mem), &on->cell_start_buf);
+        status |= clSetKernelArg(on->cell_offsets_kernel, 2, sizeof(cl_int), &all_cells);
+        status |= clSetKernelArg(on->cell_offsets_kernel, 3, on->scan_local_size * sizeof(cl_int), NULL);
+        checkError(status, "Failed to set the arguments of cell_offsets");
 
-    // Wait for all devices to finish.
-    clWaitForEvents(1, &finish_event);
+        status = clSetKernelArg(on->sort_kernel, 0, sizeof(cl_mem), &on->nearest_buf);
+        status |= clSetKernelArg(on->sort_kernel, 1, sizeof(cl_mem), &on->particle_cell_buf);
+        status |= clSetKernelArg(on->sort_kernel, 2, sizeof(cl_mem), &on->particle_slot_buf);
+        status |= clSetKernelArg(on->sort_kernel, 3, sizeof(cl_mem), &on->cell_start_buf);
+        status |= clSetKernelArg(on->sort_kernel, 4, sizeof(cl_mem), &on->sorted_buf);
+        status |= clSetKernelArg(on->sort_kernel, 5, sizeof(cl_mem), &on->sorted_index_buf);
+        status |= clSetKernelArg(on->sort_kernel, 6, sizeof(cl_int), &particle_count);
+        checkError(status, "Failed to set the arguments of sort_by_cell");
+    }
+    if (!co_execution) {
+        free(neighbors);
+        host_cell_neighbors = NULL;
+    }
+}
+
+// The -D options of md.cl: the unrolling, and with specialize = on the constants of the run
+// as float literals equal to the arguments the kernels are passed.
+void build_options(char *options, size_t size) {
+    int length = snprintf(options, size, "-D UNROLL=%d", unroll);
+    if (specialize) {
+        snprintf(options + length, size - length, " -D PARTICLES=%d -D BOX=%.9ef -D CUTOFF2=%.9ef",
+            N, (double)(cl_float)box_size, (double)(cl_float)(rc * rc));
+    }
+}
 
-    clGetEventProfilingInfo(kernel_event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
-    clGetEventProfilingInfo(kernel_event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
-    total_time = time_end - time_start;
-    kernel_total_time += total_time;
+// The largest power of two that the device runs of the kernel and whose tile fits in local
+// memory, unless work_group_size sets it.
+size_t choose_work_group_size(cl_device_id on, cl_kernel tiled) {
+    if (work_group_size > 0) {
+        return work_group_size;
+    }
+    size_t kernel_limit;
+    cl_ulong local_memory;
+    cl_int status = clGetKernelWorkGroupInfo(tiled, on, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernel_limit), &kernel_limit, NULL);
+    checkError(status, "Failed to query the work-group size");
+    status = clGetDeviceInfo(on, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_memory), &local_memory, NULL);
+    checkError(status, "Failed to query the local memory size");
+    size_t local_size = 1;
+    while (local_size * 2 <= kernel_limit && local_size * 2 * sizeof(cl_float3) <= local_memory / 2) {
+        local_size *= 2;
+    }
+    return local_size;
+}
 
-    // Release all events.
-    clReleaseEvent(kernel_event);
-    clReleaseEvent(finish_event);
+// Work-items offset .. offset + global - 1 on the queue of a device. The event is kept until
+// the next read_state() collects its device time, and is returned for the caller to retain
+// if it needs it longer. A local size of 0 leaves the work-group size to the runtime.
+cl_event enqueue_kernel(md_device *on, cl_kernel launched, size_t offset, size_t global, size_t local, int phase) {
+    size_t global_work_offset[1] = {offset};
+    size_t global_work_size[1] = {global};
+    size_t local_work_size[1] = {local};
+    cl_event event;
+    cl_int status = clEnqueueNDRangeKernel(on->queue, launched, 1, offset == 0 ? NULL : global_work_offset,
+        global_work_size, local == 0 ? NULL : local_work_size, 0, NULL, &event);
+    checkError(status, "Failed to launch kernel");
+    keep_event(event, phase, on - device);
+    return event;
 }
 
-void motion(){
-    double total_energy = 0;
-    for (int i = 0; i < N; i++)
-            total_energy+=output_energy[i];
-        total_energy/=(2 * N);
-    for (int i = 0; i < N; i++) {
-        velocity[i] = (cl_float3) {velocity[i].x + output_force[i].x * dt,
-            velocity[i].y + output_force[i].y * dt,
-            velocity[i].z + output_force[i].z * dt};
-        input_a[i] = (cl_float3) {input_a[i].x + velocity[i].x * dt,
-            input_a[i].y + velocity[i].y * dt,
-            input_a[i].z + velocity[i].z * dt};
+void keep_event(cl_event event, int phase, int on) {
+    if (pending_count == MAX_PENDING) {
+        wait_pending(MAX_PENDING / 2);
+        collect_pending(MAX_PENDING / 2);
     }
+    pending[pending_count].event = event;
+    pending[pending_count].phase = phase;
+    pending[pending_count].device = on;
+    pending_count++;
+}
 
+// Counting sort of the wrapped positions by cell, on the device.
+void enqueue_cells(md_device *on) {
+    size_t global = (N + on->force_local_size - 1) / on->force_local_size * on->force_local_size;
+    cl_int zero = 0;
+    cl_event event;
+    cl_int status = clEnqueueFillBuffer(on->queue, on->cell_count_buf, &zero, sizeof(zero),
+        0, cells_total * sizeof(cl_int), 0, NULL, &event);
+    checkError(status, "Failed to clear the cell counts");
+    keep_event(event, PROFILE_NEIGHBOR_SEARCH, on - device);
+    enqueue_kernel(on, on->cell_index_kernel, 0, global, on->force_local_size, PROFILE_NEIGHBOR_SEARCH);
+    enqueue_kernel(on, on->cell_offsets_kernel, 0, on->scan_local_size, on->scan_local_size, PROFILE_NEIGHBOR_SEARCH);
+    enqueue_kernel(on, on->sort_kernel, 0, global, on->force_local_size, PROFILE_NEIGHBOR_SEARCH);
 }
 
-void nearest_image(){
-    for (int i = 0; i < N; i++){
-        float x,y,z;
-        if (input_a[i].x  > 0){
-            x = fmod(input_a[i].x + half_box, box_size) - half_box;
+// wrapped positions, then the forces on them, with energy also the energy of every work-group;
+// with co_execution the host computes its share while the devices run
+void enqueue_forces(bool energy) {
+    for (int d = 0; d < device_count; d++) {
+        enqueue_kernel(&device[d], device[d].wrap_kernel, device[d].first, device[d].last - device[d].first, 0, PROFILE_WRAP);
+    }
+    if (device_count > 1 || co_execution) {
+        exchange_positions();
+    }
+    for (int d = 0; d < device_count; d++) {
+        md_device *on = &device[d];
+        cl_kernel force = energy ? on->energy_kernel : on->force_kernel;
+        cl_event event;
+        double items;
+        if (pair_search == PAIR_SEARCH_CELLS) {
+            // the work-items of the other devices' particles only take part in the group sums
+            enqueue_cells(on);
+            event = enqueue_kernel(on, force, 0, (N + on->force_local_size - 1) / on->force_local_size * on->force_local_size,
+                on->force_local_size, PROFILE_KERNEL);
+            items = on->last - on->first;
+        } else {
+            int count = on->last - on->first;
+            size_t global = (count + on->force_local_size - 1) / on->force_local_size * on->force_local_size;
+            event = enqueue_kernel(on, force, on->first, global, on->force_local_size, PROFILE_KERNEL);
+            items = global;
         }
-        else{
-            x = fmod(input_a[i].x - half_box, box_size) + half_box;
+        on->force_items += items;
+        if (co_execution) {
+            if (on->last_force != NULL) {
+                clReleaseEvent(on->last_force);
+            }
+            clRetainEvent(event);
+            on->last_force = event;
+            on->last_items = items;
+            clFlush(on->queue);
         }
-        if (input_a[i].y  > 0){
-            y = fmod(input_a[i].y + half_box, box_size) - half_box;
+    }
+    if (co_execution) {
+        host_forces(energy);
+    }
+    PROFILE_COUNT(PROFILE_PAIRS_EVALUATED, (long)pairs_per_step);
+}
+
+// The group energies of the last force kernel and the velocities into the two sums of every device;
+// the host sums the kinetic energy of its own particles at once.
+void enqueue_energy_sum() {
+    for (int d = 0; d < device_count; d++) {
+        enqueue_kernel(&device[d], device[d].energy_sum_kernel, 0, device[d].sum_local_size, device[d].sum_local_size, PROFILE_ENERGY);
+    }
+    if (co_execution) {
+        double kinetic = 0;
+        for (int i = cpu_first; i < N; i++) {
+            kinetic += velocity[i].x * velocity[i].x + velocity[i].y * velocity[i].y + velocity[i].z * velocity[i].z;
         }
-        else{
-            y = fmod(input_a[i].y - half_box, box_size) + half_box;
+        cpu_kinetic = kinetic / 2;
+    }
+}
+
+// Every device's wrapped run of positions to all the others, through the host: events
+// of one context cannot hold back the queue of another. The writes of this step may still
+// be running while the next step reads, so the exchanges take the two host arrays in turn.
+// With co_execution the host wraps its own run into the array and sends it to every device.
+void exchange_positions() {
+    cl_int status;
+    cl_float3 *wrapped = exchange[exchanges % 2];
+    exchanges++;
+    cl_event read[MAX_DEVICES];
+    for (int d = 0; d < device_count; d++) {
+        md_device *on = &device[d];
+        status = clEnqueueReadBuffer(on->queue, on->nearest_buf, CL_FALSE, on->first * sizeof(cl_float3),
+            (on->last - on->first) * sizeof(cl_float3), wrapped + on->first, 0, NULL, &read[d]);
+        checkError(status, "Failed to read the wrapped positions");
+        clRetainEvent(read[d]);
+        keep_event(read[d], PROFILE_READ, d);
+        clFlush(on->queue);
+    }
+    if (co_execution) {
+        host_wrap(wrapped);
+        for (int e = 0; e < device_count; e++) {
+            cl_event event;
+            status = clEnqueueWriteBuffer(device[e].queue, device[e].nearest_buf, CL_FALSE, cpu_first * sizeof(cl_float3),
+                (N - cpu_first) * sizeof(cl_float3), wrapped + cpu_first, 0, NULL, &event);
+            checkError(status, "Failed to transfer the wrapped positions");
+            keep_event(event, PROFILE_WRITE, e);
         }
-        if (input_a[i].z  > 0){
-            z = fmod(input_a[i].z + half_box, box_size) - half_box;
+    }
+    for (int d = 0; d < device_count; d++) {
+        md_device *from = &device[d];
+        wait_for(1, &read[d]);
+        clReleaseEvent(read[d]);
+        for (int e = 0; e < device_count; e++) {
+            if (e == d) {
+                continue;
+            }
+            cl_event event;
+            status = clEnqueueWriteBuffer(device[e].queue, device[e].nearest_buf, CL_FALSE, from->first * sizeof(cl_float3),
+                (from->last - from->first) * sizeof(cl_float3), wrapped + from->first, 0, NULL, &event);
+            checkError(status, "Failed to transfer the wrapped positions");
+            keep_event(event, PROFILE_WRITE, e);
+        }
+    }
+    // every device reads its own run and gets all the others
+    bytes_copied += (double)device_count * N * sizeof(cl_float3);
+    PROFILE_COUNT(PROFILE_BYTES_FROM_DEVICE, (co_execution ? cpu_first : N) * sizeof(cl_float3));
+    PROFILE_COUNT(PROFILE_BYTES_TO_DEVICE, ((long)device_count * N - (co_execution ? cpu_first : N)) * sizeof(cl_float3));
+}
+
+// Advances one step on the devices and leaves the forces of the new positions in output_force_buf,
+// with energy also the energies at the end of the step in energy_sums_buf.
+// The kernel only provides full forces, so r-RESPA falls back to velocity Verlet here.
+void enqueue_step(bool energy) {
+    for (int d = 0; d < device_count; d++) {
+        enqueue_kernel(&device[d], device[d].kick_drift_kernel, device[d].first, device[d].last - device[d].first, 0, PROFILE_MOTION);
+    }
+    if (co_execution) {
+        host_kick_drift();
+    }
+    enqueue_forces(energy);
+    if (integrator != EULER) {
+        for (int d = 0; d < device_count; d++) {
+            enqueue_kernel(&device[d], device[d].kick_kernel, device[d].first, device[d].last - device[d].first, 0, PROFILE_MOTION);
         }
-        else{
-            z = fmod(input_a[i].z - half_box, box_size) + half_box;
+        if (co_execution) {
+            host_kick();
         }
-        nearest[i] = (cl_float3){ x, y, z};
     }
+    if (energy) {
+        enqueue_energy_sum();
+    }
+    host_state_current = false;
 }
 
-// Free the resources allocated during initialization
-void cleanup() {
-    if(kernel) {
-      clReleaseKernel(kernel);
+// The wrapped positions of the host's particles, as wrap() computes them.
+void host_wrap(cl_float3 *wrapped) {
+    cl_float box = box_size;
+    for (int i = cpu_first; i < N; i++) {
+        wrapped[i].x = input_a[i].x - box * floorf(input_a[i].x / box + 0.5f);
+        wrapped[i].y = input_a[i].y - box * floorf(input_a[i].y / box + 0.5f);
+        wrapped[i].z = input_a[i].z - box * floorf(input_a[i].z / box + 0.5f);
+    }
+}
+
+// The forces on the host's particles at the wrapped positions of this step's exchange, and with
+// energy also their pair energy. Every particle gets its own full
+// list of partners, as on the devices, so the kernel's reactions on the partners are thrown away.
+void host_forces(bool energy) {
+    PROFILE_BEGIN(PROFILE_FORCE);
+    double start = omp_get_wtime();
+    const cl_float3 *wrapped = exchange[(exchanges - 1) % 2];
+    for (int i = 0; i < N; i++) {
+        cpu_positions.x[i] = wrapped[i].x;
+        cpu_positions.y[i] = wrapped[i].y;
+        cpu_positions.z[i] = wrapped[i].z;
+    }
+    if (pair_search == PAIR_SEARCH_CELLS) {
+        for (int c = 0; c < cells_total; c++) {
+            host_cell_head[c] = -1;
+        }
+        for (int i = 0; i < N; i++) {
+            int cell = host_cell_of(wrapped[i]);
+            host_cell_next[i] = host_cell_head[cell];
+            host_cell_head[cell] = i;
+        }
+    }
+    double potential = 0;
+    #pragma omp parallel reduction(+:potential) num_threads(threads)
+    {
+        int *list = cpu_partners[omp_get_thread_num()];
+        coords *reactions = &cpu_reactions[omp_get_thread_num()];
+        #pragma omp for schedule(dynamic, 32)
+        for (int i = cpu_first; i < N; i++) {
+            double force_i[3] = { 0, 0, 0 };
+            if (pair_search == PAIR_SEARCH_CELLS) {
+                potential += cpu_lj.kernel(&cpu_lj, &cpu_positions, i, list, host_partners(i, list), reactions, force_i);
+            } else {
+                potential += cpu_lj.kernel(&cpu_lj, &cpu_positions, i, cpu_all, i, reactions, force_i);
+                potential += cpu_lj.kernel(&cpu_lj, &cpu_positions, i, cpu_all + i + 1, N - i - 1, reactions, force_i);
+            }
+            cpu_force[i] = (cl_float3){ (cl_float)force_i[0], (cl_float)force_i[1], (cl_float)force_i[2] };
+        }
+        PROFILE_FLUSH();
+    }
+    if (energy) {
+        // every pair is in it twice, as in energy_sum()
+        cpu_potential = potential / 2;
+    }
+    cpu_time = omp_get_wtime() - start;
+    cpu_share_sum += (double)(N - cpu_first) / N;
+    cpu_share_steps++;
+    PROFILE_END(PROFILE_FORCE);
+}
+
+// cell_of() of md.cl, so the host sees the same partners as the devices
+int host_cell_of(cl_float3 p) {
+    cl_float box = box_size;
+    cl_float cell_size = box / cells_per_side;
+    int cx = (int)((p.x + box / 2) / cell_size);
+    int cy = (int)((p.y + box / 2) / cell_size);
+    int cz = (int)((p.z + box / 2) / cell_size);
+    cx = cx < 0 ? 0 : (cx >= cells_per_side ? cells_per_side - 1 : cx);
+    cy = cy < 0 ? 0 : (cy >= cells_per_side ? cells_per_side - 1 : cy);
+    cz = cz < 0 ? 0 : (cz >= cells_per_side ? cells_per_side - 1 : cz);
+    return (cz * cells_per_side + cy) * cells_per_side + cx;
+}
+
+// The particles of the cells around that of particle i, but i, into list; returns how many.
+int host_partners(int i, int *list) {
+    const cl_float3 *wrapped = exchange[(exchanges - 1) % 2];
+    int count = 0;
+    int *around = host_cell_neighbors + host_cell_of(wrapped[i]) * 27;
+    for (int k = 0; k < 27 && around[k] >= 0; k++) {
+        for (int j = host_cell_head[around[k]]; j != -1; j = host_cell_next[j]) {
+            if (j != i) {
+                list[count++] = j;
+            }
+        }
+    }
+    return count;
+}
+
+// kick_drift() and kick() on the host's particles.
+void host_kick_drift() {
+    PROFILE_BEGIN(PROFILE_INTEGRATION);
+    cl_float kick = integrator == EULER ? dt : dt / 2;
+    cl_float drift = dt;
+    for (int i = cpu_first; i < N; i++) {
+        velocity[i].x += cpu_force[i].x * kick;
+        velocity[i].y += cpu_force[i].y * kick;
+        velocity[i].z += cpu_force[i].z * kick;
+        input_a[i].x += velocity[i].x * drift;
+        input_a[i].y += velocity[i].y * drift;
+        input_a[i].z += velocity[i].z * drift;
+    }
+    PROFILE_END(PROFILE_INTEGRATION);
+}
+
+void host_kick() {
+    PROFILE_BEGIN(PROFILE_INTEGRATION);
+    cl_float kick = dt / 2;
+    for (int i = cpu_first; i < N; i++) {
+        velocity[i].x += cpu_force[i].x * kick;
+        velocity[i].y += cpu_force[i].y * kick;
+        velocity[i].z += cpu_force[i].z * kick;
+    }
+    PROFILE_END(PROFILE_INTEGRATION);
+}
+
+// the whole state to every device
+void upload_state() {
+    cl_int status;
+    for (int d = 0; d < device_count; d++) {
+        cl_event events[2];
+        status = clEnqueueWriteBuffer(device[d].queue, device[d].position_buf, CL_FALSE,
+            0, N * sizeof(cl_float3), input_a, 0, NULL, &events[0]);
+        checkError(status, "Failed to transfer the positions");
+        status = clEnqueueWriteBuffer(device[d].queue, device[d].velocity_buf, CL_FALSE,
+            0, N * sizeof(cl_float3), velocity, 0, NULL, &events[1]);
+        checkError(status, "Failed to transfer the velocities");
+        keep_event(events[0], PROFILE_WRITE, d);
+        keep_event(events[1], PROFILE_WRITE, d);
+    }
+    bytes_copied += (double)device_count * 2 * N * sizeof(cl_float3);
+    PROFILE_COUNT(PROFILE_BYTES_TO_DEVICE, (long)device_count * 2 * N * sizeof(cl_float3));
+}
+
+// Brings positions and velocities back once the queued steps are done, every device
+// those of its own particles.
+void read_state() {
+    cl_int status;
+    for (int d = 0; d < device_count; d++) {
+        md_device *on = &device[d];
+        int count = on->last - on->first;
+        cl_event events[2];
+        status = clEnqueueReadBuffer(on->queue, on->position_buf, CL_FALSE,
+            on->first * sizeof(cl_float3), count * sizeof(cl_float3), input_a + on->first, 0, NULL, &events[0]);
+        checkError(status, "Failed to read the positions");
+        status = clEnqueueReadBuffer(on->queue, on->velocity_buf, CL_FALSE,
+            on->first * sizeof(cl_float3), count * sizeof(cl_float3), velocity + on->first, 0, NULL, &events[1]);
+        checkError(status, "Failed to read the velocities");
+        keep_event(events[0], PROFILE_READ, d);
+        keep_event(events[1], PROFILE_READ, d);
+    }
+    bytes_copied += N * 2 * sizeof(cl_float3);
+    PROFILE_COUNT(PROFILE_BYTES_FROM_DEVICE, N * 2 * sizeof(cl_float3));
+
+    // Wait for all devices to finish.
+    wait_pending(pending_count);
+    collect_pending(pending_count);
+    host_state_current = true;
+}
+
+// Queues the reads of a report step into the next staging set and returns its index.
+int enqueue_report(int step) {
+    cl_int status;
+    int current = reports % 2;
+    report_stage *report = &stage[current];
+    for (int d = 0; d < device_count; d++) {
+        md_device *on = &device[d];
+        cl_event event;
+        status = clEnqueueReadBuffer(on->queue, on->energy_sums_buf, CL_FALSE,
+            0, 2 * sizeof(cl_float), report->sums[d], 0, NULL, &event);
+        checkError(status, "Failed to read the energies");
+        keep_event(event, PROFILE_READ, d);
+        // the report waits on its own reference, the pending list may release it earlier
+        clRetainEvent(event);
+        clFlush(on->queue);
+        report->done[d] = event;
     }
-    if(queue) {
-      clReleaseCommandQueue(queue);
+    bytes_copied += device_count * 2 * sizeof(cl_float);
+    PROFILE_COUNT(PROFILE_BYTES_FROM_DEVICE, device_count * 2 * sizeof(cl_float));
+    report->host_sums[0] = co_execution ? cpu_potential : 0;
+    report->host_sums[1] = co_execution ? cpu_kinetic : 0;
+    report->step = step;
+    report->waiting = true;
+    reports++;
+    return current;
+}
+
+// Prints a report and samples the energy drift on it.
+void finish_report(report_stage *report, double initial_energy, double *max_deviation) {
+    for (int d = 0; d < device_count; d++) {
+        wait_for(1, &report->done[d]);
+        clReleaseEvent(report->done[d]);
     }
-    if(nearest_buf) {
-      clReleaseMemObject(nearest_buf);
+    report->waiting = false;
+    PROFILE_BEGIN(PROFILE_ENERGY);
+    double potential = report->host_sums[0], kinetic = report->host_sums[1];
+    for (int d = 0; d < device_count; d++) {
+        potential += report->sums[d][0];
+        kinetic += report->sums[d][1];
     }
-    if(output_energy_buf) {
-      clReleaseMemObject(output_energy_buf);
+    printf("energy is %f \n", potential / N);
+    double sampled = potential + kinetic;
+    if (fabs(sampled - initial_energy) > *max_deviation)
+        *max_deviation = fabs(sampled - initial_energy);
+    PROFILE_END(PROFILE_ENERGY);
+}
+
+// the reports still in flight, oldest first
+void finish_reports(double initial_energy, double *max_deviation) {
+    for (int r = reports - 2; r < reports; r++) {
+        if (r >= 0 && stage[r % 2].waiting) {
+            finish_report(&stage[r % 2], initial_energy, max_deviation);
+        }
     }
-    if(output_force_buf) {
-      clReleaseMemObject(output_force_buf);
+}
+
+// The total energy in the sums of the last energy step, waiting for it.
+double read_energy() {
+    cl_float sums[MAX_DEVICES][2];
+    for (int d = 0; d < device_count; d++) {
+        cl_event event;
+        cl_int status = clEnqueueReadBuffer(device[d].queue, device[d].energy_sums_buf, CL_FALSE,
+            0, 2 * sizeof(cl_float), sums[d], 0, NULL, &event);
+        checkError(status, "Failed to read the energies");
+        keep_event(event, PROFILE_READ, d);
     }
-    if(program) {
-    clReleaseProgram(program);
+    bytes_copied += device_count * 2 * sizeof(cl_float);
+    PROFILE_COUNT(PROFILE_BYTES_FROM_DEVICE, device_count * 2 * sizeof(cl_float));
+    wait_pending(pending_count);
+    collect_pending(pending_count);
+    double total = co_execution ? cpu_potential + cpu_kinetic : 0;
+    for (int d = 0; d < device_count; d++) {
+        total += sums[d][0] + sums[d][1];
     }
-    if(context) {
-    clReleaseContext(context);
+    return total;
+}
+
+void wait_for(cl_uint count, const cl_event *events) {
+    struct timespec wait_start, wait_end;
+    clock_gettime(CLOCK_MONOTONIC, &wait_start);
+    clWaitForEvents(count, events);
+    clock_gettime(CLOCK_MONOTONIC, &wait_end);
+    host_wait_time += (wait_end.tv_sec - wait_start.tv_sec) + 1e-9 * (wait_end.tv_nsec - wait_start.tv_nsec);
+}
+
+// Waits for the oldest count commands. The queues run in order, so that is the last of
+// them on every device; events of different contexts are waited for one at a time.
+void wait_pending(int count) {
+    for (int d = 0; d < device_count; d++) {
+        for (int e = count - 1; e >= 0; e--) {
+            if (pending[e].device == d) {
+                wait_for(1, &pending[e].event);
+                break;
+            }
+        }
     }
 }
 
+// Device time of the oldest count commands, which must have finished: all of them add up
+// to device_busy_time, the md kernels also to kernel_total_time and their device's force_time.
+void collect_pending(int count) {
+#ifdef PROFILE
+    // every device clock has an origin of its own; put the end of its last command at the host's now
+    double offset[MAX_DEVICES];
+    double now = profile_now();
+    for (int e = 0; e < count; e++) {
+        cl_ulong device_end;
+        clGetEventProfilingInfo(pending[e].event, CL_PROFILING_COMMAND_END, sizeof(device_end), &device_end, NULL);
+        offset[pending[e].device] = now - device_end * 1e-3;
+    }
+#endif
+    for (int e = 0; e < count; e++) {
+        cl_ulong time_start, time_end;
+        clGetEventProfilingInfo(pending[e].event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
+        clGetEventProfilingInfo(pending[e].event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
+        if (pending[e].phase == PROFILE_KERNEL) {
+            kernel_total_time += time_end - time_start;
+            device[pending[e].device].force_time += time_end - time_start;
+        }
+        device_busy_time += time_end - time_start;
+#ifdef PROFILE
+        device_span(pending[e].phase, pending[e].event, offset[pending[e].device]);
+#endif
+        clReleaseEvent(pending[e].event);
+    }
+    memmove(pending, pending + count, sizeof(pending_event) * (pending_count - count));
+    pending_count -= count;
+}
+
+#ifdef PROFILE
+// start to end of a profiled command, moved onto the host clock by offset microseconds
+void device_span(int phase, cl_event event, double offset) {
+    cl_ulong start, end;
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+    PROFILE_SPAN(phase, start * 1e-3 + offset, end * 1e-3 + offset);
+}
+#endif
+
+// Free the resources allocated during initialization
+void cleanup() {
+    for (int d = 0; d < device_count; d++) {
+        md_device *on = &device[d];
+        if(on->energy_kernel) {
+          clReleaseKernel(on->energy_kernel);
+        }
+        if(on->force_kernel) {
+          clReleaseKernel(on->force_kernel);
+        }
+        if(on->energy_sum_kernel) {
+          clReleaseKernel(on->energy_sum_kernel);
+        }
+        if(on->wrap_kernel) {
+          clReleaseKernel(on->wrap_kernel);
+        }
+        if(on->kick_drift_kernel) {
+          clReleaseKernel(on->kick_drift_kernel);
+        }
+        if(on->kick_kernel) {
+          clReleaseKernel(on->kick_kernel);
+        }
+        if(on->cell_index_kernel) {
+          clReleaseKernel(on->cell_index_kernel);
+          clReleaseKernel(on->cell_offsets_kernel);
+          clReleaseKernel(on->sort_kernel);
+        }
+        if(on->cell_neighbors_buf) {
+          clReleaseMemObject(on->cell_neighbors_buf);
+          clReleaseMemObject(on->particle_cell_buf);
+          clReleaseMemObject(on->particle_slot_buf);
+          clReleaseMemObject(on->cell_count_buf);
+          clReleaseMemObject(on->cell_start_buf);
+          clReleaseMemObject(on->sorted_buf);
+          clReleaseMemObject(on->sorted_index_buf);
+        }
+        if(on->queue) {
+          clReleaseCommandQueue(on->queue);
+        }
+        if(on->position_buf) {
+          clReleaseMemObject(on->position_buf);
+        }
+        if(on->velocity_buf) {
+          clReleaseMemObject(on->velocity_buf);
+        }
+        if(on->nearest_buf) {
+          clReleaseMemObject(on->nearest_buf);
+        }
+        if(on->output_energy_buf) {
+          clReleaseMemObject(on->output_energy_buf);
+        }
+        if(on->output_force_buf) {
+          clReleaseMemObject(on->output_force_buf);
+        }
+        if(on->energy_sums_buf) {
+          clReleaseMemObject(on->energy_sums_buf);
+        }
+        if(on->table_buf) {
+          clReleaseMemObject(on->table_buf);
+        }
+        if(on->program) {
+        clReleaseProgram(on->program);
+        }
+        if(on->context) {
+        clReleaseContext(on->context);
+        }
+        if(on->last_force) {
+          clReleaseEvent(on->last_force);
+        }
+        if(parent_device) {
+          clReleaseDevice(on->id);
+        }
+    }
+    if (co_execution) {
+        free_lj_table(&cpu_lj);
+        free_coords(&cpu_positions);
+        free(cpu_force);
+        free(cpu_all);
+        for (int t = 0; t < threads; t++) {
+            free(cpu_partners[t]);
+            free_coords(&cpu_reactions[t]);
+        }
+        free(host_cell_head);
+        free(host_cell_next);
+    }
+    free(host_cell_neighbors);
+    if (potential == POTENTIAL_TABLE) {
+        free_pair_table(&table);
+    }
+    if (!snapshot_contains(&restart_snapshot, input_a)) {
+        free(input_a);
+        free(velocity);
+    }
+    snapshot_unmap(&restart_snapshot);
+    for (int b = 0; b < 2; b++) {
+        free(exchange[b]);
+    }
+}
@@ -0,0 +1,239 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+// Definitions of the problem parameters declared in parameters.h and the parser
+// that sets them. Include it only from the file that holds main().
+//
+// load_parameters() reads, in this order,
+//   --config=FILE   lines of "name = value", '#' starts a comment
+//   --name=value    a single parameter
+// so later settings win over earlier ones and over the defaults below.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parameters.h"
+
+int N = 16;
+double rc = 3;
+double skin = 0.3;
+double box_size = 6;
+double half_box = 3;
+int total_it = 20000;
+double dt = 0.0005;
+int threads = 8;
+int integrator = VELOCITY_VERLET;
+int respa_steps = 4;
+double respa_switch_start = 1.8;
+double respa_switch_end = 2.2;
+int potential = POTENTIAL_LJ;
+double table_tolerance = 1e-6;
+double table_rmin = 0.7;
+int precision = PRECISION_DOUBLE;
+double initial_dist_by_one_axis = 1.5;
+double initial_dist_to_edge = 2;
+const char *trajectory_path = "";
+int trajectory_every = 100;
+int trajectory_format = TRAJECTORY_FLOAT;
+int trajectory_compression = 0;
+int trajectory_buffers = 8;
+const char *checkpoint_path = "";
+int checkpoint_every = 1000;
+const char *restart_path = "";
+const char *opencl_vendor = "NVIDIA";
+int pair_search = PAIR_SEARCH_ALL;
+int pipeline = 0;
+int co_execution = 0;
+int devices = 1;
+int sub_devices = 0;
+int work_group_size = 0;
+const char *program_cache = "./device/cache";
+int specialize = 1;
+int unroll = 4;
+const char *profile_trace = "";
+
+const char *integrator_names[] = { "euler", "velocity-verlet", "respa", NULL };
+const char *potential_names[] = { "lj", "table", NULL };
+const char *precision_names[] = { "double", "mixed", "validate", NULL };
+const char *trajectory_format_names[] = { "float", "int16", NULL };
+const char *trajectory_compression_names[] = { "none", "zlib", NULL };
+const char *pair_search_names[] = { "all", "cells", NULL };
+const char *pipeline_names[] = { "off", "on", NULL };
+const char *co_execution_names[] = { "off", "on", NULL };
+const char *specialize_names[] = { "off", "on", NULL };
+
+struct parameter {
+    const char *name;
+    int *int_value;             // exactly one of int_value, double_value and string_value is set
+    double *double_value;
+    const char **value_names;   // names accepted for the values 0, 1, ... of an int
+    const char **string_value;
+};
+
+struct parameter parameters[] = {
+    { "N", &N, NULL, NULL },
+    { "rc", NULL, &rc, NULL },
+    { "skin", NULL, &skin, NULL },
+    { "box_size", NULL, &box_size, NULL },
+    { "total_it", &total_it, NULL, NULL },
+    { "dt", NULL, &dt, NULL },
+    { "threads", &threads, NULL, NULL },
+    { "integrator", &integrator, NULL, integrator_names },
+    { "respa_steps", &respa_steps, NULL, NULL },
+    { "respa_switch_start", NULL, &respa_switch_start, NULL },
+    { "respa_switch_end", NULL, &respa_switch_end, NULL },
+    { "potential", &potential, NULL, potential_names },
+    { "table_tolerance", NULL, &table_tolerance, NULL },
+    { "table_rmin", NULL, &table_rmin, NULL },
+    { "precision", &precision, NULL, precision_names },
+    { "initial_dist_by_one_axis", NULL, &initial_dist_by_one_axis, NULL },
+    { "initial_dist_to_edge", NULL, &initial_dist_to_edge, NULL },
+    { "trajectory", NULL, NULL, NULL, &trajectory_path },
+    { "trajectory_every", &trajectory_every, NULL, NULL },
+    { "trajectory_format", &trajectory_format, NULL, trajectory_format_names },
+    { "trajectory_compression", &trajectory_compression, NULL, trajectory_compression_names },
+    { "trajectory_buffers", &trajectory_buffers, NULL, NULL },
+    { "checkpoint", NULL, NULL, NULL, &checkpoint_path },
+    { "checkpoint_every", &checkpoint_every, NULL, NULL },
+    { "restart", NULL, NULL, NULL, &restart_path },
+    { "opencl_vendor", NULL, NULL, NULL, &opencl_vendor },
+    { "devices", &devices, NULL, NULL },
+    { "sub_devices", &sub_devices, NULL, NULL },
+    { "work_group_size", &work_group_size, NULL, NULL },
+    { "pair_search", &pair_search, NULL, pair_search_names },
+    { "pipeline", &pipeline, NULL, pipeline_names },
+    { "co_execution", &co_execution, NULL, co_execution_names },
+    { "program_cache", NULL, NULL, NULL, &program_cache },
+    { "specialize", &specialize, NULL, specialize_names },
+    { "unroll", &unroll, NULL, NULL },
+    { "profile_trace", NULL, NULL, NULL, &profile_trace },
+};
+
+#define PARAMETER_COUNT (int)(sizeof(parameters) / sizeof(parameters[0]))
+
+static void set_parameter(const char *name, const char *value, const char *source) {
+    for (int p = 0; p < PARAMETER_COUNT; p++) {
+        if (strcmp(parameters[p].name, name) != 0) {
+            continue;
+        }
+        char *end;
+        if (parameters[p].string_value != NULL) {
+            // config file lines are reused, so keep a copy
+            *parameters[p].string_value = strdup(value);
+            return;
+        }
+        if (parameters[p].double_value != NULL) {
+            *parameters[p].double_value = strtod(value, &end);
+        } else {
+            *parameters[p].int_value = (int)strtol(value, &end, 10);
+            for (int v = 0; end == value && parameters[p].value_names != NULL && parameters[p].value_names[v] != NULL; v++) {
+                if (strcmp(parameters[p].value_names[v], value) == 0) {
+                    *parameters[p].int_value = v;
+                    end = (char*)value + strlen(value);
+                }
+            }
+        }
+        if (end == value || *end != '\0') {
+            printf("%s: bad value \"%s\" for %s\n", source, value, name);
+            exit(1);
+        }
+        return;
+    }
+    printf("%s: unknown parameter \"%s\"\n", source, name);
+    exit(1);
+}
+
+static void load_config_file(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        printf("Failed to open config file %s\n", path);
+        exit(1);
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        char name[64], value[128];
+        int fields = sscanf(line, " %63[^= \t] = %127s", name, value);
+        if (fields == 2) {
+            set_parameter(name, value, path);
+        } else if (fields == 1) {
+            printf("%s: no value for %s\n", path, name);
+            exit(1);
+        }
+    }
+    fclose(file);
+}
+
+static void load_parameters(int argc, char **argv) {
+    for (int a = 1; a < argc; a++) {
+        char *equals = strchr(argv[a], '=');
+        if (strncmp(argv[a], "--", 2) != 0 || equals == NULL) {
+            printf("usage: %s [--config=FILE] [--name=value ...]\n", argv[0]);
+            exit(1);
+        }
+        *equals = '\0';
+        if (strcmp(argv[a] + 2, "config") == 0) {
+            load_config_file(equals + 1);
+        } else {
+            set_parameter(argv[a] + 2, equals + 1, "command line");
+        }
+    }
+    half_box = box_size / 2;
+    if (N < 2 || rc <= 0 || rc > half_box || dt <= 0 || total_it < 0 || integrator < EULER || integrator > RESPA) {
+        printf("Invalid parameters: need N >= 2, 0 < rc <= box_size / 2, dt > 0 and a known integrator\n");
+        exit(1);
+    }
+    if (threads < 1 || threads > MAX_THREADS) {
+        printf("Invalid parameters: need 1 <= threads <= %d\n", MAX_THREADS);
+        exit(1);
+    }
+    if (integrator == RESPA && (respa_steps < 1 || respa_switch_start >= respa_switch_end || respa_switch_end > rc)) {
+        printf("Invalid parameters: need respa_steps >= 1 and respa_switch_start < respa_switch_end <= rc\n");
+        exit(1);
+    }
+    if (potential == POTENTIAL_TABLE && (table_tolerance <= 0 || table_rmin <= 0 || table_rmin >= rc)) {
+        printf("Invalid parameters: need table_tolerance > 0 and 0 < table_rmin < rc\n");
+        exit(1);
+    }
+    if (precision < PRECISION_DOUBLE || precision > PRECISION_VALIDATE || (precision != PRECISION_DOUBLE && potential != POTENTIAL_LJ)) {
+        printf("Invalid parameters: need a known precision, and potential = lj unless it is double\n");
+        exit(1);
+    }
+    if (precision == PRECISION_VALIDATE && restart_path[0] != '\0') {
+        printf("Invalid parameters: precision = validate runs from the initial state, not from a restart\n");
+        exit(1);
+    }
+    if (trajectory_path[0] != '\0' && (trajectory_every < 1 || trajectory_buffers < 1)) {
+        printf("Invalid parameters: need trajectory_every >= 1 and trajectory_buffers >= 1\n");
+        exit(1);
+    }
+    if (work_group_size < 0 || pair_search < PAIR_SEARCH_ALL || pair_search > PAIR_SEARCH_CELLS || pipeline < 0 || pipeline > 1) {
+        printf("Invalid parameters: need work_group_size >= 0, a known pair_search and pipeline off or on\n");
+        exit(1);
+    }
+    if (co_execution < 0 || co_execution > 1) {
+        printf("Invalid parameters: need co_execution off or on\n");
+        exit(1);
+    }
+    if (devices < 0 || devices > MAX_DEVICES || sub_devices < 0 || sub_devices > MAX_DEVICES) {
+        printf("Invalid parameters: need 0 <= devices <= %d and 0 <= sub_devices <= %d\n", MAX_DEVICES, MAX_DEVICES);
+        exit(1);
+    }
+    if (specialize < 0 || specialize > 1 || unroll < 1) {
+        printf("Invalid parameters: need specialize off or on and unroll >= 1\n");
+        exit(1);
+    }
+    if (checkpoint_path[0] != '\0' && checkpoint_every < 1) {
+        printf("Invalid parameters: need checkpoint_every >= 1\n");
+        exit(1);
+    }
+#ifndef PROFILE
+    if (profile_trace[0] != '\0') {
+        printf("Invalid parameters: profile_trace needs a build with -D PROFILE\n");
+        exit(1);
+    }
+#endif
+}
+
+#endif
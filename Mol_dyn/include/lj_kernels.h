@@ -0,0 +1,96 @@
+#ifndef LJ_KERNELS_H
+#define LJ_KERNELS_H
+#include <stddef.h>
+#include "scratch_arena.h"
+#include "pair_table.h"
+
+#define SIMD_ALIGNMENT 64   // bytes, one 512-bit vector
+#define SIMD_PADDING 8      // doubles per 512-bit vector
+
+// Structure-of-arrays storage used by the CPU engine: every component lives in
+// its own aligned array, padded to a whole number of 512-bit vectors.
+struct coords {
+    double *x;
+    double *y;
+    double *z;
+};
+typedef struct coords coords;
+
+// Single-precision copy of the positions, wrapped into the box, that the
+// mixed-precision kernels read instead of the double array. The pair math runs
+// in float, twice the lanes per vector, while forces and energy add up in double.
+struct coords_single {
+    float *x;
+    float *y;
+    float *z;
+};
+typedef struct coords_single coords_single;
+
+struct lj_setup;
+
+// Lennard-Jones interaction of particle i with partners list[0..count).
+// Adds the force on i to force_i[0..2], subtracts it from partner_force[j]
+// for every partner and returns the pair energy.
+typedef double (*lj_kernel)(const struct lj_setup *setup, const coords *array, int i,
+                            const int *list, int count, coords *partner_force, double *force_i);
+
+// Constants of the cut and shifted Lennard-Jones potential in a periodic box.
+// For r-RESPA the pair terms are weighted by weight_full + weight_switch * S(r),
+// where S falls smoothly from 1 at switch_start to 0 at the inner cutoff:
+// (1, 0) is the whole potential, (0, 1) its short-range and (1, -1) its long-range part.
+struct lj_setup {
+    double cutoff2;     // rc * rc
+    double box;
+    double inv_box;
+    double shift;       // potential at the cutoff, Urc
+    double weight_full;
+    double weight_switch;
+    double switch_start;
+    double switch_inv_width;
+    const pair_table *table;    // tabulated pair, NULL computes it from the formula
+    coords_single *single;      // float positions of the mixed-precision kernels, NULL runs in double
+    lj_kernel kernel;       // instance picked for these constants by select_lj_kernel()
+    char kernel_name[48];
+};
+typedef struct lj_setup lj_setup;
+
+int padded_count(int count);
+coords alloc_coords(int count);
+void free_coords(coords *array);
+// bytes of scratch arena taken by arena_coords(arena, count)
+size_t coords_bytes(int count);
+coords arena_coords(scratch_arena *arena, int count);
+coords_single alloc_coords_single(int count);
+void free_coords_single(coords_single *array);
+// wraps the positions into the box as it rounds them to float
+void fill_coords_single(coords_single *single, const coords *array, int count, double box);
+lj_setup make_lj_setup(double cutoff, double box);
+lj_setup make_respa_setup(const lj_setup *full, double switch_start, double switch_end, bool inner);
+// Replaces the formula of the setup, switching included, by a pair_table of it
+// on r_min <= r < rc accurate to tolerance, and selects the table kernels.
+void tabulate_lj_setup(lj_setup *setup, double r_min, double tolerance);
+void free_lj_table(lj_setup *setup);
+// Selects the mixed-precision kernels, which read the positions from single
+// instead of the array they are passed; refill it before every force evaluation.
+void make_mixed_setup(lj_setup *setup, coords_single *single);
+
+#define LJ_ISA_SCALAR 0
+#define LJ_ISA_AVX2 1
+#define LJ_ISA_AVX512 2
+extern const char *lj_isa_names[];
+
+// Widest instruction set the CPU supports (checked through CPUID at run time).
+int best_lj_isa();
+// Sets setup->kernel to the isa instance specialized for the setup's cutoff
+// (rc 2.5 and 3.0 are compiled in) and for whether it is switched, or to the
+// instance that reads the cutoff at run time when generic is set or no bucket fits.
+// A tabulated setup always gets the table instance, a mixed-precision one the
+// float instance, which reads the cutoff at run time.
+// make_lj_setup() and make_respa_setup() already call it with best_lj_isa().
+void select_lj_kernel(lj_setup *setup, int isa, bool generic);
+
+#ifdef KERNEL_BENCH
+void benchmark_lj_kernels();
+#endif
+
+#endif
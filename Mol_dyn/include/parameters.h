@@ -1,8 +1,55 @@
-#define rc 3
-#define box_size 6
-#define half_box 3
-#define N 16
-#define total_it 20000
-#define dt 0.0005
-#define initial_dist_by_one_axis 1.5
-#define initial_dist_to_edge 2
\ No newline at end of file
+// Problem parameters. Their defaults live in config.h, and load_parameters()
+// overrides them at start-up from a config file and the command line.
+#define EULER 0
+#define VELOCITY_VERLET 1
+#define RESPA 2
+#define TRAJECTORY_FLOAT 0
+#define TRAJECTORY_INT16 1
+#define POTENTIAL_LJ 0
+#define POTENTIAL_TABLE 1
+#define PRECISION_DOUBLE 0
+#define PRECISION_MIXED 1
+#define PRECISION_VALIDATE 2
+#define PAIR_SEARCH_ALL 0
+#define PAIR_SEARCH_CELLS 1
+#define MAX_THREADS 64
+#define MAX_DEVICES 16
+#define ARGON_TAU_PS 2.156     // the LJ time unit for argon, behind the ns/day figures
+
+extern int N;
+extern double rc;
+extern double skin;
+extern double box_size;
+extern double half_box;     // box_size / 2, derived
+extern int total_it;
+extern double dt;
+extern int threads;                     // OpenMP threads of the CPU engines, at most MAX_THREADS
+extern int integrator;
+extern int respa_steps;
+extern double respa_switch_start;
+extern double respa_switch_end;
+extern int potential;                   // POTENTIAL_TABLE interpolates the pair from a table on r^2
+extern double table_tolerance;          // relative error the table must reach
+extern double table_rmin;               // closer pairs get the table values at table_rmin
+extern int precision;                   // PRECISION_MIXED runs the CPU pair math in float, PRECISION_VALIDATE also in double to compare
+extern double initial_dist_by_one_axis;
+extern double initial_dist_to_edge;
+extern const char *trajectory_path;     // "" writes no trajectory
+extern int trajectory_every;
+extern int trajectory_format;
+extern int trajectory_compression;      // 0 none, 1 zlib
+extern int trajectory_buffers;          // frames the writer thread may lag behind
+extern const char *checkpoint_path;     // "" writes no checkpoints
+extern int checkpoint_every;
+extern const char *restart_path;        // checkpoint to resume from, "" starts afresh
+extern const char *opencl_vendor;       // part of the vendor name of the OpenCL platform the NVIDIA build runs on
+extern int devices;                     // OpenCL devices the particles are split over, 0 takes all of them, at most MAX_DEVICES
+extern int sub_devices;                 // > 0 splits the first OpenCL device into that many sub-devices and runs on all of them
+extern int work_group_size;             // work-items per group of the OpenCL force kernel, 0 picks the largest that fits
+extern int pipeline;                    // 1 has the OpenCL host print each report one report later instead of waiting for it
+extern int co_execution;                // 1 has the OpenCL host compute a share of the forces on its own threads, see balance_host()
+extern int pair_search;                 // PAIR_SEARCH_CELLS has the OpenCL host walk cell lists built on the device instead of all pairs
+extern const char *program_cache;       // directory of the built OpenCL programs, "" builds from source every run
+extern int specialize;                  // 1 builds the OpenCL program for this N, box and rc, see md.cl
+extern int unroll;                      // unrolling of the pair loops of the OpenCL kernels
+extern const char *profile_trace;       // Chrome trace of the phase timers of a -D PROFILE build, "" writes none
@@ -0,0 +1,173 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+// Timers and counters of the hot paths. Built with -D PROFILE they record every run
+// of a phase; without it the macros below compile to nothing.
+//   PROFILE_BEGIN(phase), PROFILE_END(phase)   time a phase, from serial code only
+//   PROFILE_SPAN(phase, start, end)            a phase timed elsewhere, e.g. on the device
+//   PROFILE_COUNT(counter, n)                  add to a counter, from any thread
+//   PROFILE_FLUSH()                            every thread that counted, at the end of its parallel region
+//   PROFILE_REPORT(trace_path)                 print the table, and write the trace unless the path is ""
+// The trace is Chrome trace JSON for chrome://tracing or ui.perfetto.dev. The state
+// lives in the file that defines PROFILE_STORAGE before including this header.
+
+enum profile_phase {
+    // OpenMP engine; neighbor search also times the cell lists of the OpenCL host
+    PROFILE_NEIGHBOR_SEARCH,
+    PROFILE_FORCE,
+    PROFILE_INTEGRATION,
+    PROFILE_TRAJECTORY,
+    PROFILE_CHECKPOINT,
+    // OpenCL host; write, kernel and read are the device's own timestamps
+    PROFILE_WRAP,
+    PROFILE_WRITE,
+    PROFILE_KERNEL,
+    PROFILE_READ,
+    PROFILE_MOTION,
+    PROFILE_ENERGY,
+    PROFILE_PHASES
+};
+
+enum profile_counter {
+    PROFILE_PAIRS_EVALUATED,
+    PROFILE_PAIRS_INSIDE,       // inside the cutoff, counted by the OpenMP kernels only
+    PROFILE_BYTES_TO_DEVICE,
+    PROFILE_BYTES_FROM_DEVICE,
+    PROFILE_COUNTERS
+};
+
+#ifdef PROFILE
+#include <stdio.h>
+#include <time.h>
+
+#define PROFILE_MAX_EVENTS (1 << 18)    // runs kept for the trace, the totals go on past it
+
+static const char *const profile_phase_names[PROFILE_PHASES] = {
+    "neighbor search", "force", "integration", "trajectory", "checkpoint",
+    "wrap", "write", "kernel", "read", "motion", "energy"
+};
+static const char *const profile_counter_names[PROFILE_COUNTERS] = {
+    "pairs evaluated", "pairs inside cutoff", "bytes to device", "bytes from device"
+};
+
+struct profile_event {
+    int phase;
+    double start, end;      // microseconds of CLOCK_MONOTONIC
+};
+
+struct profile_state {
+    double started[PROFILE_PHASES];     // the open run of each phase
+    double total[PROFILE_PHASES];
+    double longest[PROFILE_PHASES];
+    long calls[PROFILE_PHASES];
+    long counters[PROFILE_COUNTERS];
+    long events;
+    profile_event event[PROFILE_MAX_EVENTS];
+};
+
+extern profile_state profile;
+extern thread_local long profile_tally[PROFILE_COUNTERS];
+#ifdef PROFILE_STORAGE
+profile_state profile;
+thread_local long profile_tally[PROFILE_COUNTERS];
+#endif
+
+static inline double profile_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec * 1e-3;
+}
+
+static inline void profile_span(int phase, double start, double end) {
+    double length = end - start;
+    profile.total[phase] += length;
+    if (length > profile.longest[phase])
+        profile.longest[phase] = length;
+    profile.calls[phase]++;
+    if (profile.events < PROFILE_MAX_EVENTS) {
+        profile_event event = {phase, start, end};
+        profile.event[profile.events] = event;
+    }
+    profile.events++;
+}
+
+// the counts of the calling thread go to the totals
+static inline void profile_flush() {
+    for (int c = 0; c < PROFILE_COUNTERS; c++) {
+        if (profile_tally[c] != 0) {
+#ifdef _OPENMP
+            #pragma omp atomic
+#endif
+            profile.counters[c] += profile_tally[c];
+            profile_tally[c] = 0;
+        }
+    }
+}
+
+static inline void profile_report() {
+    profile_flush();
+    double all = 0;
+    for (int p = 0; p < PROFILE_PHASES; p++)
+        all += profile.total[p];
+    printf("\n%-20s %10s %12s %12s %12s %7s\n", "phase", "calls", "total ms", "mean us", "max us", "share");
+    for (int p = 0; p < PROFILE_PHASES; p++) {
+        if (profile.calls[p] == 0)
+            continue;
+        printf("%-20s %10ld %12.3f %12.3f %12.3f %6.1f%%\n", profile_phase_names[p], profile.calls[p],
+            profile.total[p] * 1e-3, profile.total[p] / profile.calls[p], profile.longest[p], 100 * profile.total[p] / all);
+    }
+    for (int c = 0; c < PROFILE_COUNTERS; c++) {
+        if (profile.counters[c] != 0)
+            printf("%-20s %ld\n", profile_counter_names[c], profile.counters[c]);
+    }
+    if (profile.counters[PROFILE_PAIRS_EVALUATED] != 0 && profile.counters[PROFILE_PAIRS_INSIDE] != 0)
+        printf("%-20s %.1f%% of the pairs evaluated\n", "inside cutoff",
+            100.0 * profile.counters[PROFILE_PAIRS_INSIDE] / profile.counters[PROFILE_PAIRS_EVALUATED]);
+}
+
+// every kept run as a complete event on one track, and the counters at the end of the run
+static inline bool profile_export(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+    long kept = profile.events < PROFILE_MAX_EVENTS ? profile.events : PROFILE_MAX_EVENTS;
+    double origin = kept > 0 ? profile.event[0].start : 0, last = 0;
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (long e = 0; e < kept; e++) {
+        const profile_event *event = &profile.event[e];
+        fprintf(file, "{\"name\": \"%s\", \"cat\": \"phase\", \"ph\": \"X\", \"pid\": 0, \"tid\": 0, \"ts\": %.3f, \"dur\": %.3f},\n",
+            profile_phase_names[event->phase], event->start - origin, event->end - event->start);
+        if (event->end - origin > last)
+            last = event->end - origin;
+    }
+    for (int c = 0; c < PROFILE_COUNTERS; c++) {
+        fprintf(file, "{\"name\": \"%s\", \"ph\": \"C\", \"pid\": 0, \"ts\": %.3f, \"args\": {\"value\": %ld}}%s\n",
+            profile_counter_names[c], last, profile.counters[c], c + 1 < PROFILE_COUNTERS ? "," : "");
+    }
+    fprintf(file, "]}\n");
+    bool written = fclose(file) == 0;
+    if (profile.events > kept)
+        printf("profile trace %s: the first %ld of %ld runs\n", path, kept, profile.events);
+    return written;
+}
+
+#define PROFILE_BEGIN(phase) (profile.started[phase] = profile_now())
+#define PROFILE_END(phase) profile_span(phase, profile.started[phase], profile_now())
+#define PROFILE_SPAN(phase, start, end) profile_span(phase, start, end)
+#define PROFILE_COUNT(counter, n) (profile_tally[counter] += (n))
+#define PROFILE_FLUSH() profile_flush()
+#define PROFILE_REPORT(trace_path) do { \
+        profile_report(); \
+        if ((trace_path)[0] != '\0' && !profile_export(trace_path)) \
+            printf("Failed to write profile trace %s\n", trace_path); \
+    } while (0)
+#else
+#define PROFILE_BEGIN(phase)
+#define PROFILE_END(phase)
+#define PROFILE_SPAN(phase, start, end)
+#define PROFILE_COUNT(counter, n)
+#define PROFILE_FLUSH()
+#define PROFILE_REPORT(trace_path)
+#endif
+
+#endif
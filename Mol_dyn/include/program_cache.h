@@ -0,0 +1,190 @@
+#ifndef PROGRAM_CACHE_H
+#define PROGRAM_CACHE_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifndef _WIN32
+    #include <sys/stat.h>
+    #include <unistd.h>
+#else
+    #include <process.h>
+#endif
+#include "CL/cl.h"
+
+// On-disk cache of built OpenCL programs. A binary is kept under a name hashed from
+// the device, its driver, the kernel source and the build options, and the file
+// starts with that whole key, so an edited source, a driver update or the options
+// of another run never load a binary that does not belong to them:
+//   uint32 key bytes, the key, then the binary as clGetProgramInfo returns it
+// A binary the driver rejects is rebuilt from source and written again.
+
+#define PROGRAM_CACHE_MAX_KEY 4096
+
+// 64-bit FNV-1a, continued from hash
+static inline uint64_t program_cache_hash(const void *data, size_t bytes, uint64_t hash) {
+    const unsigned char *byte = (const unsigned char*)data;
+    for (size_t b = 0; b < bytes; b++) {
+        hash ^= byte[b];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// the whole file with a terminating zero, NULL if it cannot be read
+static inline char *program_cache_load(const char *path, size_t *bytes) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    char *data = NULL;
+    long size = -1;
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+        data = (char*)malloc(size + 1);
+        if (data != NULL && fread(data, 1, size, file) != (size_t)size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(file);
+    if (data != NULL) {
+        data[size] = '\0';
+        *bytes = size;
+    }
+    return data;
+}
+
+static inline void program_cache_build_log(cl_program program, cl_device_id device) {
+    size_t bytes = 0;
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &bytes);
+    char *log = (char*)malloc(bytes + 1);
+    if (log != NULL && clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, bytes, log, NULL) == CL_SUCCESS) {
+        log[bytes] = '\0';
+        fprintf(stderr, "%s\n", log);
+    }
+    free(log);
+}
+
+// Writes a temporary of this process next to PATH and renames it over PATH once every
+// write and the close went through, so neither a run that reads PATH meanwhile nor
+// runs storing into the same directory at once ever leave half a binary there.
+static inline bool program_cache_store(const char *path, const char *key, cl_program program) {
+    size_t bytes = 0;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(bytes), &bytes, NULL) != CL_SUCCESS || bytes == 0) {
+        return false;
+    }
+    unsigned char *binary = (unsigned char*)malloc(bytes);
+    if (binary == NULL || clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL) != CL_SUCCESS) {
+        free(binary);
+        return false;
+    }
+    char temporary[4096];
+    FILE *file = NULL;
+#ifndef _WIN32
+    snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path);
+    int descriptor = mkstemp(temporary);
+    if (descriptor >= 0) {
+        fchmod(descriptor, 0644);
+        file = fdopen(descriptor, "wb");
+        if (file == NULL) {
+            close(descriptor);
+            remove(temporary);
+        }
+    }
+#else
+    snprintf(temporary, sizeof(temporary), "%s.%d.tmp", path, _getpid());
+    file = fopen(temporary, "wb");
+#endif
+    bool written = file != NULL;
+    if (written) {
+        uint32_t key_bytes = strlen(key);
+        written = fwrite(&key_bytes, sizeof(key_bytes), 1, file) == 1 && fwrite(key, 1, key_bytes, file) == key_bytes &&
+            fwrite(binary, 1, bytes, file) == bytes;
+        written = fclose(file) == 0 && written;
+    }
+    free(binary);
+    if (written && rename(temporary, path) == 0) {
+        return true;
+    }
+    if (file != NULL) {
+        remove(temporary);
+    }
+    return false;
+}
+
+// Builds the program of the source at source_path for device with options, from the
+// binary cached in directory if there is one that matches; directory "" builds from
+// source every time. *hit tells which it was. On a build error the log goes to stderr
+// and the result is NULL with *status set.
+static inline cl_program program_cache_build(cl_context context, cl_device_id device, const char *source_path,
+        const char *options, const char *directory, bool *hit, cl_int *status) {
+    *hit = false;
+    size_t source_bytes;
+    char *source = program_cache_load(source_path, &source_bytes);
+    if (source == NULL) {
+        fprintf(stderr, "Failed to load kernel %s\n", source_path);
+        *status = CL_INVALID_VALUE;
+        return NULL;
+    }
+    char device_name[256] = "", driver[256] = "", key[PROGRAM_CACHE_MAX_KEY];
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+    snprintf(key, sizeof(key), "device %s\ndriver %s\nsource %016llx\noptions %s\n", device_name, driver,
+        (unsigned long long)program_cache_hash(source, source_bytes, 14695981039346656037ull), options);
+    char path[4096] = "";
+    if (directory[0] != '\0') {
+        snprintf(path, sizeof(path), "%s/%016llx.bin", directory,
+            (unsigned long long)program_cache_hash(key, strlen(key), 14695981039346656037ull));
+    }
+
+    cl_program program = NULL;
+    size_t cached_bytes;
+    char *cached = path[0] != '\0' ? program_cache_load(path, &cached_bytes) : NULL;
+    uint32_t key_bytes;
+    if (cached != NULL && cached_bytes > sizeof(key_bytes)) {
+        memcpy(&key_bytes, cached, sizeof(key_bytes));
+        if (key_bytes == strlen(key) && cached_bytes > sizeof(key_bytes) + key_bytes &&
+                memcmp(cached + sizeof(key_bytes), key, key_bytes) == 0) {
+            const unsigned char *binary = (const unsigned char*)cached + sizeof(key_bytes) + key_bytes;
+            size_t binary_bytes = cached_bytes - sizeof(key_bytes) - key_bytes;
+            cl_int binary_status;
+            program = clCreateProgramWithBinary(context, 1, &device, &binary_bytes, &binary, &binary_status, status);
+            if (program != NULL && (*status != CL_SUCCESS || binary_status != CL_SUCCESS ||
+                    clBuildProgram(program, 1, &device, options, NULL, NULL) != CL_SUCCESS)) {
+                clReleaseProgram(program);
+                program = NULL;
+            }
+        }
+    }
+    free(cached);
+    if (program != NULL) {
+        free(source);
+        *hit = true;
+        *status = CL_SUCCESS;
+        return program;
+    }
+
+    const char *text = source;
+    program = clCreateProgramWithSource(context, 1, &text, &source_bytes, status);
+    free(source);
+    if (*status != CL_SUCCESS) {
+        return NULL;
+    }
+    *status = clBuildProgram(program, 1, &device, options, NULL, NULL);
+    if (*status != CL_SUCCESS) {
+        program_cache_build_log(program, device);
+        clReleaseProgram(program);
+        return NULL;
+    }
+    if (path[0] != '\0') {
+#ifndef _WIN32
+        mkdir(directory, 0755);
+#endif
+        if (!program_cache_store(path, key, program)) {
+            printf("program cache: failed to write %s\n", path);
+        }
+    }
+    return program;
+}
+
+#endif
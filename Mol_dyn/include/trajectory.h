@@ -0,0 +1,86 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Binary trajectory, little endian:
+//   trajectory_header
+//   per frame: trajectory_frame_header, then payload_bytes of payload
+// The uncompressed payload holds x[N], y[N], z[N], vx[N], vy[N], vz[N] as
+// float, or as int16 scaled by position_scale / velocity_scale when the file is
+// quantized. Quantized positions are wrapped into the box; float ones are not.
+// With TRAJECTORY_DEFLATED every payload is a zlib stream of raw_bytes.
+#define TRAJECTORY_MAGIC "MDTRAJ1"
+#define TRAJECTORY_VERSION 1
+#define TRAJECTORY_QUANTIZED 1
+#define TRAJECTORY_DEFLATED 2
+
+struct trajectory_header {
+    char magic[8];
+    int32_t version;
+    int32_t particles;
+    int32_t flags;
+    int32_t stride;     // steps between frames
+    double box;
+    double dt;
+};
+typedef struct trajectory_header trajectory_header;
+
+struct trajectory_frame_header {
+    int64_t step;
+    double time;
+    double position_scale;
+    double velocity_scale;
+    uint32_t payload_bytes;
+    uint32_t raw_bytes;
+};
+typedef struct trajectory_frame_header trajectory_frame_header;
+
+// Frames are copied into a ring of slots allocated up front and encoded and
+// written by a background thread. The step loop only waits when all slots are
+// still queued, which is counted in stalls.
+struct trajectory_writer {
+    FILE *file;
+    trajectory_header header;
+    double **ring;          // per slot x, y, z, vx, vy, vz of every particle
+    long *ring_step;
+    int ring_size;
+    int head;               // next slot to fill
+    int tail;               // next slot to write
+    int queued;
+    bool closing;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t drained;
+    void *raw;
+    void *packed;
+    size_t packed_capacity;
+    long frames;
+    long bytes;
+    long stalls;
+    const char *error;      // first failure, NULL while every frame made it to the file
+};
+typedef struct trajectory_writer trajectory_writer;
+
+trajectory_writer *trajectory_open(const char *path, int particles, int stride, double box, double dt,
+                                   int flags, int ring_size);
+// copies one frame; position and velocity are x, y, z arrays of the particles
+void trajectory_push(trajectory_writer *writer, long step, const double *const position[3],
+                     const double *const velocity[3]);
+// Writes out what is still queued and closes the file, false if a frame failed to
+// compress or write or the close failed; error and the counters stay readable.
+bool trajectory_close(trajectory_writer *writer);
+void trajectory_free(trajectory_writer *writer);
+
+// bytes a stored (possibly deflated) payload can take
+size_t trajectory_payload_capacity(const trajectory_header *header);
+// Reads the header, false if the file is not a trajectory.
+bool trajectory_read_header(FILE *file, trajectory_header *header);
+// Reads the next frame into values (6 * particles: x, y, z, vx, vy, vz), false at the end.
+// scratch must hold 6 * particles floats and packed trajectory_payload_capacity() bytes.
+bool trajectory_read_frame(FILE *file, const trajectory_header *header, trajectory_frame_header *frame,
+                           double *values, void *scratch, void *packed, size_t packed_capacity);
+
+#endif
@@ -0,0 +1,631 @@
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mpi.h>
+#include "parameters.h"
+#include "config.h"
+#include "lj_kernels.h"
+#include "scratch_arena.h"
+#define PROFILE_STORAGE
+#include "profile.h"
+
+// Domain-decomposed MD: the box is cut into dims[0] x dims[1] x dims[2] bricks,
+// one per MPI rank. A rank integrates the atoms inside its brick and holds copies
+// (ghosts) of every atom within halo = rc + skin of it, shifted to the periodic
+// image it interacts with. The pair kernels and the velocity-Verlet step are the
+// ones of md_cpu.cpp, run over the rank's own atoms.
+
+void init_domain();
+void set_initial_state();
+void grow_atoms(int needed);
+void grow_buffers(int doubles);
+void exchange(int dimension, int side, int send_doubles, int *recv_doubles);
+void migrate_atoms();
+void build_halo();
+void update_halo();
+void build_neighbor_lists();
+bool neighbor_lists_outdated();
+double calculate_energy_force_lj();
+void kick(double step);
+void drift(double step);
+double kinetic_energy();
+void md();
+
+int rank, ranks;
+MPI_Comm grid;
+int dims[3] = { 0, 0, 0 };
+int grid_coords[3];
+int neighbor_rank[3][2];    // [dimension][0 lower, 1 upper]
+double domain_lo[3], domain_hi[3], domain_size[3];
+double halo;
+
+// owned atoms take [0, local_count), their ghosts [local_count, local_count + ghost_count)
+int local_count = 0;
+int ghost_count = 0;
+int atom_capacity = 0;
+coords position, velocity, force, position_at_build;
+double *atom_id;
+
+// One halo message: the atoms sent to neighbor_rank[dimension][side] and the shift
+// across the periodic box they get on the way. The ghosts coming back from the
+// opposite neighbor land at recv_start. Rebuilt with the neighbor lists and
+// replayed every step in between, so only the positions travel.
+struct halo_swap {
+    int *send_list;
+    int send_count;
+    int send_capacity;
+    double shift;
+    int recv_start;
+    int recv_count;
+};
+halo_swap swaps[3][2];
+
+double *send_buffer, *recv_buffer;
+int buffer_capacity = 0;
+
+// Verlet lists of the owned atoms: the owned partners j > i come first, then the
+// ghosts. A pair with a ghost is also computed by the ghost's owner, so it adds
+// half its energy and its reaction force is dropped.
+int *pair_start;            // partners of i are pair_list[pair_start[i] .. pair_start[i + 1])
+int *local_partners;        // how many of them are owned atoms
+int *pair_list;
+long pair_capacity = 0;
+int *cell_head;
+int *cell_next;
+int cell_dims[3];
+int cell_capacity = 0;
+double cell_size[3];
+
+lj_setup lj;
+int rebuilds = 0;
+long migrations = 0;
+double force_time = 0, comm_time = 0;
+long heap_allocations = 0;
+
+int main(int argc, char **argv)
+{
+    MPI_Init(&argc, &argv);
+    MPI_Comm_size(MPI_COMM_WORLD, &ranks);
+    load_parameters(argc, argv);
+    if (integrator != VELOCITY_VERLET || precision != PRECISION_DOUBLE) {
+        // RESPA, Euler, mixed precision and its validation stay in md_cpu.cpp
+        int world_rank;
+        MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+        if (world_rank == 0) {
+            printf("error: the decomposed run does integrator = velocity-verlet in precision = double only, not %s in %s\n",
+                integrator_names[integrator], precision_names[precision]);
+        }
+        MPI_Finalize();
+        exit(1);
+    }
+    init_domain();
+    // the ghosts already carry their periodic shift, so the minimum image of the
+    // kernels must leave every pair alone: all pairs here are shorter than 2 box_size
+    lj = make_lj_setup(rc, 4 * box_size);
+    if (potential == POTENTIAL_TABLE) {
+        tabulate_lj_setup(&lj, table_rmin, table_tolerance);
+    }
+    if (rank == 0) {
+        printf("N %d, rc %g, box %g on %d ranks as %d x %d x %d domains\n",
+            N, rc, box_size, ranks, dims[0], dims[1], dims[2]);
+        printf("LJ pair kernel: %s\n", lj.kernel_name);
+    }
+    set_initial_state();
+    md();
+    free_lj_table(&lj);
+    // only the pair counts of the kernels are recorded here, those of rank 0
+    if (rank == 0) {
+        PROFILE_REPORT(profile_trace);
+    }
+    MPI_Finalize();
+    return 0;
+}
+
+/////// HELPER FUNCTIONS ///////
+
+void init_domain() {
+    int periods[3] = { 1, 1, 1 };
+    MPI_Dims_create(ranks, 3, dims);
+    MPI_Cart_create(MPI_COMM_WORLD, 3, dims, periods, 1, &grid);
+    MPI_Comm_rank(grid, &rank);
+    MPI_Cart_coords(grid, rank, 3, grid_coords);
+    halo = rc + skin;
+    for (int d = 0; d < 3; d++) {
+        MPI_Cart_shift(grid, d, 1, &neighbor_rank[d][0], &neighbor_rank[d][1]);
+        domain_size[d] = box_size / dims[d];
+        domain_lo[d] = -half_box + grid_coords[d] * domain_size[d];
+        domain_hi[d] = domain_lo[d] + domain_size[d];
+        // ghosts come from the adjacent domains only
+        if (domain_size[d] < halo) {
+            if (rank == 0) {
+                printf("error: domains of %g are thinner than rc + skin = %g, use fewer ranks or a bigger box\n",
+                    domain_size[d], halo);
+            }
+            MPI_Finalize();
+            exit(1);
+        }
+        swaps[d][0].send_capacity = swaps[d][1].send_capacity = 0;
+    }
+}
+
+// Every rank walks the same lattice, which fills the whole box evenly, and keeps
+// the sites inside its domain. Atom ids are the site numbers.
+void set_initial_state() {
+    int per_side = (int)ceil(cbrt((double)N));
+    double spacing = box_size / per_side;
+    if (spacing < 1) {
+        if (rank == 0) {
+            printf("error: %d atoms do not fit into the box, lattice spacing would be %g\n", N, spacing);
+        }
+        MPI_Finalize();
+        exit(1);
+    }
+    grow_atoms(2 * N / ranks + 64);
+    for (int site = 0; site < N; site++) {
+        double site_position[3] = {
+            -half_box + (site % per_side + 0.5) * spacing,
+            -half_box + ((site / per_side) % per_side + 0.5) * spacing,
+            -half_box + (site / (per_side * per_side) + 0.5) * spacing
+        };
+        bool inside = true;
+        for (int d = 0; d < 3; d++) {
+            inside = inside && site_position[d] >= domain_lo[d] && site_position[d] < domain_hi[d];
+        }
+        if (!inside) {
+            continue;
+        }
+        grow_atoms(local_count + 1);
+        position.x[local_count] = site_position[0];
+        position.y[local_count] = site_position[1];
+        position.z[local_count] = site_position[2];
+        velocity.x[local_count] = velocity.y[local_count] = velocity.z[local_count] = 0;
+        atom_id[local_count] = site;
+        local_count++;
+    }
+}
+
+static double *component(coords *array, int d) {
+    return d == 0 ? array->x : (d == 1 ? array->y : array->z);
+}
+
+static void move_coords(coords *grown, coords *old, int count) {
+    memcpy(grown->x, old->x, sizeof(double) * count);
+    memcpy(grown->y, old->y, sizeof(double) * count);
+    memcpy(grown->z, old->z, sizeof(double) * count);
+    free_coords(old);
+    *old = *grown;
+}
+
+// keeps owned atoms and ghosts, grows by half again so appends stay amortized
+void grow_atoms(int needed) {
+    if (needed <= atom_capacity) {
+        return;
+    }
+    int capacity = needed + needed / 2;
+    int count = local_count + ghost_count;
+    coords grown = alloc_coords(capacity);
+    if (atom_capacity > 0) {
+        move_coords(&grown, &position, count);
+        grown = alloc_coords(capacity);
+        move_coords(&grown, &velocity, count);
+        grown = alloc_coords(capacity);
+        move_coords(&grown, &force, count);
+        grown = alloc_coords(capacity);
+        move_coords(&grown, &position_at_build, count);
+    } else {
+        position = grown;
+        velocity = alloc_coords(capacity);
+        force = alloc_coords(capacity);
+        position_at_build = alloc_coords(capacity);
+    }
+    double *ids = (double*)counted_alloc(sizeof(double), sizeof(double) * capacity);
+    if (atom_capacity > 0) {
+        memcpy(ids, atom_id, sizeof(double) * count);
+        free(atom_id);
+    }
+    atom_id = ids;
+    atom_capacity = capacity;
+}
+
+void grow_buffers(int doubles) {
+    if (doubles <= buffer_capacity) {
+        return;
+    }
+    if (buffer_capacity > 0) {
+        free(send_buffer);
+        free(recv_buffer);
+    }
+    buffer_capacity = doubles + doubles / 2;
+    send_buffer = (double*)counted_alloc(sizeof(double), sizeof(double) * buffer_capacity);
+    recv_buffer = (double*)counted_alloc(sizeof(double), sizeof(double) * buffer_capacity);
+}
+
+// Sends send_buffer[0..send_doubles) to neighbor_rank[dimension][side] and receives
+// the matching message of the opposite neighbor into recv_buffer.
+void exchange(int dimension, int side, int send_doubles, int *recv_doubles) {
+    int to = neighbor_rank[dimension][side];
+    int from = neighbor_rank[dimension][1 - side];
+    MPI_Sendrecv(&send_doubles, 1, MPI_INT, to, 0, recv_doubles, 1, MPI_INT, from, 0, grid, MPI_STATUS_IGNORE);
+    grow_buffers(*recv_doubles);
+    MPI_Sendrecv(send_buffer, send_doubles, MPI_DOUBLE, to, 1, recv_buffer, *recv_doubles, MPI_DOUBLE, from, 1,
+        grid, MPI_STATUS_IGNORE);
+}
+
+// Wraps the owned atoms into the box and hands the ones that left the domain to
+// the neighbor they went to, one dimension after the other. Between two rebuilds
+// an atom moves less than skin / 2 < halo <= domain_size, so it is never more than
+// one domain away.
+void migrate_atoms() {
+    ghost_count = 0;
+    for (int i = 0; i < local_count; i++) {
+        for (int d = 0; d < 3; d++) {
+            double *x = component(&position, d);
+            x[i] -= box_size * floor((x[i] + half_box) / box_size);
+        }
+    }
+    for (int d = 0; d < 3; d++) {
+        if (dims[d] == 1) {
+            continue;
+        }
+        for (int side = 0; side < 2; side++) {
+            int target = (grid_coords[d] + (side == 0 ? dims[d] - 1 : 1)) % dims[d];
+            int sent = 0;
+            grow_buffers(7 * local_count);
+            double *x = component(&position, d);
+            for (int i = 0; i < local_count; i++) {
+                int owner = (int)((x[i] + half_box) / domain_size[d]);
+                owner = owner >= dims[d] ? dims[d] - 1 : owner;
+                if (owner == grid_coords[d]) {
+                    continue;
+                }
+                if (owner != target) {
+                    // with two domains both neighbors are the same rank, the lower send takes them all
+                    if ((grid_coords[d] + dims[d] - owner) % dims[d] > 1 && (owner + dims[d] - grid_coords[d]) % dims[d] > 1) {
+                        printf("error: atom %.0f moved more than one domain between two rebuilds\n", atom_id[i]);
+                        MPI_Abort(grid, 1);
+                    }
+                    continue;
+                }
+                double *message = send_buffer + 7 * sent;
+                message[0] = position.x[i];
+                message[1] = position.y[i];
+                message[2] = position.z[i];
+                message[3] = velocity.x[i];
+                message[4] = velocity.y[i];
+                message[5] = velocity.z[i];
+                message[6] = atom_id[i];
+                sent++;
+                // fill the hole with the last atom and look at slot i again
+                local_count--;
+                position.x[i] = position.x[local_count];
+                position.y[i] = position.y[local_count];
+                position.z[i] = position.z[local_count];
+                velocity.x[i] = velocity.x[local_count];
+                velocity.y[i] = velocity.y[local_count];
+                velocity.z[i] = velocity.z[local_count];
+                atom_id[i] = atom_id[local_count];
+                i--;
+            }
+            int recv_doubles;
+            exchange(d, side, 7 * sent, &recv_doubles);
+            int received = recv_doubles / 7;
+            grow_atoms(local_count + received);
+            for (int k = 0; k < received; k++) {
+                const double *message = recv_buffer + 7 * k;
+                position.x[local_count] = message[0];
+                position.y[local_count] = message[1];
+                position.z[local_count] = message[2];
+                velocity.x[local_count] = message[3];
+                velocity.y[local_count] = message[4];
+                velocity.z[local_count] = message[5];
+                atom_id[local_count] = message[6];
+                local_count++;
+            }
+            migrations += sent;
+        }
+    }
+}
+
+// Collects the ghosts in x, then y, then z. Ghosts received in earlier dimensions
+// are forwarded too, which brings in the edge and corner neighbors without
+// talking to them directly.
+void build_halo() {
+    for (int d = 0; d < 3; d++) {
+        int candidates = local_count + ghost_count;
+        for (int side = 0; side < 2; side++) {
+            halo_swap *swap = &swaps[d][side];
+            double *x = component(&position, d);
+            if (swap->send_capacity < candidates) {
+                if (swap->send_capacity > 0) {
+                    free(swap->send_list);
+                }
+                swap->send_capacity = candidates + candidates / 2;
+                swap->send_list = (int*)counted_alloc(sizeof(int), sizeof(int) * swap->send_capacity);
+            }
+            swap->send_count = 0;
+            for (int k = 0; k < candidates; k++) {
+                if ((side == 0 && x[k] < domain_lo[d] + halo) || (side == 1 && x[k] >= domain_hi[d] - halo)) {
+                    swap->send_list[swap->send_count++] = k;
+                }
+            }
+            // crossing the periodic boundary moves the copy to the image next to the receiver
+            swap->shift = 0;
+            if (side == 0 && grid_coords[d] == 0) {
+                swap->shift = box_size;
+            }
+            if (side == 1 && grid_coords[d] == dims[d] - 1) {
+                swap->shift = -box_size;
+            }
+            grow_buffers(4 * swap->send_count);
+            for (int s = 0; s < swap->send_count; s++) {
+                int k = swap->send_list[s];
+                double *message = send_buffer + 4 * s;
+                message[0] = position.x[k];
+                message[1] = position.y[k];
+                message[2] = position.z[k];
+                message[3] = atom_id[k];
+                message[d] += swap->shift;
+            }
+            int recv_doubles;
+            exchange(d, side, 4 * swap->send_count, &recv_doubles);
+            swap->recv_start = local_count + ghost_count;
+            swap->recv_count = recv_doubles / 4;
+            grow_atoms(swap->recv_start + swap->recv_count);
+            for (int k = 0; k < swap->recv_count; k++) {
+                const double *message = recv_buffer + 4 * k;
+                position.x[swap->recv_start + k] = message[0];
+                position.y[swap->recv_start + k] = message[1];
+                position.z[swap->recv_start + k] = message[2];
+                atom_id[swap->recv_start + k] = message[3];
+            }
+            ghost_count += swap->recv_count;
+        }
+    }
+}
+
+// replays the swaps of the last build with the current positions
+void update_halo() {
+    for (int d = 0; d < 3; d++) {
+        for (int side = 0; side < 2; side++) {
+            halo_swap *swap = &swaps[d][side];
+            grow_buffers(3 * swap->send_count);
+            for (int s = 0; s < swap->send_count; s++) {
+                int k = swap->send_list[s];
+                send_buffer[3 * s] = position.x[k];
+                send_buffer[3 * s + 1] = position.y[k];
+                send_buffer[3 * s + 2] = position.z[k];
+                send_buffer[3 * s + d] += swap->shift;
+            }
+            int recv_doubles;
+            exchange(d, side, 3 * swap->send_count, &recv_doubles);
+            for (int k = 0; k < swap->recv_count; k++) {
+                position.x[swap->recv_start + k] = recv_buffer[3 * k];
+                position.y[swap->recv_start + k] = recv_buffer[3 * k + 1];
+                position.z[swap->recv_start + k] = recv_buffer[3 * k + 2];
+            }
+        }
+    }
+}
+
+static int cell_index(int k) {
+    int c[3];
+    for (int d = 0; d < 3; d++) {
+        c[d] = (int)((component(&position, d)[k] - (domain_lo[d] - halo)) / cell_size[d]);
+        c[d] = c[d] < 0 ? 0 : (c[d] >= cell_dims[d] ? cell_dims[d] - 1 : c[d]);
+    }
+    return (c[2] * cell_dims[1] + c[1]) * cell_dims[0] + c[0];
+}
+
+// Bins owned atoms and ghosts into cells of side >= halo over the domain and its
+// halo, then lists for every owned atom its partners within rc + skin.
+void build_neighbor_lists() {
+    int count = local_count + ghost_count;
+    int cells_total = 1;
+    for (int d = 0; d < 3; d++) {
+        cell_dims[d] = (int)((domain_size[d] + 2 * halo) / halo);
+        cell_size[d] = (domain_size[d] + 2 * halo) / cell_dims[d];
+        cells_total *= cell_dims[d];
+    }
+    if (cell_capacity < cells_total + count) {
+        if (cell_capacity > 0) {
+            free(cell_head);
+            free(cell_next);
+            free(pair_start);
+            free(local_partners);
+        }
+        cell_capacity = 2 * (cells_total + count);
+        cell_head = (int*)counted_alloc(sizeof(int), sizeof(int) * cell_capacity);
+        cell_next = (int*)counted_alloc(sizeof(int), sizeof(int) * cell_capacity);
+        pair_start = (int*)counted_alloc(sizeof(int), sizeof(int) * cell_capacity);
+        local_partners = (int*)counted_alloc(sizeof(int), sizeof(int) * cell_capacity);
+    }
+    for (int c = 0; c < cells_total; c++) {
+        cell_head[c] = -1;
+    }
+    // push in reverse so every cell lists its atoms in increasing order
+    for (int k = count - 1; k >= 0; k--) {
+        int cell = cell_index(k);
+        cell_next[k] = cell_head[cell];
+        cell_head[cell] = k;
+    }
+    double list_cutoff = halo * halo;
+    while (1) {
+        long pairs = 0;
+        for (int i = 0; i < local_count; i++) {
+            pair_start[i] = pairs;
+            int c = cell_index(i);
+            int cx = c % cell_dims[0], cy = (c / cell_dims[0]) % cell_dims[1], cz = c / (cell_dims[0] * cell_dims[1]);
+            // owned partners first, then ghosts
+            for (int pass = 0; pass < 2; pass++) {
+                for (int dz = -1; dz <= 1; dz++) {
+                    for (int dy = -1; dy <= 1; dy++) {
+                        for (int dx = -1; dx <= 1; dx++) {
+                            int nx = cx + dx, ny = cy + dy, nz = cz + dz;
+                            if (nx < 0 || ny < 0 || nz < 0 || nx >= cell_dims[0] || ny >= cell_dims[1] || nz >= cell_dims[2]) {
+                                continue;
+                            }
+                            for (int j = cell_head[(nz * cell_dims[1] + ny) * cell_dims[0] + nx]; j != -1; j = cell_next[j]) {
+                                if (pass == 0 ? (j <= i || j >= local_count) : j < local_count) {
+                                    continue;
+                                }
+                                double x = position.x[j] - position.x[i];
+                                double y = position.y[j] - position.y[i];
+                                double z = position.z[j] - position.z[i];
+                                if (x * x + y * y + z * z < list_cutoff) {
+                                    if (pairs < pair_capacity) {
+                                        pair_list[pairs] = j;
+                                    }
+                                    pairs++;
+                                }
+                            }
+                        }
+                    }
+                }
+                if (pass == 0) {
+                    local_partners[i] = pairs - pair_start[i];
+                }
+            }
+        }
+        pair_start[local_count] = pairs;
+        if (pairs <= pair_capacity) {
+            break;
+        }
+        // more pairs than we had room for: grow the list and build it again
+        if (pair_capacity > 0) {
+            free(pair_list);
+        }
+        pair_capacity = pairs + pairs / 4;
+        pair_list = (int*)counted_alloc(sizeof(int), sizeof(int) * pair_capacity);
+    }
+    memcpy(position_at_build.x, position.x, sizeof(double) * local_count);
+    memcpy(position_at_build.y, position.y, sizeof(double) * local_count);
+    memcpy(position_at_build.z, position.z, sizeof(double) * local_count);
+    rebuilds++;
+}
+
+// all ranks have to agree, since a rebuild migrates atoms and redoes the halo
+bool neighbor_lists_outdated() {
+    double max_displacement = 0;
+    for (int i = 0; i < local_count; i++) {
+        double x = position.x[i] - position_at_build.x[i];
+        double y = position.y[i] - position_at_build.y[i];
+        double z = position.z[i] - position_at_build.z[i];
+        double displacement = x * x + y * y + z * z;
+        max_displacement = displacement > max_displacement ? displacement : max_displacement;
+    }
+    double global_max;
+    MPI_Allreduce(&max_displacement, &global_max, 1, MPI_DOUBLE, MPI_MAX, grid);
+    return global_max > (skin / 2) * (skin / 2);
+}
+
+// returns this rank's share of the potential energy
+double calculate_energy_force_lj() {
+    double start = MPI_Wtime();
+    if (rebuilds == 0 || neighbor_lists_outdated()) {
+        migrate_atoms();
+        build_halo();
+        build_neighbor_lists();
+    } else {
+        update_halo();
+    }
+    double communicated = MPI_Wtime();
+    comm_time += communicated - start;
+    int count = local_count + ghost_count;
+    memset(force.x, 0, sizeof(double) * count);
+    memset(force.y, 0, sizeof(double) * count);
+    memset(force.z, 0, sizeof(double) * count);
+    double energy = 0;
+    double ghost_energy = 0;
+    for (int i = 0; i < local_count; i++) {
+        double force_i[3] = { 0, 0, 0 };
+        const int *list = pair_list + pair_start[i];
+        int owned = local_partners[i];
+        energy += lj.kernel(&lj, &position, i, list, owned, &force, force_i);
+        ghost_energy += lj.kernel(&lj, &position, i, list + owned, pair_start[i + 1] - pair_start[i] - owned, &force, force_i);
+        force.x[i] += force_i[0];
+        force.y[i] += force_i[1];
+        force.z[i] += force_i[2];
+    }
+    force_time += MPI_Wtime() - communicated;
+    return energy + ghost_energy / 2;
+}
+
+void kick(double step) {
+    #pragma omp simd
+    for (int i = 0; i < local_count; i++) {
+        velocity.x[i] += force.x[i] * step;
+        velocity.y[i] += force.y[i] * step;
+        velocity.z[i] += force.z[i] * step;
+    }
+}
+
+void drift(double step) {
+    #pragma omp simd
+    for (int i = 0; i < local_count; i++) {
+        position.x[i] += velocity.x[i] * step;
+        position.y[i] += velocity.y[i] * step;
+        position.z[i] += velocity.z[i] * step;
+    }
+}
+
+double kinetic_energy() {
+    double energy = 0;
+    #pragma omp simd reduction(+:energy)
+    for (int i = 0; i < local_count; i++) {
+        energy += velocity.x[i] * velocity.x[i] + velocity.y[i] * velocity.y[i] + velocity.z[i] * velocity.z[i];
+    }
+    return energy / 2;
+}
+
+void md() {
+    double potential = calculate_energy_force_lj();
+    double energy[2] = { potential, kinetic_energy() }, total[2];
+    MPI_Allreduce(energy, total, 2, MPI_DOUBLE, MPI_SUM, grid);
+    double initial_energy = total[0] + total[1];
+    double final_energy = initial_energy;
+    double max_deviation = 0;
+    force_time = comm_time = 0;
+    long allocations_before = heap_allocations;
+    MPI_Barrier(grid);
+    double start_time = MPI_Wtime();
+    for (int n = 0; n < total_it; n ++){
+        if (!(n % 1000) && rank == 0) {
+            printf("energy is %f \n", total[0] / N);
+        }
+        kick(dt / 2);
+        drift(dt);
+        potential = calculate_energy_force_lj();
+        kick(dt / 2);
+        energy[0] = potential;
+        energy[1] = kinetic_energy();
+        MPI_Allreduce(energy, total, 2, MPI_DOUBLE, MPI_SUM, grid);
+        final_energy = total[0] + total[1];
+        if (fabs(final_energy - initial_energy) > max_deviation) {
+            max_deviation = fabs(final_energy - initial_energy);
+        }
+    }
+    double loop_time = MPI_Wtime() - start_time;
+
+    // the slowest rank sets the pace; max / mean of the owned atoms is the load imbalance
+    double local[4] = { loop_time, force_time, comm_time, (double)local_count };
+    double slowest[4], sum[4];
+    MPI_Reduce(local, slowest, 4, MPI_DOUBLE, MPI_MAX, 0, grid);
+    MPI_Reduce(local, sum, 4, MPI_DOUBLE, MPI_SUM, 0, grid);
+    long counts[3] = { migrations, ghost_count, heap_allocations - allocations_before }, count_sum[3];
+    MPI_Reduce(counts, count_sum, 3, MPI_LONG, MPI_SUM, 0, grid);
+    if (rank == 0) {
+        printf("\nneighbor list rebuilds: %d in %d steps, %ld atom migrations, %.1f ghosts per rank\n",
+            rebuilds, total_it, count_sum[0], (double)count_sum[1] / ranks);
+        // buffers only grow when a rank gains atoms or ghosts beyond its high-water mark
+        printf("heap allocations in the step loop: %ld over all ranks\n", count_sum[2]);
+        printf("integrator %s, dt %g: total energy per particle %f -> %f\n",
+            integrator_names[integrator], dt, initial_energy / N, final_energy / N);
+        printf("energy drift %e per particle per unit time, max deviation %e per particle\n",
+            (final_energy - initial_energy) / (N * total_it * dt), max_deviation / N);
+        printf("atoms per rank %.1f mean, %.0f max (imbalance %.3f)\n",
+            sum[3] / ranks, slowest[3], slowest[3] / (sum[3] / ranks));
+        printf("force %.3f s, halo and migration %.3f s (slowest rank)\n", slowest[1], slowest[2]);
+        printf("ranks %d, N %d: step loop %.3f s, %.3e s per step\n", ranks, N, slowest[0], slowest[0] / total_it);
+    }
+}
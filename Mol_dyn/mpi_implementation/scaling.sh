@@ -0,0 +1,38 @@
+#!/bin/sh
+# Strong and weak scaling of the domain-decomposed MD engine.
+#   sh mpi_implementation/scaling.sh [binary] [rank counts]
+# Set MPIRUN (e.g. "mpirun --oversubscribe") to change how the ranks are started.
+# Strong scaling keeps N and the box fixed; weak scaling keeps the atoms per rank
+# and the density fixed by growing the box with the cube root of the rank count.
+BINARY=${1:-./MDHost_MPI}
+RANKS=${2:-"1 2 4 8"}
+MPIRUN=${MPIRUN:-mpirun}
+STEPS=${STEPS:-500}
+STRONG_N=${STRONG_N:-32000}
+STRONG_BOX=${STRONG_BOX:-40}
+WEAK_N=${WEAK_N:-4000}
+WEAK_BOX=${WEAK_BOX:-20}
+
+step_loop() {
+    $MPIRUN -np $1 $BINARY --N=$2 --box_size=$3 --total_it=$STEPS | awk '/^ranks .* step loop/ { print $7 }'
+}
+
+echo "strong scaling: N $STRONG_N, box $STRONG_BOX, $STEPS steps"
+echo "ranks  loop s  speedup  efficiency"
+base=""
+for p in $RANKS; do
+    t=$(step_loop $p $STRONG_N $STRONG_BOX)
+    base=${base:-$t}
+    awk -v p=$p -v t=$t -v b=$base 'BEGIN { printf "%5d %7.3f %8.2f %10.2f\n", p, t, b / t, b / t / p }'
+done
+
+echo "weak scaling: $WEAK_N atoms per rank, box $WEAK_BOX per $WEAK_N atoms, $STEPS steps"
+echo "ranks      N     box  loop s  efficiency"
+base=""
+for p in $RANKS; do
+    n=$((WEAK_N * p))
+    box=$(awk -v p=$p -v b=$WEAK_BOX 'BEGIN { printf "%.4f", b * exp(log(p) / 3) }')
+    t=$(step_loop $p $n $box)
+    base=${base:-$t}
+    awk -v p=$p -v n=$n -v box=$box -v t=$t -v b=$base 'BEGIN { printf "%5d %6d %7.2f %7.3f %11.2f\n", p, n, box, t, b / t }'
+done
@@ -0,0 +1,1165 @@
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+#endif
+#include "parameters.h"
+#include "lj_kernels.h"
+#include "scratch_arena.h"
+#include "profile.h"
+
+int padded_count(int count) {
+    return (count + SIMD_PADDING - 1) / SIMD_PADDING * SIMD_PADDING;
+}
+
+coords alloc_coords(int count) {
+    size_t bytes = sizeof(double) * padded_count(count);
+    coords array;
+    array.x = (double*)counted_alloc(SIMD_ALIGNMENT, bytes);
+    array.y = (double*)counted_alloc(SIMD_ALIGNMENT, bytes);
+    array.z = (double*)counted_alloc(SIMD_ALIGNMENT, bytes);
+    memset(array.x, 0, bytes);
+    memset(array.y, 0, bytes);
+    memset(array.z, 0, bytes);
+    return array;
+}
+
+size_t coords_bytes(int count) {
+    return 3 * (sizeof(double) * padded_count(count) + SIMD_ALIGNMENT);
+}
+
+coords arena_coords(scratch_arena *arena, int count) {
+    size_t bytes = sizeof(double) * padded_count(count);
+    coords array;
+    array.x = (double*)arena_alloc(arena, bytes);
+    array.y = (double*)arena_alloc(arena, bytes);
+    array.z = (double*)arena_alloc(arena, bytes);
+    return array;
+}
+
+void free_coords(coords *array) {
+    free(array->x);
+    free(array->y);
+    free(array->z);
+}
+
+coords_single alloc_coords_single(int count) {
+    size_t bytes = sizeof(float) * padded_count(count);
+    coords_single array;
+    array.x = (float*)counted_alloc(SIMD_ALIGNMENT, bytes);
+    array.y = (float*)counted_alloc(SIMD_ALIGNMENT, bytes);
+    array.z = (float*)counted_alloc(SIMD_ALIGNMENT, bytes);
+    memset(array.x, 0, bytes);
+    memset(array.y, 0, bytes);
+    memset(array.z, 0, bytes);
+    return array;
+}
+
+void free_coords_single(coords_single *array) {
+    free(array->x);
+    free(array->y);
+    free(array->z);
+}
+
+// the engine never wraps its positions, and far from the box they would lose
+// their digits in float, so the copy holds their images inside it
+void fill_coords_single(coords_single *single, const coords *array, int count, double box) {
+    #pragma omp simd
+    for (int i = 0; i < count; i++) {
+        single->x[i] = (float)(array->x[i] - box * floor(array->x[i] / box + 0.5));
+        single->y[i] = (float)(array->y[i] - box * floor(array->y[i] / box + 0.5));
+        single->z[i] = (float)(array->z[i] - box * floor(array->z[i] / box + 0.5));
+    }
+}
+
+lj_setup make_lj_setup(double cutoff, double box) {
+    lj_setup setup;
+    double cutoff6 = cutoff * cutoff * cutoff * cutoff * cutoff * cutoff;
+    setup.cutoff2 = cutoff * cutoff;
+    setup.box = box;
+    setup.inv_box = 1 / box;
+    setup.shift = 4 * (1 / (cutoff6 * cutoff6) - 1 / cutoff6);
+    setup.weight_full = 1;
+    setup.weight_switch = 0;
+    setup.switch_start = 0;
+    setup.switch_inv_width = 0;
+    setup.table = NULL;
+    setup.single = NULL;
+    select_lj_kernel(&setup, best_lj_isa(), false);
+    return setup;
+}
+
+lj_setup make_respa_setup(const lj_setup *full, double switch_start, double switch_end, bool inner) {
+    lj_setup setup = *full;
+    setup.table = NULL;
+    setup.single = NULL;
+    setup.switch_start = switch_start;
+    setup.switch_inv_width = 1 / (switch_end - switch_start);
+    if (inner) {
+        // nothing of the short-range part is left beyond switch_end
+        setup.cutoff2 = switch_end * switch_end;
+        setup.weight_full = 0;
+        setup.weight_switch = 1;
+    } else {
+        setup.weight_full = 1;
+        setup.weight_switch = -1;
+    }
+    select_lj_kernel(&setup, best_lj_isa(), false);
+    return setup;
+}
+
+// weight_full + weight_switch * S(r), S = 1 - 3t^2 + 2t^3 with t the position of r in the switching range
+static inline double split_weight(const lj_setup *setup, double dist) {
+    double t = (sqrt(dist) - setup->switch_start) * setup->switch_inv_width;
+    t = t < 0 ? 0 : (t > 1 ? 1 : t);
+    return setup->weight_full + setup->weight_switch * (1 - t * t * (3 - 2 * t));
+}
+
+// Cutoff buckets: a kernel instantiated with RC_TENTHS > 0 has rc = RC_TENTHS / 10
+// and the matching shift folded in as constants, RC_TENTHS == 0 reads both from the setup.
+static constexpr double bucket_pow6(double x) {
+    return x * x * x * x * x * x;
+}
+
+template <int RC_TENTHS>
+static inline double kernel_cutoff2(const lj_setup *setup) {
+    return RC_TENTHS ? (RC_TENTHS / 10.0) * (RC_TENTHS / 10.0) : setup->cutoff2;
+}
+
+template <int RC_TENTHS>
+static inline double kernel_shift(const lj_setup *setup) {
+    return RC_TENTHS ? 4 * (1 / (bucket_pow6(RC_TENTHS / 10.0) * bucket_pow6(RC_TENTHS / 10.0)) - 1 / bucket_pow6(RC_TENTHS / 10.0))
+                     : setup->shift;
+}
+
+// One reciprocal instead of the four divisions of 2 / r14 - 1 / r8 and 1 / r12 - 1 / r6.
+// The force on i is -dU/dr_i = 24 (2 / r14 - 1 / r8) (r_i - r_j), i.e. the
+// multiplier below is applied to r_j - r_i.
+template <int RC_TENTHS, bool SPLIT>
+static inline double lj_pair(const lj_setup *setup, const coords *array, int i, int j,
+                             coords *partner_force, double *fx, double *fy, double *fz) {
+    double x = array->x[j] - array->x[i];
+    double y = array->y[j] - array->y[i];
+    double z = array->z[j] - array->z[i];
+    // most pairs are already nearest images, so skip the costly rounding for them
+    if (fabs(x) > 0.5 * setup->box) x -= setup->box * round(x * setup->inv_box);
+    if (fabs(y) > 0.5 * setup->box) y -= setup->box * round(y * setup->inv_box);
+    if (fabs(z) > 0.5 * setup->box) z -= setup->box * round(z * setup->inv_box);
+    double dist = x * x + y * y + z * z;
+    if (dist >= kernel_cutoff2<RC_TENTHS>(setup)) {
+        return 0;
+    }
+    PROFILE_COUNT(PROFILE_PAIRS_INSIDE, 1);
+    double inv2 = 1 / dist;
+    double inv6 = inv2 * inv2 * inv2;
+    double inv8 = inv6 * inv2;
+    double weight = SPLIT ? split_weight(setup, dist) : 1;
+    double multiplier = weight * 24 * (inv8 - 2 * inv6 * inv8);
+    *fx += x * multiplier;
+    *fy += y * multiplier;
+    *fz += z * multiplier;
+    partner_force->x[j] -= x * multiplier;
+    partner_force->y[j] -= y * multiplier;
+    partner_force->z[j] -= z * multiplier;
+    return weight * (4 * (inv6 * inv6 - inv6) - kernel_shift<RC_TENTHS>(setup));
+}
+
+template <int RC_TENTHS, bool SPLIT>
+static double lj_kernel_scalar(const lj_setup *setup, const coords *array, int i,
+                               const int *list, int count, coords *partner_force, double *force_i) {
+    double fx = 0, fy = 0, fz = 0;
+    double energy = 0;
+    for (int k = 0; k < count; k++) {
+        energy += lj_pair<RC_TENTHS, SPLIT>(setup, array, i, list[k], partner_force, &fx, &fy, &fz);
+    }
+    force_i[0] += fx;
+    force_i[1] += fy;
+    force_i[2] += fz;
+    return energy;
+}
+
+// the pair as lj_pair() computes it, weight included, for tabulate_lj_setup()
+static void switched_lj_pair(double s, const void *context, double *energy, double *multiplier) {
+    const lj_setup *setup = (const lj_setup*)context;
+    lennard_jones_pair(s, &setup->shift, energy, multiplier);
+    double weight = split_weight(setup, s);
+    *energy *= weight;
+    *multiplier *= weight;
+}
+
+void tabulate_lj_setup(lj_setup *setup, double r_min, double tolerance) {
+    pair_table *table = (pair_table*)malloc(sizeof(pair_table));
+    // the switch bends the pair at both ends of its range; the inner part ends at the second
+    double kinks[2] = { setup->switch_start, setup->switch_start + 1 / setup->switch_inv_width };
+    int kink_count = 0;
+    if (setup->weight_switch != 0) {
+        kink_count = kinks[1] * kinks[1] < setup->cutoff2 ? 2 : 1;
+    }
+    if (!build_pair_table(table, switched_lj_pair, setup, r_min, sqrt(setup->cutoff2), tolerance, kinks, kink_count)) {
+        printf("pair table: %d intervals reach only a relative error of %.1e\n", table->intervals, table->max_error);
+    }
+    setup->table = table;
+    select_lj_kernel(setup, best_lj_isa(), false);
+}
+
+void free_lj_table(lj_setup *setup) {
+    if (setup->table != NULL) {
+        free_pair_table((pair_table*)setup->table);
+        free((pair_table*)setup->table);
+        setup->table = NULL;
+    }
+}
+
+// lj_pair() with the energy and multiplier looked up in setup->table
+static inline double table_pair(const lj_setup *setup, const coords *array, int i, int j,
+                                coords *partner_force, double *fx, double *fy, double *fz) {
+    double x = array->x[j] - array->x[i];
+    double y = array->y[j] - array->y[i];
+    double z = array->z[j] - array->z[i];
+    if (fabs(x) > 0.5 * setup->box) x -= setup->box * round(x * setup->inv_box);
+    if (fabs(y) > 0.5 * setup->box) y -= setup->box * round(y * setup->inv_box);
+    if (fabs(z) > 0.5 * setup->box) z -= setup->box * round(z * setup->inv_box);
+    double dist = x * x + y * y + z * z;
+    if (dist >= setup->cutoff2) {
+        return 0;
+    }
+    PROFILE_COUNT(PROFILE_PAIRS_INSIDE, 1);
+    double energy, multiplier;
+    pair_table_lookup(setup->table, dist, &energy, &multiplier);
+    *fx += x * multiplier;
+    *fy += y * multiplier;
+    *fz += z * multiplier;
+    partner_force->x[j] -= x * multiplier;
+    partner_force->y[j] -= y * multiplier;
+    partner_force->z[j] -= z * multiplier;
+    return energy;
+}
+
+static double table_kernel_scalar(const lj_setup *setup, const coords *array, int i,
+                                  const int *list, int count, coords *partner_force, double *force_i) {
+    double fx = 0, fy = 0, fz = 0;
+    double energy = 0;
+    for (int k = 0; k < count; k++) {
+        energy += table_pair(setup, array, i, list[k], partner_force, &fx, &fy, &fz);
+    }
+    force_i[0] += fx;
+    force_i[1] += fy;
+    force_i[2] += fz;
+    return energy;
+}
+
+void make_mixed_setup(lj_setup *setup, coords_single *single) {
+    setup->single = single;
+    select_lj_kernel(setup, best_lj_isa(), false);
+}
+
+static inline float split_weight_single(const lj_setup *setup, float dist) {
+    float t = (sqrtf(dist) - (float)setup->switch_start) * (float)setup->switch_inv_width;
+    t = t < 0 ? 0 : (t > 1 ? 1 : t);
+    return (float)setup->weight_full + (float)setup->weight_switch * (1 - t * t * (3 - 2 * t));
+}
+
+// lj_pair() in float on setup->single; only the sums over the pairs are double.
+template <bool SPLIT>
+static inline double mixed_pair(const lj_setup *setup, int i, int j,
+                                coords *partner_force, double *fx, double *fy, double *fz) {
+    const coords_single *single = setup->single;
+    const float box = (float)setup->box;
+    const float inv_box = (float)setup->inv_box;
+    float x = single->x[j] - single->x[i];
+    float y = single->y[j] - single->y[i];
+    float z = single->z[j] - single->z[i];
+    if (fabsf(x) > 0.5f * box) x -= box * rintf(x * inv_box);
+    if (fabsf(y) > 0.5f * box) y -= box * rintf(y * inv_box);
+    if (fabsf(z) > 0.5f * box) z -= box * rintf(z * inv_box);
+    float dist = x * x + y * y + z * z;
+    if (dist >= (float)setup->cutoff2) {
+        return 0;
+    }
+    PROFILE_COUNT(PROFILE_PAIRS_INSIDE, 1);
+    float inv2 = 1 / dist;
+    float inv6 = inv2 * inv2 * inv2;
+    float inv8 = inv6 * inv2;
+    float weight = SPLIT ? split_weight_single(setup, dist) : 1;
+    float multiplier = weight * 24 * (inv8 - 2 * inv6 * inv8);
+    *fx += x * multiplier;
+    *fy += y * multiplier;
+    *fz += z * multiplier;
+    partner_force->x[j] -= x * multiplier;
+    partner_force->y[j] -= y * multiplier;
+    partner_force->z[j] -= z * multiplier;
+    return weight * (4 * (inv6 * inv6 - inv6) - (float)setup->shift);
+}
+
+template <bool SPLIT>
+static double mixed_kernel_scalar(const lj_setup *setup, const coords *array, int i,
+                                  const int *list, int count, coords *partner_force, double *force_i) {
+    double fx = 0, fy = 0, fz = 0;
+    double energy = 0;
+    for (int k = 0; k < count; k++) {
+        energy += mixed_pair<SPLIT>(setup, i, list[k], partner_force, &fx, &fy, &fz);
+    }
+    force_i[0] += fx;
+    force_i[1] += fy;
+    force_i[2] += fz;
+    return energy;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2,fma")))
+static inline double horizontal_sum(__m256d v) {
+    __m128d low = _mm256_castpd256_pd128(v);
+    __m128d high = _mm256_extractf128_pd(v, 1);
+    low = _mm_add_pd(low, high);
+    return _mm_cvtsd_f64(_mm_add_sd(low, _mm_unpackhi_pd(low, low)));
+}
+
+template <int RC_TENTHS, bool SPLIT>
+__attribute__((target("avx2,fma")))
+static double lj_kernel_avx2(const lj_setup *setup, const coords *array, int i,
+                             const int *list, int count, coords *partner_force, double *force_i) {
+    const __m256d xi = _mm256_set1_pd(array->x[i]);
+    const __m256d yi = _mm256_set1_pd(array->y[i]);
+    const __m256d zi = _mm256_set1_pd(array->z[i]);
+    const __m256d box = _mm256_set1_pd(setup->box);
+    const __m256d inv_box = _mm256_set1_pd(setup->inv_box);
+    const __m256d cutoff2 = _mm256_set1_pd(kernel_cutoff2<RC_TENTHS>(setup));
+    const __m256d shift = _mm256_set1_pd(kernel_shift<RC_TENTHS>(setup));
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d two = _mm256_set1_pd(2.0);
+    const __m256d three = _mm256_set1_pd(3.0);
+    const __m256d four = _mm256_set1_pd(4.0);
+    const __m256d twenty_four = _mm256_set1_pd(24.0);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d weight_full = _mm256_set1_pd(setup->weight_full);
+    const __m256d weight_switch = _mm256_set1_pd(setup->weight_switch);
+    const __m256d switch_start = _mm256_set1_pd(setup->switch_start);
+    const __m256d switch_inv_width = _mm256_set1_pd(setup->switch_inv_width);
+    __m256d fx = _mm256_setzero_pd();
+    __m256d fy = _mm256_setzero_pd();
+    __m256d fz = _mm256_setzero_pd();
+    __m256d energy = _mm256_setzero_pd();
+    int k = 0;
+    for (; k + 4 <= count; k += 4) {
+        __m128i index = _mm_loadu_si128((const __m128i*)(list + k));
+        __m256d x = _mm256_sub_pd(_mm256_i32gather_pd(array->x, index, 8), xi);
+        __m256d y = _mm256_sub_pd(_mm256_i32gather_pd(array->y, index, 8), yi);
+        __m256d z = _mm256_sub_pd(_mm256_i32gather_pd(array->z, index, 8), zi);
+        x = _mm256_fnmadd_pd(box, _mm256_round_pd(_mm256_mul_pd(x, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), x);
+        y = _mm256_fnmadd_pd(box, _mm256_round_pd(_mm256_mul_pd(y, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), y);
+        z = _mm256_fnmadd_pd(box, _mm256_round_pd(_mm256_mul_pd(z, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), z);
+        __m256d dist = _mm256_fmadd_pd(z, z, _mm256_fmadd_pd(y, y, _mm256_mul_pd(x, x)));
+        __m256d inside = _mm256_cmp_pd(dist, cutoff2, _CMP_LT_OQ);
+        if (_mm256_movemask_pd(inside) == 0) {
+            continue;
+        }
+        PROFILE_COUNT(PROFILE_PAIRS_INSIDE, __builtin_popcount(_mm256_movemask_pd(inside)));
+        __m256d inv2 = _mm256_div_pd(one, dist);
+        __m256d inv6 = _mm256_mul_pd(_mm256_mul_pd(inv2, inv2), inv2);
+        __m256d inv8 = _mm256_mul_pd(inv6, inv2);
+        __m256d multiplier = _mm256_mul_pd(_mm256_mul_pd(twenty_four, inv8), _mm256_fnmadd_pd(two, inv6, one));
+        __m256d pair_energy = _mm256_fmsub_pd(four, _mm256_fmsub_pd(inv6, inv6, inv6), shift);
+        if (SPLIT) {
+            __m256d t = _mm256_mul_pd(_mm256_sub_pd(_mm256_sqrt_pd(dist), switch_start), switch_inv_width);
+            t = _mm256_min_pd(_mm256_max_pd(t, zero), one);
+            __m256d s = _mm256_fnmadd_pd(_mm256_mul_pd(t, t), _mm256_fnmadd_pd(two, t, three), one);
+            __m256d weight = _mm256_fmadd_pd(weight_switch, s, weight_full);
+            multiplier = _mm256_mul_pd(multiplier, weight);
+            pair_energy = _mm256_mul_pd(pair_energy, weight);
+        }
+        multiplier = _mm256_and_pd(inside, multiplier);
+        energy = _mm256_add_pd(energy, _mm256_and_pd(inside, pair_energy));
+        __m256d px = _mm256_mul_pd(x, multiplier);
+        __m256d py = _mm256_mul_pd(y, multiplier);
+        __m256d pz = _mm256_mul_pd(z, multiplier);
+        fx = _mm256_add_pd(fx, px);
+        fy = _mm256_add_pd(fy, py);
+        fz = _mm256_add_pd(fz, pz);
+        // AVX2 has no scatter, so the reaction forces go to the partners lane by lane
+        double lane_x[4], lane_y[4], lane_z[4];
+        _mm256_storeu_pd(lane_x, px);
+        _mm256_storeu_pd(lane_y, py);
+        _mm256_storeu_pd(lane_z, pz);
+        for (int l = 0; l < 4; l++) {
+            int j = list[k + l];
+            partner_force->x[j] -= lane_x[l];
+            partner_force->y[j] -= lane_y[l];
+            partner_force->z[j] -= lane_z[l];
+        }
+    }
+    double force_x = horizontal_sum(fx);
+    double force_y = horizontal_sum(fy);
+    double force_z = horizontal_sum(fz);
+    double total_energy = horizontal_sum(energy);
+    for (; k < count; k++) {
+        total_energy += lj_pair<RC_TENTHS, SPLIT>(setup, array, i, list[k], partner_force, &force_x, &force_y, &force_z);
+    }
+    force_i[0] += force_x;
+    force_i[1] += force_y;
+    force_i[2] += force_z;
+    return total_energy;
+}
+
+template <int RC_TENTHS, bool SPLIT>
+__attribute__((target("avx512f")))
+static double lj_kernel_avx512(const lj_setup *setup, const coords *array, int i,
+                               const int *list, int count, coords *partner_force, double *force_i) {
+    const __m512d xi = _mm512_set1_pd(array->x[i]);
+    const __m512d yi = _mm512_set1_pd(array->y[i]);
+    const __m512d zi = _mm512_set1_pd(array->z[i]);
+    const __m512d box = _mm512_set1_pd(setup->box);
+    const __m512d inv_box = _mm512_set1_pd(setup->inv_box);
+    const __m512d cutoff2 = _mm512_set1_pd(kernel_cutoff2<RC_TENTHS>(setup));
+    const __m512d shift = _mm512_set1_pd(kernel_shift<RC_TENTHS>(setup));
+    const __m512d one = _mm512_set1_pd(1.0);
+    const __m512d two = _mm512_set1_pd(2.0);
+    const __m512d three = _mm512_set1_pd(3.0);
+    const __m512d four = _mm512_set1_pd(4.0);
+    const __m512d twenty_four = _mm512_set1_pd(24.0);
+    const __m512d zero = _mm512_setzero_pd();
+    const __m512d weight_full = _mm512_set1_pd(setup->weight_full);
+    const __m512d weight_switch = _mm512_set1_pd(setup->weight_switch);
+    const __m512d switch_start = _mm512_set1_pd(setup->switch_start);
+    const __m512d switch_inv_width = _mm512_set1_pd(setup->switch_inv_width);
+    __m512d fx = zero;
+    __m512d fy = zero;
+    __m512d fz = zero;
+    __m512d energy = zero;
+    for (int k = 0; k < count; k += 8) {
+        // the last partial vector is handled by masking off the missing lanes
+        int remaining = count - k;
+        __mmask8 lanes = remaining >= 8 ? (__mmask8)0xFF : (__mmask8)((1u << remaining) - 1);
+        __m256i index = _mm512_castsi512_si256(_mm512_maskz_loadu_epi32((__mmask16)lanes, list + k));
+        __m512d x = _mm512_sub_pd(_mm512_mask_i32gather_pd(zero, lanes, index, array->x, 8), xi);
+        __m512d y = _mm512_sub_pd(_mm512_mask_i32gather_pd(zero, lanes, index, array->y, 8), yi);
+        __m512d z = _mm512_sub_pd(_mm512_mask_i32gather_pd(zero, lanes, index, array->z, 8), zi);
+        x = _mm512_fnmadd_pd(box, _mm512_roundscale_pd(_mm512_mul_pd(x, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), x);
+        y = _mm512_fnmadd_pd(box, _mm512_roundscale_pd(_mm512_mul_pd(y, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), y);
+        z = _mm512_fnmadd_pd(box, _mm512_roundscale_pd(_mm512_mul_pd(z, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), z);
+        __m512d dist = _mm512_fmadd_pd(z, z, _mm512_fmadd_pd(y, y, _mm512_mul_pd(x, x)));
+        __mmask8 inside = _mm512_mask_cmp_pd_mask(lanes, dist, cutoff2, _CMP_LT_OQ);
+        if (inside == 0) {
+            continue;
+        }
+        PROFILE_COUNT(PROFILE_PAIRS_INSIDE, __builtin_popcount(inside));
+        __m512d inv2 = _mm512_maskz_div_pd(inside, one, dist);
+        __m512d inv6 = _mm512_mul_pd(_mm512_mul_pd(inv2, inv2), inv2);
+        __m512d inv8 = _mm512_mul_pd(inv6, inv2);
+        __m512d multiplier = _mm512_mul_pd(_mm512_mul_pd(twenty_four, inv8), _mm512_fnmadd_pd(two, inv6, one));
+        __m512d pair_energy = _mm512_fmsub_pd(four, _mm512_fmsub_pd(inv6, inv6, inv6), shift);
+        if (SPLIT) {
+            __m512d t = _mm512_mul_pd(_mm512_sub_pd(_mm512_sqrt_pd(dist), switch_start), switch_inv_width);
+            t = _mm512_min_pd(_mm512_max_pd(t, zero), one);
+            __m512d s = _mm512_fnmadd_pd(_mm512_mul_pd(t, t), _mm512_fnmadd_pd(two, t, three), one);
+            __m512d weight = _mm512_fmadd_pd(weight_switch, s, weight_full);
+            multiplier = _mm512_mul_pd(multiplier, weight);
+            pair_energy = _mm512_mul_pd(pair_energy, weight);
+        }
+        energy = _mm512_mask_add_pd(energy, inside, energy, pair_energy);
+        __m512d px = _mm512_mul_pd(x, multiplier);
+        __m512d py = _mm512_mul_pd(y, multiplier);
+        __m512d pz = _mm512_mul_pd(z, multiplier);
+        fx = _mm512_add_pd(fx, px);
+        fy = _mm512_add_pd(fy, py);
+        fz = _mm512_add_pd(fz, pz);
+        // partners in one list are distinct, so the scatter cannot collide with itself
+        __m512d partner = _mm512_mask_i32gather_pd(zero, inside, index, partner_force->x, 8);
+        _mm512_mask_i32scatter_pd(partner_force->x, inside, index, _mm512_sub_pd(partner, px), 8);
+        partner = _mm512_mask_i32gather_pd(zero, inside, index, partner_force->y, 8);
+        _mm512_mask_i32scatter_pd(partner_force->y, inside, index, _mm512_sub_pd(partner, py), 8);
+        partner = _mm512_mask_i32gather_pd(zero, inside, index, partner_force->z, 8);
+        _mm512_mask_i32scatter_pd(partner_force->z, inside, index, _mm512_sub_pd(partner, pz), 8);
+    }
+    force_i[0] += _mm512_reduce_add_pd(fx);
+    force_i[1] += _mm512_reduce_add_pd(fy);
+    force_i[2] += _mm512_reduce_add_pd(fz);
+    return _mm512_reduce_add_pd(energy);
+}
+
+// The SIMD table kernels gather the 8 coefficients of every lane's interval,
+// which all sit in the one cache line of that interval.
+__attribute__((target("avx2,fma")))
+static double table_kernel_avx2(const lj_setup *setup, const coords *array, int i,
+                                const int *list, int count, coords *partner_force, double *force_i) {
+    const pair_table *table = setup->table;
+    const __m256d xi = _mm256_set1_pd(array->x[i]);
+    const __m256d yi = _mm256_set1_pd(array->y[i]);
+    const __m256d zi = _mm256_set1_pd(array->z[i]);
+    const __m256d box = _mm256_set1_pd(setup->box);
+    const __m256d inv_box = _mm256_set1_pd(setup->inv_box);
+    const __m256d cutoff2 = _mm256_set1_pd(setup->cutoff2);
+    const __m256d s_min = _mm256_set1_pd(table->s_min);
+    const __m256d inv_h = _mm256_set1_pd(table->inv_h);
+    const __m128i last = _mm_set1_epi32(table->intervals - 1);
+    const __m256d zero = _mm256_setzero_pd();
+    const double *c = table->coefficients;
+    __m256d fx = _mm256_setzero_pd();
+    __m256d fy = _mm256_setzero_pd();
+    __m256d fz = _mm256_setzero_pd();
+    __m256d energy = _mm256_setzero_pd();
+    int k = 0;
+    for (; k + 4 <= count; k += 4) {
+        __m128i index = _mm_loadu_si128((const __m128i*)(list + k));
+        __m256d x = _mm256_sub_pd(_mm256_i32gather_pd(array->x, index, 8), xi);
+        __m256d y = _mm256_sub_pd(_mm256_i32gather_pd(array->y, index, 8), yi);
+        __m256d z = _mm256_sub_pd(_mm256_i32gather_pd(array->z, index, 8), zi);
+        x = _mm256_fnmadd_pd(box, _mm256_round_pd(_mm256_mul_pd(x, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), x);
+        y = _mm256_fnmadd_pd(box, _mm256_round_pd(_mm256_mul_pd(y, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), y);
+        z = _mm256_fnmadd_pd(box, _mm256_round_pd(_mm256_mul_pd(z, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), z);
+        __m256d dist = _mm256_fmadd_pd(z, z, _mm256_fmadd_pd(y, y, _mm256_mul_pd(x, x)));
+        __m256d inside = _mm256_cmp_pd(dist, cutoff2, _CMP_LT_OQ);
+        if (_mm256_movemask_pd(inside) == 0) {
+            continue;
+        }
+        PROFILE_COUNT(PROFILE_PAIRS_INSIDE, __builtin_popcount(_mm256_movemask_pd(inside)));
+        __m256d u = _mm256_mul_pd(_mm256_max_pd(_mm256_sub_pd(dist, s_min), zero), inv_h);
+        __m128i interval = _mm_min_epi32(_mm256_cvttpd_epi32(_mm256_and_pd(inside, u)), last);
+        __m256d t = _mm256_sub_pd(u, _mm256_cvtepi32_pd(interval));
+        __m128i offset = _mm_slli_epi32(interval, 3);
+        __m256d e0 = _mm256_mask_i32gather_pd(zero, c + 0, offset, inside, 8);
+        __m256d e1 = _mm256_mask_i32gather_pd(zero, c + 1, offset, inside, 8);
+        __m256d e2 = _mm256_mask_i32gather_pd(zero, c + 2, offset, inside, 8);
+        __m256d e3 = _mm256_mask_i32gather_pd(zero, c + 3, offset, inside, 8);
+        __m256d m0 = _mm256_mask_i32gather_pd(zero, c + 4, offset, inside, 8);
+        __m256d m1 = _mm256_mask_i32gather_pd(zero, c + 5, offset, inside, 8);
+        __m256d m2 = _mm256_mask_i32gather_pd(zero, c + 6, offset, inside, 8);
+        __m256d m3 = _mm256_mask_i32gather_pd(zero, c + 7, offset, inside, 8);
+        __m256d pair_energy = _mm256_fmadd_pd(t, _mm256_fmadd_pd(t, _mm256_fmadd_pd(t, e3, e2), e1), e0);
+        __m256d multiplier = _mm256_fmadd_pd(t, _mm256_fmadd_pd(t, _mm256_fmadd_pd(t, m3, m2), m1), m0);
+        multiplier = _mm256_and_pd(inside, multiplier);
+        energy = _mm256_add_pd(energy, _mm256_and_pd(inside, pair_energy));
+        __m256d px = _mm256_mul_pd(x, multiplier);
+        __m256d py = _mm256_mul_pd(y, multiplier);
+        __m256d pz = _mm256_mul_pd(z, multiplier);
+        fx = _mm256_add_pd(fx, px);
+        fy = _mm256_add_pd(fy, py);
+        fz = _mm256_add_pd(fz, pz);
+        double lane_x[4], lane_y[4], lane_z[4];
+        _mm256_storeu_pd(lane_x, px);
+        _mm256_storeu_pd(lane_y, py);
+        _mm256_storeu_pd(lane_z, pz);
+        for (int l = 0; l < 4; l++) {
+            int j = list[k + l];
+            partner_force->x[j] -= lane_x[l];
+            partner_force->y[j] -= lane_y[l];
+            partner_force->z[j] -= lane_z[l];
+        }
+    }
+    double force_x = horizontal_sum(fx);
+    double force_y = horizontal_sum(fy);
+    double force_z = horizontal_sum(fz);
+    double total_energy = horizontal_sum(energy);
+    for (; k < count; k++) {
+        total_energy += table_pair(setup, array, i, list[k], partner_force, &force_x, &force_y, &force_z);
+    }
+    force_i[0] += force_x;
+    force_i[1] += force_y;
+    force_i[2] += force_z;
+    return total_energy;
+}
+
+// rows r[0..7] of an 8 x 8 matrix of doubles into its columns c0..c7
+__attribute__((target("avx512f")))
+static inline void transpose_8x8(const __m512d *r, __m512d *c0, __m512d *c1, __m512d *c2, __m512d *c3,
+                                 __m512d *c4, __m512d *c5, __m512d *c6, __m512d *c7) {
+    // pairs of rows interleaved: t0 = r0[0] r1[0] r0[2] r1[2] ...
+    __m512d t0 = _mm512_unpacklo_pd(r[0], r[1]), t1 = _mm512_unpackhi_pd(r[0], r[1]);
+    __m512d t2 = _mm512_unpacklo_pd(r[2], r[3]), t3 = _mm512_unpackhi_pd(r[2], r[3]);
+    __m512d t4 = _mm512_unpacklo_pd(r[4], r[5]), t5 = _mm512_unpackhi_pd(r[4], r[5]);
+    __m512d t6 = _mm512_unpacklo_pd(r[6], r[7]), t7 = _mm512_unpackhi_pd(r[6], r[7]);
+    // 128-bit blocks: u0 = r0[0] r1[0] r2[0] r3[0] r0[4] r1[4] r2[4] r3[4]
+    __m512d u0 = _mm512_permutex2var_pd(t0, _mm512_set_epi64(13, 12, 5, 4, 9, 8, 1, 0), t2);
+    __m512d u1 = _mm512_permutex2var_pd(t1, _mm512_set_epi64(13, 12, 5, 4, 9, 8, 1, 0), t3);
+    __m512d u2 = _mm512_permutex2var_pd(t0, _mm512_set_epi64(15, 14, 7, 6, 11, 10, 3, 2), t2);
+    __m512d u3 = _mm512_permutex2var_pd(t1, _mm512_set_epi64(15, 14, 7, 6, 11, 10, 3, 2), t3);
+    __m512d u4 = _mm512_permutex2var_pd(t4, _mm512_set_epi64(13, 12, 5, 4, 9, 8, 1, 0), t6);
+    __m512d u5 = _mm512_permutex2var_pd(t5, _mm512_set_epi64(13, 12, 5, 4, 9, 8, 1, 0), t7);
+    __m512d u6 = _mm512_permutex2var_pd(t4, _mm512_set_epi64(15, 14, 7, 6, 11, 10, 3, 2), t6);
+    __m512d u7 = _mm512_permutex2var_pd(t5, _mm512_set_epi64(15, 14, 7, 6, 11, 10, 3, 2), t7);
+    // 256-bit halves: columns
+    *c0 = _mm512_shuffle_f64x2(u0, u4, 0x44);
+    *c1 = _mm512_shuffle_f64x2(u1, u5, 0x44);
+    *c2 = _mm512_shuffle_f64x2(u2, u6, 0x44);
+    *c3 = _mm512_shuffle_f64x2(u3, u7, 0x44);
+    *c4 = _mm512_shuffle_f64x2(u0, u4, 0xEE);
+    *c5 = _mm512_shuffle_f64x2(u1, u5, 0xEE);
+    *c6 = _mm512_shuffle_f64x2(u2, u6, 0xEE);
+    *c7 = _mm512_shuffle_f64x2(u3, u7, 0xEE);
+}
+
+__attribute__((target("avx512f")))
+static double table_kernel_avx512(const lj_setup *setup, const coords *array, int i,
+                                  const int *list, int count, coords *partner_force, double *force_i) {
+    const pair_table *table = setup->table;
+    const __m512d xi = _mm512_set1_pd(array->x[i]);
+    const __m512d yi = _mm512_set1_pd(array->y[i]);
+    const __m512d zi = _mm512_set1_pd(array->z[i]);
+    const __m512d box = _mm512_set1_pd(setup->box);
+    const __m512d inv_box = _mm512_set1_pd(setup->inv_box);
+    const __m512d cutoff2 = _mm512_set1_pd(setup->cutoff2);
+    const __m512d s_min = _mm512_set1_pd(table->s_min);
+    const __m512d inv_h = _mm512_set1_pd(table->inv_h);
+    const __m256i last = _mm256_set1_epi32(table->intervals - 1);
+    const __m512d zero = _mm512_setzero_pd();
+    const double *c = table->coefficients;
+    __m512d fx = zero;
+    __m512d fy = zero;
+    __m512d fz = zero;
+    __m512d energy = zero;
+    for (int k = 0; k < count; k += 8) {
+        int remaining = count - k;
+        __mmask8 lanes = remaining >= 8 ? (__mmask8)0xFF : (__mmask8)((1u << remaining) - 1);
+        __m256i index = _mm512_castsi512_si256(_mm512_maskz_loadu_epi32((__mmask16)lanes, list + k));
+        __m512d x = _mm512_sub_pd(_mm512_mask_i32gather_pd(zero, lanes, index, array->x, 8), xi);
+        __m512d y = _mm512_sub_pd(_mm512_mask_i32gather_pd(zero, lanes, index, array->y, 8), yi);
+        __m512d z = _mm512_sub_pd(_mm512_mask_i32gather_pd(zero, lanes, index, array->z, 8), zi);
+        x = _mm512_fnmadd_pd(box, _mm512_roundscale_pd(_mm512_mul_pd(x, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), x);
+        y = _mm512_fnmadd_pd(box, _mm512_roundscale_pd(_mm512_mul_pd(y, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), y);
+        z = _mm512_fnmadd_pd(box, _mm512_roundscale_pd(_mm512_mul_pd(z, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), z);
+        __m512d dist = _mm512_fmadd_pd(z, z, _mm512_fmadd_pd(y, y, _mm512_mul_pd(x, x)));
+        __mmask8 inside = _mm512_mask_cmp_pd_mask(lanes, dist, cutoff2, _CMP_LT_OQ);
+        if (inside == 0) {
+            continue;
+        }
+        PROFILE_COUNT(PROFILE_PAIRS_INSIDE, __builtin_popcount(inside));
+        __m512d u = _mm512_maskz_mul_pd(inside, _mm512_max_pd(_mm512_sub_pd(dist, s_min), zero), inv_h);
+        __m256i interval = _mm256_min_epi32(_mm512_cvttpd_epi32(u), last);
+        __m512d t = _mm512_sub_pd(u, _mm512_cvtepi32_pd(interval));
+        // lanes outside the cutoff have u = 0, so every lane reads a valid interval:
+        // load each lane's cache line and transpose them into one vector per coefficient
+        int lane_interval[8];
+        _mm256_storeu_si256((__m256i*)lane_interval, interval);
+        __m512d row[8];
+        for (int l = 0; l < 8; l++) {
+            row[l] = _mm512_loadu_pd(c + (long)lane_interval[l] * PAIR_TABLE_STRIDE);
+        }
+        __m512d e0, e1, e2, e3, m0, m1, m2, m3;
+        transpose_8x8(row, &e0, &e1, &e2, &e3, &m0, &m1, &m2, &m3);
+        __m512d pair_energy = _mm512_fmadd_pd(t, _mm512_fmadd_pd(t, _mm512_fmadd_pd(t, e3, e2), e1), e0);
+        __m512d multiplier = _mm512_maskz_mov_pd(inside, _mm512_fmadd_pd(t, _mm512_fmadd_pd(t, _mm512_fmadd_pd(t, m3, m2), m1), m0));
+        energy = _mm512_mask_add_pd(energy, inside, energy, pair_energy);
+        __m512d px = _mm512_mul_pd(x, multiplier);
+        __m512d py = _mm512_mul_pd(y, multiplier);
+        __m512d pz = _mm512_mul_pd(z, multiplier);
+        fx = _mm512_add_pd(fx, px);
+        fy = _mm512_add_pd(fy, py);
+        fz = _mm512_add_pd(fz, pz);
+        __m512d partner = _mm512_mask_i32gather_pd(zero, inside, index, partner_force->x, 8);
+        _mm512_mask_i32scatter_pd(partner_force->x, inside, index, _mm512_sub_pd(partner, px), 8);
+        partner = _mm512_mask_i32gather_pd(zero, inside, index, partner_force->y, 8);
+        _mm512_mask_i32scatter_pd(partner_force->y, inside, index, _mm512_sub_pd(partner, py), 8);
+        partner = _mm512_mask_i32gather_pd(zero, inside, index, partner_force->z, 8);
+        _mm512_mask_i32scatter_pd(partner_force->z, inside, index, _mm512_sub_pd(partner, pz), 8);
+    }
+    force_i[0] += _mm512_reduce_add_pd(fx);
+    force_i[1] += _mm512_reduce_add_pd(fy);
+    force_i[2] += _mm512_reduce_add_pd(fz);
+    return _mm512_reduce_add_pd(energy);
+}
+
+// both halves of 8 floats widened to double and added
+__attribute__((target("avx2,fma")))
+static inline __m256d widened_sum(__m256 v) {
+    return _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+}
+
+// The mixed-precision kernels run the pair math of 8 (AVX2) or 16 (AVX-512) pairs
+// per vector in float and widen the products to double before any sum.
+template <bool SPLIT>
+__attribute__((target("avx2,fma")))
+static double mixed_kernel_avx2(const lj_setup *setup, const coords *array, int i,
+                                const int *list, int count, coords *partner_force, double *force_i) {
+    const coords_single *single = setup->single;
+    const __m256 xi = _mm256_set1_ps(single->x[i]);
+    const __m256 yi = _mm256_set1_ps(single->y[i]);
+    const __m256 zi = _mm256_set1_ps(single->z[i]);
+    const __m256 box = _mm256_set1_ps((float)setup->box);
+    const __m256 inv_box = _mm256_set1_ps((float)setup->inv_box);
+    const __m256 cutoff2 = _mm256_set1_ps((float)setup->cutoff2);
+    const __m256 shift = _mm256_set1_ps((float)setup->shift);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 two = _mm256_set1_ps(2.0f);
+    const __m256 three = _mm256_set1_ps(3.0f);
+    const __m256 four = _mm256_set1_ps(4.0f);
+    const __m256 twenty_four = _mm256_set1_ps(24.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 weight_full = _mm256_set1_ps((float)setup->weight_full);
+    const __m256 weight_switch = _mm256_set1_ps((float)setup->weight_switch);
+    const __m256 switch_start = _mm256_set1_ps((float)setup->switch_start);
+    const __m256 switch_inv_width = _mm256_set1_ps((float)setup->switch_inv_width);
+    __m256d fx = _mm256_setzero_pd();
+    __m256d fy = _mm256_setzero_pd();
+    __m256d fz = _mm256_setzero_pd();
+    __m256d energy = _mm256_setzero_pd();
+    int k = 0;
+    for (; k + 8 <= count; k += 8) {
+        __m256i index = _mm256_loadu_si256((const __m256i*)(list + k));
+        __m256 x = _mm256_sub_ps(_mm256_i32gather_ps(single->x, index, 4), xi);
+        __m256 y = _mm256_sub_ps(_mm256_i32gather_ps(single->y, index, 4), yi);
+        __m256 z = _mm256_sub_ps(_mm256_i32gather_ps(single->z, index, 4), zi);
+        x = _mm256_fnmadd_ps(box, _mm256_round_ps(_mm256_mul_ps(x, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), x);
+        y = _mm256_fnmadd_ps(box, _mm256_round_ps(_mm256_mul_ps(y, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), y);
+        z = _mm256_fnmadd_ps(box, _mm256_round_ps(_mm256_mul_ps(z, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), z);
+        __m256 dist = _mm256_fmadd_ps(z, z, _mm256_fmadd_ps(y, y, _mm256_mul_ps(x, x)));
+        __m256 inside = _mm256_cmp_ps(dist, cutoff2, _CMP_LT_OQ);
+        if (_mm256_movemask_ps(inside) == 0) {
+            continue;
+        }
+        PROFILE_COUNT(PROFILE_PAIRS_INSIDE, __builtin_popcount(_mm256_movemask_ps(inside)));
+        __m256 inv2 = _mm256_div_ps(one, dist);
+        __m256 inv6 = _mm256_mul_ps(_mm256_mul_ps(inv2, inv2), inv2);
+        __m256 inv8 = _mm256_mul_ps(inv6, inv2);
+        __m256 multiplier = _mm256_mul_ps(_mm256_mul_ps(twenty_four, inv8), _mm256_fnmadd_ps(two, inv6, one));
+        __m256 pair_energy = _mm256_fmsub_ps(four, _mm256_fmsub_ps(inv6, inv6, inv6), shift);
+        if (SPLIT) {
+            __m256 t = _mm256_mul_ps(_mm256_sub_ps(_mm256_sqrt_ps(dist), switch_start), switch_inv_width);
+            t = _mm256_min_ps(_mm256_max_ps(t, zero), one);
+            __m256 s = _mm256_fnmadd_ps(_mm256_mul_ps(t, t), _mm256_fnmadd_ps(two, t, three), one);
+            __m256 weight = _mm256_fmadd_ps(weight_switch, s, weight_full);
+            multiplier = _mm256_mul_ps(multiplier, weight);
+            pair_energy = _mm256_mul_ps(pair_energy, weight);
+        }
+        multiplier = _mm256_and_ps(inside, multiplier);
+        energy = _mm256_add_pd(energy, widened_sum(_mm256_and_ps(inside, pair_energy)));
+        __m256 px = _mm256_mul_ps(x, multiplier);
+        __m256 py = _mm256_mul_ps(y, multiplier);
+        __m256 pz = _mm256_mul_ps(z, multiplier);
+        fx = _mm256_add_pd(fx, widened_sum(px));
+        fy = _mm256_add_pd(fy, widened_sum(py));
+        fz = _mm256_add_pd(fz, widened_sum(pz));
+        float lane_x[8], lane_y[8], lane_z[8];
+        _mm256_storeu_ps(lane_x, px);
+        _mm256_storeu_ps(lane_y, py);
+        _mm256_storeu_ps(lane_z, pz);
+        for (int l = 0; l < 8; l++) {
+            int j = list[k + l];
+            partner_force->x[j] -= lane_x[l];
+            partner_force->y[j] -= lane_y[l];
+            partner_force->z[j] -= lane_z[l];
+        }
+    }
+    double force_x = horizontal_sum(fx);
+    double force_y = horizontal_sum(fy);
+    double force_z = horizontal_sum(fz);
+    double total_energy = horizontal_sum(energy);
+    for (; k < count; k++) {
+        total_energy += mixed_pair<SPLIT>(setup, i, list[k], partner_force, &force_x, &force_y, &force_z);
+    }
+    force_i[0] += force_x;
+    force_i[1] += force_y;
+    force_i[2] += force_z;
+    return total_energy;
+}
+
+__attribute__((target("avx512f")))
+static inline __m512d low_half_pd(__m512 v) {
+    return _mm512_cvtps_pd(_mm512_castps512_ps256(v));
+}
+
+__attribute__((target("avx512f")))
+static inline __m512d high_half_pd(__m512 v) {
+    return _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1)));
+}
+
+__attribute__((target("avx512f")))
+static inline void subtract_from_partners(double *partner_force, __mmask8 mask, __m256i index, __m512d value) {
+    __m512d partner = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), mask, index, partner_force, 8);
+    _mm512_mask_i32scatter_pd(partner_force, mask, index, _mm512_sub_pd(partner, value), 8);
+}
+
+template <bool SPLIT>
+__attribute__((target("avx512f")))
+static double mixed_kernel_avx512(const lj_setup *setup, const coords *array, int i,
+                                  const int *list, int count, coords *partner_force, double *force_i) {
+    const coords_single *single = setup->single;
+    const __m512 xi = _mm512_set1_ps(single->x[i]);
+    const __m512 yi = _mm512_set1_ps(single->y[i]);
+    const __m512 zi = _mm512_set1_ps(single->z[i]);
+    const __m512 box = _mm512_set1_ps((float)setup->box);
+    const __m512 inv_box = _mm512_set1_ps((float)setup->inv_box);
+    const __m512 cutoff2 = _mm512_set1_ps((float)setup->cutoff2);
+    const __m512 shift = _mm512_set1_ps((float)setup->shift);
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512 two = _mm512_set1_ps(2.0f);
+    const __m512 three = _mm512_set1_ps(3.0f);
+    const __m512 four = _mm512_set1_ps(4.0f);
+    const __m512 twenty_four = _mm512_set1_ps(24.0f);
+    const __m512 zero = _mm512_setzero_ps();
+    const __m512 weight_full = _mm512_set1_ps((float)setup->weight_full);
+    const __m512 weight_switch = _mm512_set1_ps((float)setup->weight_switch);
+    const __m512 switch_start = _mm512_set1_ps((float)setup->switch_start);
+    const __m512 switch_inv_width = _mm512_set1_ps((float)setup->switch_inv_width);
+    __m512d fx = _mm512_setzero_pd();
+    __m512d fy = _mm512_setzero_pd();
+    __m512d fz = _mm512_setzero_pd();
+    __m512d energy = _mm512_setzero_pd();
+    for (int k = 0; k < count; k += 16) {
+        int remaining = count - k;
+        __mmask16 lanes = remaining >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << remaining) - 1);
+        __m512i index = _mm512_maskz_loadu_epi32(lanes, list + k);
+        __m512 x = _mm512_sub_ps(_mm512_mask_i32gather_ps(zero, lanes, index, single->x, 4), xi);
+        __m512 y = _mm512_sub_ps(_mm512_mask_i32gather_ps(zero, lanes, index, single->y, 4), yi);
+        __m512 z = _mm512_sub_ps(_mm512_mask_i32gather_ps(zero, lanes, index, single->z, 4), zi);
+        x = _mm512_fnmadd_ps(box, _mm512_roundscale_ps(_mm512_mul_ps(x, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), x);
+        y = _mm512_fnmadd_ps(box, _mm512_roundscale_ps(_mm512_mul_ps(y, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), y);
+        z = _mm512_fnmadd_ps(box, _mm512_roundscale_ps(_mm512_mul_ps(z, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), z);
+        __m512 dist = _mm512_fmadd_ps(z, z, _mm512_fmadd_ps(y, y, _mm512_mul_ps(x, x)));
+        __mmask16 inside = _mm512_mask_cmp_ps_mask(lanes, dist, cutoff2, _CMP_LT_OQ);
+        if (inside == 0) {
+            continue;
+        }
+        PROFILE_COUNT(PROFILE_PAIRS_INSIDE, __builtin_popcount(inside));
+        __m512 inv2 = _mm512_maskz_div_ps(inside, one, dist);
+        __m512 inv6 = _mm512_mul_ps(_mm512_mul_ps(inv2, inv2), inv2);
+        __m512 inv8 = _mm512_mul_ps(inv6, inv2);
+        __m512 multiplier = _mm512_mul_ps(_mm512_mul_ps(twenty_four, inv8), _mm512_fnmadd_ps(two, inv6, one));
+        __m512 pair_energy = _mm512_fmsub_ps(four, _mm512_fmsub_ps(inv6, inv6, inv6), shift);
+        if (SPLIT) {
+            __m512 t = _mm512_mul_ps(_mm512_sub_ps(_mm512_sqrt_ps(dist), switch_start), switch_inv_width);
+            t = _mm512_min_ps(_mm512_max_ps(t, zero), one);
+            __m512 s = _mm512_fnmadd_ps(_mm512_mul_ps(t, t), _mm512_fnmadd_ps(two, t, three), one);
+            __m512 weight = _mm512_fmadd_ps(weight_switch, s, weight_full);
+            multiplier = _mm512_mul_ps(multiplier, weight);
+            pair_energy = _mm512_mul_ps(pair_energy, weight);
+        }
+        pair_energy = _mm512_maskz_mov_ps(inside, pair_energy);
+        energy = _mm512_add_pd(energy, _mm512_add_pd(low_half_pd(pair_energy), high_half_pd(pair_energy)));
+        // lanes outside the cutoff have inv2 = 0 and so no force
+        __m512 px = _mm512_mul_ps(x, multiplier);
+        __m512 py = _mm512_mul_ps(y, multiplier);
+        __m512 pz = _mm512_mul_ps(z, multiplier);
+        __m512d px_low = low_half_pd(px), px_high = high_half_pd(px);
+        __m512d py_low = low_half_pd(py), py_high = high_half_pd(py);
+        __m512d pz_low = low_half_pd(pz), pz_high = high_half_pd(pz);
+        fx = _mm512_add_pd(fx, _mm512_add_pd(px_low, px_high));
+        fy = _mm512_add_pd(fy, _mm512_add_pd(py_low, py_high));
+        fz = _mm512_add_pd(fz, _mm512_add_pd(pz_low, pz_high));
+        // the reaction forces are double, so they are scattered 8 lanes at a time
+        __mmask8 inside_low = (__mmask8)inside;
+        __mmask8 inside_high = (__mmask8)(inside >> 8);
+        __m256i index_low = _mm512_castsi512_si256(index);
+        __m256i index_high = _mm512_extracti64x4_epi64(index, 1);
+        subtract_from_partners(partner_force->x, inside_low, index_low, px_low);
+        subtract_from_partners(partner_force->y, inside_low, index_low, py_low);
+        subtract_from_partners(partner_force->z, inside_low, index_low, pz_low);
+        if (inside_high != 0) {
+            subtract_from_partners(partner_force->x, inside_high, index_high, px_high);
+            subtract_from_partners(partner_force->y, inside_high, index_high, py_high);
+            subtract_from_partners(partner_force->z, inside_high, index_high, pz_high);
+        }
+    }
+    force_i[0] += _mm512_reduce_add_pd(fx);
+    force_i[1] += _mm512_reduce_add_pd(fy);
+    force_i[2] += _mm512_reduce_add_pd(fz);
+    return _mm512_reduce_add_pd(energy);
+}
+
+int best_lj_isa() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return LJ_ISA_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return LJ_ISA_AVX2;
+    }
+    return LJ_ISA_SCALAR;
+}
+
+template <int RC_TENTHS, bool SPLIT>
+static lj_kernel kernel_instance(int isa) {
+    if (isa == LJ_ISA_AVX512) {
+        return lj_kernel_avx512<RC_TENTHS, SPLIT>;
+    }
+    if (isa == LJ_ISA_AVX2) {
+        return lj_kernel_avx2<RC_TENTHS, SPLIT>;
+    }
+    return lj_kernel_scalar<RC_TENTHS, SPLIT>;
+}
+
+static lj_kernel table_instance(int isa) {
+    if (isa == LJ_ISA_AVX512) {
+        return table_kernel_avx512;
+    }
+    if (isa == LJ_ISA_AVX2) {
+        return table_kernel_avx2;
+    }
+    return table_kernel_scalar;
+}
+
+template <bool SPLIT>
+static lj_kernel mixed_instance(int isa) {
+    if (isa == LJ_ISA_AVX512) {
+        return mixed_kernel_avx512<SPLIT>;
+    }
+    if (isa == LJ_ISA_AVX2) {
+        return mixed_kernel_avx2<SPLIT>;
+    }
+    return mixed_kernel_scalar<SPLIT>;
+}
+
+#else
+
+int best_lj_isa() {
+    return LJ_ISA_SCALAR;
+}
+
+template <int RC_TENTHS, bool SPLIT>
+static lj_kernel kernel_instance(int isa) {
+    return lj_kernel_scalar<RC_TENTHS, SPLIT>;
+}
+
+static lj_kernel table_instance(int isa) {
+    return table_kernel_scalar;
+}
+
+template <bool SPLIT>
+static lj_kernel mixed_instance(int isa) {
+    return mixed_kernel_scalar<SPLIT>;
+}
+
+#endif
+
+const char *lj_isa_names[] = { "scalar", "avx2", "avx512" };
+
+// the setup matches a bucket only if the folded constants are exactly its own
+template <int RC_TENTHS>
+static bool in_cutoff_bucket(const lj_setup *setup) {
+    return setup->cutoff2 == kernel_cutoff2<RC_TENTHS>(setup) && setup->shift == kernel_shift<RC_TENTHS>(setup);
+}
+
+template <bool SPLIT>
+static lj_kernel bucket_instance(const lj_setup *setup, int isa, bool generic, const char **bucket) {
+    if (!generic && in_cutoff_bucket<25>(setup)) {
+        *bucket = "rc 2.5";
+        return kernel_instance<25, SPLIT>(isa);
+    }
+    if (!generic && in_cutoff_bucket<30>(setup)) {
+        *bucket = "rc 3.0";
+        return kernel_instance<30, SPLIT>(isa);
+    }
+    *bucket = "generic rc";
+    return kernel_instance<0, SPLIT>(isa);
+}
+
+void select_lj_kernel(lj_setup *setup, int isa, bool generic) {
+    const char *bucket;
+    bool split = setup->weight_switch != 0;
+    if (setup->table != NULL) {
+        setup->kernel = table_instance(isa);
+        snprintf(setup->kernel_name, sizeof(setup->kernel_name), "%s, table of %d intervals%s",
+            lj_isa_names[isa], setup->table->intervals, split ? ", switched" : "");
+        return;
+    }
+    if (setup->single != NULL) {
+        setup->kernel = split ? mixed_instance<true>(isa) : mixed_instance<false>(isa);
+        snprintf(setup->kernel_name, sizeof(setup->kernel_name), "%s, mixed precision, generic rc%s",
+            lj_isa_names[isa], split ? ", switched" : "");
+        return;
+    }
+    if (split) {
+        setup->kernel = bucket_instance<true>(setup, isa, generic, &bucket);
+    } else {
+        setup->kernel = bucket_instance<false>(setup, isa, generic, &bucket);
+    }
+    snprintf(setup->kernel_name, sizeof(setup->kernel_name), "%s, %s%s",
+        lj_isa_names[isa], bucket, split ? ", switched" : "");
+}
+
+#ifdef KERNEL_BENCH
+
+// The pair loop as it was before the SoA layout: AoS particles, recursive
+// fast_pow and four divisions per pair. Kept only as the speedup baseline
+// and as the reference the other kernels are checked against.
+struct bench_dim {
+    double x;
+    double y;
+    double z;
+};
+
+static double bench_fast_pow(double a, int n) {
+    if (n == 0)
+        return 1;
+    if (n % 2 == 1)
+        return bench_fast_pow(a, n - 1) * a;
+    else {
+        double b = bench_fast_pow(a, n / 2);
+        return b * b;
+    }
+}
+
+static double lj_kernel_legacy(const lj_setup *setup, const bench_dim *array, int i,
+                               const int *list, int count, bench_dim *partner_force, double *force_i) {
+    double force_x = 0, force_y = 0, force_z = 0;
+    double energy = 0;
+    for (int k = 0; k < count; k++) {
+        int j = list[k];
+        double x = array[j].x - array[i].x;
+        double y = array[j].y - array[i].y;
+        double z = array[j].z - array[i].z;
+        x -= setup->box * round(x / setup->box);
+        y -= setup->box * round(y / setup->box);
+        z -= setup->box * round(z / setup->box);
+        double dist = x * x + y * y + z * z;
+        if (dist >= setup->cutoff2) {
+            continue;
+        }
+        double r6 = bench_fast_pow(dist, 3);
+        double r12 = r6 * r6;
+        double r8 = r6 * dist;
+        double r14 = r12 * dist;
+        double multiplier = (24 * (1 / r8 - 2 / r14));
+        force_x += x * multiplier;
+        force_y += y * multiplier;
+        force_z += z * multiplier;
+        partner_force[j].x -= x * multiplier;
+        partner_force[j].y -= y * multiplier;
+        partner_force[j].z -= z * multiplier;
+        energy += 4 * (1 / r12 - 1 / r6) - setup->shift;
+    }
+    force_i[0] += force_x;
+    force_i[1] += force_y;
+    force_i[2] += force_z;
+    return energy;
+}
+
+// Times every kernel on one thread over the half lists of a jittered lattice
+// at liquid density and prints the cost per listed pair.
+void benchmark_lj_kernels() {
+    const int side = 24;
+    const int count = side * side * side;
+    const double density = 0.8;
+    const int repetitions = 20;
+    double box = cbrt(count / density);
+    double spacing = box / side;
+    lj_setup setup = make_lj_setup(rc, box);
+
+    coords array = alloc_coords(count);
+    bench_dim *aos = (bench_dim*)malloc(sizeof(bench_dim) * count);
+    srand(12345);
+    for (int n = 0; n < count; n++) {
+        int ix = n % side, iy = (n / side) % side, iz = n / (side * side);
+        array.x[n] = (ix + 0.2 * rand() / RAND_MAX) * spacing - box / 2;
+        array.y[n] = (iy + 0.2 * rand() / RAND_MAX) * spacing - box / 2;
+        array.z[n] = (iz + 0.2 * rand() / RAND_MAX) * spacing - box / 2;
+        aos[n] = { array.x[n], array.y[n], array.z[n] };
+    }
+
+    // half lists within rc + skin, built by brute force once
+    double list_cutoff = (rc + skin) * (rc + skin);
+    int *list_count = (int*)malloc(sizeof(int) * count);
+    int *list_start = (int*)malloc(sizeof(int) * (count + 1));
+    int capacity = count * 64;
+    int *list = (int*)malloc(sizeof(int) * capacity);
+    long pairs = 0;
+    for (int i = 0; i < count; i++) {
+        list_start[i] = pairs;
+        for (int j = i + 1; j < count; j++) {
+            double x = array.x[j] - array.x[i];
+            double y = array.y[j] - array.y[i];
+            double z = array.z[j] - array.z[i];
+            x -= box * round(x / box);
+            y -= box * round(y / box);
+            z -= box * round(z / box);
+            if (x * x + y * y + z * z < list_cutoff) {
+                if (pairs == capacity) {
+                    capacity *= 2;
+                    list = (int*)realloc(list, sizeof(int) * capacity);
+                }
+                list[pairs++] = j;
+            }
+        }
+        list_count[i] = pairs - list_start[i];
+    }
+    list_start[count] = pairs;
+
+    coords force = alloc_coords(count);
+    bench_dim *aos_force = (bench_dim*)malloc(sizeof(bench_dim) * count);
+    printf("LJ kernel benchmark: %d particles, %ld listed pairs, %.1f partners per half list\n",
+        count, pairs, (double)pairs / count);
+
+    // legacy baseline
+    double legacy_energy = 0;
+    double start = 0, legacy_time = 0;
+    for (int rep = -1; rep < repetitions; rep++) {
+        if (rep == 0) {
+            start = omp_get_wtime();
+        }
+        memset(aos_force, 0, sizeof(bench_dim) * count);
+        legacy_energy = 0;
+        for (int i = 0; i < count; i++) {
+            double force_i[3] = { 0, 0, 0 };
+            legacy_energy += lj_kernel_legacy(&setup, aos, i, list + list_start[i], list_count[i], aos_force, force_i);
+            aos_force[i].x += force_i[0];
+            aos_force[i].y += force_i[1];
+            aos_force[i].z += force_i[2];
+        }
+    }
+    legacy_time = (omp_get_wtime() - start) / repetitions;
+    double legacy_ns = legacy_time * 1e9 / pairs;
+    printf("%-40s %8.2f ns/pair  speedup %5.2fx  energy %.6f\n", "legacy", legacy_ns, 1.0, legacy_energy / count);
+
+    // every instruction set four times: the cutoff-bucket instance, the generic one,
+    // the table and mixed precision
+    lj_setup tabulated = setup;
+    tabulate_lj_setup(&tabulated, table_rmin, table_tolerance);
+    coords_single single = alloc_coords_single(count);
+    fill_coords_single(&single, &array, count, box);
+    lj_setup mixed = setup;
+    make_mixed_setup(&mixed, &single);
+    int best_isa = best_lj_isa();
+    for (int kernel = 0; kernel < 12; kernel++) {
+        int isa = kernel / 4;
+        if (isa > best_isa) {
+            printf("%-8s not supported by this CPU\n", lj_isa_names[isa]);
+            kernel += 3;
+            continue;
+        }
+        lj_setup instance = kernel % 4 == 2 ? tabulated : (kernel % 4 == 3 ? mixed : setup);
+        select_lj_kernel(&instance, isa, kernel % 4 == 1);
+        double energy = 0;
+        for (int rep = -1; rep < repetitions; rep++) {
+            if (rep == 0) {
+                start = omp_get_wtime();
+            }
+            memset(force.x, 0, sizeof(double) * count);
+            memset(force.y, 0, sizeof(double) * count);
+            memset(force.z, 0, sizeof(double) * count);
+            energy = 0;
+            for (int i = 0; i < count; i++) {
+                double force_i[3] = { 0, 0, 0 };
+                energy += instance.kernel(&instance, &array, i, list + list_start[i], list_count[i], &force, force_i);
+                force.x[i] += force_i[0];
+                force.y[i] += force_i[1];
+                force.z[i] += force_i[2];
+            }
+        }
+        double time = (omp_get_wtime() - start) / repetitions;
+        double max_error = 0;
+        for (int i = 0; i < count; i++) {
+            double error = fabs(force.x[i] - aos_force[i].x) + fabs(force.y[i] - aos_force[i].y) + fabs(force.z[i] - aos_force[i].z);
+            double norm = fabs(aos_force[i].x) + fabs(aos_force[i].y) + fabs(aos_force[i].z) + 1e-12;
+            if (error / norm > max_error) {
+                max_error = error / norm;
+            }
+        }
+        double ns = time * 1e9 / pairs;
+        printf("%-40s %8.2f ns/pair  speedup %5.2fx  energy %.6f  max rel force error %.1e\n",
+            instance.kernel_name, ns, legacy_ns / ns, energy / count, max_error);
+    }
+
+    free_lj_table(&tabulated);
+    free_coords_single(&single);
+    free_coords(&array);
+    free_coords(&force);
+    free(aos);
+    free(aos_force);
+    free(list);
+    free(list_start);
+    free(list_count);
+}
+
+#endif
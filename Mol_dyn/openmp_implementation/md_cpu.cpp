@@ -6,39 +6,188 @@
 #include <omp.h>
 #include <string.h>
 #include "parameters.h"
+#include "config.h"
+#include "lj_kernels.h"
+#include "scratch_arena.h"
+#include "trajectory.h"
+#include "snapshot.h"
+#define PROFILE_STORAGE
+#include "profile.h"
 
-#define NUM_THREADS 8
+double wrap_coordinate(double x);
+double minimum_image(double d);
+int cell_of(double x, double y, double z);
+void init_cell_list();
+void build_cell_list(coords *array);
+void free_cell_list();
+void init_verlet_list();
+void build_verlet_list(coords *array);
+bool verlet_list_outdated(coords *array);
+void free_verlet_list();
+void init_scratch_arenas();
+void free_scratch_arenas();
+void set_initial_state(coords *array, coords *velocity, coords *force);
+void restore_checkpoint(coords *array, coords *velocity);
+bool write_checkpoint(coords *array, coords *velocity, long step, double initial_energy, double max_deviation);
+void release_coords(coords *array);
+struct md_summary;
+md_summary md(coords *array, coords *velocity, coords *force);
+void use_mixed_precision();
+void validate_precision(coords *array, coords *velocity, coords *force);
+void sample_precision_error(coords *array, coords *force, double potential);
+double calculate_energy_force_lj(coords *array, coords *force, const lj_setup *setup);
+void motion(coords *array, coords *velocity, coords *force);
+void kick(coords *velocity, coords *force, double step);
+void drift(coords *array, coords *velocity, double step);
+double velocity_verlet_step(coords *array, coords *velocity, coords *force);
+double respa_step(coords *array, coords *velocity, coords *force);
+double kinetic_energy(coords *velocity);
 
-struct dim {
-    double x;
-    double y;
-    double z;
+lj_setup lj;
+// r-RESPA splits the potential at respa_switch_start..respa_switch_end into a
+// short-range part integrated every dt / respa_steps and a long-range part applied every dt
+lj_setup lj_inner;
+lj_setup lj_outer;
+coords force_long;
+
+// precision mixed evaluates the pairs in float on a wrapped float copy of the positions
+coords_single single_position;
+// precision validate keeps the double setups to recompute every mixed step with
+bool checking_precision = false;
+lj_setup lj_double;
+lj_setup lj_inner_double;
+lj_setup lj_outer_double;
+coords reference_force;
+coords reference_force_long;
+long precision_samples = 0;
+double force_error_rms_sum = 0;     // rms of |F_mixed - F_double| over the rms force, summed over the samples
+double force_error_max = 0;         // largest |F_mixed - F_double| of a particle over the rms force
+double energy_error_max = 0;        // largest relative error of the potential energy
+double precision_check_time = 0;
+
+// Linked-cell neighbor search: the box is split into cells of side >= rc + skin,
+// so every partner of a particle lies in its own cell or in one of the 26 around it.
+int cells_per_side;
+int cells_total;
+double cell_size;
+int *cell_head;             // first particle of each cell, -1 if the cell is empty
+int *cell_next;             // next particle in the same cell, -1 at the end
+int *cell_neighbors;        // up to 27 distinct neighbor cells per cell
+int *cell_neighbors_count;
+
+// Verlet neighbor lists: every particle keeps the partners j > i found within rc + skin,
+// so each pair is listed once, and the lists are rebuilt only once some particle
+// has moved more than skin / 2.
+int *verlet_list;           // partners of particle i start at verlet_list[i * verlet_capacity]
+int *verlet_count;
+int verlet_capacity;
+coords position_at_build;
+bool verlet_built = false;
+int verlet_rebuilds = 0;
+long verlet_total_length = 0;
+long verlet_length = 0;             // of the current lists
+long pair_visits = 0;               // listed pairs over all force evaluations
+
+// every OpenMP thread accumulates the +F / -F of its pairs in its own buffer,
+// carved each step out of the thread's scratch arena
+scratch_arena thread_arena[MAX_THREADS];
+coords thread_force[MAX_THREADS];
+
+long heap_allocations = 0;
+
+// Everything a resumed run needs besides the positions and velocities; forces and
+// neighbor lists are recomputed from the positions. The MD uses no random numbers.
+struct md_checkpoint {
+    int N;
+    int integrator;
+    double dt;
+    double box_size;
+    long step;              // steps completed
+    double initial_energy;
+    double max_deviation;
+    long verlet_rebuilds;
+    long verlet_total_length;
 };
-typedef struct dim dim;
+typedef struct md_checkpoint md_checkpoint;
 
-double square_dist(dim first, dim second);
-int nearest_image(dim* initial_array, dim* new_array, int particle_count, int particle);
-void set_initial_state(dim *array, dim *velocity, dim *force);
-double fast_pow(double a, int n);
-void md(dim *array, dim *velocity, dim *force);
-double calculate_energy_force_lj(dim *array, dim *force);
-void motion(dim *array, dim *velocity, dim *force);
+// a restart runs on positions and velocities inside the mapped checkpoint
+snapshot restart_snapshot;
+md_checkpoint resumed;
 
-double Urc = 4 * ( 1 / fast_pow(rc, 12) - 1 / fast_pow(rc, 6) );
+struct md_summary {
+    double initial_energy;
+    double final_energy;
+    double max_deviation;
+    double loop_time;
+};
+typedef struct md_summary md_summary;
 
-int main()
+int main(int argc, char **argv)
 {
     time_t t;
     time_t start_total_time = time(NULL);
     srand((unsigned)time(&t));
-    dim *r = (dim*)malloc(sizeof(dim) * N);
-    dim *v = (dim*)malloc(sizeof(dim) * N);
-    dim *f = (dim*)malloc(sizeof(dim) * N);
-    set_initial_state(r,v,f);
-    md(r,v,f);
-    free(r);
-    free(v);
-    free(f);
+    load_parameters(argc, argv);
+    #ifdef KERNEL_BENCH
+        benchmark_lj_kernels();
+        return 0;
+    #endif
+    lj = make_lj_setup(rc, box_size);
+    lj_inner = make_respa_setup(&lj, respa_switch_start, respa_switch_end, true);
+    lj_outer = make_respa_setup(&lj, respa_switch_start, respa_switch_end, false);
+    if (potential == POTENTIAL_TABLE) {
+        if (integrator == RESPA) {
+            tabulate_lj_setup(&lj_inner, table_rmin, table_tolerance);
+            tabulate_lj_setup(&lj_outer, table_rmin, table_tolerance);
+        } else {
+            tabulate_lj_setup(&lj, table_rmin, table_tolerance);
+        }
+    }
+    if (precision != PRECISION_DOUBLE) {
+        single_position = alloc_coords_single(N);
+    }
+    if (precision == PRECISION_MIXED) {
+        use_mixed_precision();
+    }
+    printf("N %d, rc %g, box %g\n", N, rc, box_size);
+    if (integrator == RESPA) {
+        printf("LJ pair kernels: %s / %s\n", lj_inner.kernel_name, lj_outer.kernel_name);
+    } else {
+        printf("LJ pair kernel: %s\n", lj.kernel_name);
+    }
+    coords r, v;
+    coords f = alloc_coords(N);
+    force_long = alloc_coords(N);
+    if (restart_path[0] != '\0') {
+        restore_checkpoint(&r, &v);
+    } else {
+        r = alloc_coords(N);
+        v = alloc_coords(N);
+        set_initial_state(&r,&v,&f);
+    }
+    init_cell_list();
+    init_verlet_list();
+    init_scratch_arenas();
+    if (precision == PRECISION_VALIDATE) {
+        validate_precision(&r,&v,&f);
+    } else {
+        md(&r,&v,&f);
+    }
+    free_scratch_arenas();
+    free_verlet_list();
+    free_cell_list();
+    release_coords(&r);
+    release_coords(&v);
+    free_coords(&f);
+    free_coords(&force_long);
+    if (precision != PRECISION_DOUBLE) {
+        free_coords_single(&single_position);
+    }
+    snapshot_unmap(&restart_snapshot);
+    free_lj_table(&lj);
+    free_lj_table(&lj_inner);
+    free_lj_table(&lj_outer);
+    PROFILE_REPORT(profile_trace);
     time_t end_total_time = time(NULL);
     printf("\nTotal execution time in seconds =  %f\n", difftime(end_total_time, start_total_time));
     return 0;
@@ -46,7 +195,7 @@ int main()
 
 /////// HELPER FUNCTIONS ///////
 
-void set_initial_state(dim *array, dim *velocity, dim *force) {
+void set_initial_state(coords *array, coords *velocity, coords *force) {
     int count = 0;
     for (double i = -(box_size - initial_dist_to_edge)/2; i < (box_size - initial_dist_to_edge)/2; i += initial_dist_by_one_axis) {
         for (double j = -(box_size - initial_dist_to_edge)/2; j < (box_size - initial_dist_to_edge)/2; j += initial_dist_by_one_axis) {
@@ -54,105 +203,573 @@ void set_initial_state(dim *array, dim *velocity, dim *force) {
                 if( count == N){
                     return; //it is not balanced grid but we can use it
                 }
-                array[count] = { i,j,l };
-                velocity[count] = { 0, 0, 0 };
-                force[count] = { 0, 0, 0 };
+                array->x[count] = i;
+                array->y[count] = j;
+                array->z[count] = l;
+                velocity->x[count] = velocity->y[count] = velocity->z[count] = 0;
+                force->x[count] = force->y[count] = force->z[count] = 0;
                 count++;
             }
         }
     }
     if( count < N ){
-        printf("error decrease initial_dist parameter, count is %ld  N is %ld \n", count, N);
+        printf("error decrease initial_dist parameter, count is %d  N is %d \n", count, N);
         exit(1);
     }
 }
 
-int nearest_image(dim* initial_array, dim* new_array, int particle_count, int particle) {
-    int count = 0;
-    for (int z_dif = -box_size; z_dif < box_size + 1; z_dif += box_size) {
-        for (int y_dif = -box_size; y_dif < box_size + 1; y_dif += box_size) {
-            for (int x_dif = -box_size; x_dif < box_size + 1; x_dif += box_size) {
-                for (int i = 0; i < particle_count; i++) {
-                    if (particle == i) {
+void restore_checkpoint(coords *array, coords *velocity) {
+    if (!snapshot_map(restart_path, &restart_snapshot)) {
+        printf("Failed to map checkpoint %s\n", restart_path);
+        exit(1);
+    }
+    const md_checkpoint *state = (const md_checkpoint*)snapshot_find(&restart_snapshot, "state", sizeof(md_checkpoint));
+    if (state == NULL) {
+        printf("Checkpoint %s is damaged or belongs to another problem\n", restart_path);
+        exit(1);
+    }
+    resumed = *state;
+    if (resumed.N != N || resumed.box_size != box_size) {
+        printf("Checkpoint %s holds N %d in box %g, this run has N %d in box %g\n",
+            restart_path, resumed.N, resumed.box_size, N, box_size);
+        exit(1);
+    }
+    // the sections keep the padded SoA layout, so the engine works on them in place;
+    // the private mapping copies a page only once the run writes to it
+    size_t bytes = sizeof(double) * padded_count(N);
+    array->x = (double*)snapshot_find(&restart_snapshot, "x", bytes);
+    array->y = (double*)snapshot_find(&restart_snapshot, "y", bytes);
+    array->z = (double*)snapshot_find(&restart_snapshot, "z", bytes);
+    velocity->x = (double*)snapshot_find(&restart_snapshot, "vx", bytes);
+    velocity->y = (double*)snapshot_find(&restart_snapshot, "vy", bytes);
+    velocity->z = (double*)snapshot_find(&restart_snapshot, "vz", bytes);
+    if (!array->x || !array->y || !array->z || !velocity->x || !velocity->y || !velocity->z) {
+        printf("Checkpoint %s is damaged or belongs to another problem\n", restart_path);
+        exit(1);
+    }
+    verlet_rebuilds = (int)resumed.verlet_rebuilds;
+    verlet_total_length = resumed.verlet_total_length;
+    printf("resumed from %s at step %ld\n", restart_path, resumed.step);
+}
+
+bool write_checkpoint(coords *array, coords *velocity, long step, double initial_energy, double max_deviation) {
+    md_checkpoint state = { N, integrator, dt, box_size, step, initial_energy, max_deviation, verlet_rebuilds, verlet_total_length };
+    size_t bytes = sizeof(double) * padded_count(N);
+    snapshot_section sections[] = {
+        { "state", &state, sizeof(state) },
+        { "x", array->x, bytes },
+        { "y", array->y, bytes },
+        { "z", array->z, bytes },
+        { "vx", velocity->x, bytes },
+        { "vy", velocity->y, bytes },
+        { "vz", velocity->z, bytes },
+    };
+    return snapshot_write(checkpoint_path, sections, sizeof(sections) / sizeof(sections[0]));
+}
+
+void release_coords(coords *array) {
+    if (!snapshot_contains(&restart_snapshot, array->x)) {
+        free_coords(array);
+    }
+}
+
+void use_mixed_precision() {
+    make_mixed_setup(&lj, &single_position);
+    make_mixed_setup(&lj_inner, &single_position);
+    make_mixed_setup(&lj_outer, &single_position);
+}
+
+// Runs the same start twice, in double and then in mixed precision, to compare
+// their energy conservation. Along the mixed run the forces and potential of every
+// step are recomputed in double at the same positions.
+void validate_precision(coords *array, coords *velocity, coords *force) {
+    const char *trajectory = trajectory_path;
+    const char *checkpoint = checkpoint_path;
+    // only the mixed run writes the outputs
+    trajectory_path = "";
+    checkpoint_path = "";
+    printf("\nreference run in double precision\n");
+    md_summary reference = md(array, velocity, force);
+    trajectory_path = trajectory;
+    checkpoint_path = checkpoint;
+
+    set_initial_state(array, velocity, force);
+    verlet_built = false;
+    verlet_rebuilds = 0;
+    verlet_total_length = 0;
+    lj_double = lj;
+    lj_inner_double = lj_inner;
+    lj_outer_double = lj_outer;
+    reference_force = alloc_coords(N);
+    reference_force_long = alloc_coords(N);
+    use_mixed_precision();
+    checking_precision = true;
+    if (integrator == RESPA) {
+        printf("\nmixed-precision run, LJ pair kernels: %s / %s\n", lj_inner.kernel_name, lj_outer.kernel_name);
+    } else {
+        printf("\nmixed-precision run, LJ pair kernel: %s\n", lj.kernel_name);
+    }
+    md_summary mixed = md(array, velocity, force);
+    checking_precision = false;
+    free_coords(&reference_force);
+    free_coords(&reference_force_long);
+
+    double time = total_it * dt;
+    double mixed_loop_time = mixed.loop_time - precision_check_time;
+    printf("\nprecision validation over %d steps of dt %g:\n", total_it, (double)dt);
+    printf("  double: energy drift %e per particle per unit time, max deviation %e per particle, %.3f s of step loop\n",
+        (reference.final_energy - reference.initial_energy) / (N * time), reference.max_deviation / N, reference.loop_time);
+    printf("  mixed:  energy drift %e per particle per unit time, max deviation %e per particle, %.3f s of step loop without the checks\n",
+        (mixed.final_energy - mixed.initial_energy) / (N * time), mixed.max_deviation / N, mixed_loop_time);
+    printf("  mixed against double at the same positions, %ld steps: force error rms %.2e, max %.2e (of the rms force), potential energy error max %.2e\n",
+        precision_samples, force_error_rms_sum / precision_samples, force_error_max, energy_error_max);
+}
+
+// compares the forces and potential a mixed-precision step ended with against the double kernels
+void sample_precision_error(coords *array, coords *force, double potential) {
+    double start = omp_get_wtime();
+    double reference;
+    if (integrator == RESPA) {
+        reference = calculate_energy_force_lj(array, &reference_force, &lj_inner_double) +
+                    calculate_energy_force_lj(array, &reference_force_long, &lj_outer_double);
+    } else {
+        reference = calculate_energy_force_lj(array, &reference_force, &lj_double);
+    }
+    double error2 = 0, norm2 = 0, largest2 = 0;
+    for (int i = 0; i < N; i++) {
+        double x = reference_force.x[i], y = reference_force.y[i], z = reference_force.z[i];
+        double dx = force->x[i] - x, dy = force->y[i] - y, dz = force->z[i] - z;
+        if (integrator == RESPA) {
+            x += reference_force_long.x[i];
+            y += reference_force_long.y[i];
+            z += reference_force_long.z[i];
+            dx += force_long.x[i] - reference_force_long.x[i];
+            dy += force_long.y[i] - reference_force_long.y[i];
+            dz += force_long.z[i] - reference_force_long.z[i];
+        }
+        double d2 = dx * dx + dy * dy + dz * dz;
+        error2 += d2;
+        norm2 += x * x + y * y + z * z;
+        largest2 = d2 > largest2 ? d2 : largest2;
+    }
+    // relative to the rms force rather than per particle, where small forces would blow it up
+    if (norm2 > 0) {
+        force_error_rms_sum += sqrt(error2 / norm2);
+        force_error_max = fmax(force_error_max, sqrt(largest2 * N / norm2));
+    }
+    if (reference != 0) {
+        energy_error_max = fmax(energy_error_max, fabs(potential - reference) / fabs(reference));
+    }
+    precision_samples++;
+    precision_check_time += omp_get_wtime() - start;
+}
+
+void init_cell_list() {
+    cells_per_side = (int)(box_size / (rc + skin));
+    if (cells_per_side < 1) {
+        cells_per_side = 1;
+    }
+    cell_size = (double)box_size / cells_per_side;
+    cells_total = cells_per_side * cells_per_side * cells_per_side;
+    cell_head = (int*)counted_alloc(sizeof(int), sizeof(int) * cells_total);
+    cell_next = (int*)counted_alloc(sizeof(int), sizeof(int) * N);
+    cell_neighbors = (int*)counted_alloc(sizeof(int), sizeof(int) * cells_total * 27);
+    cell_neighbors_count = (int*)counted_alloc(sizeof(int), sizeof(int) * cells_total);
+    for (int cz = 0; cz < cells_per_side; cz++) {
+        for (int cy = 0; cy < cells_per_side; cy++) {
+            for (int cx = 0; cx < cells_per_side; cx++) {
+                int cell = (cz * cells_per_side + cy) * cells_per_side + cx;
+                int *list = cell_neighbors + cell * 27;
+                int count = 0;
+                for (int dz = -1; dz <= 1; dz++) {
+                    for (int dy = -1; dy <= 1; dy++) {
+                        for (int dx = -1; dx <= 1; dx++) {
+                            int nx = (cx + dx + cells_per_side) % cells_per_side;
+                            int ny = (cy + dy + cells_per_side) % cells_per_side;
+                            int nz = (cz + dz + cells_per_side) % cells_per_side;
+                            int neighbor = (nz * cells_per_side + ny) * cells_per_side + nx;
+                            // with fewer than 3 cells per side the periodic stencil
+                            // wraps onto itself, so every cell must be listed only once
+                            bool seen = false;
+                            for (int k = 0; k < count; k++) {
+                                if (list[k] == neighbor) {
+                                    seen = true;
+                                    break;
+                                }
+                            }
+                            if (!seen) {
+                                list[count] = neighbor;
+                                count++;
+                            }
+                        }
+                    }
+                }
+                cell_neighbors_count[cell] = count;
+            }
+        }
+    }
+}
+
+void free_cell_list() {
+    free(cell_head);
+    free(cell_next);
+    free(cell_neighbors);
+    free(cell_neighbors_count);
+}
+
+void build_cell_list(coords *array) {
+    for (int c = 0; c < cells_total; c++) {
+        cell_head[c] = -1;
+    }
+    for (int i = 0; i < N; i++) {
+        int cell = cell_of(array->x[i], array->y[i], array->z[i]);
+        cell_next[i] = cell_head[cell];
+        cell_head[cell] = i;
+    }
+}
+
+void init_verlet_list() {
+    // expected partners in half of the rc + skin sphere, with room for density fluctuations
+    double list_radius = rc + skin;
+    double expected = (double)N / ((double)box_size * box_size * box_size) * 2.0 / 3.0 * M_PI * list_radius * list_radius * list_radius;
+    verlet_capacity = (int)(1.5 * expected) + 16;
+    if (verlet_capacity > N) {
+        verlet_capacity = N;
+    }
+    verlet_list = (int*)counted_alloc(sizeof(int), sizeof(int) * N * verlet_capacity);
+    verlet_count = (int*)counted_alloc(sizeof(int), sizeof(int) * N);
+    position_at_build = alloc_coords(N);
+}
+
+void free_verlet_list() {
+    free(verlet_list);
+    free(verlet_count);
+    free_coords(&position_at_build);
+}
+
+// a step needs one force buffer per thread, so size each arena for N particles
+void init_scratch_arenas() {
+    for (int t = 0; t < threads; t++) {
+        arena_init(&thread_arena[t], coords_bytes(N));
+    }
+}
+
+void free_scratch_arenas() {
+    for (int t = 0; t < threads; t++) {
+        arena_release(&thread_arena[t]);
+    }
+}
+
+void build_verlet_list(coords *array) {
+    build_cell_list(array);
+    double list_cutoff = (rc + skin) * (rc + skin);
+    while (1) {
+        int longest = 0;
+        #pragma omp parallel for reduction(max:longest) schedule(dynamic, 32) num_threads(threads)
+        for (int i = 0; i < N; i++) {
+            int *list = verlet_list + (long)i * verlet_capacity;
+            int count = 0;
+            int cell = cell_of(array->x[i], array->y[i], array->z[i]);
+            for (int k = 0; k < cell_neighbors_count[cell]; k++) {
+                for (int j = cell_head[cell_neighbors[cell * 27 + k]]; j != -1; j = cell_next[j]) {
+                    if (j <= i) {
                         continue;
                     }
-                    dim temp = { initial_array[i].x + x_dif, initial_array[i].y + y_dif, initial_array[i].z + z_dif };
-                    if (square_dist(temp, initial_array[particle]) < rc*rc) {
-                        new_array[count] = temp;
+                    double x = minimum_image(array->x[j] - array->x[i]);
+                    double y = minimum_image(array->y[j] - array->y[i]);
+                    double z = minimum_image(array->z[j] - array->z[i]);
+                    if (x * x + y * y + z * z < list_cutoff) {
+                        if (count < verlet_capacity) {
+                            list[count] = j;
+                        }
                         count++;
                     }
                 }
             }
+            verlet_count[i] = count;
+            if (count > longest) {
+                longest = count;
+            }
         }
+        if (longest <= verlet_capacity) {
+            break;
+        }
+        // a denser region than we sized for: grow the lists and build them again
+        verlet_capacity = longest + longest / 4;
+        free(verlet_list);
+        verlet_list = (int*)counted_alloc(sizeof(int), sizeof(int) * N * verlet_capacity);
+    }
+    long length = 0;
+    for (int i = 0; i < N; i++) {
+        length += verlet_count[i];
     }
-    return count;
+    memcpy(position_at_build.x, array->x, sizeof(double) * N);
+    memcpy(position_at_build.y, array->y, sizeof(double) * N);
+    memcpy(position_at_build.z, array->z, sizeof(double) * N);
+    verlet_built = true;
+    verlet_rebuilds++;
+    verlet_total_length += length;
+    verlet_length = length;
 }
 
-double square_dist(dim first, dim second) {
-    return (first.x - second.x)*(first.x - second.x) + (first.y - second.y)*(first.y - second.y) + (first.z - second.z)*(first.z - second.z);
+bool verlet_list_outdated(coords *array) {
+    double max_displacement = 0;
+    #pragma omp simd reduction(max:max_displacement)
+    for (int i = 0; i < N; i++) {
+        double x = array->x[i] - position_at_build.x[i];
+        double y = array->y[i] - position_at_build.y[i];
+        double z = array->z[i] - position_at_build.z[i];
+        double displacement = x * x + y * y + z * z;
+        max_displacement = displacement > max_displacement ? displacement : max_displacement;
+    }
+    return max_displacement > (skin / 2) * (skin / 2);
+}
+
+// particles are never wrapped back into the box in md(), so bin them by their image inside it
+int cell_of(double x, double y, double z) {
+    int cx = (int)((wrap_coordinate(x) + half_box) / cell_size);
+    int cy = (int)((wrap_coordinate(y) + half_box) / cell_size);
+    int cz = (int)((wrap_coordinate(z) + half_box) / cell_size);
+    // rounding can push a particle lying on the upper face one cell too far
+    if (cx >= cells_per_side) cx = cells_per_side - 1;
+    if (cy >= cells_per_side) cy = cells_per_side - 1;
+    if (cz >= cells_per_side) cz = cells_per_side - 1;
+    return (cz * cells_per_side + cy) * cells_per_side + cx;
+}
+
+double wrap_coordinate(double x) {
+    return x - box_size * floor((x + half_box) / box_size);
+}
+
+// rc <= half_box, so only the closest periodic image can be inside the cutoff
+double minimum_image(double d) {
+    return d - box_size * round(d / box_size);
 }
 
-double calculate_energy_force_lj(dim *array, dim *force){
-    for (int i = 0; i < N; i++){
-        force[i] = { 0, 0, 0};
+double calculate_energy_force_lj(coords *array, coords *force, const lj_setup *setup){
+    PROFILE_BEGIN(PROFILE_NEIGHBOR_SEARCH);
+    if (!verlet_built || verlet_list_outdated(array)) {
+        build_verlet_list(array);
     }
+    PROFILE_END(PROFILE_NEIGHBOR_SEARCH);
+    PROFILE_BEGIN(PROFILE_FORCE);
+    PROFILE_COUNT(PROFILE_PAIRS_EVALUATED, verlet_length);
+    if (setup->single != NULL) {
+        fill_coords_single(setup->single, array, N, box_size);
+    }
+    pair_visits += verlet_length;
     double energy = 0;
-    #pragma omp parallel for reduction(+:energy) num_threads(NUM_THREADS)
-    for (int i = 0; i < N; i++) {
-        double force_x = 0;
-        double force_y = 0;
-        double force_z = 0;
-        dim *neighbors = (dim*)malloc(sizeof(dim) * N);
-        int count_near = nearest_image(array, neighbors, N, i);
-        for (int j = 0; j < count_near; j++) {
-            double dist = square_dist(array[i], neighbors[j]);
-            double r6 = fast_pow(dist, 3);
-            double r12 = r6 * r6;
-            double r8 = r6 * dist;
-            double r14 = r12 * dist;
-            double multiplier = (12 * (1 / r14 - 1 / r8));
-            force_x += (neighbors[j].x - array[i].x)  * multiplier;
-            force_y += (neighbors[j].y - array[i].y)  * multiplier;
-            force_z += (neighbors[j].z - array[i].z)  * multiplier;
-            energy += 4 * (1 / r12 - 1 / r6) - Urc;
-        }
-        free(neighbors);
-        force[i].x = force_x;
-        force[i].y = force_y;
-        force[i].z = force_z;
-    }
-    // now we consider each interaction twice, so we need to divide energy by 2
-    return energy / 2;
+    #pragma omp parallel reduction(+:energy) num_threads(threads)
+    {
+        int team = omp_get_num_threads();
+        scratch_arena *scratch = &thread_arena[omp_get_thread_num()];
+        arena_reset(scratch);
+        thread_force[omp_get_thread_num()] = arena_coords(scratch, N);
+        coords *own_force = &thread_force[omp_get_thread_num()];
+        memset(own_force->x, 0, sizeof(double) * N);
+        memset(own_force->y, 0, sizeof(double) * N);
+        memset(own_force->z, 0, sizeof(double) * N);
+        // lower indices own longer half lists, so hand the particles out dynamically
+        #pragma omp for schedule(dynamic, 32)
+        for (int i = 0; i < N; i++) {
+            double force_i[3] = { 0, 0, 0 };
+            energy += setup->kernel(setup, array, i, verlet_list + (long)i * verlet_capacity, verlet_count[i], own_force, force_i);
+            own_force->x[i] += force_i[0];
+            own_force->y[i] += force_i[1];
+            own_force->z[i] += force_i[2];
+        }
+        // the implicit barrier above makes every buffer complete, now sum them per particle
+        #pragma omp for simd
+        for (int i = 0; i < N; i++) {
+            double sum_x = 0, sum_y = 0, sum_z = 0;
+            for (int t = 0; t < team; t++) {
+                sum_x += thread_force[t].x[i];
+                sum_y += thread_force[t].y[i];
+                sum_z += thread_force[t].z[i];
+            }
+            force->x[i] = sum_x;
+            force->y[i] = sum_y;
+            force->z[i] = sum_z;
+        }
+        PROFILE_FLUSH();
+    }
+    PROFILE_END(PROFILE_FORCE);
+    // every pair is visited once, so the energy is not double counted
+    return energy;
 }
 
-void md(dim *array, dim *velocity, dim *force) {
-    for (int n = 0; n < total_it; n ++){
-        double total_energy = calculate_energy_force_lj(array, force);
-        motion(array, velocity, force);
+md_summary md(coords *array, coords *velocity, coords *force) {
+    double potential;
+    if (integrator == RESPA) {
+        potential = calculate_energy_force_lj(array, force, &lj_inner) + calculate_energy_force_lj(array, &force_long, &lj_outer);
+    } else {
+        potential = calculate_energy_force_lj(array, force, &lj);
+    }
+    double initial_energy = potential + kinetic_energy(velocity);
+    double max_deviation = 0;
+    int first_step = 0;
+    if (restart_path[0] != '\0') {
+        // keep measuring the drift against the energy the run started with
+        initial_energy = resumed.initial_energy;
+        max_deviation = resumed.max_deviation;
+        first_step = (int)resumed.step;
+    }
+    trajectory_writer *trajectory = NULL;
+    const double *position_components[3] = { array->x, array->y, array->z };
+    const double *velocity_components[3] = { velocity->x, velocity->y, velocity->z };
+    if (trajectory_path[0] != '\0') {
+        int flags = (trajectory_format == TRAJECTORY_INT16 ? TRAJECTORY_QUANTIZED : 0) |
+                    (trajectory_compression ? TRAJECTORY_DEFLATED : 0);
+        trajectory = trajectory_open(trajectory_path, N, trajectory_every, box_size, dt, flags, trajectory_buffers);
+        trajectory_push(trajectory, first_step, position_components, velocity_components);
+    }
+    double push_time = 0;
+    double checkpoint_time = 0;
+    int checkpoints = 0;
+    long allocations_before = heap_allocations;
+    long pair_visits_before = pair_visits;
+    double start_time = omp_get_wtime();
+    for (int n = first_step; n < total_it; n ++){
         if (!(n % 1000)) {
-            printf("energy is %f \n", total_energy/N);
+            printf("energy is %f \n", potential/N);
+        }
+        if (integrator == EULER) {
+            motion(array, velocity, force);
+            potential = calculate_energy_force_lj(array, force, &lj);
+        }
+        else if (integrator == VELOCITY_VERLET) {
+            potential = velocity_verlet_step(array, velocity, force);
+        }
+        else {
+            potential = respa_step(array, velocity, force);
+        }
+        if (checking_precision) {
+            sample_precision_error(array, force, potential);
+        }
+        double deviation = fabs(potential + kinetic_energy(velocity) - initial_energy);
+        if (deviation > max_deviation) {
+            max_deviation = deviation;
         }
+        if (trajectory != NULL && (n + 1) % trajectory_every == 0) {
+            PROFILE_BEGIN(PROFILE_TRAJECTORY);
+            double push_start = omp_get_wtime();
+            trajectory_push(trajectory, n + 1, position_components, velocity_components);
+            push_time += omp_get_wtime() - push_start;
+            PROFILE_END(PROFILE_TRAJECTORY);
+        }
+        if (checkpoint_path[0] != '\0' && ((n + 1) % checkpoint_every == 0 || n + 1 == total_it)) {
+            PROFILE_BEGIN(PROFILE_CHECKPOINT);
+            double checkpoint_start = omp_get_wtime();
+            if (!write_checkpoint(array, velocity, n + 1, initial_energy, max_deviation)) {
+                printf("Failed to write checkpoint %s at step %d\n", checkpoint_path, n + 1);
+            }
+            checkpoint_time += omp_get_wtime() - checkpoint_start;
+            PROFILE_END(PROFILE_CHECKPOINT);
+            checkpoints++;
+        }
+    }
+    double loop_time = omp_get_wtime() - start_time;
+    long loop_pairs = pair_visits - pair_visits_before;
+    long loop_allocations = heap_allocations - allocations_before;
+    if (trajectory != NULL) {
+        double close_start = omp_get_wtime();
+        if (!trajectory_close(trajectory)) {
+            printf("Failed to write trajectory %s: %s after %ld frames\n", trajectory_path, trajectory->error, trajectory->frames);
+        }
+        // the loop only paid for the copies and any stalls, the rest overlapped with it
+        printf("trajectory %s: %ld frames, %ld bytes, %ld writer stalls, %.3f s copying in the step loop, %.3f s draining at the end\n",
+            trajectory_path, trajectory->frames, trajectory->bytes, trajectory->stalls, push_time, omp_get_wtime() - close_start);
+        trajectory_free(trajectory);
+    }
+    if (checkpoints > 0) {
+        printf("checkpoint %s: %d written, %.3f ms each\n", checkpoint_path, checkpoints, 1000 * checkpoint_time / checkpoints);
+    }
+    double final_energy = potential + kinetic_energy(velocity);
+    printf("\nneighbor list rebuilds: %d in %d steps, average list length %.2f\n",
+        verlet_rebuilds, total_it, (double)verlet_total_length / ((double)verlet_rebuilds * N));
+    printf("heap allocations in the step loop: %ld, scratch arena peak %lu bytes per thread\n",
+        loop_allocations, (unsigned long)thread_arena[0].peak);
+    // a stable dt keeps the total energy flat; pick the largest one whose drift is acceptable
+    printf("integrator %s, dt %g: total energy per particle %f -> %f\n",
+        integrator_names[integrator], (double)dt, initial_energy / N, final_energy / N);
+    printf("energy drift %e per particle per unit time, max deviation %e per particle\n",
+        (final_energy - initial_energy) / (N * total_it * dt), max_deviation / N);
+    printf("simulated time %g in %.3f s of step loop\n", total_it * dt, loop_time);
+    int steps = total_it - first_step;
+    printf("throughput: %.4e pairs/s, %.4e steps/s, %.4f ns/day on %d threads\n",
+        loop_pairs / loop_time, steps / loop_time, steps * dt * ARGON_TAU_PS * 1e-3 / loop_time * 86400, threads);
+    md_summary summary = { initial_energy, final_energy, max_deviation, loop_time };
+    return summary;
+}
+
+// symplectic Euler: kick with the current forces, then drift
+void motion(coords *array, coords *velocity, coords *force){
+    PROFILE_BEGIN(PROFILE_INTEGRATION);
+    #pragma omp simd
+    for (int i = 0; i < N; i++) {
+        velocity->x[i] += force->x[i] * dt;
+        velocity->y[i] += force->y[i] * dt;
+        velocity->z[i] += force->z[i] * dt;
+        array->x[i] += velocity->x[i] * dt;
+        array->y[i] += velocity->y[i] * dt;
+        array->z[i] += velocity->z[i] * dt;
     }
+    PROFILE_END(PROFILE_INTEGRATION);
 }
 
-void motion(dim *array, dim *velocity, dim * force){
+void kick(coords *velocity, coords *force, double step) {
+    PROFILE_BEGIN(PROFILE_INTEGRATION);
+    #pragma omp simd
     for (int i = 0; i < N; i++) {
-        velocity[i] = {velocity[i].x + force[i].x * dt,
-            velocity[i].y + force[i].y * dt,
-            velocity[i].z + force[i].z * dt};
-        array[i] = {array[i].x + velocity[i].x * dt,
-            array[i].y + velocity[i].y * dt,
-            array[i].z + velocity[i].z * dt};
+        velocity->x[i] += force->x[i] * step;
+        velocity->y[i] += force->y[i] * step;
+        velocity->z[i] += force->z[i] * step;
     }
+    PROFILE_END(PROFILE_INTEGRATION);
 }
 
-inline double fast_pow(double a, int n) {
-    if (n == 0)
-        return 1;
-    if (n % 2 == 1)
-        return fast_pow(a, n - 1) * a;
-    else {
-        double b = fast_pow(a, n / 2);
-        return b * b;
+void drift(coords *array, coords *velocity, double step) {
+    PROFILE_BEGIN(PROFILE_INTEGRATION);
+    #pragma omp simd
+    for (int i = 0; i < N; i++) {
+        array->x[i] += velocity->x[i] * step;
+        array->y[i] += velocity->y[i] * step;
+        array->z[i] += velocity->z[i] * step;
     }
+    PROFILE_END(PROFILE_INTEGRATION);
+}
+
+// force holds the forces at the current positions on entry and at the new ones on return
+double velocity_verlet_step(coords *array, coords *velocity, coords *force) {
+    kick(velocity, force, dt / 2);
+    drift(array, velocity, dt);
+    double potential = calculate_energy_force_lj(array, force, &lj);
+    kick(velocity, force, dt / 2);
+    return potential;
+}
+
+// r-RESPA: half kicks with the long-range forces around respa_steps velocity-Verlet
+// steps of dt / respa_steps driven by the short-range forces alone
+double respa_step(coords *array, coords *velocity, coords *force) {
+    double inner_dt = dt / respa_steps;
+    double inner_energy = 0;
+    kick(velocity, &force_long, dt / 2);
+    for (int m = 0; m < respa_steps; m++) {
+        kick(velocity, force, inner_dt / 2);
+        drift(array, velocity, inner_dt);
+        inner_energy = calculate_energy_force_lj(array, force, &lj_inner);
+        kick(velocity, force, inner_dt / 2);
+    }
+    double outer_energy = calculate_energy_force_lj(array, &force_long, &lj_outer);
+    kick(velocity, &force_long, dt / 2);
+    return inner_energy + outer_energy;
+}
+
+double kinetic_energy(coords *velocity) {
+    double energy = 0;
+    #pragma omp simd reduction(+:energy)
+    for (int i = 0; i < N; i++) {
+        energy += velocity->x[i] * velocity->x[i] + velocity->y[i] * velocity->y[i] + velocity->z[i] * velocity->z[i];
+    }
+    return energy / 2;
 }
@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#ifdef TRAJECTORY_ZLIB
+    #include <zlib.h>
+#endif
+#include "trajectory.h"
+#include "scratch_arena.h"
+
+static size_t raw_bytes(const trajectory_header *header) {
+    size_t component = header->flags & TRAJECTORY_QUANTIZED ? sizeof(int16_t) : sizeof(float);
+    return 6 * component * header->particles;
+}
+
+// deflate can grow incompressible data by a few bytes per block
+size_t trajectory_payload_capacity(const trajectory_header *header) {
+    return raw_bytes(header) + raw_bytes(header) / 1000 + 64;
+}
+
+// Fills writer->raw from one slot and returns the position and velocity scales.
+static void encode_frame(trajectory_writer *writer, const double *values, double *position_scale, double *velocity_scale) {
+    int particles = writer->header.particles;
+    int count = 6 * particles;
+    if (!(writer->header.flags & TRAJECTORY_QUANTIZED)) {
+        float *out = (float*)writer->raw;
+        for (int k = 0; k < count; k++) {
+            out[k] = (float)values[k];
+        }
+        *position_scale = *velocity_scale = 0;
+        return;
+    }
+    double box = writer->header.box;
+    double max_velocity = 0;
+    for (int k = 3 * particles; k < count; k++) {
+        max_velocity = fabs(values[k]) > max_velocity ? fabs(values[k]) : max_velocity;
+    }
+    *position_scale = box / 2 / 32767;
+    *velocity_scale = max_velocity > 0 ? max_velocity / 32767 : 1;
+    int16_t *out = (int16_t*)writer->raw;
+    for (int k = 0; k < 3 * particles; k++) {
+        double wrapped = values[k] - box * floor(values[k] / box + 0.5);
+        out[k] = (int16_t)lrint(wrapped / *position_scale);
+    }
+    for (int k = 3 * particles; k < count; k++) {
+        out[k] = (int16_t)lrint(values[k] / *velocity_scale);
+    }
+}
+
+// Keeps the first failure; the frames after it are dropped, but the slots still
+// drain so the step loop never waits on a writer that cannot write.
+static void fail(trajectory_writer *writer, const char *error) {
+    pthread_mutex_lock(&writer->lock);
+    if (writer->error == NULL) {
+        writer->error = error;
+    }
+    pthread_mutex_unlock(&writer->lock);
+}
+
+static void *writer_thread(void *argument) {
+    trajectory_writer *writer = (trajectory_writer*)argument;
+    size_t raw_size = raw_bytes(&writer->header);
+    while (1) {
+        pthread_mutex_lock(&writer->lock);
+        while (writer->queued == 0 && !writer->closing) {
+            pthread_cond_wait(&writer->filled, &writer->lock);
+        }
+        if (writer->queued == 0) {
+            pthread_mutex_unlock(&writer->lock);
+            break;
+        }
+        int slot = writer->tail;
+        bool failed = writer->error != NULL;
+        pthread_mutex_unlock(&writer->lock);
+
+        // the slot stays queued while we read it, so the step loop cannot refill it
+        trajectory_frame_header frame;
+        frame.step = writer->ring_step[slot];
+        frame.time = frame.step * writer->header.dt;
+        encode_frame(writer, writer->ring[slot], &frame.position_scale, &frame.velocity_scale);
+        frame.raw_bytes = raw_size;
+        const void *payload = writer->raw;
+        frame.payload_bytes = raw_size;
+        #ifdef TRAJECTORY_ZLIB
+            if (!failed && writer->header.flags & TRAJECTORY_DEFLATED) {
+                uLongf packed_size = writer->packed_capacity;
+                if (compress2((Bytef*)writer->packed, &packed_size, (const Bytef*)writer->raw, raw_size, Z_BEST_SPEED) != Z_OK) {
+                    fail(writer, "compression failed");
+                    failed = true;
+                }
+                frame.payload_bytes = packed_size;
+                payload = writer->packed;
+            }
+        #endif
+        if (!failed && (fwrite(&frame, sizeof(frame), 1, writer->file) != 1 ||
+                        fwrite(payload, 1, frame.payload_bytes, writer->file) != frame.payload_bytes)) {
+            fail(writer, "short write");
+            failed = true;
+        }
+
+        pthread_mutex_lock(&writer->lock);
+        if (!failed) {
+            writer->frames++;
+            writer->bytes += sizeof(frame) + frame.payload_bytes;
+        }
+        writer->tail = (writer->tail + 1) % writer->ring_size;
+        writer->queued--;
+        pthread_cond_signal(&writer->drained);
+        pthread_mutex_unlock(&writer->lock);
+    }
+    return NULL;
+}
+
+trajectory_writer *trajectory_open(const char *path, int particles, int stride, double box, double dt,
+                                   int flags, int ring_size) {
+    #ifndef TRAJECTORY_ZLIB
+        if (flags & TRAJECTORY_DEFLATED) {
+            printf("Trajectory compression needs a build with -D TRAJECTORY_ZLIB -lz\n");
+            exit(1);
+        }
+    #endif
+    trajectory_writer *writer = (trajectory_writer*)counted_alloc(sizeof(double), sizeof(trajectory_writer));
+    writer->file = fopen(path, "wb");
+    if (writer->file == NULL) {
+        printf("Failed to open trajectory file %s\n", path);
+        exit(1);
+    }
+    memset(&writer->header, 0, sizeof(writer->header));
+    memcpy(writer->header.magic, TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC));
+    writer->header.version = TRAJECTORY_VERSION;
+    writer->header.particles = particles;
+    writer->header.flags = flags;
+    writer->header.stride = stride;
+    writer->header.box = box;
+    writer->header.dt = dt;
+    writer->error = NULL;
+    if (fwrite(&writer->header, sizeof(writer->header), 1, writer->file) != 1) {
+        writer->error = "short write";
+    }
+
+    writer->ring_size = ring_size;
+    writer->ring = (double**)counted_alloc(sizeof(double*), sizeof(double*) * ring_size);
+    writer->ring_step = (long*)counted_alloc(sizeof(long), sizeof(long) * ring_size);
+    for (int slot = 0; slot < ring_size; slot++) {
+        writer->ring[slot] = (double*)counted_alloc(sizeof(double), sizeof(double) * 6 * particles);
+    }
+    size_t raw_size = raw_bytes(&writer->header);
+    writer->raw = counted_alloc(sizeof(double), raw_size);
+    writer->packed_capacity = trajectory_payload_capacity(&writer->header);
+    writer->packed = counted_alloc(sizeof(double), writer->packed_capacity);
+    writer->head = writer->tail = writer->queued = 0;
+    writer->closing = false;
+    writer->frames = writer->bytes = writer->stalls = 0;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->filled, NULL);
+    pthread_cond_init(&writer->drained, NULL);
+    pthread_create(&writer->thread, NULL, writer_thread, writer);
+    return writer;
+}
+
+void trajectory_push(trajectory_writer *writer, long step, const double *const position[3],
+                     const double *const velocity[3]) {
+    pthread_mutex_lock(&writer->lock);
+    if (writer->queued == writer->ring_size) {
+        writer->stalls++;
+        while (writer->queued == writer->ring_size) {
+            pthread_cond_wait(&writer->drained, &writer->lock);
+        }
+    }
+    int slot = writer->head;
+    pthread_mutex_unlock(&writer->lock);
+
+    // the writer thread never touches the head slot, so copy without the lock
+    int particles = writer->header.particles;
+    double *values = writer->ring[slot];
+    for (int d = 0; d < 3; d++) {
+        memcpy(values + d * particles, position[d], sizeof(double) * particles);
+        memcpy(values + (3 + d) * particles, velocity[d], sizeof(double) * particles);
+    }
+    writer->ring_step[slot] = step;
+
+    pthread_mutex_lock(&writer->lock);
+    writer->head = (writer->head + 1) % writer->ring_size;
+    writer->queued++;
+    pthread_cond_signal(&writer->filled);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+bool trajectory_close(trajectory_writer *writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->closing = true;
+    pthread_cond_signal(&writer->filled);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+    if (fclose(writer->file) != 0 && writer->error == NULL) {
+        writer->error = "close failed";
+    }
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->filled);
+    pthread_cond_destroy(&writer->drained);
+    return writer->error == NULL;
+}
+
+void trajectory_free(trajectory_writer *writer) {
+    for (int slot = 0; slot < writer->ring_size; slot++) {
+        free(writer->ring[slot]);
+    }
+    free(writer->ring);
+    free(writer->ring_step);
+    free(writer->raw);
+    free(writer->packed);
+    free(writer);
+}
+
+bool trajectory_read_header(FILE *file, trajectory_header *header) {
+    if (fread(header, sizeof(*header), 1, file) != 1) {
+        return false;
+    }
+    return memcmp(header->magic, TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC)) == 0 && header->version == TRAJECTORY_VERSION;
+}
+
+bool trajectory_read_frame(FILE *file, const trajectory_header *header, trajectory_frame_header *frame,
+                           double *values, void *scratch, void *packed, size_t packed_capacity) {
+    if (fread(frame, sizeof(*frame), 1, file) != 1) {
+        return false;
+    }
+    if (frame->raw_bytes != raw_bytes(header) || frame->payload_bytes > packed_capacity) {
+        printf("Corrupt trajectory frame at step %ld\n", (long)frame->step);
+        return false;
+    }
+    void *payload = header->flags & TRAJECTORY_DEFLATED ? packed : scratch;
+    if (fread(payload, 1, frame->payload_bytes, file) != frame->payload_bytes) {
+        printf("Truncated trajectory frame at step %ld\n", (long)frame->step);
+        return false;
+    }
+    if (header->flags & TRAJECTORY_DEFLATED) {
+        #ifdef TRAJECTORY_ZLIB
+            uLongf raw_size = frame->raw_bytes;
+            if (uncompress((Bytef*)scratch, &raw_size, (const Bytef*)packed, frame->payload_bytes) != Z_OK) {
+                printf("Corrupt compressed frame at step %ld\n", (long)frame->step);
+                return false;
+            }
+        #else
+            printf("Reading a compressed trajectory needs a build with -D TRAJECTORY_ZLIB -lz\n");
+            return false;
+        #endif
+    }
+    int count = 6 * header->particles;
+    if (header->flags & TRAJECTORY_QUANTIZED) {
+        const int16_t *in = (const int16_t*)scratch;
+        for (int k = 0; k < count; k++) {
+            values[k] = in[k] * (k < 3 * header->particles ? frame->position_scale : frame->velocity_scale);
+        }
+    } else {
+        const float *in = (const float*)scratch;
+        for (int k = 0; k < count; k++) {
+            values[k] = in[k];
+        }
+    }
+    return true;
+}
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "trajectory.h"
+
+// Post-processing of the binary trajectories written by the CPU engine.
+//   trajectory_reader FILE            header and one summary line per frame
+//   trajectory_reader FILE --xyz      every frame as extended XYZ text on stdout
+//   trajectory_reader FILE --frame=K  only frame K (0 based), either way
+
+long heap_allocations = 0;   // trajectory.cpp allocates through counted_alloc()
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        printf("usage: %s FILE [--xyz] [--frame=K]\n", argv[0]);
+        return 1;
+    }
+    bool xyz = false;
+    long only_frame = -1;
+    for (int a = 2; a < argc; a++) {
+        if (strcmp(argv[a], "--xyz") == 0) {
+            xyz = true;
+        } else if (strncmp(argv[a], "--frame=", 8) == 0) {
+            only_frame = atol(argv[a] + 8);
+        } else {
+            printf("unknown option %s\n", argv[a]);
+            return 1;
+        }
+    }
+    FILE *file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        printf("Failed to open %s\n", argv[1]);
+        return 1;
+    }
+    trajectory_header header;
+    if (!trajectory_read_header(file, &header)) {
+        printf("%s is not a trajectory of this version\n", argv[1]);
+        return 1;
+    }
+    int particles = header.particles;
+    double *values = (double*)malloc(sizeof(double) * 6 * particles);
+    void *scratch = malloc(sizeof(float) * 6 * particles);
+    size_t packed_capacity = trajectory_payload_capacity(&header);
+    void *packed = malloc(packed_capacity);
+    if (!xyz) {
+        printf("%d particles, box %g, dt %g, a frame every %d steps, %s%s\n", particles, header.box, header.dt,
+            header.stride, header.flags & TRAJECTORY_QUANTIZED ? "int16" : "float",
+            header.flags & TRAJECTORY_DEFLATED ? ", deflated" : "");
+        printf("frame      step       time   kinetic/N   max |v|   center of mass\n");
+    }
+    trajectory_frame_header frame;
+    for (long index = 0; trajectory_read_frame(file, &header, &frame, values, scratch, packed, packed_capacity); index++) {
+        if (only_frame >= 0 && index != only_frame) {
+            continue;
+        }
+        const double *x = values, *y = values + particles, *z = values + 2 * particles;
+        const double *vx = values + 3 * particles, *vy = values + 4 * particles, *vz = values + 5 * particles;
+        if (xyz) {
+            printf("%d\nLattice=\"%g 0 0 0 %g 0 0 0 %g\" Properties=species:S:1:pos:R:3:vel:R:3 Time=%g Step=%ld\n",
+                particles, header.box, header.box, header.box, frame.time, (long)frame.step);
+            for (int i = 0; i < particles; i++) {
+                printf("Ar %.6f %.6f %.6f %.6f %.6f %.6f\n", x[i], y[i], z[i], vx[i], vy[i], vz[i]);
+            }
+            continue;
+        }
+        double kinetic = 0, max_velocity = 0, center[3] = { 0, 0, 0 };
+        for (int i = 0; i < particles; i++) {
+            double v2 = vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i];
+            kinetic += v2 / 2;
+            max_velocity = sqrt(v2) > max_velocity ? sqrt(v2) : max_velocity;
+            center[0] += x[i];
+            center[1] += y[i];
+            center[2] += z[i];
+        }
+        printf("%5ld %9ld %10.4f %11.6f %9.5f   %.4f %.4f %.4f\n", index, (long)frame.step, frame.time,
+            kinetic / particles, max_velocity, center[0] / particles, center[1] / particles, center[2] / particles);
+    }
+    free(values);
+    free(scratch);
+    free(packed);
+    fclose(file);
+    return 0;
+}
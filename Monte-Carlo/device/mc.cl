@@ -1,41 +1,369 @@
-#include "parameters.h"
+// The problem size comes in as arguments, so one binary serves every N and box,
+// unless the host builds the program for its run with the build options
+//   -D PARTICLES=<N> -D BOX=<box_size>f -D CUTOFF2=<rc^2>f
+// which turn the loop bounds and the box into literals; the arguments are then
+// still passed but unused. -D UNROLL=<k> sets the unrolling of the pair loops.
+#ifndef PARTICLES
+    #define PARTICLES n
+#endif
+#ifndef BOX
+    #define BOX box_size
+#endif
+#ifndef CUTOFF2
+    #define CUTOFF2 cutoff2
+#endif
+#ifndef UNROLL
+    #define UNROLL 8
+#endif
 
-__attribute__((reqd_work_group_size(N, 1, 1)))
+// A launch covers one or more independent replicas of n particles: dimension 1
+// picks the replica, and work-item i of dimension 0 computes particle i of it
+// against the other particles of that replica only.
+// All pairs in tiles: each work-group stages tile_size particles at a time in
+// local memory, one per work-item, and every work-item runs through the tile.
+// Dimension 0 is n rounded up to the work-group size; the work-items past n
+// only help to load the tiles.
 __kernel void mc(__global const float3 *restrict particles,
-                 __global float *restrict out) {
+                 __global float *restrict out,
+                 const int n,
+                 const float box_size,
+                 const float cutoff2,
+                 __local float3 *restrict tile) {
 
     int index = get_global_id(0);
+    int local_index = get_local_id(0);
+    int tile_size = get_local_size(0);
+    // the replicas lie one after the other, PARTICLES particles each
+    __global const float3 *replica = particles + get_global_id(1) * PARTICLES;
+    float3 own = replica[min(index, PARTICLES - 1)];
+    float half_box = BOX / 2;
     float energy = 0;
-    #pragma unroll 8
-    for (int i = 0; i < N; i++) {
-        float x = particles[i].x - particles[index].x;
-        float y = particles[i].y - particles[index].y;
-        float z = particles[i].z - particles[index].z;
-        if (x > half_box)
-            x -= box_size;
-        else{
-            if (x < -half_box)
-                x += box_size;
+    for (int start = 0; start < PARTICLES; start += tile_size) {
+        if (start + local_index < PARTICLES)
+            tile[local_index] = replica[start + local_index];
+        barrier(CLK_LOCAL_MEM_FENCE);
+        int count = min(tile_size, PARTICLES - start);
+        #pragma unroll UNROLL
+        for (int j = 0; j < count; j++) {
+            float x = tile[j].x - own.x;
+            float y = tile[j].y - own.y;
+            float z = tile[j].z - own.z;
+            if (x > half_box)
+                x -= BOX;
+            else{
+                if (x < -half_box)
+                    x += BOX;
+            }
+            if (y > half_box)
+                y -= BOX;
+            else{
+                if (y < -half_box)
+                    y += BOX;
+            }
+            if (z > half_box)
+                z -= BOX;
+            else{
+                if (z < -half_box)
+                    z += BOX;
+            }
+            float sq_dist = x * x + y * y + z * z;
+            if ((sq_dist < CUTOFF2) && (start + j != index)) {
+                float r6 = sq_dist * sq_dist * sq_dist;
+                float r12 = r6 * r6;
+                energy += 4 * (1 / r12 - 1 / r6);
+            }
         }
-        if (y > half_box)
-            y -= box_size;
-        else{
-            if (y < -half_box)
-                y += box_size;
+        // the tile is overwritten only once every work-item is through it
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (index < PARTICLES)
+        out[get_global_id(1) * PARTICLES + index] = energy;
+}
+
+
+// mc() with the pair energy interpolated from a cubic table on r^2 instead of
+// the reciprocals; table[k] holds e0..e3 and m0..m3 of interval k as laid out in
+// pair_table.h, and pairs closer than sqrt(s_min) get the energy at s_min.
+__kernel void mc_table(__global const float3 *restrict particles,
+                       __global float *restrict out,
+                       const int n,
+                       const float box_size,
+                       const float cutoff2,
+                       __local float3 *restrict tile,
+                       __global const float8 *restrict table,
+                       const float s_min,
+                       const float inv_h,
+                       const int intervals) {
+
+    int index = get_global_id(0);
+    int local_index = get_local_id(0);
+    int tile_size = get_local_size(0);
+    // the replicas lie one after the other, PARTICLES particles each
+    __global const float3 *replica = particles + get_global_id(1) * PARTICLES;
+    float3 own = replica[min(index, PARTICLES - 1)];
+    float half_box = BOX / 2;
+    float energy = 0;
+    for (int start = 0; start < PARTICLES; start += tile_size) {
+        if (start + local_index < PARTICLES)
+            tile[local_index] = replica[start + local_index];
+        barrier(CLK_LOCAL_MEM_FENCE);
+        int count = min(tile_size, PARTICLES - start);
+        #pragma unroll UNROLL
+        for (int j = 0; j < count; j++) {
+            float x = tile[j].x - own.x;
+            float y = tile[j].y - own.y;
+            float z = tile[j].z - own.z;
+            if (x > half_box)
+                x -= BOX;
+            else{
+                if (x < -half_box)
+                    x += BOX;
+            }
+            if (y > half_box)
+                y -= BOX;
+            else{
+                if (y < -half_box)
+                    y += BOX;
+            }
+            if (z > half_box)
+                z -= BOX;
+            else{
+                if (z < -half_box)
+                    z += BOX;
+            }
+            float sq_dist = x * x + y * y + z * z;
+            if ((sq_dist < CUTOFF2) && (start + j != index)) {
+                float u = max(sq_dist - s_min, 0.0f) * inv_h;
+                int k = min((int)u, intervals - 1);
+                float t = u - k;
+                float8 c = table[k];
+                energy += c.s0 + t * (c.s1 + t * (c.s2 + t * c.s3));
+            }
         }
-        if (z > half_box)
-            z -= box_size;
-        else{
-            if (z < -half_box)
-                z += box_size;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (index < PARTICLES)
+        out[get_global_id(1) * PARTICLES + index] = energy;
+}
+
+
+// Cell-list pipeline for rc much smaller than the box. The box is split into
+// cells_per_side^3 cells of side >= rc, and every trial
+//   cell_index     counts the particles of each cell, cell_count must be zero before it
+//   cell_offsets   turns the counts into the first sorted slot of each cell
+//   sort_by_cell   lays the positions out cell after cell
+//   mc_cells       walks the up to 27 cells around each particle
+// cell_neighbors holds 27 cells per cell, each listed once and padded with -1.
+// Dimension 1 picks the replica, each with cells of its own. The order inside a
+// cell follows the atomics, so sums may differ in the last bits from run to run.
+
+// the cell of a wrapped position; rounding can put a particle on the upper face one cell too far
+int cell_of(float3 p, float box_size, int cells_per_side) {
+    float cell_size = box_size / cells_per_side;
+    int cx = clamp((int)((p.x + box_size / 2) / cell_size), 0, cells_per_side - 1);
+    int cy = clamp((int)((p.y + box_size / 2) / cell_size), 0, cells_per_side - 1);
+    int cz = clamp((int)((p.z + box_size / 2) / cell_size), 0, cells_per_side - 1);
+    return (cz * cells_per_side + cy) * cells_per_side + cx;
+}
+
+__kernel void cell_index(__global const float3 *restrict particles,
+                         __global int *restrict particle_cell,
+                         __global int *restrict particle_slot,
+                         __global int *restrict cell_count,
+                         const int n,
+                         const float box_size,
+                         const int cells_per_side) {
+
+    int index = get_global_id(0);
+    if (index >= PARTICLES)
+        return;
+    int offset = get_global_id(1) * PARTICLES;
+    int cell = cell_of(particles[offset + index], BOX, cells_per_side);
+    particle_cell[offset + index] = cell;
+    cell_count += get_global_id(1) * cells_per_side * cells_per_side * cells_per_side;
+    particle_slot[offset + index] = atomic_inc(&cell_count[cell]);
+}
+
+// An exclusive scan by one work-group per replica: every work-item sums a run of
+// cells, the first one scans those sums, and every work-item then fills in its run.
+__kernel void cell_offsets(__global const int *restrict cell_count,
+                           __global int *restrict cell_start,
+                           const int cells,
+                           __local int *restrict partial) {
+
+    int local_index = get_local_id(0);
+    int items = get_local_size(0);
+    cell_count += get_global_id(1) * cells;
+    cell_start += get_global_id(1) * cells;
+    int chunk = (cells + items - 1) / items;
+    int first = min(local_index * chunk, cells);
+    int last = min(first + chunk, cells);
+    int sum = 0;
+    for (int c = first; c < last; c++)
+        sum += cell_count[c];
+    partial[local_index] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (local_index == 0) {
+        int running = 0;
+        for (int i = 0; i < items; i++) {
+            int run = partial[i];
+            partial[i] = running;
+            running += run;
         }
-        float sq_dist = x * x + y * y + z * z;
-        if ((sq_dist < rc * rc) && (i != index)) {
-            float r6 = sq_dist * sq_dist * sq_dist;
-            float r12 = r6 * r6;
-            energy += 4 * (1 / r12 - 1 / r6);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    int running = partial[local_index];
+    for (int c = first; c < last; c++) {
+        cell_start[c] = running;
+        running += cell_count[c];
+    }
+}
+
+__kernel void sort_by_cell(__global const float3 *restrict particles,
+                           __global const int *restrict particle_cell,
+                           __global const int *restrict particle_slot,
+                           __global const int *restrict cell_start,
+                           __global float3 *restrict sorted,
+                           __global int *restrict sorted_index,
+                           const int n,
+                           const int cells) {
+
+    int index = get_global_id(0);
+    if (index >= PARTICLES)
+        return;
+    int offset = get_global_id(1) * PARTICLES;
+    int slot = cell_start[get_global_id(1) * cells + particle_cell[offset + index]] + particle_slot[offset + index];
+    sorted[offset + slot] = particles[offset + index];
+    sorted_index[offset + slot] = index;
+}
+
+// mc() over the sorted positions and the neighbor cells only; work-item s computes
+// sorted particle s and writes its energy at the particle's own index.
+__kernel void mc_cells(__global const float3 *restrict sorted,
+                       __global const int *restrict sorted_index,
+                       __global const int *restrict cell_start,
+                       __global const int *restrict cell_count,
+                       __global const int *restrict cell_neighbors,
+                       __global float *restrict out,
+                       const int n,
+                       const float box_size,
+                       const float cutoff2,
+                       const int cells_per_side) {
+
+    int index = get_global_id(0);
+    if (index >= PARTICLES)
+        return;
+    // the sorted particles and the cells of each replica lie one after the other
+    sorted += get_global_id(1) * PARTICLES;
+    sorted_index += get_global_id(1) * PARTICLES;
+    cell_start += get_global_id(1) * cells_per_side * cells_per_side * cells_per_side;
+    cell_count += get_global_id(1) * cells_per_side * cells_per_side * cells_per_side;
+    float3 own = sorted[index];
+    int cell = cell_of(own, BOX, cells_per_side);
+    float half_box = BOX / 2;
+    float energy = 0;
+    for (int around = 0; around < 27; around++) {
+        int neighbor = cell_neighbors[cell * 27 + around];
+        if (neighbor < 0)
+            break;
+        int last = cell_start[neighbor] + cell_count[neighbor];
+        for (int i = cell_start[neighbor]; i < last; i++) {
+            float x = sorted[i].x - own.x;
+            float y = sorted[i].y - own.y;
+            float z = sorted[i].z - own.z;
+            if (x > half_box)
+                x -= BOX;
+            else{
+                if (x < -half_box)
+                    x += BOX;
+            }
+            if (y > half_box)
+                y -= BOX;
+            else{
+                if (y < -half_box)
+                    y += BOX;
+            }
+            if (z > half_box)
+                z -= BOX;
+            else{
+                if (z < -half_box)
+                    z += BOX;
+            }
+            float sq_dist = x * x + y * y + z * z;
+            if ((sq_dist < CUTOFF2) && (i != index)) {
+                float r6 = sq_dist * sq_dist * sq_dist;
+                float r12 = r6 * r6;
+                energy += 4 * (1 / r12 - 1 / r6);
+            }
         }
     }
-    out[index] = energy;
+    out[get_global_id(1) * PARTICLES + sorted_index[index]] = energy;
 }
 
+// mc_cells() with the pair energy from the table of mc_table().
+__kernel void mc_cells_table(__global const float3 *restrict sorted,
+                             __global const int *restrict sorted_index,
+                             __global const int *restrict cell_start,
+                             __global const int *restrict cell_count,
+                             __global const int *restrict cell_neighbors,
+                             __global float *restrict out,
+                             const int n,
+                             const float box_size,
+                             const float cutoff2,
+                             const int cells_per_side,
+                             __global const float8 *restrict table,
+                             const float s_min,
+                             const float inv_h,
+                             const int intervals) {
+
+    int index = get_global_id(0);
+    if (index >= PARTICLES)
+        return;
+    // the sorted particles and the cells of each replica lie one after the other
+    sorted += get_global_id(1) * PARTICLES;
+    sorted_index += get_global_id(1) * PARTICLES;
+    cell_start += get_global_id(1) * cells_per_side * cells_per_side * cells_per_side;
+    cell_count += get_global_id(1) * cells_per_side * cells_per_side * cells_per_side;
+    float3 own = sorted[index];
+    int cell = cell_of(own, BOX, cells_per_side);
+    float half_box = BOX / 2;
+    float energy = 0;
+    for (int around = 0; around < 27; around++) {
+        int neighbor = cell_neighbors[cell * 27 + around];
+        if (neighbor < 0)
+            break;
+        int last = cell_start[neighbor] + cell_count[neighbor];
+        for (int i = cell_start[neighbor]; i < last; i++) {
+            float x = sorted[i].x - own.x;
+            float y = sorted[i].y - own.y;
+            float z = sorted[i].z - own.z;
+            if (x > half_box)
+                x -= BOX;
+            else{
+                if (x < -half_box)
+                    x += BOX;
+            }
+            if (y > half_box)
+                y -= BOX;
+            else{
+                if (y < -half_box)
+                    y += BOX;
+            }
+            if (z > half_box)
+                z -= BOX;
+            else{
+                if (z < -half_box)
+                    z += BOX;
+            }
+            float sq_dist = x * x + y * y + z * z;
+            if ((sq_dist < CUTOFF2) && (i != index)) {
+                float u = max(sq_dist - s_min, 0.0f) * inv_h;
+                int k = min((int)u, intervals - 1);
+                float t = u - k;
+                float8 c = table[k];
+                energy += c.s0 + t * (c.s1 + t * (c.s2 + t * c.s3));
+            }
+        }
+    }
+    out[get_global_id(1) * PARTICLES + sorted_index[index]] = energy;
+}
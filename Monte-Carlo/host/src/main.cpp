@@ -4,6 +4,13 @@
 #include "CL/opencl.h"
 #include <time.h>
 #include "parameters.h"
+#include "config.h"
+#include "snapshot.h"
+#include "rng.h"
+#include "pair_table.h"
+#include "program_cache.h"
+#define PROFILE_STORAGE
+#include "profile.h"
 #ifdef ALTERA
     #include "AOCL_Utils.h"
     using namespace aocl_utils;
@@ -16,30 +23,121 @@ cl_platform_id platform = NULL;
 cl_device_id device;
 cl_context context = NULL;
 cl_command_queue queue;
+cl_command_queue second_queue = NULL;  // the second half of the replicas with pipeline = on
 cl_program program = NULL;
 cl_kernel kernel;
 cl_mem nearest_buf;
 cl_mem output_buf;
+// With transfer = map or host_ptr the host maps its part of nearest_buf and output_buf
+// instead of copying it; on a device that works on the host's memory that copies nothing.
+bool zero_copy = false;
+cl_bool unified_memory = CL_FALSE;
+#define HOST_PAGE 4096      // alignment of the host arrays of transfer = host_ptr
+cl_mem table_buf = NULL;    // float8 coefficients per interval for mc_table
+pair_table table;
+// the cell-list pipeline of pair_search = cells, laid out in mc.cl; one set of cells per replica
+cl_kernel cell_index_kernel;
+cl_kernel cell_offsets_kernel;
+cl_kernel sort_kernel;
+cl_mem particle_cell_buf;
+cl_mem particle_slot_buf;
+cl_mem cell_count_buf;
+cl_mem cell_start_buf;
+cl_mem cell_neighbors_buf;
+cl_mem sorted_buf;
+cl_mem sorted_index_buf;
+int cells_per_side;
+int cells_total;
+size_t scan_local_size;
 
-// Problem data(positions and energy)
-cl_float3 input_a[N] = {};
-cl_float3 nearest[N] = {};
-float output[N] = {};
-float max_deviation = 0.005;
+// Problem data(positions and energy), N elements per replica, allocated once the parameters are loaded;
+// replica r owns the elements r N .. r N + N - 1
+cl_float3 *input_a;
+cl_float3 *nearest;
+float *output;
 double kernel_total_time = 0.;
+double device_busy_time = 0.;   // ns of every command of the energies
+double host_wait_time = 0.;     // s the host spent blocked on the device
+double bytes_copied = 0.;       // between host and device memory, for the positions and energies
+// the kernel runs N rounded up to whole work-groups per replica, one tile of positions in local memory each
+size_t tile_size;
+size_t padded_N;
+double pairs_per_trial;     // partners the kernel visits in one replica each trial
+uint64_t rng_state = 1;     // never seeded, like the rand() it replaces
+
+// Everything a resumed run needs besides the configuration and the energies of
+// the accepted trials, which are sections of their own.
+struct mc_checkpoint {
+    int N;
+    int nmax;
+    double box_size;
+    long trial;             // trials done
+    long accepted;          // entries in the "energies" section
+    long accepted_hung;
+    double energy;          // of the current configuration
+    uint64_t rng_state;
+    double kernel_total_time;
+};
+
+// one chain of the batched ensemble, with its own random numbers and temperature
+struct replica {
+    double temperature;
+    uint64_t rng_state;
+    float energy;           // of the current configuration
+    int accepted;
+    int accepted_hung;
+    float *energies;        // of the accepted trials, nmax of them
+};
+
+// Replicas whose energies are computed in one launch. With pipeline = on the two halves
+// take turns: one is on the device while the host accepts and moves the other.
+struct replica_group {
+    int first;
+    int count;
+    cl_command_queue queue;
+    int trial;              // trials done
+    int running;            // replicas short of nmax
+    bool in_flight;
+    cl_event write_event;
+    cl_event cell_events[4];
+    cl_event kernel_event;
+    cl_event read_event;
+    float *energy_view;     // the output of the group on the host, in output or mapped
+};
+
+// a restart runs on the configuration inside the mapped checkpoint
+snapshot restart_snapshot;
+mc_checkpoint resumed;
 
 // Function prototypes
 bool init_opencl();
 void init_problem();
-void run();
+void fill_lattice();
+void bind_kernel_args();
+void enqueue_energy(replica_group *group);
+void finish_energy(replica_group *group, float *energies);
+void trial_moves(replica *chain, cl_float3 *tmp, replica_group *group);
+void accept_trials(replica *chain, const cl_float3 *tmp, const float *energies, replica_group *group);
+void init_cells();
+void enqueue_cells(replica_group *group);
+size_t choose_work_group_size(cl_kernel tiled);
+void build_options(char *options, size_t size);
 void cleanup();
 void mc();
-void nearest_image();
-float calculate_energy_lj();
+void nearest_image(int first, int count, cl_float3 *to);
+void *aligned_array(size_t bytes);
+void calculate_energy_lj(float *energies);
+void init_pair_table();
+void restore_checkpoint();
+bool write_checkpoint(long trial, long accepted, long accepted_hung, double energy, const float *energies);
+#ifdef PROFILE
+void device_span(int phase, cl_event event, double offset);
+#endif
 
 // Entry point.
-int main() {
+int main(int argc, char **argv) {
     time_t start_total_time = time(NULL);
+    load_parameters(argc, argv);
     // Initialize OpenCL.
     if(!init_opencl()) {
       return -1;
@@ -49,6 +147,7 @@ int main() {
     mc();
     // Free the resources allocated
     cleanup();
+    PROFILE_REPORT(profile_trace);
     time_t end_total_time = time(NULL);
     printf("\nTotal execution time in seconds =  %f\n", difftime(end_total_time, start_total_time));
     printf("\nKernel execution time in milliseconds = %0.3f ms\n", (kernel_total_time / 1000000.0) );
@@ -60,6 +159,9 @@ int main() {
 // Initializes the OpenCL objects.
 bool init_opencl() {
     cl_int status;
+    const char *cache_state = "off";
+    struct timespec startup_start, startup_end;
+    clock_gettime(CLOCK_MONOTONIC, &startup_start);
 
     printf("Initializing OpenCL\n");
     #ifdef ALTERA
@@ -73,9 +175,10 @@ bool init_opencl() {
         cl_platform_id pls[MAX_PLATFORMS_COUNT];
         clGetPlatformIDs(MAX_PLATFORMS_COUNT, pls, &num_platforms);
         char vendor[128];
-        for (int i = 0; i < MAX_PLATFORMS_COUNT; i++){
+        // opencl_vendor picks another runtime, e.g. "pocl" to run on the CPU
+        for (cl_uint i = 0; i < num_platforms && i < MAX_PLATFORMS_COUNT; i++){
             clGetPlatformInfo (pls[i], CL_PLATFORM_VENDOR, sizeof(vendor), vendor, NULL);
-            if (!strcmp("NVIDIA Corporation", vendor))
+            if (strstr(vendor, opencl_vendor) != NULL)
             {
                 platform = pls[i];
                 break;
@@ -96,7 +199,7 @@ bool init_opencl() {
     #endif
     #ifdef NVIDIA
         cl_uint num_devices;
-        clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU , 1, &device, &num_devices);
+        clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, &num_devices);
     #endif
 
     context = clCreateContext(NULL, 1, &device, NULL, NULL, &status);
@@ -104,6 +207,10 @@ bool init_opencl() {
 
     queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
     checkError(status, "Failed to create command queue");
+    if (pipeline) {
+        second_queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+        checkError(status, "Failed to create the second command queue");
+    }
 
     #ifdef ALTERA
         std::string binary_file = getBoardBinaryFile("mc", device);
@@ -111,49 +218,114 @@ bool init_opencl() {
         program = createProgramFromBinary(context, binary_file.c_str(), &device, 1);
     #endif
     #ifdef NVIDIA
-        int MAX_SOURCE_SIZE  = 65536;
-        FILE *fp;
-        const char fileName[] = "./device/mc.cl";
-        size_t source_size;
-        char *source_str;
-        try {
-            fp = fopen(fileName, "r");
-            if (!fp) {
-                fprintf(stderr, "Failed to load kernel.\n");
-                exit(1);
-            }
-            source_str = (char *)malloc(MAX_SOURCE_SIZE);
-            source_size = fread(source_str, 1, MAX_SOURCE_SIZE, fp);
-            fclose(fp);
+        // the program for this run, from the cache when an earlier run built the same one
+        char options[256];
+        bool cached;
+        build_options(options, sizeof(options));
+        struct timespec build_start, build_end;
+        clock_gettime(CLOCK_MONOTONIC, &build_start);
+        program = program_cache_build(context, device, "./device/mc.cl", options, program_cache, &cached, &status);
+        checkError(status, "Failed to build program");
+        clock_gettime(CLOCK_MONOTONIC, &build_end);
+        printf("program: %s in %.3f ms, options \"%s\"\n", cached ? "cached binary" : "built from source",
+            1e3 * (build_end.tv_sec - build_start.tv_sec) + 1e-6 * (build_end.tv_nsec - build_start.tv_nsec), options);
+        if (program_cache[0] != '\0') {
+            cache_state = cached ? "hot" : "cold";
         }
-        catch (int a) {
-            printf("%f", a);
-        }
-        program = clCreateProgramWithSource(context, 1, (const char **)&source_str, (const size_t *)&source_size, &status);
+    #endif
+    #ifdef ALTERA
+        // Build the program that was just created.
+        status = clBuildProgram(program, 0, NULL, "", NULL, NULL);
+        checkError(status, "Failed to build program");
     #endif
 
-    // Build the program that was just created.
-    status = clBuildProgram(program, 0, NULL, "", NULL, NULL);
-    checkError(status, "Failed to build program");
-
-    const char *kernel_name = "mc";
+    const char *kernel_name = potential == POTENTIAL_TABLE ? "mc_table" : "mc";
+    if (pair_search == PAIR_SEARCH_CELLS) {
+        kernel_name = potential == POTENTIAL_TABLE ? "mc_cells_table" : "mc_cells";
+    }
     kernel = clCreateKernel(program, kernel_name, &status);
     checkError(status, "Failed to create kernel");
+    tile_size = choose_work_group_size(kernel);
+    padded_N = (N + tile_size - 1) / tile_size * tile_size;
+    printf("kernel: %zu x %d work-items in groups of %zu\n", padded_N, replicas, tile_size);
+
+    // an SoC, or a CPU, shares its memory with the host: map instead of copying there,
+    // unless the pipeline has the other half of the replicas on the device meanwhile
+    clGetDeviceInfo(device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified_memory), &unified_memory, NULL);
+    if (transfer == TRANSFER_AUTO) {
+        transfer = unified_memory && !pipeline ? TRANSFER_MAP : TRANSFER_COPY;
+    }
+    zero_copy = transfer != TRANSFER_COPY;
+    cl_mem_flags host_memory = 0;
+    if (transfer == TRANSFER_MAP) {
+        host_memory = CL_MEM_ALLOC_HOST_PTR;
+    } else if (transfer == TRANSFER_HOST_PTR) {
+        // the buffers run on these arrays themselves
+        host_memory = CL_MEM_USE_HOST_PTR;
+        nearest = (cl_float3*)aligned_array(N * replicas * sizeof(cl_float3));
+        output = (float*)aligned_array(N * replicas * sizeof(float));
+        if (!nearest || !output) {
+            printf("Failed to allocate the problem data for N = %d\n", N);
+            exit(1);
+        }
+    }
+    printf("transfers: %s, device memory %s the host\n", transfer == TRANSFER_COPY ? "copy" : transfer == TRANSFER_MAP ? "map" : "host_ptr",
+        unified_memory ? "shared with" : "apart from");
 
     // Input buffer.
-    nearest_buf = clCreateBuffer(context, CL_MEM_READ_ONLY,
-        N * sizeof(cl_float3), NULL, &status);
+    nearest_buf = clCreateBuffer(context, CL_MEM_READ_ONLY | host_memory,
+        N * replicas * sizeof(cl_float3), nearest, &status);
     checkError(status, "Failed to create buffer for input A");
 
     // Output buffer.
-    output_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-        N * sizeof(float), NULL, &status);
+    output_buf = clCreateBuffer(context, CL_MEM_WRITE_ONLY | host_memory,
+        N * replicas * sizeof(float), output, &status);
     checkError(status, "Failed to create buffer for output");
 
+    if (potential == POTENTIAL_TABLE) {
+        init_pair_table();
+    }
+    pairs_per_trial = (double)N * (N - 1);
+    if (pair_search == PAIR_SEARCH_CELLS) {
+        init_cells();
+    }
+    bind_kernel_args();
+
+    clock_gettime(CLOCK_MONOTONIC, &startup_end);
+    // run twice to see the startup with the cache cold and hot
+    printf("OpenCL ready in %.3f ms, program cache %s\n",
+        1e3 * (startup_end.tv_sec - startup_start.tv_sec) + 1e-6 * (startup_end.tv_nsec - startup_start.tv_nsec),
+        cache_state);
+
     return true;
 }
 
 void init_problem() {
+    if (transfer == TRANSFER_COPY) {
+        nearest = (cl_float3*)calloc(N * replicas, sizeof(cl_float3));
+        output = (float*)calloc(N * replicas, sizeof(float));
+    }
+    if (restart_path[0] != '\0') {
+        restore_checkpoint();
+    } else {
+        input_a = (cl_float3*)calloc(N * replicas, sizeof(cl_float3));
+    }
+    if (!input_a || (transfer != TRANSFER_MAP && (!nearest || !output))) {
+        printf("Failed to allocate the problem data for N = %d\n", N);
+        exit(1);
+    }
+    if (restart_path[0] != '\0') {
+        return;
+    }
+    fill_lattice();
+    // every replica starts from the same lattice, they part with their first moves
+    for (int r = 1; r < replicas; r++) {
+        memcpy(input_a + (long)r * N, input_a, sizeof(cl_float3) * N);
+    }
+}
+
+// the first N sites of a cubic lattice, the start of replica 0
+void fill_lattice() {
     int count = 0;
     for (double i = -(box_size - initial_dist_to_edge)/2; i < (box_size - initial_dist_to_edge)/2; i += initial_dist_by_one_axis) {
         for (double j = -(box_size - initial_dist_to_edge)/2; j < (box_size - initial_dist_to_edge)/2; j += initial_dist_by_one_axis) {
@@ -167,108 +339,581 @@ void init_problem() {
         }
     }
     if( count < N ){
-        printf("error decrease initial_dist parameter, count is %ld  N is %ld \n", count, N);
+        printf("error decrease initial_dist parameter, count is %d  N is %d \n", count, N);
         exit(1);
     }
 }
 
-float calculate_energy_lj() {
-    nearest_image();
-    memset(output, 0, sizeof(output));
-    run();
-    float total_energy = 0;
-    for (unsigned i = 0; i < N; i++)
-        total_energy+=output[i];
-    total_energy/=2;
-    return total_energy;
+// Tabulates the unshifted pair the mc kernel computes and uploads it as floats.
+void init_pair_table() {
+    cl_int status;
+    if (!build_pair_table(&table, lennard_jones_pair, NULL, table_rmin, rc, table_tolerance, NULL, 0)) {
+        printf("pair table: %d intervals reach only a relative error of %.1e\n", table.intervals, table.max_error);
+    } else {
+        printf("pair table: %d intervals, relative error %.1e\n", table.intervals, table.max_error);
+    }
+    cl_float *coefficients = (cl_float*)malloc(sizeof(cl_float) * PAIR_TABLE_STRIDE * table.intervals);
+    for (long c = 0; c < (long)PAIR_TABLE_STRIDE * table.intervals; c++) {
+        coefficients[c] = (cl_float)table.coefficients[c];
+    }
+    table_buf = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        sizeof(cl_float) * PAIR_TABLE_STRIDE * table.intervals, coefficients, &status);
+    checkError(status, "Failed to create buffer for the pair table");
+    free(coefficients);
+}
+
+void restore_checkpoint() {
+    if (!snapshot_map(restart_path, &restart_snapshot)) {
+        printf("Failed to map checkpoint %s\n", restart_path);
+        exit(1);
+    }
+    const mc_checkpoint *state = (const mc_checkpoint*)snapshot_find(&restart_snapshot, "state", sizeof(mc_checkpoint));
+    if (state == NULL) {
+        printf("Checkpoint %s is damaged or belongs to another problem\n", restart_path);
+        exit(1);
+    }
+    resumed = *state;
+    if (resumed.N != N || resumed.box_size != box_size || resumed.accepted > nmax) {
+        printf("Checkpoint %s holds N %d in box %g with %ld accepted trials, this run has N %d in box %g and nmax %d\n",
+            restart_path, resumed.N, resumed.box_size, resumed.accepted, N, box_size, nmax);
+        exit(1);
+    }
+    // the private mapping copies a page only once the run writes to it
+    input_a = (cl_float3*)snapshot_find(&restart_snapshot, "positions", N * sizeof(cl_float3));
+    if (input_a == NULL) {
+        printf("Checkpoint %s is damaged or belongs to another problem\n", restart_path);
+        exit(1);
+    }
+    rng_state = resumed.rng_state;
+    kernel_total_time = resumed.kernel_total_time;
+    printf("resumed from %s at trial %ld\n", restart_path, resumed.trial);
+}
+
+bool write_checkpoint(long trial, long accepted, long accepted_hung, double energy, const float *energies) {
+    mc_checkpoint state = { N, nmax, box_size, trial, accepted, accepted_hung, energy, rng_state, kernel_total_time };
+    snapshot_section sections[] = {
+        { "state", &state, sizeof(state) },
+        { "positions", input_a, N * sizeof(cl_float3) },
+        { "energies", energies, sizeof(float) * accepted },
+    };
+    return snapshot_write(checkpoint_path, sections, sizeof(sections) / sizeof(sections[0]));
+}
+
+// the energy of every replica's configuration, one launch for all of them
+void calculate_energy_lj(float *energies) {
+    replica_group all = { 0, replicas, queue };
+    enqueue_energy(&all);
+    finish_energy(&all, energies);
 }
 
 void mc() {
     int i = 0;
-    int good_iter = 0;
-    int good_iter_hung = 0;
-    float energy_ar[nmax] = {};
-    float u1 = calculate_energy_lj();
-    printf("energy is %f\n", u1/N);
-    while (1) {
-        if ((good_iter == nmax) || (i == total_it)) {
-            printf("\nenergy is %f \ngood iters percent %f \n", energy_ar[good_iter-1]/N, (float)good_iter/(float)total_it);
-            break;
+    replica *chain = (replica*)calloc(replicas, sizeof(replica));
+    float *energies = (float*)calloc(replicas, sizeof(float));
+    cl_float3 *tmp = (cl_float3*)malloc(sizeof(cl_float3) * N * replicas);
+    calculate_energy_lj(energies);
+    for (int r = 0; r < replicas; r++) {
+        chain[r].temperature = Temperature + r * replica_temperature_step;
+        // replica 0 draws the numbers a single chain would
+        chain[r].rng_state = r == 0 ? rng_state : rng_mix(rng_state + r);
+        chain[r].energy = energies[r];
+        chain[r].energies = (float*)calloc(nmax, sizeof(float));
+    }
+    if (restart_path[0] != '\0') {
+        i = (int)resumed.trial;
+        chain[0].accepted = (int)resumed.accepted;
+        chain[0].accepted_hung = (int)resumed.accepted_hung;
+        chain[0].energy = (float)resumed.energy;
+        const float *saved = (const float*)snapshot_find(&restart_snapshot, "energies", sizeof(float) * chain[0].accepted);
+        if (saved == NULL) {
+            printf("Checkpoint %s is damaged or belongs to another problem\n", restart_path);
+            exit(1);
+        }
+        memcpy(chain[0].energies, saved, sizeof(float) * chain[0].accepted);
+    }
+    printf("energy is %f\n", chain[0].energy/N);
+    double checkpoint_time = 0;
+    int checkpoints = 0;
+    int first_trial = i;
+    int groups = pipeline ? 2 : 1;
+    replica_group group[2];
+    for (int g = 0; g < groups; g++) {
+        group[g].first = replicas * g / groups;
+        group[g].count = replicas * (g + 1) / groups - group[g].first;
+        group[g].queue = g == 0 ? queue : second_queue;
+        group[g].trial = i;
+        group[g].running = 0;
+        group[g].in_flight = false;
+        // a replica that has accepted nmax trials stops moving, the others go on
+        for (int r = group[g].first; r < group[g].first + group[g].count; r++)
+            group[g].running += chain[r].accepted < nmax;
+    }
+    struct timespec loop_start, loop_end;
+    clock_gettime(CLOCK_MONOTONIC, &loop_start);
+    for (int g = 0; g < groups; g++) {
+        if ((group[g].running > 0) && (group[g].trial < total_it)) {
+            trial_moves(chain, tmp, &group[g]);
+            enqueue_energy(&group[g]);
+        }
+    }
+    // each turn waits for one group only; with two of them the other one keeps the device busy
+    for (int g = 0; group[0].in_flight || group[groups - 1].in_flight; g = (g + 1) % groups) {
+        replica_group *turn = &group[g];
+        if (!turn->in_flight)
+            continue;
+        finish_energy(turn, energies);
+        accept_trials(chain, tmp, energies, turn);
+        turn->trial++;
+        if (checkpoint_path[0] != '\0' && (turn->trial % checkpoint_every == 0 || turn->trial == total_it)) {
+            PROFILE_BEGIN(PROFILE_CHECKPOINT);
+            struct timespec checkpoint_start, checkpoint_end;
+            clock_gettime(CLOCK_MONOTONIC, &checkpoint_start);
+            // checkpoints need replicas = 1, so a single group
+            rng_state = chain[0].rng_state;
+            if (!write_checkpoint(turn->trial, chain[0].accepted, chain[0].accepted_hung, chain[0].energy, chain[0].energies)) {
+                printf("Failed to write checkpoint %s at trial %d\n", checkpoint_path, turn->trial);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &checkpoint_end);
+            PROFILE_END(PROFILE_CHECKPOINT);
+            checkpoint_time += (checkpoint_end.tv_sec - checkpoint_start.tv_sec) + 1e-9 * (checkpoint_end.tv_nsec - checkpoint_start.tv_nsec);
+            checkpoints++;
+        }
+        if ((turn->running > 0) && (turn->trial < total_it)) {
+            trial_moves(chain, tmp, turn);
+            enqueue_energy(turn);
         }
-        cl_float3 tmp[N];
-        memcpy(tmp, input_a, sizeof(cl_float3)*N);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &loop_end);
+    double loop_time = (loop_end.tv_sec - loop_start.tv_sec) + 1e-9 * (loop_end.tv_nsec - loop_start.tv_nsec);
+    for (int r = 0; r < replicas; r++) {
+        if (replicas > 1)
+            printf("\nreplica %d at temperature %g", r, chain[r].temperature);
+        float last = chain[r].accepted > 0 ? chain[r].energies[chain[r].accepted - 1] : chain[r].energy;
+        printf("\nenergy is %f \ngood iters percent %f \n", last/N, (float)chain[r].accepted/(float)total_it);
+    }
+    if (checkpoints > 0) {
+        printf("checkpoint %s: %d written, %.3f ms each\n", checkpoint_path, checkpoints, 1000 * checkpoint_time / checkpoints);
+    }
+    // the replicas that stopped are computed along with the rest of their group
+    int trials = 0;
+    double replica_trials = 0;
+    for (int g = 0; g < groups; g++) {
+        if (group[g].trial - first_trial > trials)
+            trials = group[g].trial - first_trial;
+        replica_trials += (double)group[g].count * (group[g].trial - first_trial);
+    }
+    printf("%d trials of %d replicas in %.3f s of trial loop\n", trials, replicas, loop_time);
+    printf("throughput: %.4e trials/s, %.4e pairs/s\n", replica_trials / loop_time,
+        pairs_per_trial * replica_trials / loop_time);
+    double hidden = device_busy_time * 1e-6 - host_wait_time * 1e3;
+    printf("pipeline %s: device busy %.3f ms, host blocked %.3f ms, %.3f ms of device time hidden\n",
+        pipeline ? "on" : "off", device_busy_time * 1e-6, host_wait_time * 1e3, hidden > 0 ? hidden : 0);
+    printf("transfers %s: %.0f bytes copied per trial of a replica\n", zero_copy ? "mapped" : "copied",
+        replica_trials > 0 ? bytes_copied / replica_trials : 0);
+    for (int r = 0; r < replicas; r++)
+        free(chain[r].energies);
+    free(chain);
+    free(energies);
+    free(tmp);
+}
+
+// Keeps the configurations of the group in tmp and moves every running replica of it.
+void trial_moves(replica *chain, cl_float3 *tmp, replica_group *group) {
+    PROFILE_BEGIN(PROFILE_TRIAL_MOVE);
+    long first = (long)group->first * N;
+    memcpy(tmp + first, input_a + first, sizeof(cl_float3) * N * group->count);
+    for (int r = group->first; r < group->first + group->count; r++) {
+        if (chain[r].accepted == nmax)
+            continue;
+        cl_float3 *moved = input_a + (long)r * N;
+        rng_state = chain[r].rng_state;
         for (int particle = 0; particle < N; particle++) {
             //ofsset between -max_deviation/2 and max_deviation/2
-            double ex = (double)rand() / (double)RAND_MAX * max_deviation - max_deviation / 2;
-            double ey = (double)rand() / (double)RAND_MAX * max_deviation - max_deviation / 2;
-            double ez = (double)rand() / (double)RAND_MAX * max_deviation - max_deviation / 2;
-            input_a[particle].x = input_a[particle].x + ex;
-            input_a[particle].y = input_a[particle].y + ex;
-            input_a[particle].z = input_a[particle].z + ex;
+            double ex = rng_uniform() * max_deviation - max_deviation / 2;
+            double ey = rng_uniform() * max_deviation - max_deviation / 2;
+            double ez = rng_uniform() * max_deviation - max_deviation / 2;
+            moved[particle].x = moved[particle].x + ex;
+            moved[particle].y = moved[particle].y + ex;
+            moved[particle].z = moved[particle].z + ex;
         }
-        double u2 = calculate_energy_lj();
-        double deltaU_div_T = (u1 - u2) / Temperature;
+        chain[r].rng_state = rng_state;
+    }
+    PROFILE_END(PROFILE_TRIAL_MOVE);
+}
+
+// The Metropolis test of every running replica of the group; a rejected one gets its configuration back from tmp.
+void accept_trials(replica *chain, const cl_float3 *tmp, const float *energies, replica_group *group) {
+    for (int r = group->first; r < group->first + group->count; r++) {
+        if (chain[r].accepted == nmax)
+            continue;
+        rng_state = chain[r].rng_state;
+        double u1 = chain[r].energy;
+        double u2 = energies[r];
+        double deltaU_div_T = (u1 - u2) / chain[r].temperature;
         double probability = exp(deltaU_div_T);
-        double rand_0_1 = (double)rand() / (double)RAND_MAX;
+        double rand_0_1 = rng_uniform();
         if ((u2 < u1) || (probability <= rand_0_1)) {
-            u1 = u2;
-            energy_ar[good_iter] = u2;
-            good_iter++;
-            good_iter_hung++;
+            chain[r].energy = u2;
+            chain[r].energies[chain[r].accepted] = u2;
+            chain[r].accepted++;
+            chain[r].accepted_hung++;
+            group->running -= chain[r].accepted == nmax;
         }
         else {
-            memcpy(input_a, tmp, sizeof(cl_float3) * N);
+            memcpy(input_a + (long)r * N, tmp + (long)r * N, sizeof(cl_float3) * N);
         }
-        i++;
+        chain[r].rng_state = rng_state;
     }
 }
-void run() {
-    cl_int status;
-    cl_event kernel_event;
-    cl_event finish_event;
-    cl_ulong time_start, time_end;
-    double total_time;
-
-    cl_event write_event;
-    status = clEnqueueWriteBuffer(queue, nearest_buf, CL_FALSE,
-        0, N * sizeof(cl_float3), nearest, 0, NULL, &write_event);
-    checkError(status, "Failed to transfer input A");
 
+// The arguments of the energy kernel are the same every trial, so they are set once.
+void bind_kernel_args() {
+    cl_int status;
     unsigned argi = 0;
 
-    size_t global_work_size[1] = {N};
-    size_t local_work_size[1] = {N};
-    status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &nearest_buf);
-    checkError(status, "Failed to set argument nearest");
+    cl_int particle_count = N;
+    cl_float box = box_size;
+    cl_float cutoff2 = rc * rc;
+    if (pair_search == PAIR_SEARCH_CELLS) {
+        status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &sorted_buf);
+        checkError(status, "Failed to set argument sorted");
+        status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &sorted_index_buf);
+        checkError(status, "Failed to set argument sorted_index");
+        status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &cell_start_buf);
+        checkError(status, "Failed to set argument cell_start");
+        status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &cell_count_buf);
+        checkError(status, "Failed to set argument cell_count");
+        status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &cell_neighbors_buf);
+        checkError(status, "Failed to set argument cell_neighbors");
+    } else {
+        status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &nearest_buf);
+        checkError(status, "Failed to set argument nearest");
+    }
 
     status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &output_buf);
     checkError(status, "Failed to set argument output");
 
-    status = clEnqueueNDRangeKernel(queue, kernel, 1, NULL,
-        global_work_size, local_work_size, 1, &write_event, &kernel_event);
+    status = clSetKernelArg(kernel, argi++, sizeof(cl_int), &particle_count);
+    checkError(status, "Failed to set argument n");
+
+    status = clSetKernelArg(kernel, argi++, sizeof(cl_float), &box);
+    checkError(status, "Failed to set argument box_size");
+
+    status = clSetKernelArg(kernel, argi++, sizeof(cl_float), &cutoff2);
+    checkError(status, "Failed to set argument cutoff2");
+
+    if (pair_search == PAIR_SEARCH_CELLS) {
+        cl_int cells = cells_per_side;
+        status = clSetKernelArg(kernel, argi++, sizeof(cl_int), &cells);
+        checkError(status, "Failed to set argument cells_per_side");
+    } else {
+        status = clSetKernelArg(kernel, argi++, tile_size * sizeof(cl_float3), NULL);
+        checkError(status, "Failed to set argument tile");
+    }
+
+    if (potential == POTENTIAL_TABLE) {
+        cl_float s_min = table.s_min;
+        cl_float inv_h = table.inv_h;
+        cl_int intervals = table.intervals;
+        status = clSetKernelArg(kernel, argi++, sizeof(cl_mem), &table_buf);
+        checkError(status, "Failed to set argument table");
+        status = clSetKernelArg(kernel, argi++, sizeof(cl_float), &s_min);
+        checkError(status, "Failed to set argument s_min");
+        status = clSetKernelArg(kernel, argi++, sizeof(cl_float), &inv_h);
+        checkError(status, "Failed to set argument inv_h");
+        status = clSetKernelArg(kernel, argi++, sizeof(cl_int), &intervals);
+        checkError(status, "Failed to set argument intervals");
+    }
+}
+
+// Wraps the positions of the group and enqueues their write, the cells, the kernel and the
+// read of the energies on the group's queue, without waiting for any of it. With zero_copy
+// the positions are wrapped straight into the mapped buffer, and the unmap and the map of
+// the energies take the place of the write and the read.
+void enqueue_energy(replica_group *group) {
+    cl_int status;
+    long first = (long)group->first * N;
+    long count = (long)group->count * N;
+    cl_float3 *to = nearest + first;
+    if (zero_copy) {
+        // the queue holds nothing of the group's that still reads the buffer
+        to = (cl_float3*)clEnqueueMapBuffer(group->queue, nearest_buf, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION,
+            first * sizeof(cl_float3), count * sizeof(cl_float3), 0, NULL, NULL, &status);
+        checkError(status, "Failed to map input A");
+    }
+    PROFILE_BEGIN(PROFILE_WRAP);
+    nearest_image(group->first, group->count, to);
+    PROFILE_END(PROFILE_WRAP);
+    if (zero_copy) {
+        status = clEnqueueUnmapMemObject(group->queue, nearest_buf, to, 0, NULL, &group->write_event);
+        checkError(status, "Failed to unmap input A");
+    } else {
+        status = clEnqueueWriteBuffer(group->queue, nearest_buf, CL_FALSE,
+            first * sizeof(cl_float3), count * sizeof(cl_float3), to, 0, NULL, &group->write_event);
+        checkError(status, "Failed to transfer input A");
+    }
+    if (!zero_copy || !unified_memory) {
+        bytes_copied += count * sizeof(cl_float3);
+        PROFILE_COUNT(PROFILE_BYTES_TO_DEVICE, count * sizeof(cl_float3));
+    }
+
+    // the queue runs in order, so the cells are built from the positions just written
+    if (pair_search == PAIR_SEARCH_CELLS) {
+        enqueue_cells(group);
+    }
+
+    // one work-item per particle of every replica fills the device even for small N;
+    // the offset of the second dimension is the first replica of the group
+    size_t global_work_offset[2] = {0, (size_t)group->first};
+    size_t global_work_size[2] = {padded_N, (size_t)group->count};
+    size_t local_work_size[2] = {tile_size, 1};
+    status = clEnqueueNDRangeKernel(group->queue, kernel, 2, global_work_offset,
+        global_work_size, local_work_size, 1, &group->write_event, &group->kernel_event);
     checkError(status, "Failed to launch kernel");
+    PROFILE_COUNT(PROFILE_PAIRS_EVALUATED, (long)pairs_per_trial * group->count);
+
+    if (zero_copy) {
+        group->energy_view = (float*)clEnqueueMapBuffer(group->queue, output_buf, CL_FALSE, CL_MAP_READ,
+            first * sizeof(float), count * sizeof(float), 1, &group->kernel_event, &group->read_event, &status);
+        checkError(status, "Failed to map the energies");
+    } else {
+        group->energy_view = output + first;
+        status = clEnqueueReadBuffer(group->queue, output_buf, CL_FALSE,
+            first * sizeof(float), count * sizeof(float), group->energy_view, 1, &group->kernel_event, &group->read_event);
+        checkError(status, "Failed to read the energies");
+    }
+    if (!zero_copy || !unified_memory) {
+        bytes_copied += count * sizeof(float);
+        PROFILE_COUNT(PROFILE_BYTES_FROM_DEVICE, count * sizeof(float));
+    }
+    // the device starts on it while the host turns to the other group
+    clFlush(group->queue);
+    group->in_flight = true;
+}
+
+// Waits for the energies of the group and sums them per replica into energies.
+void finish_energy(replica_group *group, float *energies) {
+    struct timespec wait_start, wait_end;
+    clock_gettime(CLOCK_MONOTONIC, &wait_start);
+    clWaitForEvents(1, &group->read_event);
+    clock_gettime(CLOCK_MONOTONIC, &wait_end);
+    host_wait_time += (wait_end.tv_sec - wait_start.tv_sec) + 1e-9 * (wait_end.tv_nsec - wait_start.tv_nsec);
+    group->in_flight = false;
+
+#ifdef PROFILE
+    // the device clock has an origin of its own; put the end of the read at the host's now
+    cl_ulong device_end;
+    clGetEventProfilingInfo(group->read_event, CL_PROFILING_COMMAND_END, sizeof(device_end), &device_end, NULL);
+    double offset = profile_now() - device_end * 1e-3;
+    device_span(PROFILE_WRITE, group->write_event, offset);
+    device_span(PROFILE_KERNEL, group->kernel_event, offset);
+    device_span(PROFILE_READ, group->read_event, offset);
+    for (int e = 0; pair_search == PAIR_SEARCH_CELLS && e < 4; e++) {
+        device_span(PROFILE_CELL_LIST, group->cell_events[e], offset);
+    }
+#endif
+
+    cl_event events[7] = { group->kernel_event, group->write_event, group->read_event };
+    int count = 3;
+    for (int e = 0; pair_search == PAIR_SEARCH_CELLS && e < 4; e++) {
+        events[count++] = group->cell_events[e];
+    }
+    for (int e = 0; e < count; e++) {
+        cl_ulong time_start, time_end;
+        clGetEventProfilingInfo(events[e], CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
+        clGetEventProfilingInfo(events[e], CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
+        device_busy_time += time_end - time_start;
+        if (e == 0) {
+            kernel_total_time += time_end - time_start;
+        }
+        clReleaseEvent(events[e]);
+    }
 
-    status = clEnqueueReadBuffer(queue, output_buf, CL_FALSE,
-        0, N * sizeof(float), output, 1, &kernel_event, &finish_event);
+    PROFILE_BEGIN(PROFILE_ENERGY_SUM);
+    for (int r = group->first; r < group->first + group->count; r++) {
+        const float *own = group->energy_view + (long)(r - group->first) * N;
+        float total_energy = 0;
+        for (int i = 0; i < N; i++)
+            total_energy+=own[i];
+        energies[r] = total_energy / 2;
+    }
+    PROFILE_END(PROFILE_ENERGY_SUM);
+    if (zero_copy) {
+        cl_int status = clEnqueueUnmapMemObject(group->queue, output_buf, group->energy_view, 0, NULL, NULL);
+        checkError(status, "Failed to unmap the energies");
+    }
+}
+
+// Cells of side >= rc, so every partner lies in the cell of a particle or in one of the
+// 26 around it; the neighbor table is built here once, the cells on the device every trial.
+void init_cells() {
+    cl_int status;
+    cells_per_side = (int)(box_size / rc);
+    cells_total = cells_per_side * cells_per_side * cells_per_side;
+    cl_int *neighbors = (cl_int*)malloc(sizeof(cl_int) * cells_total * 27);
+    int stencil = 0;
+    for (int cz = 0; cz < cells_per_side; cz++) {
+        for (int cy = 0; cy < cells_per_side; cy++) {
+            for (int cx = 0; cx < cells_per_side; cx++) {
+                int cell = (cz * cells_per_side + cy) * cells_per_side + cx;
+                cl_int *list = neighbors + cell * 27;
+                int count = 0;
+                for (int dz = -1; dz <= 1; dz++) {
+                    for (int dy = -1; dy <= 1; dy++) {
+                        for (int dx = -1; dx <= 1; dx++) {
+                            int nx = (cx + dx + cells_per_side) % cells_per_side;
+                            int ny = (cy + dy + cells_per_side) % cells_per_side;
+                            int nz = (cz + dz + cells_per_side) % cells_per_side;
+                            int neighbor = (nz * cells_per_side + ny) * cells_per_side + nx;
+                            // with fewer than 3 cells per side the periodic stencil
+                            // wraps onto itself, so every cell must be listed only once
+                            bool seen = false;
+                            for (int k = 0; k < count; k++) {
+                                if (list[k] == neighbor) {
+                                    seen = true;
+                                    break;
+                                }
+                            }
+                            if (!seen) {
+                                list[count] = neighbor;
+                                count++;
+                            }
+                        }
+                    }
+                }
+                for (int k = count; k < 27; k++) {
+                    list[k] = -1;
+                }
+                stencil = count;
+            }
+        }
+    }
+    // at uniform density
+    pairs_per_trial = (double)N * ((double)N * stencil / cells_total - 1);
+    printf("cell list: %d cells per side, %d neighbor cells each\n", cells_per_side, stencil);
+
+    cell_neighbors_buf = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        sizeof(cl_int) * cells_total * 27, neighbors, &status);
+    checkError(status, "Failed to create buffer for the neighbor cells");
+    free(neighbors);
+    particle_cell_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, N * replicas * sizeof(cl_int), NULL, &status);
+    checkError(status, "Failed to create buffer for the particle cells");
+    particle_slot_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, N * replicas * sizeof(cl_int), NULL, &status);
+    checkError(status, "Failed to create buffer for the particle slots");
+    cell_count_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, cells_total * replicas * sizeof(cl_int), NULL, &status);
+    checkError(status, "Failed to create buffer for the cell counts");
+    cell_start_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, cells_total * replicas * sizeof(cl_int), NULL, &status);
+    checkError(status, "Failed to create buffer for the cell starts");
+    sorted_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, N * replicas * sizeof(cl_float3), NULL, &status);
+    checkError(status, "Failed to create buffer for the sorted positions");
+    sorted_index_buf = clCreateBuffer(context, CL_MEM_READ_WRITE, N * replicas * sizeof(cl_int), NULL, &status);
+    checkError(status, "Failed to create buffer for the sorted indices");
+
+    cell_index_kernel = clCreateKernel(program, "cell_index", &status);
+    checkError(status, "Failed to create kernel cell_index");
+    cell_offsets_kernel = clCreateKernel(program, "cell_offsets", &status);
+    checkError(status, "Failed to create kernel cell_offsets");
+    sort_kernel = clCreateKernel(program, "sort_by_cell", &status);
+    checkError(status, "Failed to create kernel sort_by_cell");
+
+    cl_int particle_count = N;
+    cl_float box = box_size;
+    cl_int cells = cells_per_side;
+    cl_int all_cells = cells_total;
+    status = clSetKernelArg(cell_index_kernel, 0, sizeof(cl_mem), &nearest_buf);
+    status |= clSetKernelArg(cell_index_kernel, 1, sizeof(cl_mem), &particle_cell_buf);
+    status |= clSetKernelArg(cell_index_kernel, 2, sizeof(cl_mem), &particle_slot_buf);
+    status |= clSetKernelArg(cell_index_kernel, 3, sizeof(cl_mem), &cell_count_buf);
+    status |= clSetKernelArg(cell_index_kernel, 4, sizeof(cl_int), &particle_count);
+    status |= clSetKernelArg(cell_index_kernel, 5, sizeof(cl_float), &box);
+    status |= clSetKernelArg(cell_index_kernel, 6, sizeof(cl_int), &cells);
+    checkError(status, "Failed to set the arguments of cell_index");
+
+    scan_local_size = choose_work_group_size(cell_offsets_kernel);
+    status = clSetKernelArg(cell_offsets_kernel, 0, sizeof(cl_mem), &cell_count_buf);
+    status |= clSetKernelArg(cell_offsets_kernel, 1, sizeof(cl_mem), &cell_start_buf);
+    status |= clSetKernelArg(cell_offsets_kernel, 2, sizeof(cl_int), &all_cells);
+    status |= clSetKernelArg(cell_offsets_kernel, 3, scan_local_size * sizeof(cl_int), NULL);
+    checkError(status, "Failed to set the arguments of cell_offsets");
+
+    status = clSetKernelArg(sort_kernel, 0, sizeof(cl_mem), &nearest_buf);
+    status |= clSetKernelArg(sort_kernel, 1, sizeof(cl_mem), &particle_cell_buf);
+    status |= clSetKernelArg(sort_kernel, 2, sizeof(cl_mem), &particle_slot_buf);
+    status |= clSetKernelArg(sort_kernel, 3, sizeof(cl_mem), &cell_start_buf);
+    status |= clSetKernelArg(sort_kernel, 4, sizeof(cl_mem), &sorted_buf);
+    status |= clSetKernelArg(sort_kernel, 5, sizeof(cl_mem), &sorted_index_buf);
+    status |= clSetKernelArg(sort_kernel, 6, sizeof(cl_int), &particle_count);
+    status |= clSetKernelArg(sort_kernel, 7, sizeof(cl_int), &all_cells);
+    checkError(status, "Failed to set the arguments of sort_by_cell");
+}
 
-    // Release local events.
-    clReleaseEvent(write_event);
+// Counting sort of the positions of every replica of the group by cell: the clear, cell_index,
+// cell_offsets and sort_by_cell, with their events.
+void enqueue_cells(replica_group *group) {
+    cl_int status;
+    cl_int zero = 0;
+    cl_event *events = group->cell_events;
+    size_t offset[2] = {0, (size_t)group->first};
+    size_t global_work_size[2] = {padded_N, (size_t)group->count};
+    size_t local_work_size[2] = {tile_size, 1};
+    size_t scan_size[2] = {scan_local_size, (size_t)group->count};
+    size_t scan_local[2] = {scan_local_size, 1};
+    status = clEnqueueFillBuffer(group->queue, cell_count_buf, &zero, sizeof(zero),
+        group->first * cells_total * sizeof(cl_int), group->count * cells_total * sizeof(cl_int), 0, NULL, &events[0]);
+    checkError(status, "Failed to clear the cell counts");
+    status = clEnqueueNDRangeKernel(group->queue, cell_index_kernel, 2, offset,
+        global_work_size, local_work_size, 0, NULL, &events[1]);
+    checkError(status, "Failed to launch kernel cell_index");
+    status = clEnqueueNDRangeKernel(group->queue, cell_offsets_kernel, 2, offset,
+        scan_size, scan_local, 0, NULL, &events[2]);
+    checkError(status, "Failed to launch kernel cell_offsets");
+    status = clEnqueueNDRangeKernel(group->queue, sort_kernel, 2, offset,
+        global_work_size, local_work_size, 0, NULL, &events[3]);
+    checkError(status, "Failed to launch kernel sort_by_cell");
+}
 
-    // Wait for all devices to finish.
-    clWaitForEvents(1, &finish_event);
+// The -D options of mc.cl: the unrolling, and with specialize = on the constants of the run
+// as float literals equal to the arguments the kernels are passed.
+void build_options(char *options, size_t size) {
+    int length = snprintf(options, size, "-D UNROLL=%d", unroll);
+    if (specialize) {
+        snprintf(options + length, size - length, " -D PARTICLES=%d -D BOX=%.9ef -D CUTOFF2=%.9ef",
+            N, (double)(cl_float)box_size, (double)(cl_float)(rc * rc));
+    }
+}
 
-    clGetEventProfilingInfo(kernel_event, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
-    clGetEventProfilingInfo(kernel_event, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
-    total_time = time_end - time_start;
-    kernel_total_time += total_time;
+// The largest power of two that the device runs of the kernel and whose tile fits in local
+// memory, unless work_group_size sets it.
+size_t choose_work_group_size(cl_kernel tiled) {
+    if (work_group_size > 0) {
+        return work_group_size;
+    }
+    size_t kernel_limit;
+    cl_ulong local_memory;
+    cl_int status = clGetKernelWorkGroupInfo(tiled, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernel_limit), &kernel_limit, NULL);
+    checkError(status, "Failed to query the work-group size");
+    status = clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_memory), &local_memory, NULL);
+    checkError(status, "Failed to query the local memory size");
+    size_t local_size = 1;
+    while (local_size * 2 <= kernel_limit && local_size * 2 * sizeof(cl_float3) <= local_memory / 2) {
+        local_size *= 2;
+    }
+    return local_size;
+}
 
-    // Release all events.
-    clReleaseEvent(kernel_event);
-    clReleaseEvent(finish_event);
+#ifdef PROFILE
+// start to end of a profiled command, moved onto the host clock by offset microseconds
+void device_span(int phase, cl_event event, double offset) {
+    cl_ulong start, end;
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL);
+    PROFILE_SPAN(phase, start * 1e-3 + offset, end * 1e-3 + offset);
 }
+#endif
 
-void nearest_image(){
-    for (int i = 0; i < N; i++){
+// the positions of replicas first .. first + count - 1 wrapped into the box, at to
+void nearest_image(int first, int count, cl_float3 *to){
+    for (int i = first * N; i < (first + count) * N; i++){
         float x,y,z;
         if (input_a[i].x  > 0){
             x = fmod(input_a[i].x + half_box, box_size) - half_box;
@@ -288,27 +933,65 @@ void nearest_image(){
         else{
             z = fmod(input_a[i].z - half_box, box_size) + half_box;
         }
-        nearest[i] = (cl_float3){ x, y, z};
+        to[i - first * N] = (cl_float3){ x, y, z};
     }
 }
+
+// Zeroed, page-aligned and a whole number of pages, so CL_MEM_USE_HOST_PTR can leave
+// the data where it is; NULL if there is no memory.
+void *aligned_array(size_t bytes) {
+    size_t pages = (bytes + HOST_PAGE - 1) / HOST_PAGE * HOST_PAGE;
+    void *array = aligned_alloc(HOST_PAGE, pages);
+    if (array != NULL) {
+        memset(array, 0, pages);
+    }
+    return array;
+}
 // Free the resources allocated during initialization
 void cleanup() {
     if(kernel) {
       clReleaseKernel(kernel);
     }
+    if(cell_index_kernel) {
+      clReleaseKernel(cell_index_kernel);
+      clReleaseKernel(cell_offsets_kernel);
+      clReleaseKernel(sort_kernel);
+    }
+    if(cell_neighbors_buf) {
+      clReleaseMemObject(cell_neighbors_buf);
+      clReleaseMemObject(particle_cell_buf);
+      clReleaseMemObject(particle_slot_buf);
+      clReleaseMemObject(cell_count_buf);
+      clReleaseMemObject(cell_start_buf);
+      clReleaseMemObject(sorted_buf);
+      clReleaseMemObject(sorted_index_buf);
+    }
     if(queue) {
       clReleaseCommandQueue(queue);
     }
+    if(second_queue) {
+      clReleaseCommandQueue(second_queue);
+    }
     if(nearest_buf) {
       clReleaseMemObject(nearest_buf);
     }
     if(output_buf) {
       clReleaseMemObject(output_buf);
     }
+    if(table_buf) {
+      clReleaseMemObject(table_buf);
+      free_pair_table(&table);
+    }
     if(program) {
     clReleaseProgram(program);
     }
     if(context) {
     clReleaseContext(context);
     }
+    if (!snapshot_contains(&restart_snapshot, input_a)) {
+        free(input_a);
+    }
+    snapshot_unmap(&restart_snapshot);
+    free(nearest);
+    free(output);
 }
@@ -0,0 +1,235 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+// Definitions of the problem parameters declared in parameters.h and the parser
+// that sets them. Include it only from the file that holds main().
+//
+// load_parameters() reads, in this order,
+//   --config=FILE   lines of "name = value", '#' starts a comment
+//   --name=value    a single parameter
+// so later settings win over earlier ones and over the defaults below.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parameters.h"
+
+int N = 32;
+double rc = 3;
+double box_size = 6;
+double half_box = 3;
+int nmax = 30000;
+int total_it = 60000;
+int threads = 8;
+double Temperature = 1.3;
+int replicas = 1;
+double replica_temperature_step = 0;
+double max_deviation = 0.005;
+int moves = MOVES_ALL;
+int recompute_every = 100;
+double initial_dist_by_one_axis = 1.2;
+double initial_dist_to_edge = 2;
+int potential = POTENTIAL_LJ;
+double table_tolerance = 1e-6;
+double table_rmin = 0.7;
+int precision = PRECISION_DOUBLE;
+const char *checkpoint_path = "";
+int checkpoint_every = 5000;
+const char *restart_path = "";
+const char *opencl_vendor = "NVIDIA";
+int pair_search = PAIR_SEARCH_ALL;
+int pipeline = 0;
+int work_group_size = 0;
+const char *program_cache = "./device/cache";
+int specialize = 1;
+int unroll = 8;
+int transfer = TRANSFER_AUTO;
+const char *profile_trace = "";
+
+struct parameter {
+    const char *name;
+    int *int_value;             // exactly one of int_value, double_value and string_value is set
+    double *double_value;
+    const char **string_value;
+    const char **value_names;   // names accepted for the values 0, 1, ... of an int
+};
+
+const char *potential_names[] = { "lj", "table", NULL };
+const char *precision_names[] = { "double", "mixed", "validate", NULL };
+const char *pair_search_names[] = { "all", "cells", NULL };
+const char *moves_names[] = { "all", "single", NULL };
+const char *pipeline_names[] = { "off", "on", NULL };
+const char *specialize_names[] = { "off", "on", NULL };
+const char *transfer_names[] = { "auto", "copy", "map", "host_ptr", NULL };
+
+struct parameter parameters[] = {
+    { "N", &N, NULL },
+    { "rc", NULL, &rc },
+    { "box_size", NULL, &box_size },
+    { "nmax", &nmax, NULL },
+    { "total_it", &total_it, NULL },
+    { "threads", &threads, NULL },
+    { "Temperature", NULL, &Temperature },
+    { "replicas", &replicas, NULL },
+    { "replica_temperature_step", NULL, &replica_temperature_step },
+    { "max_deviation", NULL, &max_deviation },
+    { "moves", &moves, NULL, NULL, moves_names },
+    { "recompute_every", &recompute_every, NULL },
+    { "initial_dist_by_one_axis", NULL, &initial_dist_by_one_axis },
+    { "initial_dist_to_edge", NULL, &initial_dist_to_edge },
+    { "potential", &potential, NULL, NULL, potential_names },
+    { "table_tolerance", NULL, &table_tolerance },
+    { "table_rmin", NULL, &table_rmin },
+    { "precision", &precision, NULL, NULL, precision_names },
+    { "checkpoint", NULL, NULL, &checkpoint_path },
+    { "checkpoint_every", &checkpoint_every, NULL },
+    { "restart", NULL, NULL, &restart_path },
+    { "opencl_vendor", NULL, NULL, &opencl_vendor },
+    { "work_group_size", &work_group_size, NULL },
+    { "pair_search", &pair_search, NULL, NULL, pair_search_names },
+    { "pipeline", &pipeline, NULL, NULL, pipeline_names },
+    { "program_cache", NULL, NULL, &program_cache },
+    { "specialize", &specialize, NULL, NULL, specialize_names },
+    { "unroll", &unroll, NULL },
+    { "transfer", &transfer, NULL, NULL, transfer_names },
+    { "profile_trace", NULL, NULL, &profile_trace },
+};
+
+#define PARAMETER_COUNT (int)(sizeof(parameters) / sizeof(parameters[0]))
+
+static void set_parameter(const char *name, const char *value, const char *source) {
+    for (int p = 0; p < PARAMETER_COUNT; p++) {
+        if (strcmp(parameters[p].name, name) != 0) {
+            continue;
+        }
+        char *end;
+        if (parameters[p].string_value != NULL) {
+            // config file lines are reused, so keep a copy
+            *parameters[p].string_value = strdup(value);
+            return;
+        }
+        if (parameters[p].double_value != NULL) {
+            *parameters[p].double_value = strtod(value, &end);
+        } else {
+            *parameters[p].int_value = (int)strtol(value, &end, 10);
+            for (int v = 0; end == value && parameters[p].value_names != NULL && parameters[p].value_names[v] != NULL; v++) {
+                if (strcmp(parameters[p].value_names[v], value) == 0) {
+                    *parameters[p].int_value = v;
+                    end = (char*)value + strlen(value);
+                }
+            }
+        }
+        if (end == value || *end != '\0') {
+            printf("%s: bad value \"%s\" for %s\n", source, value, name);
+            exit(1);
+        }
+        return;
+    }
+    printf("%s: unknown parameter \"%s\"\n", source, name);
+    exit(1);
+}
+
+static void load_config_file(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        printf("Failed to open config file %s\n", path);
+        exit(1);
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        char name[64], value[128];
+        int fields = sscanf(line, " %63[^= \t] = %127s", name, value);
+        if (fields == 2) {
+            set_parameter(name, value, path);
+        } else if (fields == 1) {
+            printf("%s: no value for %s\n", path, name);
+            exit(1);
+        }
+    }
+    fclose(file);
+}
+
+static void load_parameters(int argc, char **argv) {
+    for (int a = 1; a < argc; a++) {
+        char *equals = strchr(argv[a], '=');
+        if (strncmp(argv[a], "--", 2) != 0 || equals == NULL) {
+            printf("usage: %s [--config=FILE] [--name=value ...]\n", argv[0]);
+            exit(1);
+        }
+        *equals = '\0';
+        if (strcmp(argv[a] + 2, "config") == 0) {
+            load_config_file(equals + 1);
+        } else {
+            set_parameter(argv[a] + 2, equals + 1, "command line");
+        }
+    }
+    half_box = box_size / 2;
+    if (N < 2 || rc <= 0 || rc > half_box || nmax < 1 || total_it < 1 || Temperature <= 0) {
+        printf("Invalid parameters: need N >= 2, 0 < rc <= box_size / 2, nmax >= 1, total_it >= 1 and Temperature > 0\n");
+        exit(1);
+    }
+    if (replicas < 1 || Temperature + (replicas - 1) * replica_temperature_step <= 0) {
+        printf("Invalid parameters: need replicas >= 1 and every replica at a temperature > 0\n");
+        exit(1);
+    }
+    if (replicas > 1 && (checkpoint_path[0] != '\0' || restart_path[0] != '\0')) {
+        printf("Invalid parameters: a checkpoint holds one chain, so replicas > 1 runs without checkpoint and restart\n");
+        exit(1);
+    }
+    if (threads < 1 || threads > MAX_THREADS) {
+        printf("Invalid parameters: need 1 <= threads <= %d\n", MAX_THREADS);
+        exit(1);
+    }
+    if (potential == POTENTIAL_TABLE && (table_tolerance <= 0 || table_rmin <= 0 || table_rmin >= rc)) {
+        printf("Invalid parameters: need table_tolerance > 0 and 0 < table_rmin < rc\n");
+        exit(1);
+    }
+    if (precision < PRECISION_DOUBLE || precision > PRECISION_VALIDATE || (precision != PRECISION_DOUBLE && potential != POTENTIAL_LJ)) {
+        printf("Invalid parameters: need a known precision, and potential = lj unless it is double\n");
+        exit(1);
+    }
+    if (moves < MOVES_ALL || moves > MOVES_SINGLE || recompute_every < 1 || (moves == MOVES_SINGLE && precision != PRECISION_DOUBLE)) {
+        printf("Invalid parameters: need a known moves, recompute_every >= 1, and precision = double with moves = single\n");
+        exit(1);
+    }
+#if defined(ALTERA) || defined(NVIDIA)
+    // a single-particle trial would be a launch for O(N) pairs, so only the OpenMP engine has them
+    if (moves != MOVES_ALL) {
+        printf("Invalid parameters: the OpenCL host moves every particle of a trial, moves = single needs the OpenMP engine\n");
+        printf("usage: %s [--config=FILE] [--name=value ...]\n", argv[0]);
+        exit(1);
+    }
+#endif
+    if (work_group_size < 0 || pair_search < PAIR_SEARCH_ALL || pair_search > PAIR_SEARCH_CELLS) {
+        printf("Invalid parameters: need work_group_size >= 0 and a known pair_search\n");
+        exit(1);
+    }
+    if (pipeline < 0 || pipeline > 1 || (pipeline == 1 && replicas < 2)) {
+        printf("Invalid parameters: pipeline = on takes turns between two halves of the replicas, so it needs replicas >= 2\n");
+        exit(1);
+    }
+    if (specialize < 0 || specialize > 1 || unroll < 1 || transfer < TRANSFER_AUTO || transfer > TRANSFER_HOST_PTR) {
+        printf("Invalid parameters: need specialize off or on, unroll >= 1 and a known transfer\n");
+        exit(1);
+    }
+    // the two halves of the pipeline share the position and energy buffers, and mapping a
+    // buffer while the other queue's kernel uses it is undefined even for separate regions
+    if (pipeline == 1 && (transfer == TRANSFER_MAP || transfer == TRANSFER_HOST_PTR)) {
+        printf("Invalid parameters: pipeline = on copies the positions and energies, so it needs transfer = auto or copy\n");
+        exit(1);
+    }
+    if (checkpoint_path[0] != '\0' && checkpoint_every < 1) {
+        printf("Invalid parameters: need checkpoint_every >= 1\n");
+        exit(1);
+    }
+#ifndef PROFILE
+    if (profile_trace[0] != '\0') {
+        printf("Invalid parameters: profile_trace needs a build with -D PROFILE\n");
+        exit(1);
+    }
+#endif
+}
+
+#endif
@@ -1,6 +1,6 @@
 #include <string.h>
 #include "CL/cl.h"
-#define MAX_PLATFORMS_COUNT 2
+#define MAX_PLATFORMS_COUNT 8
 
 void checkError(cl_int err, const char *operation){
     if (err != CL_SUCCESS){
@@ -0,0 +1,156 @@
+#ifndef PAIR_TABLE_H
+#define PAIR_TABLE_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+// Cubic interpolation tables of a pair potential keyed on s = r^2, so a pair
+// costs a table lookup and two Horner polynomials instead of the reciprocals.
+// Interval k covers [s_min + k h, s_min + (k + 1) h) and holds, for t in [0, 1),
+//   energy(s)     = e0 + t (e1 + t (e2 + t e3))
+//   multiplier(s) = m0 + t (m1 + t (m2 + t m3))
+// as the 8 doubles e0..e3 m0..m3, one cache line per interval. The multiplier
+// is dU/dr / r: the force on i from j is multiplier * (r_j - r_i).
+// Pairs closer than r_min get the values at r_min.
+#define PAIR_TABLE_STRIDE 8
+#define PAIR_TABLE_MIN_INTERVALS 64
+#define PAIR_TABLE_MAX_INTERVALS (1 << 18)
+
+// energy and multiplier of a pair at squared distance s
+typedef void (*pair_function)(double s, const void *context, double *energy, double *multiplier);
+
+struct pair_table {
+    double s_min;
+    double s_max;
+    double inv_h;           // intervals per unit of s
+    int intervals;
+    double max_error;       // measured, relative to max(|exact|, 1)
+    double *coefficients;   // PAIR_TABLE_STRIDE per interval
+};
+typedef struct pair_table pair_table;
+
+// Lennard-Jones 4 (1 / r12 - 1 / r6) less *(const double*)context, the shift at the cutoff
+static inline void lennard_jones_pair(double s, const void *context, double *energy, double *multiplier) {
+    double inv2 = 1 / s;
+    double inv6 = inv2 * inv2 * inv2;
+    *energy = 4 * (inv6 * inv6 - inv6) - (context != NULL ? *(const double*)context : 0);
+    *multiplier = 24 * (inv6 * inv2 - 2 * inv6 * inv6 * inv2);
+}
+
+// value of interval k of a table at t in [0, 1); offset 0 is the energy, 4 the multiplier
+static inline double pair_table_cubic(const double *coefficients, int k, int offset, double t) {
+    const double *c = coefficients + (long)k * PAIR_TABLE_STRIDE + offset;
+    return c[0] + t * (c[1] + t * (c[2] + t * c[3]));
+}
+
+static inline void pair_table_lookup(const pair_table *table, double s, double *energy, double *multiplier) {
+    double u = s > table->s_min ? (s - table->s_min) * table->inv_h : 0;
+    int k = (int)u;
+    k = k < table->intervals - 1 ? k : table->intervals - 1;
+    double t = u - k;
+    *energy = pair_table_cubic(table->coefficients, k, 0, t);
+    *multiplier = pair_table_cubic(table->coefficients, k, 4, t);
+}
+
+// Hermite cubics through the exact values and s-derivatives at both ends of every
+// interval. The derivatives are 5-point differences: the multiplier need not be
+// the derivative of the energy, e.g. where a switching function only scales the force.
+static inline void fill_pair_table(pair_table *table, pair_function function, const void *context) {
+    double h = (table->s_max - table->s_min) / table->intervals;
+    double previous_energy = 0, previous_multiplier = 0, previous_energy_slope = 0, previous_slope = 0;
+    for (int k = 0; k <= table->intervals; k++) {
+        double s = table->s_min + k * h;
+        double energy, multiplier, e[4], m[4];
+        function(s, context, &energy, &multiplier);
+        double delta = 1e-3 * h;
+        function(s - 2 * delta, context, &e[0], &m[0]);
+        function(s - delta, context, &e[1], &m[1]);
+        function(s + delta, context, &e[2], &m[2]);
+        function(s + 2 * delta, context, &e[3], &m[3]);
+        double energy_slope = (e[0] - 8 * e[1] + 8 * e[2] - e[3]) / (12 * delta);
+        double slope = (m[0] - 8 * m[1] + 8 * m[2] - m[3]) / (12 * delta);
+        if (k > 0) {
+            double *c = table->coefficients + (long)(k - 1) * PAIR_TABLE_STRIDE;
+            double e0 = previous_energy, e1 = energy, de0 = previous_energy_slope * h, de1 = energy_slope * h;
+            double m0 = previous_multiplier, m1 = multiplier, dm0 = previous_slope * h, dm1 = slope * h;
+            c[0] = e0;
+            c[1] = de0;
+            c[2] = 3 * (e1 - e0) - 2 * de0 - de1;
+            c[3] = 2 * (e0 - e1) + de0 + de1;
+            c[4] = m0;
+            c[5] = dm0;
+            c[6] = 3 * (m1 - m0) - 2 * dm0 - dm1;
+            c[7] = 2 * (m0 - m1) + dm0 + dm1;
+        }
+        previous_energy = energy;
+        previous_multiplier = multiplier;
+        previous_energy_slope = energy_slope;
+        previous_slope = slope;
+    }
+}
+
+// largest error of the table at the quarter points of every interval
+static inline double pair_table_error(const pair_table *table, pair_function function, const void *context) {
+    double max_error = 0;
+    for (int k = 0; k < table->intervals; k++) {
+        for (int q = 1; q < 4; q++) {
+            double s = table->s_min + (k + 0.25 * q) / table->inv_h;
+            double energy, multiplier, table_energy, table_multiplier;
+            function(s, context, &energy, &multiplier);
+            pair_table_lookup(table, s, &table_energy, &table_multiplier);
+            double energy_error = fabs(table_energy - energy) / fmax(fabs(energy), 1);
+            double multiplier_error = fabs(table_multiplier - multiplier) / fmax(fabs(multiplier), 1);
+            max_error = fmax(max_error, fmax(energy_error, multiplier_error));
+        }
+    }
+    return max_error;
+}
+
+// Intervals of about h covering r_min..cutoff. A cubic cannot follow a kink
+// inside an interval, so the grid is shifted (and h shrunk) to put the up to two
+// kinks, e.g. the ends of a switching range, on knots.
+static inline void layout_pair_table(pair_table *table, double r_min, double cutoff, double h,
+                                     const double *kinks, int kink_count) {
+    double s_low = r_min * r_min;
+    double anchor = kink_count > 0 ? kinks[0] * kinks[0] : s_low;
+    if (kink_count == 2) {
+        double span = kinks[1] * kinks[1] - anchor;
+        h = span / ceil(span / h);
+    }
+    table->s_min = anchor - ceil((anchor - s_low) / h - 1e-9) * h;
+    table->intervals = (int)ceil((cutoff * cutoff - table->s_min) / h - 1e-9);
+    table->s_max = table->s_min + table->intervals * h;
+    table->inv_h = 1 / h;
+}
+
+// Tabulates function on r_min <= r < cutoff, halving the intervals until the
+// error is within tolerance. kinks are the r inside that range where the function
+// is not smooth. Returns false if even the finest table misses the tolerance;
+// that table is kept all the same.
+static inline bool build_pair_table(pair_table *table, pair_function function, const void *context,
+                                    double r_min, double cutoff, double tolerance, const double *kinks, int kink_count) {
+    table->coefficients = NULL;
+    double h = (cutoff * cutoff - r_min * r_min) / PAIR_TABLE_MIN_INTERVALS;
+    for (int level = PAIR_TABLE_MIN_INTERVALS; level <= PAIR_TABLE_MAX_INTERVALS; level *= 2, h /= 2) {
+        free(table->coefficients);
+        layout_pair_table(table, r_min, cutoff, h, kinks, kink_count);
+        table->coefficients = (double*)malloc(sizeof(double) * PAIR_TABLE_STRIDE * table->intervals);
+        if (table->coefficients == NULL) {
+            fprintf(stderr, "Failed to allocate a pair table of %d intervals\n", table->intervals);
+            exit(1);
+        }
+        fill_pair_table(table, function, context);
+        table->max_error = pair_table_error(table, function, context);
+        if (table->max_error <= tolerance) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline void free_pair_table(pair_table *table) {
+    free(table->coefficients);
+    table->coefficients = NULL;
+}
+
+#endif
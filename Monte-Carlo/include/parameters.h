@@ -1,9 +1,50 @@
-#define rc 3
-#define box_size 6
-#define N 32
-#define nmax 30000
-#define total_it 60000
-#define Temperature 1.3
-#define initial_dist_by_one_axis 1.2
-#define half_box 3
-#define initial_dist_to_edge 2
\ No newline at end of file
+// Problem parameters. Their defaults live in config.h, and load_parameters()
+// overrides them at start-up from a config file and the command line.
+#define POTENTIAL_LJ 0
+#define POTENTIAL_TABLE 1
+#define PRECISION_DOUBLE 0
+#define PRECISION_MIXED 1
+#define PRECISION_VALIDATE 2
+#define PAIR_SEARCH_ALL 0
+#define PAIR_SEARCH_CELLS 1
+#define TRANSFER_AUTO 0
+#define TRANSFER_COPY 1
+#define TRANSFER_MAP 2
+#define TRANSFER_HOST_PTR 3
+#define MOVES_ALL 0
+#define MOVES_SINGLE 1
+#define MAX_THREADS 64
+
+extern int N;
+extern double rc;
+extern double box_size;
+extern double half_box;     // box_size / 2, derived
+extern int nmax;
+extern int total_it;
+extern int threads;                     // OpenMP threads of the CPU engine, at most MAX_THREADS
+extern double Temperature;
+extern int replicas;                    // independent chains the OpenCL host advances in one kernel launch
+extern double replica_temperature_step; // replica r runs at Temperature + r * replica_temperature_step
+extern double max_deviation;
+extern int moves;                       // MOVES_SINGLE has the OpenMP engine move one particle per trial and sum only its pairs, the OpenCL host rejects it
+extern int recompute_every;             // sweeps of N single-particle trials between full energies, which reset the running one
+extern double initial_dist_by_one_axis;
+extern double initial_dist_to_edge;
+extern int potential;                   // POTENTIAL_TABLE interpolates the pair from a table on r^2
+extern double table_tolerance;          // relative error the table must reach
+extern double table_rmin;               // closer pairs get the table values at table_rmin
+extern int precision;                   // PRECISION_MIXED runs the CPU pair math in float, PRECISION_VALIDATE also in double to compare
+extern const char *checkpoint_path;     // "" writes no checkpoints
+extern int checkpoint_every;            // trials between checkpoints
+extern const char *restart_path;        // checkpoint to resume from, "" starts afresh
+extern const char *opencl_vendor;       // part of the vendor name of the OpenCL platform the NVIDIA build runs on
+extern int work_group_size;             // work-items per group of the OpenCL kernel, 0 picks the largest that fits
+extern int pair_search;                 // PAIR_SEARCH_CELLS has the OpenCL host walk cell lists built on the device instead of all pairs,
+                                        // and the single-particle trials of the OpenMP engine gather partners from cell lists of
+                                        // its own once box_size / rc >= 4; they are faster than all pairs from there on
+extern int pipeline;                    // 1 has the OpenCL host move half of the replicas while the device computes the other half
+extern const char *program_cache;       // directory of the built OpenCL programs, "" builds from source every run
+extern int specialize;                  // 1 builds the OpenCL program for this N, box and rc, see mc.cl
+extern int unroll;                      // unrolling of the pair loops of the OpenCL kernels
+extern int transfer;                    // how the OpenCL host moves positions and energies, TRANSFER_AUTO maps them on a device that shares the host's memory unless pipeline = on
+extern const char *profile_trace;       // Chrome trace of the phase timers of a -D PROFILE build, "" writes none
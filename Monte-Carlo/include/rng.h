@@ -0,0 +1,32 @@
+#ifndef RNG_H
+#define RNG_H
+#include <stdint.h>
+
+// xorshift64* generator for the trial moves. Unlike rand() its whole state is
+// one integer, so a checkpoint can store it and a resumed run draws the same
+// numbers as an uninterrupted one.
+extern uint64_t rng_state;
+
+static inline void rng_seed(uint64_t seed) {
+    // the all-zero state would only ever produce zeros
+    rng_state = seed != 0 ? seed : 0x9E3779B97F4A7C15ull;
+}
+
+// splitmix64 finalizer: seeds of neighbouring streams, e.g. base + replica,
+// become unrelated xorshift states
+static inline uint64_t rng_mix(uint64_t seed) {
+    seed += 0x9E3779B97F4A7C15ull;
+    seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ull;
+    seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBull;
+    return seed ^ (seed >> 31);
+}
+
+// uniform in [0, 1)
+static inline double rng_uniform() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (double)((rng_state * 0x2545F4914F6CDD1Dull) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef SCRATCH_ARENA_H
+#define SCRATCH_ARENA_H
+#include <stdio.h>
+#include <stdlib.h>
+
+// Every heap allocation of the engine goes through counted_alloc(), so the
+// driver can check that its step loop did not add to heap_allocations.
+extern long heap_allocations;
+
+static inline void *counted_alloc(size_t alignment, size_t bytes) {
+    #pragma omp atomic
+    heap_allocations++;
+    // aligned_alloc wants the size to be a multiple of the alignment
+    bytes = (bytes + alignment - 1) / alignment * alignment;
+    void *memory = aligned_alloc(alignment, bytes);
+    if (memory == NULL) {
+        fprintf(stderr, "Failed to allocate %lu bytes\n", (unsigned long)bytes);
+        exit(1);
+    }
+    return memory;
+}
+
+// Bump allocator over one block reserved at start-up. Scratch memory is taken
+// with arena_alloc() and handed back all at once with arena_reset().
+struct scratch_arena {
+    char *base;
+    size_t size;
+    size_t used;
+    size_t peak;
+};
+typedef struct scratch_arena scratch_arena;
+
+#define ARENA_ALIGNMENT 64
+
+static inline void arena_init(scratch_arena *arena, size_t bytes) {
+    arena->size = (bytes + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+    arena->base = (char*)counted_alloc(ARENA_ALIGNMENT, arena->size);
+    arena->used = 0;
+    arena->peak = 0;
+}
+
+static inline void *arena_alloc(scratch_arena *arena, size_t bytes) {
+    size_t start = (arena->used + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+    if (start + bytes > arena->size) {
+        // the arenas are sized from N and the cutoff density, running out is a sizing bug
+        fprintf(stderr, "Scratch arena exhausted: %lu of %lu bytes in use, %lu requested\n",
+            (unsigned long)arena->used, (unsigned long)arena->size, (unsigned long)bytes);
+        exit(1);
+    }
+    arena->used = start + bytes;
+    if (arena->used > arena->peak) {
+        arena->peak = arena->used;
+    }
+    return arena->base + start;
+}
+
+static inline void arena_reset(scratch_arena *arena) {
+    arena->used = 0;
+}
+
+static inline void arena_release(scratch_arena *arena) {
+    free(arena->base);
+    arena->base = NULL;
+    arena->size = arena->used = 0;
+}
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+// Versioned checkpoint file: a header with a table of named sections, then the
+// sections, each starting on a 64-byte boundary. A restart maps the file
+// copy-on-write and runs on the arrays in place instead of reading them.
+#define SNAPSHOT_MAGIC "MDSNAP1"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_MAX_SECTIONS 16
+#define SNAPSHOT_ALIGNMENT 64
+
+struct snapshot_entry {
+    char name[24];
+    uint64_t offset;
+    uint64_t bytes;
+};
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t file_bytes;
+    snapshot_entry entries[SNAPSHOT_MAX_SECTIONS];
+};
+
+struct snapshot_section {
+    const char *name;
+    const void *data;
+    size_t bytes;
+};
+
+struct snapshot {
+    char *base;
+    size_t bytes;
+};
+typedef struct snapshot snapshot;
+
+#ifndef _WIN32
+
+// Writes PATH.tmp through a shared mapping, syncs it and renames it over PATH,
+// so PATH always holds either the previous or the new checkpoint. No heap use.
+static inline bool snapshot_write(const char *path, const snapshot_section *sections, int count) {
+    if (count > SNAPSHOT_MAX_SECTIONS) {
+        return false;
+    }
+    snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.count = count;
+    uint64_t offset = (sizeof(header) + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+    for (int s = 0; s < count; s++) {
+        strncpy(header.entries[s].name, sections[s].name, sizeof(header.entries[s].name) - 1);
+        header.entries[s].offset = offset;
+        header.entries[s].bytes = sections[s].bytes;
+        offset += (sections[s].bytes + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+    }
+    header.file_bytes = offset;
+
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    int fd = open(temporary, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    if (ftruncate(fd, header.file_bytes) != 0) {
+        close(fd);
+        return false;
+    }
+    char *base = (char*)mmap(NULL, header.file_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    memcpy(base, &header, sizeof(header));
+    for (int s = 0; s < count; s++) {
+        memcpy(base + header.entries[s].offset, sections[s].data, sections[s].bytes);
+    }
+    bool written = msync(base, header.file_bytes, MS_SYNC) == 0;
+    munmap(base, header.file_bytes);
+    written = fsync(fd) == 0 && written;
+    close(fd);
+    return written && rename(temporary, path) == 0;
+}
+
+static inline bool snapshot_map(const char *path, snapshot *snap) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(snapshot_header)) {
+        close(fd);
+        return false;
+    }
+    // private and writable: the run modifies the arrays in place, the file stays as it is
+    char *base = (char*)mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+    const snapshot_header *header = (const snapshot_header*)base;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || header->version != SNAPSHOT_VERSION ||
+        header->file_bytes != (uint64_t)info.st_size || header->count > SNAPSHOT_MAX_SECTIONS) {
+        munmap(base, info.st_size);
+        return false;
+    }
+    snap->base = base;
+    snap->bytes = info.st_size;
+    return true;
+}
+
+static inline void snapshot_unmap(snapshot *snap) {
+    if (snap->base != NULL) {
+        munmap(snap->base, snap->bytes);
+    }
+    snap->base = NULL;
+    snap->bytes = 0;
+}
+
+#else
+
+static inline bool snapshot_write(const char *path, const snapshot_section *sections, int count) {
+    fprintf(stderr, "Checkpoints need a POSIX system\n");
+    return false;
+}
+
+static inline bool snapshot_map(const char *path, snapshot *snap) {
+    fprintf(stderr, "Checkpoints need a POSIX system\n");
+    return false;
+}
+
+static inline void snapshot_unmap(snapshot *snap) {
+}
+
+#endif
+
+// Section NAME of a mapped snapshot, NULL with the reason on stderr if it is missing,
+// of another size than bytes, which means the checkpoint belongs to a different
+// problem, or reaches past the end of the mapping of a truncated or corrupt file.
+static inline void *snapshot_find(const snapshot *snap, const char *name, size_t bytes) {
+    const snapshot_header *header = (const snapshot_header*)snap->base;
+    for (uint32_t s = 0; s < header->count; s++) {
+        if (strncmp(header->entries[s].name, name, sizeof(header->entries[s].name)) == 0) {
+            const snapshot_entry *entry = &header->entries[s];
+            if (entry->bytes != bytes) {
+                fprintf(stderr, "Snapshot section %s has %lu bytes, expected %lu\n",
+                    name, (unsigned long)entry->bytes, (unsigned long)bytes);
+                return NULL;
+            }
+            if (entry->offset < sizeof(snapshot_header) || entry->offset > snap->bytes || entry->bytes > snap->bytes - entry->offset) {
+                fprintf(stderr, "Snapshot section %s at offset %lu runs past the end of the %lu-byte file\n",
+                    name, (unsigned long)entry->offset, (unsigned long)snap->bytes);
+                return NULL;
+            }
+            return snap->base + entry->offset;
+        }
+    }
+    fprintf(stderr, "Snapshot has no section %s\n", name);
+    return NULL;
+}
+
+// true if memory lives in the mapping, which must not be passed to free()
+static inline bool snapshot_contains(const snapshot *snap, const void *memory) {
+    return snap->base != NULL && (const char*)memory >= snap->base && (const char*)memory < snap->base + snap->bytes;
+}
+
+#endif
@@ -5,36 +5,158 @@
 #include <time.h>
 #include <omp.h>
 #include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+#endif
 #include "parameters.h"
+#include "config.h"
+#include "scratch_arena.h"
+#include "snapshot.h"
+#include "rng.h"
+#include "pair_table.h"
+#define PROFILE_STORAGE
+#include "profile.h"
 
-#define NUM_THREADS 8
+#define SIMD_ALIGNMENT 64   // bytes, one 512-bit vector
+#define SIMD_PADDING 8      // doubles per 512-bit vector
+#define MIN_CELLS_PER_SIDE 4    // with fewer the cells around a particle hold most of the box, and all pairs are faster
 
-struct dim {
-    double x;
-    double y;
-    double z;
+// Structure-of-arrays storage: every component lives in its own aligned array,
+// padded to a whole number of 512-bit vectors.
+struct coords {
+    double *x;
+    double *y;
+    double *z;
 };
-typedef struct dim dim;
+typedef struct coords coords;
 
-double square_dist(dim first, dim second);
-int nearest_image(dim* initial_array, dim* new_array, int particle_count, int particle);
-void set_initial_state(dim *array);
+// single-precision copy of a configuration for the mixed-precision kernels
+struct coords_single {
+    float *x;
+    float *y;
+    float *z;
+};
+typedef struct coords_single coords_single;
+
+coords alloc_coords(int count);
+coords arena_coords(scratch_arena *arena, int count);
+void free_coords(coords *array);
+void copy_coords(coords *destination, const coords *source);
+void set_initial_state(coords *array);
+void restore_checkpoint(coords *array);
+bool write_checkpoint(const coords *array, long trial, long accepted, long accepted_hung, double energy, const double *energies);
 double fast_pow(double a, int n);
-void mc_method(dim *array);
-double calculate_energy_lj(dim *array);
+void mc_method(coords *array);
+typedef double (*row_energy_kernel)(const coords *array, int i);
+row_energy_kernel select_row_energy(bool mixed, const char **name);
+double calculate_energy_lj(coords *array, row_energy_kernel kernel);
+void init_cells(const coords *array);
+int cell_of(double x, double y, double z);
+int gather_partners(const coords *array, int cell, int particle);
+double move_energy(const coords *array, int particle, double x, double y, double z);
+double single_sweep(coords *array, double temperature, long *accepted_moves);
+
+double Urc;
+pair_table table;           // the shifted pair on r^2 when potential is POTENTIAL_TABLE
+row_energy_kernel row_energy;
+coords_single single_config;        // filled from the configuration by calculate_energy_lj() unless precision is double
+row_energy_kernel row_energy_double;    // precision validate checks every trial energy with it
+long heap_allocations = 0;
+uint64_t rng_state;
+// the cell lists of pair_search = cells for moves = single: cells of at least rc,
+// each a linked list through cell_next that a particle leaves when a trial moving
+// it to another cell is accepted
+bool single_cells = false;  // pair_search = cells with at least MIN_CELLS_PER_SIDE cells per side
+int cells_per_side;
+int *cell_neighbors;        // 27 per cell, -1 past the last distinct one
+int *cell_head;
+int *cell_next;
+int *particle_cell;
+coords cell_partners;       // the partners of a move gathered from the cells, for the vector loops
+double pairs_visited = 0;   // by the single-particle trials
+
+// Everything a resumed run needs besides the configuration and the energies of
+// the accepted trials, which are sections of their own.
+struct mc_checkpoint {
+    int N;
+    int nmax;
+    double box_size;
+    long trial;             // trials done
+    long accepted;          // entries in the "energies" section
+    long accepted_hung;
+    double energy;          // of the current configuration
+    uint64_t rng_state;
+};
+typedef struct mc_checkpoint mc_checkpoint;
 
-double Urc = 4 * ( 1 / fast_pow(rc, 12) - 1 / fast_pow(rc, 6) );
-double max_deviation = 0.005;
+// a restart runs on the configuration inside the mapped checkpoint
+snapshot restart_snapshot;
+mc_checkpoint resumed;
 
-int main()
+int main(int argc, char **argv)
 {
     time_t t;
     time_t start_total_time = time(NULL);
-    srand((unsigned)time(&t));
-    dim *r = (dim*)malloc(sizeof(dim) * N);
-    set_initial_state(r);
-    mc_method(r);
-    free(r);
+    rng_seed((uint64_t)time(&t));
+    load_parameters(argc, argv);
+    if (replicas != 1) {
+        printf("replicas: the OpenMP engine runs one chain, batched replicas run on the OpenCL host\n");
+        exit(1);
+    }
+    if (moves == MOVES_SINGLE) {
+        single_cells = pair_search == PAIR_SEARCH_CELLS && (int)(box_size / rc) >= MIN_CELLS_PER_SIDE;
+        if (pair_search == PAIR_SEARCH_CELLS && !single_cells) {
+            printf("cell list: %d cells per side are fewer than %d, the single-particle trials take all pairs\n",
+                (int)(box_size / rc), MIN_CELLS_PER_SIDE);
+        }
+        printf("moves: one particle per trial, full energy every %d sweeps%s\n", recompute_every,
+            single_cells ? ", partners from cell lists" : "");
+    }
+    Urc = 4 * ( 1 / fast_pow(rc, 12) - 1 / fast_pow(rc, 6) );
+    if (potential == POTENTIAL_TABLE && !build_pair_table(&table, lennard_jones_pair, &Urc, table_rmin, rc, table_tolerance, NULL, 0)) {
+        printf("pair table: %d intervals reach only a relative error of %.1e\n", table.intervals, table.max_error);
+    }
+    const char *row_energy_name;
+    row_energy = select_row_energy(precision != PRECISION_DOUBLE, &row_energy_name);
+    printf("LJ energy kernel: %s\n", row_energy_name);
+    if (precision != PRECISION_DOUBLE) {
+        size_t bytes = sizeof(float) * ((N + SIMD_PADDING - 1) / SIMD_PADDING * SIMD_PADDING);
+        single_config.x = (float*)counted_alloc(SIMD_ALIGNMENT, bytes);
+        single_config.y = (float*)counted_alloc(SIMD_ALIGNMENT, bytes);
+        single_config.z = (float*)counted_alloc(SIMD_ALIGNMENT, bytes);
+    }
+    if (precision == PRECISION_VALIDATE) {
+        row_energy_double = select_row_energy(false, &row_energy_name);
+        printf("checked against: %s\n", row_energy_name);
+    }
+    coords r;
+    if (restart_path[0] != '\0') {
+        restore_checkpoint(&r);
+    } else {
+        r = alloc_coords(N);
+        set_initial_state(&r);
+    }
+    mc_method(&r);
+    PROFILE_REPORT(profile_trace);
+    if (!snapshot_contains(&restart_snapshot, r.x)) {
+        free_coords(&r);
+    }
+    snapshot_unmap(&restart_snapshot);
+    if (precision != PRECISION_DOUBLE) {
+        free(single_config.x);
+        free(single_config.y);
+        free(single_config.z);
+    }
+    if (potential == POTENTIAL_TABLE) {
+        free_pair_table(&table);
+    }
+    if (single_cells) {
+        free(cell_neighbors);
+        free(cell_head);
+        free(cell_next);
+        free(particle_cell);
+        free_coords(&cell_partners);
+    }
     time_t end_total_time = time(NULL);
     printf("\nTotal execution time in seconds =  %f\n", difftime(end_total_time, start_total_time));
     return 0;
@@ -42,7 +164,82 @@ int main()
 
 /////// HELPER FUNCTIONS ///////
 
-void set_initial_state(dim *array) {
+coords alloc_coords(int count) {
+    size_t bytes = sizeof(double) * ((count + SIMD_PADDING - 1) / SIMD_PADDING * SIMD_PADDING);
+    coords array;
+    array.x = (double*)counted_alloc(SIMD_ALIGNMENT, bytes);
+    array.y = (double*)counted_alloc(SIMD_ALIGNMENT, bytes);
+    array.z = (double*)counted_alloc(SIMD_ALIGNMENT, bytes);
+    memset(array.x, 0, bytes);
+    memset(array.y, 0, bytes);
+    memset(array.z, 0, bytes);
+    return array;
+}
+
+coords arena_coords(scratch_arena *arena, int count) {
+    size_t bytes = sizeof(double) * ((count + SIMD_PADDING - 1) / SIMD_PADDING * SIMD_PADDING);
+    coords array;
+    array.x = (double*)arena_alloc(arena, bytes);
+    array.y = (double*)arena_alloc(arena, bytes);
+    array.z = (double*)arena_alloc(arena, bytes);
+    return array;
+}
+
+void free_coords(coords *array) {
+    free(array->x);
+    free(array->y);
+    free(array->z);
+}
+
+void copy_coords(coords *destination, const coords *source) {
+    memcpy(destination->x, source->x, sizeof(double) * N);
+    memcpy(destination->y, source->y, sizeof(double) * N);
+    memcpy(destination->z, source->z, sizeof(double) * N);
+}
+
+void restore_checkpoint(coords *array) {
+    if (!snapshot_map(restart_path, &restart_snapshot)) {
+        printf("Failed to map checkpoint %s\n", restart_path);
+        exit(1);
+    }
+    const mc_checkpoint *state = (const mc_checkpoint*)snapshot_find(&restart_snapshot, "state", sizeof(mc_checkpoint));
+    if (state == NULL) {
+        printf("Checkpoint %s is damaged or belongs to another problem\n", restart_path);
+        exit(1);
+    }
+    resumed = *state;
+    if (resumed.N != N || resumed.box_size != box_size || resumed.accepted > nmax) {
+        printf("Checkpoint %s holds N %d in box %g with %ld accepted trials, this run has N %d in box %g and nmax %d\n",
+            restart_path, resumed.N, resumed.box_size, resumed.accepted, N, box_size, nmax);
+        exit(1);
+    }
+    // the configuration keeps the padded SoA layout, so it is used from the mapping as it is
+    size_t bytes = sizeof(double) * ((N + SIMD_PADDING - 1) / SIMD_PADDING * SIMD_PADDING);
+    array->x = (double*)snapshot_find(&restart_snapshot, "x", bytes);
+    array->y = (double*)snapshot_find(&restart_snapshot, "y", bytes);
+    array->z = (double*)snapshot_find(&restart_snapshot, "z", bytes);
+    if (!array->x || !array->y || !array->z) {
+        printf("Checkpoint %s is damaged or belongs to another problem\n", restart_path);
+        exit(1);
+    }
+    rng_state = resumed.rng_state;
+    printf("resumed from %s at trial %ld\n", restart_path, resumed.trial);
+}
+
+bool write_checkpoint(const coords *array, long trial, long accepted, long accepted_hung, double energy, const double *energies) {
+    mc_checkpoint state = { N, nmax, box_size, trial, accepted, accepted_hung, energy, rng_state };
+    size_t bytes = sizeof(double) * ((N + SIMD_PADDING - 1) / SIMD_PADDING * SIMD_PADDING);
+    snapshot_section sections[] = {
+        { "state", &state, sizeof(state) },
+        { "x", array->x, bytes },
+        { "y", array->y, bytes },
+        { "z", array->z, bytes },
+        { "energies", energies, sizeof(double) * accepted },
+    };
+    return snapshot_write(checkpoint_path, sections, sizeof(sections) / sizeof(sections[0]));
+}
+
+void set_initial_state(coords *array) {
     int count = 0;
     for (double i = -(box_size - initial_dist_to_edge)/2; i < (box_size - initial_dist_to_edge)/2; i += initial_dist_by_one_axis) {
         for (double j = -(box_size - initial_dist_to_edge)/2; j < (box_size - initial_dist_to_edge)/2; j += initial_dist_by_one_axis) {
@@ -50,96 +247,839 @@ void set_initial_state(dim *array) {
                 if( count == N){
                     return; //it is not balanced grid but we can use it
                 }
-                array[count] = { i,j,l };
+                array->x[count] = i;
+                array->y[count] = j;
+                array->z[count] = l;
                 count++;
             }
         }
     }
     if( count < N ){
-    	printf("error decrease initial_dist parameter, count is %ld  N is %ld \n", count, N);
+    	printf("error decrease initial_dist parameter, count is %d  N is %d \n", count, N);
     	exit(1);
     }
 }
 
-int nearest_image(dim* initial_array, dim* new_array, int particle_count, int particle) {
+// Energy of particle i with every j > i. The partners are contiguous in the SoA
+// arrays, so the SIMD versions load them directly and mask off the pairs beyond
+// the cutoff; select_row_energy() picks the widest one the CPU supports.
+// Every version is instantiated for a few common N with FIXED_N, which gives
+// the compiler constant trip counts, and once with FIXED_N = 0 for any other N.
+// rc <= half_box, so only the closest periodic image can be inside the cutoff.
+template <int FIXED_N>
+double row_energy_scalar(const coords *array, int i) {
+    const int count = FIXED_N ? FIXED_N : N;
+    double energy = 0;
+    for (int j = i + 1; j < count; j++) {
+        double x = array->x[j] - array->x[i];
+        double y = array->y[j] - array->y[i];
+        double z = array->z[j] - array->z[i];
+        x -= box_size * round(x / box_size);
+        y -= box_size * round(y / box_size);
+        z -= box_size * round(z / box_size);
+        double dist = x * x + y * y + z * z;
+        if (dist >= rc * rc) {
+            continue;
+        }
+        PROFILE_COUNT(PROFILE_PAIRS_INSIDE, 1);
+        double inv2 = 1 / dist;
+        double inv6 = inv2 * inv2 * inv2;
+        energy += 4 * (inv6 * inv6 - inv6) - Urc;
+    }
+    return energy;
+}
+
+// The table versions interpolate the shifted pair from the cubic table on r^2
+// instead of taking the reciprocal; the SIMD ones gather each lane's e0..e3.
+template <int FIXED_N>
+double row_energy_table_scalar(const coords *array, int i) {
+    const int count = FIXED_N ? FIXED_N : N;
+    double energy = 0;
+    for (int j = i + 1; j < count; j++) {
+        double x = array->x[j] - array->x[i];
+        double y = array->y[j] - array->y[i];
+        double z = array->z[j] - array->z[i];
+        x -= box_size * round(x / box_size);
+        y -= box_size * round(y / box_size);
+        z -= box_size * round(z / box_size);
+        double dist = x * x + y * y + z * z;
+        if (dist >= rc * rc) {
+            continue;
+        }
+        PROFILE_COUNT(PROFILE_PAIRS_INSIDE, 1);
+        double u = dist > table.s_min ? (dist - table.s_min) * table.inv_h : 0;
+        int k = (int)u < table.intervals - 1 ? (int)u : table.intervals - 1;
+        energy += pair_table_cubic(table.coefficients, k, 0, u - k);
+    }
+    return energy;
+}
+
+// The mixed-precision versions take the pair math to float on the copy of the
+// configuration that calculate_energy_lj() fills, so a vector holds twice the
+// partners and a row reads half the bytes; the energy still adds up in double.
+// The copy is wrapped into the box, so one image shift finds the nearest.
+template <int FIXED_N>
+double row_energy_mixed_scalar(const coords *array, int i) {
+    const int count = FIXED_N ? FIXED_N : N;
+    const float box = (float)box_size;
+    const float inv_box = (float)(1.0 / box_size);
+    const float cutoff2 = (float)(rc * rc);
+    const float shift = (float)Urc;
+    double energy = 0;
+    for (int j = i + 1; j < count; j++) {
+        float x = single_config.x[j] - single_config.x[i];
+        float y = single_config.y[j] - single_config.y[i];
+        float z = single_config.z[j] - single_config.z[i];
+        x -= box * rintf(x * inv_box);
+        y -= box * rintf(y * inv_box);
+        z -= box * rintf(z * inv_box);
+        float dist = x * x + y * y + z * z;
+        if (dist >= cutoff2) {
+            continue;
+        }
+        PROFILE_COUNT(PROFILE_PAIRS_INSIDE, 1);
+        float inv2 = 1 / dist;
+        float inv6 = inv2 * inv2 * inv2;
+        energy += 4 * (inv6 * inv6 - inv6) - shift;
+    }
+    return energy;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+template <int FIXED_N>
+__attribute__((target("avx2,fma")))
+double row_energy_avx2(const coords *array, int i) {
+    const int count = FIXED_N ? FIXED_N : N;
+    const __m256d xi = _mm256_set1_pd(array->x[i]);
+    const __m256d yi = _mm256_set1_pd(array->y[i]);
+    const __m256d zi = _mm256_set1_pd(array->z[i]);
+    const __m256d box = _mm256_set1_pd(box_size);
+    const __m256d inv_box = _mm256_set1_pd(1.0 / box_size);
+    const __m256d cutoff2 = _mm256_set1_pd(rc * rc);
+    const __m256d shift = _mm256_set1_pd(Urc);
+    const __m256d one = _mm256_set1_pd(1.0);
+    const __m256d four = _mm256_set1_pd(4.0);
+    __m256d energy = _mm256_setzero_pd();
+    int j = i + 1;
+    for (; j + 4 <= count; j += 4) {
+        __m256d x = _mm256_sub_pd(_mm256_loadu_pd(array->x + j), xi);
+        __m256d y = _mm256_sub_pd(_mm256_loadu_pd(array->y + j), yi);
+        __m256d z = _mm256_sub_pd(_mm256_loadu_pd(array->z + j), zi);
+        x = _mm256_fnmadd_pd(box, _mm256_round_pd(_mm256_mul_pd(x, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), x);
+        y = _mm256_fnmadd_pd(box, _mm256_round_pd(_mm256_mul_pd(y, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), y);
+        z = _mm256_fnmadd_pd(box, _mm256_round_pd(_mm256_mul_pd(z, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), z);
+        __m256d dist = _mm256_fmadd_pd(z, z, _mm256_fmadd_pd(y, y, _mm256_mul_pd(x, x)));
+        __m256d inside = _mm256_cmp_pd(dist, cutoff2, _CMP_LT_OQ);
+        PROFILE_COUNT(PROFILE_PAIRS_INSIDE, __builtin_popcount(_mm256_movemask_pd(inside)));
+        __m256d inv2 = _mm256_div_pd(one, dist);
+        __m256d inv6 = _mm256_mul_pd(_mm256_mul_pd(inv2, inv2), inv2);
+        __m256d pair = _mm256_fmsub_pd(four, _mm256_fmsub_pd(inv6, inv6, inv6), shift);
+        energy = _mm256_add_pd(energy, _mm256_and_pd(inside, pair));
+    }
+    __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(energy), _mm256_extractf128_pd(energy, 1));
+    double total = _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+    for (; j < count; j++) {
+        double x = array->x[j] - array->x[i];
+        double y = array->y[j] - array->y[i];
+        double z = array->z[j] - array->z[i];
+        x -= box_size * round(x / box_size);
+        y -= box_size * round(y / box_size);
+        z -= box_size * round(z / box_size);
+        double dist = x * x + y * y + z * z;
+        if (dist < rc * rc) {
+            PROFILE_COUNT(PROFILE_PAIRS_INSIDE, 1);
+            double inv6 = 1 / (dist * dist * dist);
+            total += 4 * (inv6 * inv6 - inv6) - Urc;
+        }
+    }
+    return total;
+}
+
+template <int FIXED_N>
+__attribute__((target("avx512f")))
+double row_energy_avx512(const coords *array, int i) {
+    const int count = FIXED_N ? FIXED_N : N;
+    const __m512d xi = _mm512_set1_pd(array->x[i]);
+    const __m512d yi = _mm512_set1_pd(array->y[i]);
+    const __m512d zi = _mm512_set1_pd(array->z[i]);
+    const __m512d box = _mm512_set1_pd(box_size);
+    const __m512d inv_box = _mm512_set1_pd(1.0 / box_size);
+    const __m512d cutoff2 = _mm512_set1_pd(rc * rc);
+    const __m512d shift = _mm512_set1_pd(Urc);
+    const __m512d one = _mm512_set1_pd(1.0);
+    const __m512d four = _mm512_set1_pd(4.0);
+    const __m512d zero = _mm512_setzero_pd();
+    __m512d energy = zero;
+    for (int j = i + 1; j < count; j += 8) {
+        // the last partial vector is handled by masking off the missing lanes
+        int remaining = count - j;
+        __mmask8 lanes = remaining >= 8 ? (__mmask8)0xFF : (__mmask8)((1u << remaining) - 1);
+        __m512d x = _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, array->x + j), xi);
+        __m512d y = _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, array->y + j), yi);
+        __m512d z = _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, array->z + j), zi);
+        x = _mm512_fnmadd_pd(box, _mm512_roundscale_pd(_mm512_mul_pd(x, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), x);
+        y = _mm512_fnmadd_pd(box, _mm512_roundscale_pd(_mm512_mul_pd(y, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), y);
+        z = _mm512_fnmadd_pd(box, _mm512_roundscale_pd(_mm512_mul_pd(z, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), z);
+        __m512d dist = _mm512_fmadd_pd(z, z, _mm512_fmadd_pd(y, y, _mm512_mul_pd(x, x)));
+        __mmask8 inside = _mm512_mask_cmp_pd_mask(lanes, dist, cutoff2, _CMP_LT_OQ);
+        PROFILE_COUNT(PROFILE_PAIRS_INSIDE, __builtin_popcount(inside));
+        __m512d inv2 = _mm512_maskz_div_pd(inside, one, dist);
+        __m512d inv6 = _mm512_mul_pd(_mm512_mul_pd(inv2, inv2), inv2);
+        __m512d pair = _mm512_fmsub_pd(four, _mm512_fmsub_pd(inv6, inv6, inv6), shift);
+        energy = _mm512_mask_add_pd(energy, inside, energy, pair);
+    }
+    return _mm512_reduce_add_pd(energy);
+}
+
+template <int FIXED_N>
+__attribute__((target("avx2,fma")))
+double row_energy_table_avx2(const coords *array, int i) {
+    const int count = FIXED_N ? FIXED_N : N;
+    const __m256d xi = _mm256_set1_pd(array->x[i]);
+    const __m256d yi = _mm256_set1_pd(array->y[i]);
+    const __m256d zi = _mm256_set1_pd(array->z[i]);
+    const __m256d box = _mm256_set1_pd(box_size);
+    const __m256d inv_box = _mm256_set1_pd(1.0 / box_size);
+    const __m256d cutoff2 = _mm256_set1_pd(rc * rc);
+    const __m256d s_min = _mm256_set1_pd(table.s_min);
+    const __m256d inv_h = _mm256_set1_pd(table.inv_h);
+    const __m128i last = _mm_set1_epi32(table.intervals - 1);
+    const __m256d zero = _mm256_setzero_pd();
+    const double *c = table.coefficients;
+    __m256d energy = _mm256_setzero_pd();
+    int j = i + 1;
+    for (; j + 4 <= count; j += 4) {
+        __m256d x = _mm256_sub_pd(_mm256_loadu_pd(array->x + j), xi);
+        __m256d y = _mm256_sub_pd(_mm256_loadu_pd(array->y + j), yi);
+        __m256d z = _mm256_sub_pd(_mm256_loadu_pd(array->z + j), zi);
+        x = _mm256_fnmadd_pd(box, _mm256_round_pd(_mm256_mul_pd(x, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), x);
+        y = _mm256_fnmadd_pd(box, _mm256_round_pd(_mm256_mul_pd(y, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), y);
+        z = _mm256_fnmadd_pd(box, _mm256_round_pd(_mm256_mul_pd(z, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), z);
+        __m256d dist = _mm256_fmadd_pd(z, z, _mm256_fmadd_pd(y, y, _mm256_mul_pd(x, x)));
+        __m256d inside = _mm256_cmp_pd(dist, cutoff2, _CMP_LT_OQ);
+        PROFILE_COUNT(PROFILE_PAIRS_INSIDE, __builtin_popcount(_mm256_movemask_pd(inside)));
+        __m256d u = _mm256_and_pd(inside, _mm256_mul_pd(_mm256_max_pd(_mm256_sub_pd(dist, s_min), zero), inv_h));
+        __m128i interval = _mm_min_epi32(_mm256_cvttpd_epi32(u), last);
+        __m256d t = _mm256_sub_pd(u, _mm256_cvtepi32_pd(interval));
+        __m128i offset = _mm_slli_epi32(interval, 3);
+        __m256d e0 = _mm256_mask_i32gather_pd(zero, c + 0, offset, inside, 8);
+        __m256d e1 = _mm256_mask_i32gather_pd(zero, c + 1, offset, inside, 8);
+        __m256d e2 = _mm256_mask_i32gather_pd(zero, c + 2, offset, inside, 8);
+        __m256d e3 = _mm256_mask_i32gather_pd(zero, c + 3, offset, inside, 8);
+        __m256d pair = _mm256_fmadd_pd(t, _mm256_fmadd_pd(t, _mm256_fmadd_pd(t, e3, e2), e1), e0);
+        energy = _mm256_add_pd(energy, _mm256_and_pd(inside, pair));
+    }
+    __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(energy), _mm256_extractf128_pd(energy, 1));
+    double total = _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+    for (; j < count; j++) {
+        double x = array->x[j] - array->x[i];
+        double y = array->y[j] - array->y[i];
+        double z = array->z[j] - array->z[i];
+        x -= box_size * round(x / box_size);
+        y -= box_size * round(y / box_size);
+        z -= box_size * round(z / box_size);
+        double dist = x * x + y * y + z * z;
+        if (dist < rc * rc) {
+            PROFILE_COUNT(PROFILE_PAIRS_INSIDE, 1);
+            double u = dist > table.s_min ? (dist - table.s_min) * table.inv_h : 0;
+            int k = (int)u < table.intervals - 1 ? (int)u : table.intervals - 1;
+            total += pair_table_cubic(table.coefficients, k, 0, u - k);
+        }
+    }
+    return total;
+}
+
+template <int FIXED_N>
+__attribute__((target("avx512f")))
+double row_energy_table_avx512(const coords *array, int i) {
+    const int count = FIXED_N ? FIXED_N : N;
+    const __m512d xi = _mm512_set1_pd(array->x[i]);
+    const __m512d yi = _mm512_set1_pd(array->y[i]);
+    const __m512d zi = _mm512_set1_pd(array->z[i]);
+    const __m512d box = _mm512_set1_pd(box_size);
+    const __m512d inv_box = _mm512_set1_pd(1.0 / box_size);
+    const __m512d cutoff2 = _mm512_set1_pd(rc * rc);
+    const __m512d s_min = _mm512_set1_pd(table.s_min);
+    const __m512d inv_h = _mm512_set1_pd(table.inv_h);
+    const __m256i last = _mm256_set1_epi32(table.intervals - 1);
+    const __m512d zero = _mm512_setzero_pd();
+    const double *c = table.coefficients;
+    __m512d energy = zero;
+    for (int j = i + 1; j < count; j += 8) {
+        int remaining = count - j;
+        __mmask8 lanes = remaining >= 8 ? (__mmask8)0xFF : (__mmask8)((1u << remaining) - 1);
+        __m512d x = _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, array->x + j), xi);
+        __m512d y = _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, array->y + j), yi);
+        __m512d z = _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, array->z + j), zi);
+        x = _mm512_fnmadd_pd(box, _mm512_roundscale_pd(_mm512_mul_pd(x, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), x);
+        y = _mm512_fnmadd_pd(box, _mm512_roundscale_pd(_mm512_mul_pd(y, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), y);
+        z = _mm512_fnmadd_pd(box, _mm512_roundscale_pd(_mm512_mul_pd(z, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), z);
+        __m512d dist = _mm512_fmadd_pd(z, z, _mm512_fmadd_pd(y, y, _mm512_mul_pd(x, x)));
+        __mmask8 inside = _mm512_mask_cmp_pd_mask(lanes, dist, cutoff2, _CMP_LT_OQ);
+        PROFILE_COUNT(PROFILE_PAIRS_INSIDE, __builtin_popcount(inside));
+        __m512d u = _mm512_maskz_mul_pd(inside, _mm512_max_pd(_mm512_sub_pd(dist, s_min), zero), inv_h);
+        __m256i interval = _mm256_min_epi32(_mm512_cvttpd_epi32(u), last);
+        __m512d t = _mm512_sub_pd(u, _mm512_cvtepi32_pd(interval));
+        __m256i offset = _mm256_slli_epi32(interval, 3);
+        __m512d e0 = _mm512_mask_i32gather_pd(zero, inside, offset, c + 0, 8);
+        __m512d e1 = _mm512_mask_i32gather_pd(zero, inside, offset, c + 1, 8);
+        __m512d e2 = _mm512_mask_i32gather_pd(zero, inside, offset, c + 2, 8);
+        __m512d e3 = _mm512_mask_i32gather_pd(zero, inside, offset, c + 3, 8);
+        __m512d pair = _mm512_fmadd_pd(t, _mm512_fmadd_pd(t, _mm512_fmadd_pd(t, e3, e2), e1), e0);
+        energy = _mm512_mask_add_pd(energy, inside, energy, pair);
+    }
+    return _mm512_reduce_add_pd(energy);
+}
+
+template <int FIXED_N>
+__attribute__((target("avx2,fma")))
+double row_energy_mixed_avx2(const coords *array, int i) {
+    const int count = FIXED_N ? FIXED_N : N;
+    const __m256 xi = _mm256_set1_ps(single_config.x[i]);
+    const __m256 yi = _mm256_set1_ps(single_config.y[i]);
+    const __m256 zi = _mm256_set1_ps(single_config.z[i]);
+    const __m256 box = _mm256_set1_ps((float)box_size);
+    const __m256 inv_box = _mm256_set1_ps((float)(1.0 / box_size));
+    const __m256 cutoff2 = _mm256_set1_ps((float)(rc * rc));
+    const __m256 shift = _mm256_set1_ps((float)Urc);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 four = _mm256_set1_ps(4.0f);
+    __m256d energy = _mm256_setzero_pd();
+    int j = i + 1;
+    for (; j + 8 <= count; j += 8) {
+        __m256 x = _mm256_sub_ps(_mm256_loadu_ps(single_config.x + j), xi);
+        __m256 y = _mm256_sub_ps(_mm256_loadu_ps(single_config.y + j), yi);
+        __m256 z = _mm256_sub_ps(_mm256_loadu_ps(single_config.z + j), zi);
+        x = _mm256_fnmadd_ps(box, _mm256_round_ps(_mm256_mul_ps(x, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), x);
+        y = _mm256_fnmadd_ps(box, _mm256_round_ps(_mm256_mul_ps(y, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), y);
+        z = _mm256_fnmadd_ps(box, _mm256_round_ps(_mm256_mul_ps(z, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), z);
+        __m256 dist = _mm256_fmadd_ps(z, z, _mm256_fmadd_ps(y, y, _mm256_mul_ps(x, x)));
+        __m256 inside = _mm256_cmp_ps(dist, cutoff2, _CMP_LT_OQ);
+        PROFILE_COUNT(PROFILE_PAIRS_INSIDE, __builtin_popcount(_mm256_movemask_ps(inside)));
+        __m256 inv2 = _mm256_div_ps(one, dist);
+        __m256 inv6 = _mm256_mul_ps(_mm256_mul_ps(inv2, inv2), inv2);
+        __m256 pair = _mm256_and_ps(inside, _mm256_fmsub_ps(four, _mm256_fmsub_ps(inv6, inv6, inv6), shift));
+        energy = _mm256_add_pd(energy, _mm256_cvtps_pd(_mm256_castps256_ps128(pair)));
+        energy = _mm256_add_pd(energy, _mm256_cvtps_pd(_mm256_extractf128_ps(pair, 1)));
+    }
+    __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(energy), _mm256_extractf128_pd(energy, 1));
+    double total = _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+    for (; j < count; j++) {
+        float x = single_config.x[j] - single_config.x[i];
+        float y = single_config.y[j] - single_config.y[i];
+        float z = single_config.z[j] - single_config.z[i];
+        x -= (float)box_size * rintf(x * (float)(1.0 / box_size));
+        y -= (float)box_size * rintf(y * (float)(1.0 / box_size));
+        z -= (float)box_size * rintf(z * (float)(1.0 / box_size));
+        float dist = x * x + y * y + z * z;
+        if (dist < (float)(rc * rc)) {
+            PROFILE_COUNT(PROFILE_PAIRS_INSIDE, 1);
+            float inv6 = 1 / (dist * dist * dist);
+            total += 4 * (inv6 * inv6 - inv6) - (float)Urc;
+        }
+    }
+    return total;
+}
+
+template <int FIXED_N>
+__attribute__((target("avx512f")))
+double row_energy_mixed_avx512(const coords *array, int i) {
+    const int count = FIXED_N ? FIXED_N : N;
+    const __m512 xi = _mm512_set1_ps(single_config.x[i]);
+    const __m512 yi = _mm512_set1_ps(single_config.y[i]);
+    const __m512 zi = _mm512_set1_ps(single_config.z[i]);
+    const __m512 box = _mm512_set1_ps((float)box_size);
+    const __m512 inv_box = _mm512_set1_ps((float)(1.0 / box_size));
+    const __m512 cutoff2 = _mm512_set1_ps((float)(rc * rc));
+    const __m512 shift = _mm512_set1_ps((float)Urc);
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512 four = _mm512_set1_ps(4.0f);
+    __m512d energy = _mm512_setzero_pd();
+    for (int j = i + 1; j < count; j += 16) {
+        int remaining = count - j;
+        __mmask16 lanes = remaining >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << remaining) - 1);
+        __m512 x = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, single_config.x + j), xi);
+        __m512 y = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, single_config.y + j), yi);
+        __m512 z = _mm512_sub_ps(_mm512_maskz_loadu_ps(lanes, single_config.z + j), zi);
+        x = _mm512_fnmadd_ps(box, _mm512_roundscale_ps(_mm512_mul_ps(x, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), x);
+        y = _mm512_fnmadd_ps(box, _mm512_roundscale_ps(_mm512_mul_ps(y, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), y);
+        z = _mm512_fnmadd_ps(box, _mm512_roundscale_ps(_mm512_mul_ps(z, inv_box), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), z);
+        __m512 dist = _mm512_fmadd_ps(z, z, _mm512_fmadd_ps(y, y, _mm512_mul_ps(x, x)));
+        __mmask16 inside = _mm512_mask_cmp_ps_mask(lanes, dist, cutoff2, _CMP_LT_OQ);
+        PROFILE_COUNT(PROFILE_PAIRS_INSIDE, __builtin_popcount(inside));
+        __m512 inv2 = _mm512_maskz_div_ps(inside, one, dist);
+        __m512 inv6 = _mm512_mul_ps(_mm512_mul_ps(inv2, inv2), inv2);
+        __m512 pair = _mm512_maskz_mov_ps(inside, _mm512_fmsub_ps(four, _mm512_fmsub_ps(inv6, inv6, inv6), shift));
+        energy = _mm512_add_pd(energy, _mm512_cvtps_pd(_mm512_castps512_ps256(pair)));
+        energy = _mm512_add_pd(energy, _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(pair), 1))));
+    }
+    return _mm512_reduce_add_pd(energy);
+}
+#endif
+
+// isa: 0 scalar, 1 avx2, 2 avx512
+template <int FIXED_N>
+row_energy_kernel row_energy_instance(int isa, bool mixed) {
+    bool tabulated = potential == POTENTIAL_TABLE;
+    #if defined(__x86_64__) || defined(__i386__)
+        if (isa == 2) {
+            if (mixed) {
+                return row_energy_mixed_avx512<FIXED_N>;
+            }
+            return tabulated ? row_energy_table_avx512<FIXED_N> : row_energy_avx512<FIXED_N>;
+        }
+        if (isa == 1) {
+            if (mixed) {
+                return row_energy_mixed_avx2<FIXED_N>;
+            }
+            return tabulated ? row_energy_table_avx2<FIXED_N> : row_energy_avx2<FIXED_N>;
+        }
+    #endif
+    if (mixed) {
+        return row_energy_mixed_scalar<FIXED_N>;
+    }
+    return tabulated ? row_energy_table_scalar<FIXED_N> : row_energy_scalar<FIXED_N>;
+}
+
+row_energy_kernel select_row_energy(bool mixed, const char **name) {
+    static const char *isa_names[] = { "scalar", "avx2", "avx512" };
+    static char instance_name[64];
+    int isa = 0;
+    #if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+            isa = 2;
+        } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            isa = 1;
+        }
+    #endif
+    row_energy_kernel kernel;
+    switch (N) {
+        case 16: kernel = row_energy_instance<16>(isa, mixed); break;
+        case 32: kernel = row_energy_instance<32>(isa, mixed); break;
+        case 64: kernel = row_energy_instance<64>(isa, mixed); break;
+        case 128: kernel = row_energy_instance<128>(isa, mixed); break;
+        case 256: kernel = row_energy_instance<256>(isa, mixed); break;
+        default: kernel = row_energy_instance<0>(isa, mixed); break;
+    }
+    if (kernel == row_energy_instance<0>(isa, mixed)) {
+        snprintf(instance_name, sizeof(instance_name), "%s, generic N", isa_names[isa]);
+    } else {
+        snprintf(instance_name, sizeof(instance_name), "%s, N %d", isa_names[isa], N);
+    }
+    if (potential == POTENTIAL_TABLE) {
+        snprintf(instance_name + strlen(instance_name), sizeof(instance_name) - strlen(instance_name),
+            ", table of %d intervals", table.intervals);
+    }
+    if (mixed) {
+        strcat(instance_name, ", mixed precision");
+    }
+    *name = instance_name;
+    return kernel;
+}
+
+double calculate_energy_lj(coords *array, row_energy_kernel kernel){
+    if (precision != PRECISION_DOUBLE) {
+        // wrapped into the box, where float keeps the most digits of a position
+        #pragma omp simd
+        for (int i = 0; i < N; i++) {
+            single_config.x[i] = (float)(array->x[i] - box_size * floor(array->x[i] / box_size + 0.5));
+            single_config.y[i] = (float)(array->y[i] - box_size * floor(array->y[i] / box_size + 0.5));
+            single_config.z[i] = (float)(array->z[i] - box_size * floor(array->z[i] / box_size + 0.5));
+        }
+    }
+    PROFILE_COUNT(PROFILE_PAIRS_EVALUATED, (long)N * (N - 1) / 2);
+    double energy = 0;
+    // every pair is evaluated once (j > i), so the lower indices carry more work
+    #pragma omp parallel reduction(+:energy) num_threads(threads)
+    {
+        #pragma omp for schedule(dynamic, 8)
+        for (int i = 0; i < N; i++) {
+            energy += kernel(array, i);
+        }
+        PROFILE_FLUSH();
+    }
+    return energy;
+}
+
+// The shifted pair of moves = single. Its positions are kept in the box, so one
+// shift by the box takes the separation to the closest image. The shift and the
+// cutoff are arithmetic rather than branches, and the globals come in as arguments,
+// so that the loops over partners vectorize without -ffast-math.
+template <bool TABULATED>
+static inline double pair_energy(double x, double y, double z, double box, double cutoff2, double shift) {
+    x -= (fabs(x) > box / 2) * copysign(box, x);
+    y -= (fabs(y) > box / 2) * copysign(box, y);
+    z -= (fabs(z) > box / 2) * copysign(box, z);
+    double dist = x * x + y * y + z * z;
+    if (TABULATED) {
+        if (dist >= cutoff2) {
+            return 0;
+        }
+        double u = dist > table.s_min ? (dist - table.s_min) * table.inv_h : 0;
+        int k = (int)u < table.intervals - 1 ? (int)u : table.intervals - 1;
+        return pair_table_cubic(table.coefficients, k, 0, u - k);
+    }
+    double inv2 = 1 / dist;
+    double inv6 = inv2 * inv2 * inv2;
+    return (dist < cutoff2) * (4 * (inv6 * inv6 - inv6) - shift);
+}
+
+// The change of the pairs of a particle moved from (old_x, old_y, old_z) to (x, y, z)
+// with the partners begin .. end - 1, which are contiguous with all pairs. It is
+// cloned for the vector widths the row kernels pick from, and the widest the CPU runs is bound at load time.
+#if defined(__x86_64__) || defined(__i386__)
+    #define SPAN_CLONES __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "default")))
+#else
+    #define SPAN_CLONES
+#endif
+template <bool TABULATED>
+SPAN_CLONES
+double span_energy(const coords *array, int begin, int end, double old_x, double old_y, double old_z, double x, double y, double z) {
+    const double *partner_x = array->x;
+    const double *partner_y = array->y;
+    const double *partner_z = array->z;
+    const double box = box_size;
+    const double cutoff2 = rc * rc;
+    const double shift = Urc;
+    double delta = 0;
+    #pragma omp simd reduction(+:delta)
+    for (int j = begin; j < end; j++) {
+        delta += pair_energy<TABULATED>(partner_x[j] - x, partner_y[j] - y, partner_z[j] - z, box, cutoff2, shift)
+            - pair_energy<TABULATED>(partner_x[j] - old_x, partner_y[j] - old_y, partner_z[j] - old_z, box, cutoff2, shift);
+    }
+    return delta;
+}
+
+// The pairs of a particle at (x, y, z) with the partners begin .. end - 1.
+template <bool TABULATED>
+SPAN_CLONES
+double partner_energy(const coords *array, int begin, int end, double x, double y, double z) {
+    const double *partner_x = array->x;
+    const double *partner_y = array->y;
+    const double *partner_z = array->z;
+    const double box = box_size;
+    const double cutoff2 = rc * rc;
+    const double shift = Urc;
+    double energy = 0;
+    #pragma omp simd reduction(+:energy)
+    for (int j = begin; j < end; j++) {
+        energy += pair_energy<TABULATED>(partner_x[j] - x, partner_y[j] - y, partner_z[j] - z, box, cutoff2, shift);
+    }
+    return energy;
+}
+
+// Copies the particles in the cells around cell, but particle, into cell_partners,
+// so the pair math runs through the same vector loops as with all pairs.
+int gather_partners(const coords *array, int cell, int particle) {
     int count = 0;
-    for (int z_dif = -box_size; z_dif < box_size + 1; z_dif += box_size) {
-        for (int y_dif = -box_size; y_dif < box_size + 1; y_dif += box_size) {
-            for (int x_dif = -box_size; x_dif < box_size + 1; x_dif += box_size) {
-                for (int i = 0; i < particle_count; i++) {
-                    if (particle == i) {
-                        continue;
-                    }
-                    dim temp = { initial_array[i].x + x_dif, initial_array[i].y + y_dif, initial_array[i].z + z_dif };
-                    if (square_dist(temp, initial_array[particle]) < rc*rc) {
-                        new_array[count] = temp;
-                        count++;
-                    }
-                }
+    for (int k = 0; k < 27 && cell_neighbors[cell * 27 + k] >= 0; k++) {
+        for (int j = cell_head[cell_neighbors[cell * 27 + k]]; j >= 0; j = cell_next[j]) {
+            if (j != particle) {
+                cell_partners.x[count] = array->x[j];
+                cell_partners.y[count] = array->y[j];
+                cell_partners.z[count] = array->z[j];
+                count++;
             }
         }
     }
     return count;
 }
 
-double square_dist(dim first, dim second) {
-    return (first.x - second.x)*(first.x - second.x) + (first.y - second.y)*(first.y - second.y) + (first.z - second.z)*(first.z - second.z);
+void init_cells(const coords *array) {
+    cells_per_side = (int)(box_size / rc);
+    int cells_total = cells_per_side * cells_per_side * cells_per_side;
+    cell_neighbors = (int*)counted_alloc(sizeof(int), sizeof(int) * cells_total * 27);
+    cell_head = (int*)counted_alloc(sizeof(int), sizeof(int) * cells_total);
+    cell_next = (int*)counted_alloc(sizeof(int), sizeof(int) * N);
+    particle_cell = (int*)counted_alloc(sizeof(int), sizeof(int) * N);
+    cell_partners = alloc_coords(N);
+    int stencil = 0;
+    for (int cell = 0; cell < cells_total; cell++) {
+        int cx = cell % cells_per_side;
+        int cy = cell / cells_per_side % cells_per_side;
+        int cz = cell / cells_per_side / cells_per_side;
+        int *list = cell_neighbors + cell * 27;
+        int count = 0;
+        for (int d = 0; d < 27; d++) {
+            int nx = (cx + d % 3 - 1 + cells_per_side) % cells_per_side;
+            int ny = (cy + d / 3 % 3 - 1 + cells_per_side) % cells_per_side;
+            int nz = (cz + d / 9 - 1 + cells_per_side) % cells_per_side;
+            int neighbor = (nz * cells_per_side + ny) * cells_per_side + nx;
+            // with fewer than 3 cells per side the periodic stencil wraps onto itself
+            bool seen = false;
+            for (int k = 0; k < count; k++) {
+                seen = seen || list[k] == neighbor;
+            }
+            if (!seen) {
+                list[count] = neighbor;
+                count++;
+            }
+        }
+        for (int k = count; k < 27; k++) {
+            list[k] = -1;
+        }
+        stencil = count;
+        cell_head[cell] = -1;
+    }
+    for (int particle = N - 1; particle >= 0; particle--) {
+        int cell = cell_of(array->x[particle], array->y[particle], array->z[particle]);
+        particle_cell[particle] = cell;
+        cell_next[particle] = cell_head[cell];
+        cell_head[cell] = particle;
+    }
+    printf("cell list: %d cells per side, %d neighbor cells each\n", cells_per_side, stencil);
 }
 
-double calculate_energy_lj(dim *array){
-    double energy = 0;
-    #pragma omp parallel for reduction(+:energy) num_threads(NUM_THREADS)
-    for (int i = 0; i < N; i++) {
-        dim *neighbors = (dim*)malloc(sizeof(dim) * N);
-        int count_near = nearest_image(array, neighbors, N, i);
-        for (int j = 0; j < count_near; j++) {
-            double dist = square_dist(array[i], neighbors[j]);
-            double r6 = fast_pow(dist, 3);
-            double r12 = r6 * r6;
-            energy += 4 * (1 / r12 - 1 / r6) - Urc;
+int cell_of(double x, double y, double z) {
+    // a trial position can be just outside the box, the cells are inside it
+    double scale = cells_per_side / box_size;
+    int cx = (int)((x - box_size * floor(x / box_size)) * scale);
+    int cy = (int)((y - box_size * floor(y / box_size)) * scale);
+    int cz = (int)((z - box_size * floor(z / box_size)) * scale);
+    // rounding can put a position just below box_size into cell cells_per_side
+    cx = cx < cells_per_side ? cx : cells_per_side - 1;
+    cy = cy < cells_per_side ? cy : cells_per_side - 1;
+    cz = cz < cells_per_side ? cz : cells_per_side - 1;
+    return (cz * cells_per_side + cy) * cells_per_side + cx;
+}
+
+// The energy change of moving particle to (x, y, z): its pairs at the new position
+// less those at the old one, with every other particle or, with the cell lists, with
+// the particles in the cells around either position, gathered into cell_partners.
+// Both positions are taken in one pass over the partners where they share them.
+double move_energy(const coords *array, int particle, double x, double y, double z) {
+    const double old_x = array->x[particle];
+    const double old_y = array->y[particle];
+    const double old_z = array->z[particle];
+    bool tabulated = potential == POTENTIAL_TABLE;
+    double delta = 0;
+    if (!single_cells) {
+        if (tabulated) {
+            delta = span_energy<true>(array, 0, particle, old_x, old_y, old_z, x, y, z)
+                + span_energy<true>(array, particle + 1, N, old_x, old_y, old_z, x, y, z);
+        } else {
+            delta = span_energy<false>(array, 0, particle, old_x, old_y, old_z, x, y, z)
+                + span_energy<false>(array, particle + 1, N, old_x, old_y, old_z, x, y, z);
+        }
+        pairs_visited += 2 * (N - 1);
+        PROFILE_COUNT(PROFILE_PAIRS_EVALUATED, 2 * (N - 1));
+        return delta;
+    }
+    int from = particle_cell[particle];
+    int to = cell_of(x, y, z);
+    long partners = gather_partners(array, from, particle);
+    if (to == from) {
+        delta = tabulated ? span_energy<true>(&cell_partners, 0, partners, old_x, old_y, old_z, x, y, z)
+            : span_energy<false>(&cell_partners, 0, partners, old_x, old_y, old_z, x, y, z);
+        partners *= 2;
+    } else {
+        delta = -(tabulated ? partner_energy<true>(&cell_partners, 0, partners, old_x, old_y, old_z)
+            : partner_energy<false>(&cell_partners, 0, partners, old_x, old_y, old_z));
+        int count = gather_partners(array, to, particle);
+        delta += tabulated ? partner_energy<true>(&cell_partners, 0, count, x, y, z)
+            : partner_energy<false>(&cell_partners, 0, count, x, y, z);
+        partners += count;
+    }
+    pairs_visited += partners;
+    PROFILE_COUNT(PROFILE_PAIRS_EVALUATED, partners);
+    return delta;
+}
+
+// N Metropolis trials that each move one particle, in turn; returns the energy
+// change of the accepted ones. With all pairs a sweep loads the N (N - 1) partners
+// that one full energy loads twice and takes each pair at both positions; with
+// the cell lists it loads only the partners in the cells around the particle.
+double single_sweep(coords *array, double temperature, long *accepted_moves) {
+    double change = 0;
+    for (int particle = 0; particle < N; particle++) {
+        //ofsset between -max_deviation/2 and max_deviation/2
+        double x = array->x[particle] + rng_uniform() * max_deviation - max_deviation / 2;
+        double y = array->y[particle] + rng_uniform() * max_deviation - max_deviation / 2;
+        double z = array->z[particle] + rng_uniform() * max_deviation - max_deviation / 2;
+        double delta = move_energy(array, particle, x, y, z);
+        if (delta > 0 && rng_uniform() >= exp(-delta / temperature)) {
+            continue;
+        }
+        if (single_cells) {
+            int from = particle_cell[particle];
+            int to = cell_of(x, y, z);
+            if (to != from) {
+                int *link = &cell_head[from];
+                while (*link != particle) {
+                    link = &cell_next[*link];
+                }
+                *link = cell_next[particle];
+                cell_next[particle] = cell_head[to];
+                cell_head[to] = particle;
+                particle_cell[particle] = to;
+            }
         }
-        free(neighbors);
+        array->x[particle] = x - box_size * floor(x / box_size + 0.5);
+        array->y[particle] = y - box_size * floor(y / box_size + 0.5);
+        array->z[particle] = z - box_size * floor(z / box_size + 0.5);
+        change += delta;
+        (*accepted_moves)++;
     }
-    // now we consider each interaction twice, so we need to divide energy by 2
-    return energy / 2;
+    return change;
 }
 
-void mc_method(dim *array) {
-    double *energy_ar = (double*)malloc(sizeof(double) * nmax);
+void mc_method(coords *array) {
+    double *energy_ar = (double*)counted_alloc(sizeof(double), sizeof(double) * nmax);
+    // the accepted and the trial configuration live in one arena reserved up front;
+    // a trial is written over the spare buffer and accepting it just swaps the two
+    size_t configuration_bytes = 3 * (sizeof(double) * ((N + SIMD_PADDING - 1) / SIMD_PADDING * SIMD_PADDING) + ARENA_ALIGNMENT);
+    scratch_arena trial_arena;
+    arena_init(&trial_arena, 2 * configuration_bytes);
+    coords current = arena_coords(&trial_arena, N);
+    coords tmp = arena_coords(&trial_arena, N);
+    copy_coords(&current, array);
+    if (moves == MOVES_SINGLE) {
+        // into the box, which pair_energy() relies on; an all-particle run or its checkpoint leaves them anywhere
+        for (int particle = 0; particle < N; particle++) {
+            current.x[particle] -= box_size * floor(current.x[particle] / box_size + 0.5);
+            current.y[particle] -= box_size * floor(current.y[particle] / box_size + 0.5);
+            current.z[particle] -= box_size * floor(current.z[particle] / box_size + 0.5);
+        }
+        if (single_cells) {
+            init_cells(&current);
+        }
+    }
+    long allocations_before = heap_allocations;
     register int i = 0;
     register int good_iter = 0;
     int good_iter_hung = 0;
-    double u1 = calculate_energy_lj(array);
+    double u1 = calculate_energy_lj(&current, row_energy);
+    if (restart_path[0] != '\0') {
+        i = (int)resumed.trial;
+        good_iter = (int)resumed.accepted;
+        good_iter_hung = (int)resumed.accepted_hung;
+        u1 = resumed.energy;
+        const double *saved = (const double*)snapshot_find(&restart_snapshot, "energies", sizeof(double) * good_iter);
+        if (saved == NULL) {
+            printf("Checkpoint %s is damaged or belongs to another problem\n", restart_path);
+            exit(1);
+        }
+        memcpy(energy_ar, saved, sizeof(double) * good_iter);
+    }
+    double checkpoint_time = 0;
+    int checkpoints = 0;
+    // precision validate: the trial energies of the mixed kernel against the double one
+    double energy_error_sum = 0, energy_error_max = 0;
+    double mixed_time = 0, double_time = 0;
+    long checked = 0;
+    // moves = single: a trial is a sweep, the running energy is checked against a full one every recompute_every sweeps
+    long accepted_moves = 0;
+    double drift_max = 0;
+    int recomputes = 0;
+    int first_trial = i;
+    double start_time = omp_get_wtime();
     while (1) {
         if ((good_iter == nmax) || (i == total_it)) {
             printf("\nenergy is %f \ngood iters percent %f \n", energy_ar[good_iter-1]/N, (float)good_iter/(float)total_it);
             break;
         }
-        dim *tmp = (dim*)malloc(sizeof(dim)*N);
-        memcpy(tmp, array, sizeof(dim)*N);
-        for (int particle = 0; particle < N; particle++) {
-            //ofsset between -max_deviation/2 and max_deviation/2
-            double ex = (double)rand() / (double)RAND_MAX * max_deviation - max_deviation / 2;
-            double ey = (double)rand() / (double)RAND_MAX * max_deviation - max_deviation / 2;
-            double ez = (double)rand() / (double)RAND_MAX * max_deviation - max_deviation / 2;
-            tmp[particle].x = tmp[particle].x + ex;
-            tmp[particle].y = tmp[particle].y + ex;
-            tmp[particle].z = tmp[particle].z + ex;
-        }
-        double u2 = calculate_energy_lj(tmp);
-        double deltaU_div_T = (u1 - u2) / Temperature;
-        double probability = exp(deltaU_div_T);
-        double rand_0_1 = (double)rand() / (double)RAND_MAX;
-        if ((u2 < u1) || (probability <= rand_0_1)) {
-            u1 = u2;
-            memcpy(array, tmp, sizeof(dim)*N);
-            energy_ar[good_iter] = u2;
-            good_iter++;
-            good_iter_hung++;
+        if (moves == MOVES_SINGLE) {
+            PROFILE_BEGIN(PROFILE_SWEEP);
+            long accepted_before = accepted_moves;
+            u1 += single_sweep(&current, Temperature, &accepted_moves);
+            PROFILE_END(PROFILE_SWEEP);
+            if ((i + 1) % recompute_every == 0) {
+                PROFILE_BEGIN(PROFILE_ENERGY);
+                double full = calculate_energy_lj(&current, row_energy);
+                PROFILE_END(PROFILE_ENERGY);
+                drift_max = fmax(drift_max, fabs(u1 - full) / N);
+                u1 = full;
+                recomputes++;
+            }
+            // a sweep that moved anything counts as an accepted trial
+            if (accepted_moves > accepted_before) {
+                energy_ar[good_iter] = u1;
+                good_iter++;
+                good_iter_hung++;
+            }
+        } else {
+            PROFILE_BEGIN(PROFILE_TRIAL_MOVE);
+            for (int particle = 0; particle < N; particle++) {
+                //ofsset between -max_deviation/2 and max_deviation/2
+                double ex = rng_uniform() * max_deviation - max_deviation / 2;
+                double ey = rng_uniform() * max_deviation - max_deviation / 2;
+                double ez = rng_uniform() * max_deviation - max_deviation / 2;
+                tmp.x[particle] = current.x[particle] + ex;
+                tmp.y[particle] = current.y[particle] + ex;
+                tmp.z[particle] = current.z[particle] + ex;
+            }
+            PROFILE_END(PROFILE_TRIAL_MOVE);
+            PROFILE_BEGIN(PROFILE_ENERGY);
+            double energy_start = omp_get_wtime();
+            double u2 = calculate_energy_lj(&tmp, row_energy);
+            PROFILE_END(PROFILE_ENERGY);
+            if (precision == PRECISION_VALIDATE) {
+                PROFILE_BEGIN(PROFILE_REFERENCE);
+                double reference_start = omp_get_wtime();
+                double reference = calculate_energy_lj(&tmp, row_energy_double);
+                double error = fabs(u2 - reference) / fmax(fabs(reference), 1e-12);
+                energy_error_sum += error;
+                energy_error_max = fmax(energy_error_max, error);
+                mixed_time += reference_start - energy_start;
+                double_time += omp_get_wtime() - reference_start;
+                checked++;
+                PROFILE_END(PROFILE_REFERENCE);
+            }
+            double deltaU_div_T = (u1 - u2) / Temperature;
+            double probability = exp(deltaU_div_T);
+            double rand_0_1 = rng_uniform();
+            if ((u2 < u1) || (probability <= rand_0_1)) {
+                u1 = u2;
+                coords accepted = tmp;
+                tmp = current;
+                current = accepted;
+                energy_ar[good_iter] = u2;
+                good_iter++;
+                good_iter_hung++;
+            }
         }
         i++;
-        free(tmp);
+        if (checkpoint_path[0] != '\0' && (i % checkpoint_every == 0 || i == total_it)) {
+            PROFILE_BEGIN(PROFILE_CHECKPOINT);
+            double checkpoint_start = omp_get_wtime();
+            if (!write_checkpoint(&current, i, good_iter, good_iter_hung, u1, energy_ar)) {
+                printf("Failed to write checkpoint %s at trial %d\n", checkpoint_path, i);
+            }
+            checkpoint_time += omp_get_wtime() - checkpoint_start;
+            PROFILE_END(PROFILE_CHECKPOINT);
+            checkpoints++;
+        }
+    }
+    double loop_time = omp_get_wtime() - start_time;
+    if (checkpoints > 0) {
+        printf("checkpoint %s: %d written, %.3f ms each\n", checkpoint_path, checkpoints, 1000 * checkpoint_time / checkpoints);
+    }
+    int trials = i - first_trial;
+    printf("%d trials in %.3f s of trial loop\n", trials, loop_time);
+    if (moves == MOVES_SINGLE) {
+        // the pairs of the sweeps only, the full energies come on top
+        printf("throughput: %.4e single-particle trials/s, %.4e pairs/s on 1 thread\n",
+            (double)N * trials / loop_time, pairs_visited / loop_time);
+        printf("single-particle trials: %ld of %ld accepted; %d full energies, running energy off by at most %.3e per particle\n",
+            accepted_moves, (long)N * trials, recomputes, drift_max);
+    } else {
+        // a trial evaluates the N (N - 1) / 2 pairs once
+        printf("throughput: %.4e trials/s, %.4e pairs/s on %d threads\n",
+            trials / loop_time, (double)N * (N - 1) / 2 * trials / loop_time, threads);
+    }
+    if (precision == PRECISION_VALIDATE && checked > 0) {
+        // the chain follows the mixed energies, so its last one shows what they accumulated to
+        double final_reference = calculate_energy_lj(&current, row_energy_double);
+        printf("precision validation over %ld trials: relative energy error mean %.2e, max %.2e\n",
+            checked, energy_error_sum / checked, energy_error_max);
+        printf("final energy per particle %f mixed, %f double; energy evaluation %.3f ms mixed, %.3f ms double per trial\n",
+            u1 / N, final_reference / N, 1000 * mixed_time / checked, 1000 * double_time / checked);
     }
+    printf("heap allocations in the trial loop: %ld\n", heap_allocations - allocations_before);
+    copy_coords(array, &current);
+    arena_release(&trial_arena);
+    free(energy_ar);
 }
 
 inline double fast_pow(double a, int n) {
@@ -0,0 +1,174 @@
+#!/bin/sh
+# Throughput sweep of the OpenMP engines and the OpenCL hosts, written as JSON so
+# that two builds can be compared.
+#   sh benchmark.sh [output.json]
+# Every configuration runs WARMUP times untimed and REPEATS times timed, and the
+# JSON keeps the mean, standard deviation, min and max of each metric over the
+# timed runs. Engines whose binary is missing are skipped. The OpenCL hosts run on
+# the platform named by OPENCL_VENDOR, e.g. OPENCL_VENDOR=pocl on a machine without a GPU.
+#
+# The sweep is set through the environment:
+#   ENGINES      md_cpu mc_cpu md_cl mc_cl
+#   SIZES        N of the MD runs, MC_SIZES those of the MC runs
+#   DENSITIES    particles per unit volume, the box follows from N
+#   CUTOFFS      rc, skipped where it exceeds half the box
+#   THREADS      OpenMP threads of the CPU engines
+#   MD_STEPS, MC_TRIALS, DT, WARMUP, REPEATS
+ROOT=$(cd "$(dirname "$0")" && pwd)
+OUT=${1:-benchmark.json}
+ENGINES=${ENGINES:-"md_cpu mc_cpu md_cl mc_cl"}
+MD_CPU=${MD_CPU:-$ROOT/Mol_dyn/MDHost_CPU}
+MC_CPU=${MC_CPU:-$ROOT/Monte-Carlo/MCHost_CPU}
+MD_CL=${MD_CL:-$ROOT/Mol_dyn/MDHost_GPU}
+MC_CL=${MC_CL:-$ROOT/Monte-Carlo/MCHost_GPU}
+OPENCL_VENDOR=${OPENCL_VENDOR:-NVIDIA}
+SIZES=${SIZES:-"4000 32000"}
+MC_SIZES=${MC_SIZES:-"500 2000"}
+DENSITIES=${DENSITIES:-"0.5 0.8"}
+CUTOFFS=${CUTOFFS:-"2.5 3.0"}
+THREADS=${THREADS:-"1 2 4 8"}
+MD_STEPS=${MD_STEPS:-200}
+MC_TRIALS=${MC_TRIALS:-200}
+DT=${DT:-0.002}
+WARMUP=${WARMUP:-1}
+REPEATS=${REPEATS:-5}
+
+# box, lattice spacing and edge gap of N particles at a density: the initial lattice
+# of the engines then has ceil(cbrt N) sites per side, as far apart across the
+# periodic boundary as inside the box
+geometry() {
+    awk -v n=$1 -v density=$2 'BEGIN {
+        box = exp(log(n / density) / 3)
+        side = int(exp(log(n) / 3))
+        while (side * side * side < n) side++
+        spacing = box / side
+        printf "%.6f %.6f %.6f", box, spacing, spacing / 2
+    }'
+}
+
+# the numbers on the throughput line of one run, in the order it prints them
+throughput() {
+    dir=$1
+    shift
+    (cd "$dir" && "$@" 2>&1) | awk '/^throughput:/ {
+        for (i = 2; i <= NF; i++) {
+            value = $i
+            sub(/,$/, "", value)
+            if (value ~ /^[-+0-9.]+(e[-+]?[0-9]+)?$/) printf "%s ", value
+        }
+        print ""
+    }'
+}
+
+# WARMUP + REPEATS runs of one configuration as a JSON object; the arguments
+# are the engine, N, density, rc, threads, the metric names and the command
+measure() {
+    engine=$1 n=$2 density=$3 rc=$4 threads=$5 names=$6
+    shift 6
+    dir=$(dirname "$1")
+    w=0
+    while [ $w -lt $WARMUP ]; do
+        throughput "$dir" "$@" > /dev/null
+        w=$((w + 1))
+    done
+    r=0
+    while [ $r -lt $REPEATS ]; do
+        throughput "$dir" "$@"
+        r=$((r + 1))
+    done | awk -v engine=$engine -v n=$n -v density=$density -v rc=$rc -v threads=$threads -v names="$names" '
+        NF > 0 {
+            runs++
+            for (m = 1; m <= NF; m++) {
+                sum[m] += $m
+                square[m] += $m * $m
+                if (runs == 1 || $m < low[m]) low[m] = $m
+                if (runs == 1 || $m > high[m]) high[m] = $m
+            }
+        }
+        END {
+            if (runs == 0) {
+                printf "%s N %d density %s rc %s threads %s: no run finished\n", engine, n, density, rc, threads > "/dev/stderr"
+                exit 1
+            }
+            count = split(names, name, " ")
+            printf "    {\"engine\": \"%s\", \"N\": %d, \"density\": %s, \"rc\": %s, \"threads\": %s, \"runs\": %d", engine, n, density, rc, threads, runs
+            for (m = 1; m <= count; m++) {
+                mean = sum[m] / runs
+                variance = runs > 1 ? (square[m] - runs * mean * mean) / (runs - 1) : 0
+                if (variance < 0) variance = 0
+                printf ", \"%s\": {\"mean\": %.6g, \"stddev\": %.6g, \"min\": %.6g, \"max\": %.6g}", name[m], mean, sqrt(variance), low[m], high[m]
+            }
+            printf "}"
+        }'
+}
+
+# every measure() that printed an object adds it to the results, comma separated
+emit() {
+    record=$("$@")
+    if [ -n "$record" ]; then
+        [ -s "$RESULTS" ] && printf ",\n" >> "$RESULTS"
+        printf "%s" "$record" >> "$RESULTS"
+        echo "$record" | sed 's/^ *//' >&2
+    fi
+}
+
+sweep() {
+    engine=$1 binary=$2 sizes=$3
+    if [ ! -x "$binary" ]; then
+        echo "$engine: $binary not built, skipped" >&2
+        return
+    fi
+    for n in $sizes; do
+        for density in $DENSITIES; do
+            set -- $(geometry $n $density)
+            box=$1 spacing=$2 edge=$3
+            for rc in $CUTOFFS; do
+                if awk -v rc=$rc -v box=$box 'BEGIN { exit !(rc > box / 2) }'; then
+                    echo "$engine N $n density $density: rc $rc exceeds half the box $box, skipped" >&2
+                    continue
+                fi
+                common="--N=$n --box_size=$box --rc=$rc --initial_dist_by_one_axis=$spacing --initial_dist_to_edge=$edge"
+                case $engine in
+                md_cpu)
+                    for t in $THREADS; do
+                        emit measure $engine $n $density $rc $t "pairs_per_s steps_per_s ns_per_day" \
+                            $binary $common --total_it=$MD_STEPS --dt=$DT --threads=$t
+                    done ;;
+                mc_cpu)
+                    for t in $THREADS; do
+                        emit measure $engine $n $density $rc $t "trials_per_s pairs_per_s" \
+                            $binary $common --total_it=$MC_TRIALS --nmax=$MC_TRIALS --threads=$t
+                    done ;;
+                md_cl)
+                    emit measure $engine $n $density $rc null "pairs_per_s steps_per_s ns_per_day" \
+                        $binary $common --total_it=$MD_STEPS --dt=$DT --opencl_vendor=$OPENCL_VENDOR ;;
+                mc_cl)
+                    emit measure $engine $n $density $rc null "trials_per_s pairs_per_s" \
+                        $binary $common --total_it=$MC_TRIALS --nmax=$MC_TRIALS --opencl_vendor=$OPENCL_VENDOR ;;
+                esac
+            done
+        done
+    done
+}
+
+RESULTS=$(mktemp)
+for engine in $ENGINES; do
+    case $engine in
+    md_cpu) sweep md_cpu "$MD_CPU" "$SIZES" ;;
+    mc_cpu) sweep mc_cpu "$MC_CPU" "$MC_SIZES" ;;
+    md_cl) sweep md_cl "$MD_CL" "$SIZES" ;;
+    mc_cl) sweep mc_cl "$MC_CL" "$MC_SIZES" ;;
+    *) echo "unknown engine $engine" >&2 ;;
+    esac
+done
+
+commit=$(git -C "$ROOT" rev-parse --short HEAD 2>/dev/null || echo unknown)
+{
+    printf "{\n  \"commit\": \"%s\",\n  \"date\": \"%s\",\n  \"host\": \"%s\",\n" "$commit" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" "$(uname -n)"
+    printf "  \"warmup\": %d,\n  \"repeats\": %d,\n  \"md_steps\": %d,\n  \"mc_trials\": %d,\n  \"dt\": %s,\n" $WARMUP $REPEATS $MD_STEPS $MC_TRIALS $DT
+    printf "  \"results\": [\n"
+    cat "$RESULTS"
+    printf "\n  ]\n}\n"
+} > "$OUT"
+rm -f "$RESULTS"
+echo "wrote $OUT" >&2